@@ -0,0 +1,17 @@
+/**
+ * @file    application.h
+ * @brief   Host emulator replacement for the Azure Sphere applibs header of the same name. Only the intercore
+ *          socket is provided.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+#pragma once
+
+/// <summary>
+/// Opens a connection to the real-time capable application with the given component ID. On the host the
+/// connection is carried over the emulator's shared memory rings to the emulated M4 firmware.
+/// </summary>
+/// <param name="componentId">Component ID of the real-time capable application</param>
+/// <returns>A SOCK_SEQPACKET socket descriptor on success, or -1 on failure with errno set</returns>
+int Application_Socket(const char *componentId);
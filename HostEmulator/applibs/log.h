@@ -0,0 +1,15 @@
+/**
+ * @file    log.h
+ * @brief   Host emulator replacement for the Azure Sphere applibs header of the same name.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+#pragma once
+
+/// <summary>
+/// Writes a formatted debug message to stderr, or discards it if MODBUS_HOSTEMU_QUIET is set.
+/// </summary>
+/// <param name="fmt">printf style format string</param>
+/// <returns>0 on success</returns>
+int Log_Debug(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
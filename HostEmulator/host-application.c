@@ -0,0 +1,326 @@
+/**
+ * @file    host-application.c
+ * @brief   Application_Socket for A7 code built for the host emulator. Performs the part of the Azure Sphere OS that
+ *          sits between a high-level application's intercore socket and the shared buffers: the buffers are
+ *          published to the M4 through the mailbox, outgoing messages are given the 20 byte component ID prefix and
+ *          written to the M4's inbound ring, and messages from the M4's outbound ring are stripped of the prefix
+ *          and delivered to the socket.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+
+#include "host-shared-memory.h"
+#include "../ModbusOnSphereM4/mt3620-intercore.h"
+#include <applibs/application.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PREFIX_LENGTH 20 // 0-15 = component ID, 16-19 = reserved
+#define COMPONENT_ID_LENGTH 16
+#define MAX_MESSAGE_LENGTH 1024
+#define DOORBELL_WAIT_NS 100000000
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static HostEmuSharedMemory *shm = NULL;
+static uint32_t ringDataSize = 0;
+static int activeFd = -1; // Emulator side of the most recently opened socket; replies go here
+static uint8_t prefix[PREFIX_LENGTH];
+
+static bool AttachToFirmware(void);
+static void PushMailbox(uint32_t cmd, uint32_t data);
+static void WaitForDoorbell(uint32_t *seen);
+static int RingWrite(const void *src, uint32_t dataSize);
+static int RingRead(void *dest, uint32_t *dataSize);
+static void ParseComponentId(const char *componentId, uint8_t *id);
+static void *TxThread(void *arg);
+static void *RxThread(void *arg);
+
+static uint32_t RoundUp(uint32_t value, uint32_t alignment)
+{
+    return (value + (alignment - 1)) & ~(alignment - 1);
+}
+
+static uint8_t *RingData(uint8_t *ring)
+{
+    return ring + sizeof(BufferHeader);
+}
+
+static void PushMailbox(uint32_t cmd, uint32_t data)
+{
+    HostEmuMailbox *mb = &shm->mailbox;
+
+    pthread_mutex_lock(&mb->lock);
+    if (mb->count < HOSTEMU_MAILBOX_DEPTH)
+    {
+        uint32_t tail = (mb->head + mb->count) % HOSTEMU_MAILBOX_DEPTH;
+        mb->cmd[tail] = cmd;
+        mb->data[tail] = data;
+        mb->count++;
+        pthread_cond_broadcast(&mb->m4Mailbox);
+    }
+    pthread_mutex_unlock(&mb->lock);
+}
+
+static void WaitForDoorbell(uint32_t *seen)
+{
+    HostEmuMailbox *mb = &shm->mailbox;
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    t.tv_nsec += DOORBELL_WAIT_NS;
+    if (t.tv_nsec >= 1000000000L)
+    {
+        t.tv_sec++;
+        t.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&mb->lock);
+    while (mb->a7Interrupts == *seen)
+    {
+        if (pthread_cond_timedwait(&mb->a7Doorbell, &mb->lock, &t) == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+    *seen = mb->a7Interrupts;
+    pthread_mutex_unlock(&mb->lock);
+}
+
+static bool AttachToFirmware(void)
+{
+    shm = HostEmu_MapSharedMemory(NULL, false);
+    if (!shm)
+    {
+        return false;
+    }
+
+    pthread_mutex_lock(&shm->mailbox.lock);
+    bool attached = shm->mailbox.a7Attached;
+    shm->mailbox.a7Attached = true;
+    pthread_mutex_unlock(&shm->mailbox.lock);
+
+    ringDataSize = HOSTEMU_RING_SIZE - (uint32_t)sizeof(BufferHeader);
+    if (!attached)
+    {
+        memset(shm->m4Outbound, 0, sizeof(BufferHeader));
+        memset(shm->m4Inbound, 0, sizeof(BufferHeader));
+        PushMailbox(HOSTEMU_MBOX_CMD_OUTBOUND_BUFFER, (uint32_t)(uintptr_t)shm->m4Outbound | HOSTEMU_RING_SIZE_LOG2);
+        PushMailbox(HOSTEMU_MBOX_CMD_INBOUND_BUFFER, (uint32_t)(uintptr_t)shm->m4Inbound | HOSTEMU_RING_SIZE_LOG2);
+        PushMailbox(HOSTEMU_MBOX_CMD_BUFFERS_READY, 0);
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, RxThread, NULL) != 0)
+    {
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+// Mirror of EnqueueData on the M4, writing to the M4's inbound buffer.
+static int RingWrite(const void *src, uint32_t dataSize)
+{
+    BufferHeader *remote = (BufferHeader *)shm->m4Outbound;
+    BufferHeader *local = (BufferHeader *)shm->m4Inbound;
+    uint32_t remoteReadPosition = __atomic_load_n(&remote->readPosition, __ATOMIC_ACQUIRE);
+    uint32_t localWritePosition = local->writePosition;
+
+    uint32_t availSpace = (remoteReadPosition <= localWritePosition)
+                              ? remoteReadPosition - localWritePosition + ringDataSize
+                              : remoteReadPosition - localWritePosition;
+    if (availSpace < sizeof(uint32_t) + dataSize + RINGBUFFER_ALIGNMENT)
+    {
+        return -1;
+    }
+
+    uint8_t *data = RingData(shm->m4Inbound);
+    uint32_t dataToEnd = ringDataSize - localWritePosition;
+    uint32_t writeToEnd = sizeof(uint32_t) + dataSize;
+    if (dataToEnd < writeToEnd)
+    {
+        writeToEnd = dataToEnd;
+    }
+    memcpy(&data[localWritePosition], &dataSize, sizeof(uint32_t));
+    writeToEnd -= sizeof(uint32_t);
+    memcpy(&data[localWritePosition + sizeof(uint32_t)], src, writeToEnd);
+    memcpy(data, (const uint8_t *)src + writeToEnd, dataSize - writeToEnd);
+
+    localWritePosition = RoundUp(localWritePosition + sizeof(uint32_t) + dataSize, RINGBUFFER_ALIGNMENT);
+    if (localWritePosition >= ringDataSize)
+    {
+        localWritePosition -= ringDataSize;
+    }
+    __atomic_store_n(&local->writePosition, localWritePosition, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Mirror of DequeueData on the M4, reading from the M4's outbound buffer.
+static int RingRead(void *dest, uint32_t *dataSize)
+{
+    BufferHeader *remote = (BufferHeader *)shm->m4Outbound;
+    BufferHeader *local = (BufferHeader *)shm->m4Inbound;
+    uint32_t remoteWritePosition = __atomic_load_n(&remote->writePosition, __ATOMIC_ACQUIRE);
+    uint32_t localReadPosition = local->readPosition;
+
+    if (remoteWritePosition >= ringDataSize)
+    {
+        return -1;
+    }
+    uint32_t availData = (remoteWritePosition >= localReadPosition)
+                             ? remoteWritePosition - localReadPosition
+                             : remoteWritePosition - localReadPosition + ringDataSize;
+    if (availData < sizeof(uint32_t))
+    {
+        return -1;
+    }
+
+    const uint8_t *data = RingData(shm->m4Outbound);
+    uint32_t dataToEnd = ringDataSize - localReadPosition;
+    uint32_t blockSize;
+    memcpy(&blockSize, &data[localReadPosition], sizeof(uint32_t));
+    if (blockSize + sizeof(uint32_t) > availData || blockSize > *dataSize)
+    {
+        return -1;
+    }
+    *dataSize = blockSize;
+
+    uint32_t readFromEnd = dataToEnd - sizeof(uint32_t);
+    if (blockSize < readFromEnd)
+    {
+        readFromEnd = blockSize;
+    }
+    memcpy(dest, &data[localReadPosition + sizeof(uint32_t)], readFromEnd);
+    memcpy((uint8_t *)dest + readFromEnd, data, blockSize - readFromEnd);
+
+    localReadPosition = RoundUp(localReadPosition + sizeof(uint32_t) + blockSize, RINGBUFFER_ALIGNMENT);
+    if (localReadPosition >= ringDataSize)
+    {
+        localReadPosition -= ringDataSize;
+    }
+    __atomic_store_n(&local->readPosition, localReadPosition, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static void ParseComponentId(const char *componentId, uint8_t *id)
+{
+    size_t n = 0;
+    memset(id, 0, COMPONENT_ID_LENGTH);
+    for (const char *c = componentId; *c && n < COMPONENT_ID_LENGTH * 2; c++)
+    {
+        if (!isxdigit((unsigned char)*c))
+        {
+            continue;
+        }
+        uint8_t nybble = (uint8_t)(isdigit((unsigned char)*c) ? *c - '0' : (tolower((unsigned char)*c) - 'a' + 10));
+        id[n / 2] = (uint8_t)(id[n / 2] | (n % 2 ? nybble : nybble << 4));
+        n++;
+    }
+}
+
+static void *TxThread(void *arg)
+{
+    int fd = (int)(intptr_t)arg;
+    uint8_t message[PREFIX_LENGTH + MAX_MESSAGE_LENGTH];
+    uint32_t seen = 0;
+
+    for (;;)
+    {
+        ssize_t length = recv(fd, &message[PREFIX_LENGTH], MAX_MESSAGE_LENGTH, 0);
+        if (length <= 0)
+        {
+            if (length < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+
+        pthread_mutex_lock(&lock);
+        memcpy(message, prefix, PREFIX_LENGTH);
+        // Block until the M4 has made room, as the OS would.
+        while (RingWrite(message, (uint32_t)(PREFIX_LENGTH + length)) != 0)
+        {
+            pthread_mutex_unlock(&lock);
+            WaitForDoorbell(&seen);
+            pthread_mutex_lock(&lock);
+        }
+        pthread_mutex_unlock(&lock);
+    }
+
+    pthread_mutex_lock(&lock);
+    if (activeFd == fd)
+    {
+        activeFd = -1;
+    }
+    pthread_mutex_unlock(&lock);
+    close(fd);
+    return NULL;
+}
+
+static void *RxThread(void *arg)
+{
+    (void)arg;
+    uint8_t message[PREFIX_LENGTH + MAX_MESSAGE_LENGTH];
+    uint32_t seen = 0;
+
+    for (;;)
+    {
+        uint32_t length = sizeof(message);
+        if (RingRead(message, &length) != 0)
+        {
+            WaitForDoorbell(&seen);
+            continue;
+        }
+        if (length < PREFIX_LENGTH)
+        {
+            continue;
+        }
+
+        pthread_mutex_lock(&lock);
+        if (activeFd >= 0)
+        {
+            send(activeFd, &message[PREFIX_LENGTH], length - PREFIX_LENGTH, MSG_NOSIGNAL);
+        }
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+int Application_Socket(const char *componentId)
+{
+    int fds[2];
+
+    pthread_mutex_lock(&lock);
+    if (!shm && !AttachToFirmware())
+    {
+        pthread_mutex_unlock(&lock);
+        errno = ENOENT;
+        return -1;
+    }
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) != 0)
+    {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    ParseComponentId(componentId, prefix);
+    activeFd = fds[1];
+    pthread_mutex_unlock(&lock);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, TxThread, (void *)(intptr_t)fds[1]) != 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        errno = EAGAIN;
+        return -1;
+    }
+    pthread_detach(thread);
+    return fds[0];
+}
@@ -0,0 +1,388 @@
+/**
+ * @file    host-baremetal.c
+ * @brief   Emulation of the MT3620 IO M4 mailbox, general purpose timers and interrupt masking for running the
+ *          bare metal firmware as a Linux process.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+
+#include "host-baremetal.h"
+#include "host-shared-memory.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+/* Register banks emulated by this file */
+#define MAILBOX_BASE 0x21050000
+#define MAILBOX_SW_TX_INT_PORT (MAILBOX_BASE + 0x14)
+#define MAILBOX_CMD_POP0 (MAILBOX_BASE + 0x50)
+#define MAILBOX_DATA_POP0 (MAILBOX_BASE + 0x54)
+#define MAILBOX_FIFO_POP_CNT (MAILBOX_BASE + 0x58)
+
+#define GPT_BASE 0x21030000
+#define GPT_ISR (GPT_BASE + 0x00)
+#define GPT_IER (GPT_BASE + 0x04)
+#define GPT_COUNT 2
+#define GPT_CTRL_ENABLE 0x01
+#define GPT_IRQ 1
+
+// Index of the reset handler and first interrupt handler in the firmware's vector table
+#define RESET_VECTOR 1
+#define INT_TO_EXC(i_) (16 + (i_))
+
+// How long a read of an empty mailbox FIFO blocks before returning zero
+#define MAILBOX_POLL_INTERVAL_NS 10000000
+
+// Provided by the linker script on the device. The firmware only takes its address.
+uint32_t StackTop;
+
+typedef void (*IrqHandler)(void);
+
+extern const uintptr_t ExceptionVectorTable[];
+
+typedef struct
+{
+    uint32_t ctrl;
+    uint32_t icnt;
+    struct timespec deadline;
+    bool running;
+} GptState;
+
+static pthread_mutex_t irqLock;
+static pthread_mutex_t wfiLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wfiCond;
+static uint64_t irqGeneration = 0;
+static uint64_t wfiGeneration = 0;
+
+static pthread_mutex_t gptLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gptCond;
+static uint32_t gptIsr = 0;
+static uint32_t gptIer = 0;
+static GptState gpts[GPT_COUNT];
+
+static HostEmuSharedMemory *shm = NULL;
+
+static void InitCondMonotonic(pthread_cond_t *cond);
+static void AddMs(struct timespec *t, uint32_t ms);
+static bool Expired(const struct timespec *deadline, const struct timespec *now);
+static uint32_t MailboxRead(uintptr_t addr);
+static void MailboxWrite(uintptr_t addr, uint32_t value);
+static uint32_t GptRead(uintptr_t addr);
+static void GptWrite(uintptr_t addr, uint32_t value);
+static void *GptThread(void *arg);
+static void *FirmwareThread(void *arg);
+
+static void InitCondMonotonic(pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static void AddMs(struct timespec *t, uint32_t ms)
+{
+    t->tv_sec += ms / 1000;
+    t->tv_nsec += (long)(ms % 1000) * 1000000L;
+    if (t->tv_nsec >= 1000000000L)
+    {
+        t->tv_sec++;
+        t->tv_nsec -= 1000000000L;
+    }
+}
+
+static bool Expired(const struct timespec *deadline, const struct timespec *now)
+{
+    return (now->tv_sec > deadline->tv_sec) ||
+           (now->tv_sec == deadline->tv_sec && now->tv_nsec >= deadline->tv_nsec);
+}
+
+void HostEmu_WriteReg8(uintptr_t addr, uint8_t value)
+{
+    // Only used for NVIC priorities, which have no effect here.
+    (void)addr;
+    (void)value;
+}
+
+void HostEmu_WriteReg32(uintptr_t addr, uint32_t value)
+{
+    if ((addr & ~(uintptr_t)0xFFFF) == MAILBOX_BASE)
+    {
+        MailboxWrite(addr, value);
+    }
+    else if ((addr & ~(uintptr_t)0xFFFF) == GPT_BASE)
+    {
+        GptWrite(addr, value);
+    }
+}
+
+uint32_t HostEmu_ReadReg32(uintptr_t addr)
+{
+    if ((addr & ~(uintptr_t)0xFFFF) == MAILBOX_BASE)
+    {
+        return MailboxRead(addr);
+    }
+    else if ((addr & ~(uintptr_t)0xFFFF) == GPT_BASE)
+    {
+        return GptRead(addr);
+    }
+    return 0;
+}
+
+uint32_t HostEmu_BlockIrqs(void)
+{
+    pthread_mutex_lock(&irqLock);
+    return 0;
+}
+
+void HostEmu_RestoreIrqs(uint32_t prevBasePri)
+{
+    (void)prevBasePri;
+    pthread_mutex_unlock(&irqLock);
+}
+
+void HostEmu_WaitForInterrupt(void)
+{
+    pthread_mutex_lock(&wfiLock);
+    while (irqGeneration == wfiGeneration)
+    {
+        pthread_cond_wait(&wfiCond, &wfiLock);
+    }
+    wfiGeneration = irqGeneration;
+    pthread_mutex_unlock(&wfiLock);
+}
+
+void HostEmu_RaiseIrq(void (*handler)(void))
+{
+    pthread_mutex_lock(&irqLock);
+    handler();
+    pthread_mutex_unlock(&irqLock);
+
+    pthread_mutex_lock(&wfiLock);
+    irqGeneration++;
+    pthread_cond_broadcast(&wfiCond);
+    pthread_mutex_unlock(&wfiLock);
+}
+
+static uint32_t MailboxRead(uintptr_t addr)
+{
+    HostEmuMailbox *mb = &shm->mailbox;
+    uint32_t value = 0;
+
+    pthread_mutex_lock(&mb->lock);
+    switch (addr)
+    {
+    case MAILBOX_FIFO_POP_CNT:
+        if (mb->count == 0)
+        {
+            // The firmware spins on this register; block briefly instead of burning a host core.
+            struct timespec t;
+            clock_gettime(CLOCK_MONOTONIC, &t);
+            t.tv_nsec += MAILBOX_POLL_INTERVAL_NS;
+            if (t.tv_nsec >= 1000000000L)
+            {
+                t.tv_sec++;
+                t.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&mb->m4Mailbox, &mb->lock, &t);
+        }
+        value = mb->count;
+        break;
+    case MAILBOX_DATA_POP0:
+        if (mb->count > 0)
+        {
+            value = mb->data[mb->head];
+        }
+        break;
+    case MAILBOX_CMD_POP0:
+        if (mb->count > 0)
+        {
+            value = mb->cmd[mb->head];
+            mb->head = (mb->head + 1) % HOSTEMU_MAILBOX_DEPTH;
+            mb->count--;
+        }
+        break;
+    default:
+        break;
+    }
+    pthread_mutex_unlock(&mb->lock);
+    return value;
+}
+
+static void MailboxWrite(uintptr_t addr, uint32_t value)
+{
+    HostEmuMailbox *mb = &shm->mailbox;
+
+    if (addr == MAILBOX_SW_TX_INT_PORT && value != 0)
+    {
+        pthread_mutex_lock(&mb->lock);
+        mb->a7Interrupts++;
+        pthread_cond_broadcast(&mb->a7Doorbell);
+        pthread_mutex_unlock(&mb->lock);
+    }
+}
+
+static uint32_t GptRead(uintptr_t addr)
+{
+    uint32_t value = 0;
+
+    pthread_mutex_lock(&gptLock);
+    if (addr == GPT_ISR)
+    {
+        value = gptIsr;
+    }
+    else if (addr == GPT_IER)
+    {
+        value = gptIer;
+    }
+    else
+    {
+        for (int gpt = 0; gpt < GPT_COUNT; gpt++)
+        {
+            uintptr_t ctrl = GPT_BASE + 0x10 + (uintptr_t)gpt * 0x10;
+            if (addr == ctrl)
+            {
+                value = gpts[gpt].ctrl;
+            }
+            else if (addr == ctrl + 4)
+            {
+                value = gpts[gpt].icnt;
+            }
+        }
+    }
+    pthread_mutex_unlock(&gptLock);
+    return value;
+}
+
+static void GptWrite(uintptr_t addr, uint32_t value)
+{
+    pthread_mutex_lock(&gptLock);
+    if (addr == GPT_ISR)
+    {
+        // Write one to clear
+        gptIsr &= ~value;
+    }
+    else if (addr == GPT_IER)
+    {
+        gptIer = value;
+    }
+    else
+    {
+        for (int gpt = 0; gpt < GPT_COUNT; gpt++)
+        {
+            uintptr_t ctrl = GPT_BASE + 0x10 + (uintptr_t)gpt * 0x10;
+            if (addr == ctrl)
+            {
+                gpts[gpt].ctrl = value;
+                gpts[gpt].running = (value & GPT_CTRL_ENABLE) != 0;
+                if (gpts[gpt].running)
+                {
+                    // Counter clock is 1kHz, so ICNT is the period in milliseconds.
+                    clock_gettime(CLOCK_MONOTONIC, &gpts[gpt].deadline);
+                    AddMs(&gpts[gpt].deadline, gpts[gpt].icnt);
+                }
+                pthread_cond_signal(&gptCond);
+            }
+            else if (addr == ctrl + 4)
+            {
+                gpts[gpt].icnt = value;
+            }
+        }
+    }
+    pthread_mutex_unlock(&gptLock);
+}
+
+static void *GptThread(void *arg)
+{
+    (void)arg;
+    IrqHandler handler = (IrqHandler)ExceptionVectorTable[INT_TO_EXC(GPT_IRQ)];
+
+    pthread_mutex_lock(&gptLock);
+    for (;;)
+    {
+        struct timespec now;
+        struct timespec *next = NULL;
+        bool raise = false;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        for (int gpt = 0; gpt < GPT_COUNT; gpt++)
+        {
+            if (!gpts[gpt].running)
+            {
+                continue;
+            }
+            if (Expired(&gpts[gpt].deadline, &now))
+            {
+                // One shot mode with auto clear
+                gpts[gpt].running = false;
+                gpts[gpt].ctrl &= ~(uint32_t)GPT_CTRL_ENABLE;
+                gptIsr |= 1U << gpt;
+                raise |= (gptIer & (1U << gpt)) != 0;
+            }
+            else if (!next || !Expired(&gpts[gpt].deadline, next))
+            {
+                next = &gpts[gpt].deadline;
+            }
+        }
+
+        if (raise)
+        {
+            pthread_mutex_unlock(&gptLock);
+            HostEmu_RaiseIrq(handler);
+            pthread_mutex_lock(&gptLock);
+        }
+        else if (next)
+        {
+            struct timespec deadline = *next;
+            pthread_cond_timedwait(&gptCond, &gptLock, &deadline);
+        }
+        else
+        {
+            pthread_cond_wait(&gptCond, &gptLock);
+        }
+    }
+    return NULL;
+}
+
+static void *FirmwareThread(void *arg)
+{
+    (void)arg;
+    IrqHandler reset = (IrqHandler)ExceptionVectorTable[RESET_VECTOR];
+    reset();
+    return NULL;
+}
+
+int HostEmu_StartFirmware(void)
+{
+    pthread_mutexattr_t attr;
+    pthread_t thread;
+
+    shm = HostEmu_MapSharedMemory(NULL, true);
+    if (!shm)
+    {
+        return -1;
+    }
+
+    // The firmware nests BlockIrqs calls, and handlers may call it while an interrupt is being taken.
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&irqLock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    InitCondMonotonic(&wfiCond);
+    InitCondMonotonic(&gptCond);
+
+    if (pthread_create(&thread, NULL, GptThread, NULL) != 0)
+    {
+        return -1;
+    }
+    pthread_detach(thread);
+    if (pthread_create(&thread, NULL, FirmwareThread, NULL) != 0)
+    {
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
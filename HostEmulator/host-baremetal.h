@@ -0,0 +1,69 @@
+/**
+ * @file    host-baremetal.h
+ * @brief   Register and interrupt hooks used by mt3620-baremetal.h when the M4 firmware is built for a Linux host
+ *          (MT3620_HOST_EMULATION). Accesses to the mailbox and GPT register banks are routed to emulated
+ *          peripherals; accesses to any other bank are ignored.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+#ifndef HOST_BAREMETAL_H
+#define HOST_BAREMETAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// <summary>
+/// Emulated 8-bit register write.
+/// </summary>
+/// <param name="addr">Absolute register address</param>
+/// <param name="value">Value to write</param>
+void HostEmu_WriteReg8(uintptr_t addr, uint8_t value);
+
+/// <summary>
+/// Emulated 32-bit register write.
+/// </summary>
+/// <param name="addr">Absolute register address</param>
+/// <param name="value">Value to write</param>
+void HostEmu_WriteReg32(uintptr_t addr, uint32_t value);
+
+/// <summary>
+/// Emulated 32-bit register read.
+/// </summary>
+/// <param name="addr">Absolute register address</param>
+/// <returns>The current value of the register, or zero for unemulated registers</returns>
+uint32_t HostEmu_ReadReg32(uintptr_t addr);
+
+/// <summary>
+/// Blocks delivery of emulated interrupts to the calling thread's firmware until <see cref="HostEmu_RestoreIrqs" />
+/// is called. Calls may be nested.
+/// </summary>
+/// <returns>Opaque value to pass to <see cref="HostEmu_RestoreIrqs" /></returns>
+uint32_t HostEmu_BlockIrqs(void);
+
+/// <summary>
+/// Re-enables emulated interrupts blocked by <see cref="HostEmu_BlockIrqs" />.
+/// </summary>
+/// <param name="prevBasePri">Value returned from <see cref="HostEmu_BlockIrqs" /></param>
+void HostEmu_RestoreIrqs(uint32_t prevBasePri);
+
+/// <summary>
+/// Waits until at least one emulated interrupt has been delivered since the previous call.
+/// </summary>
+void HostEmu_WaitForInterrupt(void);
+
+/// <summary>
+/// Runs an interrupt handler in emulated interrupt context. Handlers are serialised with each other and with code
+/// running between <see cref="HostEmu_BlockIrqs" /> and <see cref="HostEmu_RestoreIrqs" />.
+/// </summary>
+/// <param name="handler">The interrupt handler to run</param>
+void HostEmu_RaiseIrq(void (*handler)(void));
+
+/// <summary>
+/// Creates the shared memory object and runs the firmware's reset handler on a new thread. The firmware then
+/// blocks in GetIntercoreBuffers until an A7 application attaches.
+/// </summary>
+/// <returns>0 on success, or -1 on failure</returns>
+int HostEmu_StartFirmware(void);
+
+#endif /* HOST_BAREMETAL_H */
@@ -0,0 +1,29 @@
+/**
+ * @file    host-log.c
+ * @brief   Log_Debug for A7 code built for the host emulator.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+
+#include <applibs/log.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+int Log_Debug(const char *fmt, ...)
+{
+    static int quiet = -1;
+    if (quiet < 0)
+    {
+        quiet = getenv("MODBUS_HOSTEMU_QUIET") != NULL;
+    }
+    if (!quiet)
+    {
+        va_list args;
+        va_start(args, fmt);
+        vfprintf(stderr, fmt, args);
+        va_end(args);
+    }
+    return 0;
+}
@@ -0,0 +1,157 @@
+/**
+ * @file    host-shared-memory.c
+ * @brief   Creation and mapping of the shared memory object that replaces the MT3620 mailbox and intercore buffers.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+
+#include "host-shared-memory.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+#define ATTACH_RETRY_COUNT 200
+#define ATTACH_RETRY_INTERVAL_NS 50000000
+
+static HostEmuSharedMemory *mapping = NULL;
+static pthread_mutex_t mappingLock = PTHREAD_MUTEX_INITIALIZER;
+
+static HostEmuSharedMemory *MapFixed(int fd);
+static bool InitialiseMailbox(HostEmuMailbox *mailbox);
+
+static HostEmuSharedMemory *MapFixed(int fd)
+{
+    void *addr = mmap((void *)HOSTEMU_SHM_BASE, sizeof(HostEmuSharedMemory), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+    if (addr == MAP_FAILED)
+    {
+        fprintf(stderr, "HostEmu: unable to map shared memory: %s\n", strerror(errno));
+        return NULL;
+    }
+    if ((uintptr_t)addr != HOSTEMU_SHM_BASE)
+    {
+        // Older kernels treat the address as a hint only.
+        fprintf(stderr, "HostEmu: shared memory mapped at %p instead of 0x%08lx\n", addr,
+                (unsigned long)HOSTEMU_SHM_BASE);
+        munmap(addr, sizeof(HostEmuSharedMemory));
+        return NULL;
+    }
+    return (HostEmuSharedMemory *)addr;
+}
+
+static bool InitialiseMailbox(HostEmuMailbox *mailbox)
+{
+    pthread_mutexattr_t mutexAttr;
+    pthread_condattr_t condAttr;
+
+    memset(mailbox, 0, sizeof(*mailbox));
+    pthread_mutexattr_init(&mutexAttr);
+    pthread_mutexattr_setpshared(&mutexAttr, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_init(&condAttr);
+    pthread_condattr_setpshared(&condAttr, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+
+    bool ok = pthread_mutex_init(&mailbox->lock, &mutexAttr) == 0 &&
+              pthread_cond_init(&mailbox->m4Mailbox, &condAttr) == 0 &&
+              pthread_cond_init(&mailbox->a7Doorbell, &condAttr) == 0;
+
+    pthread_mutexattr_destroy(&mutexAttr);
+    pthread_condattr_destroy(&condAttr);
+    return ok;
+}
+
+HostEmuSharedMemory *HostEmu_MapSharedMemory(const char *name, bool create)
+{
+    pthread_mutex_lock(&mappingLock);
+    if (mapping)
+    {
+        pthread_mutex_unlock(&mappingLock);
+        return mapping;
+    }
+
+    if (!name)
+    {
+        name = getenv(HOSTEMU_SHM_NAME_ENV);
+    }
+    if (!name)
+    {
+        name = HOSTEMU_SHM_DEFAULT_NAME;
+    }
+
+    int fd = -1;
+    if (create)
+    {
+        shm_unlink(name);
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd >= 0 && ftruncate(fd, sizeof(HostEmuSharedMemory)) != 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    else
+    {
+        // The M4 side owns the object; wait for it to appear.
+        for (int i = 0; i < ATTACH_RETRY_COUNT && fd < 0; i++)
+        {
+            fd = shm_open(name, O_RDWR, 0);
+            if (fd < 0)
+            {
+                struct timespec t = {.tv_sec = 0, .tv_nsec = ATTACH_RETRY_INTERVAL_NS};
+                nanosleep(&t, NULL);
+            }
+        }
+    }
+    if (fd < 0)
+    {
+        fprintf(stderr, "HostEmu: unable to open shared memory '%s': %s\n", name, strerror(errno));
+        pthread_mutex_unlock(&mappingLock);
+        return NULL;
+    }
+
+    HostEmuSharedMemory *shm = MapFixed(fd);
+    close(fd);
+    if (shm && create)
+    {
+        if (!InitialiseMailbox(&shm->mailbox))
+        {
+            munmap(shm, sizeof(HostEmuSharedMemory));
+            shm = NULL;
+        }
+        else
+        {
+            __atomic_store_n(&shm->mailbox.magic, HOSTEMU_SHM_MAGIC, __ATOMIC_RELEASE);
+        }
+    }
+    else if (shm)
+    {
+        for (int i = 0; i < ATTACH_RETRY_COUNT; i++)
+        {
+            if (__atomic_load_n(&shm->mailbox.magic, __ATOMIC_ACQUIRE) == HOSTEMU_SHM_MAGIC)
+            {
+                break;
+            }
+            struct timespec t = {.tv_sec = 0, .tv_nsec = ATTACH_RETRY_INTERVAL_NS};
+            nanosleep(&t, NULL);
+        }
+        if (shm->mailbox.magic != HOSTEMU_SHM_MAGIC)
+        {
+            fprintf(stderr, "HostEmu: shared memory '%s' was never initialised\n", name);
+            munmap(shm, sizeof(HostEmuSharedMemory));
+            shm = NULL;
+        }
+    }
+    mapping = shm;
+    pthread_mutex_unlock(&mappingLock);
+    return shm;
+}
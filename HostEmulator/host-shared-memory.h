@@ -0,0 +1,69 @@
+/**
+ * @file    host-shared-memory.h
+ * @brief   Layout of the POSIX shared memory object that replaces the MT3620 mailbox and the intercore shared
+ *          buffers when the A7 and M4 applications are run on a Linux host.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+#ifndef HOST_SHARED_MEMORY_H
+#define HOST_SHARED_MEMORY_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define HOSTEMU_SHM_DEFAULT_NAME "/modbus-sphere-intercore"
+#define HOSTEMU_SHM_NAME_ENV "MODBUS_HOSTEMU_SHM"
+
+// The M4 code passes buffer addresses through 32-bit mailbox registers, so the object is always mapped at an
+// address below 4 GiB. Both sides map it at the same address.
+#define HOSTEMU_SHM_BASE ((uintptr_t)0x20000000)
+#define HOSTEMU_SHM_MAGIC 0x4d425348
+
+// Each ring is a BufferHeader followed by the data area, as laid out by the Azure Sphere OS.
+#define HOSTEMU_RING_SIZE_LOG2 13
+#define HOSTEMU_RING_SIZE (1U << HOSTEMU_RING_SIZE_LOG2)
+
+#define HOSTEMU_MAILBOX_DEPTH 8
+
+/* Mailbox commands used by GetIntercoreBuffers */
+#define HOSTEMU_MBOX_CMD_OUTBOUND_BUFFER 0xba5e0001
+#define HOSTEMU_MBOX_CMD_INBOUND_BUFFER 0xba5e0002
+#define HOSTEMU_MBOX_CMD_BUFFERS_READY 0xba5e0003
+
+/* SW_TX_INT_PORT bits raised by the M4 */
+#define HOSTEMU_SW_INT_DATA_SENT (1U << 0)
+#define HOSTEMU_SW_INT_DATA_RECEIVED (1U << 1)
+
+typedef struct
+{
+    uint32_t magic;
+    pthread_mutex_t lock;        // Process shared, protects everything below
+    pthread_cond_t m4Mailbox;    // Signalled when a command is pushed into the M4 mailbox FIFO
+    pthread_cond_t a7Doorbell;   // Signalled when the M4 writes SW_TX_INT_PORT
+    uint32_t cmd[HOSTEMU_MAILBOX_DEPTH];
+    uint32_t data[HOSTEMU_MAILBOX_DEPTH];
+    uint32_t head;
+    uint32_t count;
+    uint32_t a7Interrupts;       // Incremented on every SW_TX_INT_PORT write
+    bool a7Attached;             // Set once the A7 side has published the buffers
+} HostEmuMailbox;
+
+typedef struct
+{
+    HostEmuMailbox mailbox;
+    uint8_t m4Outbound[HOSTEMU_RING_SIZE] __attribute__((aligned(4096)));
+    uint8_t m4Inbound[HOSTEMU_RING_SIZE] __attribute__((aligned(4096)));
+} HostEmuSharedMemory;
+
+/// <summary>
+/// Maps the shared memory object at <see cref="HOSTEMU_SHM_BASE" />. Only one object is mapped per process;
+/// subsequent calls return the existing mapping.
+/// </summary>
+/// <param name="name">Name of the object, or NULL to use $MODBUS_HOSTEMU_SHM or the default name</param>
+/// <param name="create">true to create and initialise a new object (M4 side), false to wait for an existing one</param>
+/// <returns>The mapping on success, or NULL on failure</returns>
+HostEmuSharedMemory *HostEmu_MapSharedMemory(const char *name, bool create);
+
+#endif /* HOST_SHARED_MEMORY_H */
@@ -0,0 +1,300 @@
+/**
+ * @file    host-uart.c
+ * @brief   Implementation of the mt3620-uart.h API for the host emulator. ISU0 is backed by a pseudo terminal so a
+ *          virtual or real Modbus slave can be attached to the slave side; the M4 debug UART is written to a file.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+
+#include "host-uart.h"
+#include "../ModbusOnSphereM4/mt3620-uart.h"
+#include "../modbusCommon.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define RX_BUFFER_SIZE 1024
+#define PTY_PATH_LENGTH 128
+
+// Baud rate divisors in the UART configuration message are relative to this rate
+#define UART_BASE_BAUD_RATE 115200
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    Callback rxCallback;
+    uint8_t rxBuffer[RX_BUFFER_SIZE];
+    size_t rxHead;
+    size_t rxCount;
+} HostUartState;
+
+static HostUartState isu0 = {.lock = PTHREAD_MUTEX_INITIALIZER};
+static int ptyMaster = -1;
+static int ptySlave = -1;
+static char ptyPath[PTY_PATH_LENGTH];
+static FILE *debugUart = NULL;
+static bool debugUartOpened = false;
+static HostUartConfig currentConfig;
+
+static bool OpenPty(void);
+static void *RxThread(void *arg);
+static void RaiseRxIrq(void);
+static FILE *GetDebugUart(void);
+
+static bool OpenPty(void)
+{
+    ptyMaster = posix_openpt(O_RDWR | O_NOCTTY);
+    if (ptyMaster < 0 || grantpt(ptyMaster) != 0 || unlockpt(ptyMaster) != 0 ||
+        ptsname_r(ptyMaster, ptyPath, sizeof(ptyPath)) != 0)
+    {
+        fprintf(stderr, "HostEmu: unable to create pseudo terminal: %s\n", strerror(errno));
+        return false;
+    }
+
+    // Hold the slave side open so the master never sees a hangup while no slave device is attached, and
+    // put the line into raw mode so Modbus frames pass through untouched.
+    ptySlave = open(ptyPath, O_RDWR | O_NOCTTY);
+    if (ptySlave < 0)
+    {
+        fprintf(stderr, "HostEmu: unable to open %s: %s\n", ptyPath, strerror(errno));
+        return false;
+    }
+    struct termios tio;
+    tcgetattr(ptySlave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(ptySlave, TCSANOW, &tio);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, RxThread, NULL) != 0)
+    {
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+static void RaiseRxIrq(void)
+{
+    if (isu0.rxCallback)
+    {
+        isu0.rxCallback();
+    }
+}
+
+static void *RxThread(void *arg)
+{
+    (void)arg;
+    uint8_t buffer[RX_BUFFER_SIZE];
+
+    for (;;)
+    {
+        ssize_t bytesRead = read(ptyMaster, buffer, sizeof(buffer));
+        if (bytesRead <= 0)
+        {
+            if (bytesRead < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+
+        pthread_mutex_lock(&isu0.lock);
+        for (ssize_t i = 0; i < bytesRead; i++)
+        {
+            if (isu0.rxCount == RX_BUFFER_SIZE)
+            {
+                // Overrun: the oldest byte is lost, as it would be from the hardware FIFO.
+                isu0.rxHead = (isu0.rxHead + 1) % RX_BUFFER_SIZE;
+                isu0.rxCount--;
+            }
+            isu0.rxBuffer[(isu0.rxHead + isu0.rxCount) % RX_BUFFER_SIZE] = buffer[i];
+            isu0.rxCount++;
+        }
+        pthread_mutex_unlock(&isu0.lock);
+
+        HostEmu_RaiseIrq(RaiseRxIrq);
+    }
+    return NULL;
+}
+
+static FILE *GetDebugUart(void)
+{
+    if (!debugUartOpened)
+    {
+        debugUartOpened = true;
+        const char *path = getenv(HOSTEMU_DEBUG_UART_ENV);
+        if (path && strcmp(path, "-") == 0)
+        {
+            debugUart = stderr;
+        }
+        else if (path)
+        {
+            debugUart = fopen(path, "a");
+        }
+    }
+    return debugUart;
+}
+
+const char *HostEmu_GetUartPath(void)
+{
+    return ptyMaster >= 0 ? ptyPath : NULL;
+}
+
+bool HostEmu_OpenUart(void)
+{
+    return ptyMaster >= 0 || OpenPty();
+}
+
+void HostEmu_GetUartConfig(HostUartConfig *config)
+{
+    *config = currentConfig;
+}
+
+void Uart_Init(UartId id, Callback rxCallback)
+{
+    if (id == UartIsu0)
+    {
+        pthread_mutex_lock(&isu0.lock);
+        isu0.rxCallback = rxCallback;
+        pthread_mutex_unlock(&isu0.lock);
+        HostEmu_OpenUart();
+    }
+}
+
+bool Uart_EnqueueData(UartId id, const uint8_t *data, size_t length)
+{
+    if (id == UartCM4Debug)
+    {
+        FILE *f = GetDebugUart();
+        if (f)
+        {
+            fwrite(data, 1, length, f);
+            fflush(f);
+        }
+        return true;
+    }
+
+    if (ptyMaster < 0)
+    {
+        return false;
+    }
+    while (length > 0)
+    {
+        ssize_t written = write(ptyMaster, data, length);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        length -= (size_t)written;
+    }
+    return true;
+}
+
+size_t Uart_DequeueData(UartId id, uint8_t *buffer, size_t bufferSize)
+{
+    if (id != UartIsu0)
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&isu0.lock);
+    size_t count = 0;
+    while (count < bufferSize && isu0.rxCount > 0)
+    {
+        buffer[count++] = isu0.rxBuffer[isu0.rxHead];
+        isu0.rxHead = (isu0.rxHead + 1) % RX_BUFFER_SIZE;
+        isu0.rxCount--;
+    }
+    pthread_mutex_unlock(&isu0.lock);
+    return count;
+}
+
+bool Uart_EnqueueString(UartId id, const char *msg)
+{
+    return Uart_EnqueueData(id, (const uint8_t *)msg, strlen(msg));
+}
+
+bool Uart_EnqueueIntegerAsString(UartId id, int value)
+{
+    char text[16];
+    int length = snprintf(text, sizeof(text), "%d", value);
+    return Uart_EnqueueData(id, (const uint8_t *)text, (size_t)length);
+}
+
+bool Uart_EnqueueIntegerAsHexString(UartId id, uint32_t value)
+{
+    char text[16];
+    int length = snprintf(text, sizeof(text), "%x", value);
+    return Uart_EnqueueData(id, (const uint8_t *)text, (size_t)length);
+}
+
+bool Uart_EnqueueIntegerAsHexStringWidth(UartId id, uint32_t value, size_t width)
+{
+    char text[16];
+    if (width > 8)
+    {
+        width = 8;
+    }
+    // Only the lowest nybbles are printed if the value does not fit.
+    uint32_t mask = width == 8 ? UINT32_MAX : ((1U << (width * 4)) - 1);
+    int length = snprintf(text, sizeof(text), "%0*x", (int)width, value & mask);
+    return Uart_EnqueueData(id, (const uint8_t *)text, (size_t)length);
+}
+
+void Uart_HandleIrq4(void)
+{
+    // Interrupts are delivered directly by the receive thread.
+}
+
+void Uart_HandleIrq47(void)
+{
+    // Interrupts are delivered directly by the receive thread.
+}
+
+void Uart_EnableHalfDuplex(UartId id)
+{
+    (void)id;
+    currentConfig.halfDuplex = true;
+}
+
+void Uart_DisableHalfDuplex(UartId id)
+{
+    (void)id;
+    currentConfig.halfDuplex = false;
+}
+
+bool CheckForCompletedTranmission()
+{
+    // write() to the pseudo terminal completes synchronously.
+    return true;
+}
+
+bool SetSerialConfig(uint8_t *configSetup, size_t len, UartId id, Callback callback)
+{
+    if (len < UART_CFG_MESSAGE_LENGTH)
+    {
+        return false;
+    }
+
+    uint16_t divisor = (uint16_t)(configSetup[BAUD_RATE_OFFSET_UPPER] << 8 | configSetup[BAUD_RATE_OFFSET_LOWER]);
+    currentConfig.baudRate = divisor ? UART_BASE_BAUD_RATE / divisor : 0;
+    currentConfig.halfDuplex = configSetup[DUPLEX_MODE_OFFSET] != 0;
+    currentConfig.parityEnabled = configSetup[PARITY_STATE_OFFSET] != 0;
+    currentConfig.parityEven = configSetup[PARITY_MODE_OFFSET] != 0;
+    currentConfig.stopBits = configSetup[STOP_BITS_OFFSET];
+    currentConfig.wordLength = configSetup[WORD_LENGTH_OFFSET];
+
+    Uart_Init(id, callback);
+    return true;
+}
@@ -0,0 +1,47 @@
+/**
+ * @file    host-uart.h
+ * @brief   Host emulator extensions to the mt3620-uart.h API, giving access to the pseudo terminal that stands in
+ *          for ISU0 and to the line settings most recently sent by the A7.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+#ifndef HOST_UART_H
+#define HOST_UART_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Set to a file path, or "-" for stderr, to capture output written to the M4 debug UART.
+#define HOSTEMU_DEBUG_UART_ENV "MODBUS_HOSTEMU_DEBUG_UART"
+
+typedef struct
+{
+    uint32_t baudRate;
+    bool halfDuplex;
+    bool parityEnabled;
+    bool parityEven;
+    uint8_t stopBits;
+    uint8_t wordLength;
+} HostUartConfig;
+
+/// <summary>
+/// Creates the pseudo terminal for ISU0 if it does not already exist. This is normally done by Uart_Init, but may
+/// be called earlier so a slave device can be attached before the A7 connects.
+/// </summary>
+/// <returns>true on success, or false on failure</returns>
+bool HostEmu_OpenUart(void);
+
+/// <summary>
+/// Gets the path of the slave side of the ISU0 pseudo terminal.
+/// </summary>
+/// <returns>The path, e.g. /dev/pts/3, or NULL if the UART has not been opened</returns>
+const char *HostEmu_GetUartPath(void);
+
+/// <summary>
+/// Gets the line settings most recently applied by a UART configuration message from the A7.
+/// </summary>
+/// <param name="config">Receives the settings</param>
+void HostEmu_GetUartConfig(HostUartConfig *config);
+
+#endif /* HOST_UART_H */
@@ -0,0 +1,716 @@
+/**
+ * @file    intercore-benchmark.c
+ * @brief   Measures A7 to M4 round trip throughput and latency on the host emulator, either for raw intercore
+ *          messages or for complete Modbus RTU transactions through the library, the M4 firmware and a virtual
+ *          slave. The scan mode times ModbusScanRegisters over a large range, through the M4 firmware or against a
+ *          virtual Modbus TCP slave. The jitter mode sends periodic reads while other threads load the CPUs, to show
+ *          how the scheduling options of the Modbus I/O thread affect the spread of response times. The serial mode
+ *          runs the rtu mode's reads through a serial port the library opens directly, to compare with the path
+ *          through the M4. The local mode runs them through a local server in shared memory, to compare with
+ *          Modbus TCP on the loopback interface.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+
+#include "host-baremetal.h"
+#include "host-uart.h"
+#include "virtual-slave.h"
+#include "../ModbusOnSphereA7/modbus.h"
+#include "../ModbusOnSphereA7/modbus_bus_stats.h"
+#include "../ModbusOnSphereA7/modbus_local.h"
+#include "../ModbusOnSphereA7/modbus_prepared.h"
+#include "../ModbusOnSphereA7/modbus_scan.h"
+#include "../modbusCommon.h"
+#include <applibs/application.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RT_APP_COMPONENT_ID "005180bc-402f-4cb3-a662-72937dbcde47"
+#define MESSAGE_HEADER_LENGTH 4
+#define DEFAULT_ITERATIONS 200
+#define DEFAULT_REGISTERS 10
+#define DEFAULT_TIMEOUT 20000
+#define LINE_RATE 9600
+#define DEFAULT_SCAN_REGISTERS 2000
+#define TCP_PORT 15020
+#define DEFAULT_PERIOD_US 5000
+#define MAX_LOAD_THREADS 64
+
+static modbusHandleStorage_t handles[1];
+static modbusReceiveBufferStorage_t receiveBuffers[1];
+static char localPath[64];
+static modbusLocalServer_t localServer;
+static pthread_t localServerThread;
+static atomic_bool localServerContinue;
+
+typedef enum
+{
+    intercore,
+    rtuEndToEnd,
+    scan,
+    jitter,
+    serial,
+    local
+} benchmarkMode_t;
+
+typedef struct
+{
+    benchmarkMode_t mode;
+    int iterations;
+    uint16_t registers;
+    uint32_t scanRegisters;
+    uint8_t inFlight;
+    bool external;
+    bool tcp;
+    bool prepared;
+    uint32_t periodUs;
+    int loadThreads;
+    int ioPolicy;
+    int ioPriority;
+    int ioCpu;
+    bool prefault;
+    const char *device;
+    VirtualSlaveConfig slave;
+} benchmarkOptions;
+
+static uint64_t NowNs(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000ULL + (uint64_t)t.tv_nsec;
+}
+
+static int CompareU64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void Report(const char *name, uint64_t *samples, int count, int failures, uint64_t elapsedNs,
+                   size_t bytesPerTransaction)
+{
+    if (count == 0)
+    {
+        printf("%s: no successful transactions (%d failures)\n", name, failures);
+        return;
+    }
+    qsort(samples, (size_t)count, sizeof(uint64_t), CompareU64);
+    uint64_t total = 0;
+    for (int i = 0; i < count; i++)
+    {
+        total += samples[i];
+    }
+    double seconds = (double)elapsedNs / 1e9;
+    printf("%s: %d ok, %d failed in %.3f s\n", name, count, failures, seconds);
+    printf("  throughput %.1f transactions/s, %.1f payload bytes/s\n", count / seconds,
+           (double)count * (double)bytesPerTransaction / seconds);
+    printf("  latency us: min %.1f avg %.1f p50 %.1f p99 %.1f max %.1f\n", samples[0] / 1e3,
+           (double)total / count / 1e3, samples[count / 2] / 1e3, samples[(count * 99) / 100] / 1e3,
+           samples[count - 1] / 1e3);
+}
+
+static void ReportBus(modbus_t hndl)
+{
+    modbusBusStats_t stats;
+    modbusBusConsumer_t top[3];
+
+    if (!ModbusGetBusStats(hndl, &stats))
+    {
+        return;
+    }
+    printf("  bus %u baud, %u bits/char: utilization %.1f%% headroom %.1f%%\n", stats.baudRate, stats.bitsPerChar,
+           stats.utilization * 100, stats.headroom * 100);
+    printf("  bus time us: wire %llu gaps %llu turnaround %llu (%u timeouts)\n", (unsigned long long)stats.wireUs,
+           (unsigned long long)stats.gapUs, (unsigned long long)stats.turnaroundUs, stats.timeouts);
+    size_t count = ModbusGetBusTopConsumers(hndl, top, sizeof(top) / sizeof(top[0]));
+    for (size_t i = 0; i < count; i++)
+    {
+        printf("  slave %u fc %u: %u transactions, %.1f%% of bus\n", top[i].slaveId, top[i].functionCode,
+               top[i].transactions, top[i].share * 100);
+    }
+}
+
+// Sends UART configuration messages straight over the intercore socket and times each acknowledgement.
+static int RunIntercore(const benchmarkOptions *options, uint64_t *samples)
+{
+    int fd = Application_Socket(RT_APP_COMPONENT_ID);
+    if (fd < 0)
+    {
+        perror("Application_Socket");
+        return -1;
+    }
+
+    uint8_t request[MESSAGE_HEADER_LENGTH + UART_CFG_MESSAGE_LENGTH] = {UART, UART_CFG_MESSAGE, MESSAGE_HEADER_LENGTH};
+    request[MESSAGE_HEADER_LENGTH + BAUD_RATE_OFFSET_LOWER] = BAUD_SET_9600;
+    request[MESSAGE_HEADER_LENGTH + STOP_BITS_OFFSET] = 1;
+    request[MESSAGE_HEADER_LENGTH + WORD_LENGTH_OFFSET] = 8;
+
+    struct timeval tv = {.tv_sec = 1};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    int count = 0;
+    int failures = 0;
+    uint64_t start = NowNs();
+    for (int i = 0; i < options->iterations; i++)
+    {
+        uint8_t response[64];
+        uint64_t t0 = NowNs();
+        if (send(fd, request, sizeof(request), 0) != (ssize_t)sizeof(request) ||
+            recv(fd, response, sizeof(response), 0) != MESSAGE_HEADER_LENGTH + UART_CFG_MESSAGE_RESP_LENGTH ||
+            response[MESSAGE_HEADER_LENGTH + UART_CFG_MESSAGE_RESP_SUCCESS_OFFSET] != 1)
+        {
+            failures++;
+            continue;
+        }
+        samples[count++] = NowNs() - t0;
+    }
+    Report("intercore", samples, count, failures, NowNs() - start, sizeof(request));
+    close(fd);
+    return failures ? 1 : 0;
+}
+
+// Reads holding registers from the virtual slave through the library and the M4 firmware.
+static int RunRtu(const benchmarkOptions *options, uint64_t *samples)
+{
+    // The virtual slave paces its responses to this rate so the bus statistics describe a real line.
+    serialSetup setup = {.baudRate = BAUD_SET_9600,
+                         .duplexMode = FULL_DUPLEX_MODE,
+                         .parityMode = PARITY_EVEN,
+                         .parityState = PARITY_OFF,
+                         .stopBits = 1,
+                         .wordLength = 8};
+
+    modbusInitOptions init = {.handles = handles,
+                              .handleCount = sizeof(handles) / sizeof(handles[0]),
+                              .receiveBuffers = receiveBuffers,
+                              .receiveBufferCount = sizeof(receiveBuffers) / sizeof(receiveBuffers[0])};
+    if (!ModbusInitEx(&init))
+    {
+        return -1;
+    }
+    modbus_t hndl;
+    const char *name;
+    if (options->mode == serial)
+    {
+        hndl = ModbusConnectRtuSerial(options->device, setup);
+        name = options->prepared ? "serial prepared" : "serial";
+    }
+    else if (options->mode == local)
+    {
+        hndl = options->tcp ? ModbusConnectTcp("127.0.0.1", TCP_PORT) : ModbusConnectLocal(localPath, DEFAULT_TIMEOUT);
+        name = options->tcp ? (options->prepared ? "local tcp prepared" : "local tcp")
+                            : (options->prepared ? "local prepared" : "local");
+    }
+    else
+    {
+        hndl = ModbusConnectRtu(setup, DEFAULT_TIMEOUT);
+        name = options->prepared ? "rtu prepared" : "rtu";
+    }
+    if (!hndl)
+    {
+        ModbusExit();
+        return -1;
+    }
+
+    // With --prepared every iteration sends the same request, encoded once up front.
+    modbusPrepared_t prepared = NULL;
+    if (options->prepared)
+    {
+        prepared = ModbusPrepareReadMultipleHoldingRegisters(hndl, options->slave.slaveId, 0, options->registers);
+    }
+
+    uint16_t *registers = calloc(options->registers, sizeof(uint16_t));
+    int count = 0;
+    int failures = 0;
+    uint64_t start = NowNs();
+    for (int i = 0; i < options->iterations; i++)
+    {
+        uint16_t address = prepared ? 0
+                                    : (uint16_t)((i * options->registers) %
+                                                 (VIRTUAL_SLAVE_REGISTER_COUNT - options->registers));
+        uint64_t t0 = NowNs();
+        bool ok = prepared ? ModbusSendPrepared(hndl, prepared, registers, DEFAULT_TIMEOUT)
+                           : ReadMultipleHoldingRegisters(hndl, options->slave.slaveId, address, options->registers,
+                                                          registers, DEFAULT_TIMEOUT);
+        if (!ok)
+        {
+            fprintf(stderr, "Read %d failed: %s\n", i, ModbusErrorToString((uint8_t)registers[0]));
+            failures++;
+            continue;
+        }
+        samples[count++] = NowNs() - t0;
+        if (!options->external && registers[0] != address)
+        {
+            fprintf(stderr, "Read %d returned %u, expected %u\n", i, registers[0], address);
+            failures++;
+        }
+    }
+    Report(name, samples, count, failures, NowNs() - start, (size_t)options->registers * 2);
+    ReportBus(hndl);
+
+    ModbusFreePrepared(prepared);
+    free(registers);
+    ModbusClose(hndl);
+    ModbusExit();
+    return failures ? 1 : 0;
+}
+
+// Reads a large range of holding registers with ModbusScanRegisters, over RTU or Modbus TCP.
+static int RunScan(const benchmarkOptions *options, uint64_t *samples)
+{
+    serialSetup setup = {.baudRate = BAUD_SET_9600,
+                         .duplexMode = FULL_DUPLEX_MODE,
+                         .parityMode = PARITY_EVEN,
+                         .parityState = PARITY_OFF,
+                         .stopBits = 1,
+                         .wordLength = 8};
+
+    modbusInitOptions init = {.handles = handles,
+                              .handleCount = sizeof(handles) / sizeof(handles[0]),
+                              .receiveBuffers = receiveBuffers,
+                              .receiveBufferCount = sizeof(receiveBuffers) / sizeof(receiveBuffers[0])};
+    if (!ModbusInitEx(&init))
+    {
+        return -1;
+    }
+    modbus_t hndl = options->tcp ? ModbusConnectTcp("127.0.0.1", TCP_PORT) : ModbusConnectRtu(setup, DEFAULT_TIMEOUT);
+    if (!hndl)
+    {
+        ModbusExit();
+        return -1;
+    }
+    if (options->inFlight)
+    {
+        ModbusSetMaxInFlight(hndl, options->inFlight);
+    }
+
+    size_t chunkCount = ModbusScanChunkCount(hndl, options->slave.slaveId, MODBUS_TABLE_HOLDING_REGISTERS, options->scanRegisters);
+    modbusScanChunk_t *chunks = calloc(chunkCount, sizeof(modbusScanChunk_t));
+    uint16_t *registers = calloc(options->scanRegisters, sizeof(uint16_t));
+    int count = 0;
+    int failures = 0;
+    uint64_t start = NowNs();
+    for (int i = 0; i < options->iterations; i++)
+    {
+        memset(registers, 0xFF, options->scanRegisters * sizeof(uint16_t));
+        uint64_t t0 = NowNs();
+        if (!ModbusScanRegisters(hndl, options->slave.slaveId, MODBUS_TABLE_HOLDING_REGISTERS, 0,
+                                 options->scanRegisters, registers, chunks, chunkCount, DEFAULT_TIMEOUT))
+        {
+            for (size_t c = 0; c < chunkCount; c++)
+            {
+                if (chunks[c].error)
+                {
+                    fprintf(stderr, "Scan %d: %u registers from %u failed: %s\n", i, chunks[c].count,
+                            chunks[c].address, ModbusErrorToString(chunks[c].error));
+                }
+            }
+            failures++;
+            continue;
+        }
+        samples[count++] = NowNs() - t0;
+        for (uint32_t r = 0; r < options->scanRegisters && !options->external; r++)
+        {
+            if (registers[r] != r)
+            {
+                fprintf(stderr, "Scan %d returned %u at %u\n", i, registers[r], r);
+                failures++;
+                break;
+            }
+        }
+    }
+    printf("scan of %u registers in %zu requests\n", options->scanRegisters, chunkCount);
+    Report(options->tcp ? "scan tcp" : "scan rtu", samples, count, failures, NowNs() - start,
+           (size_t)options->scanRegisters * 2);
+    if (!options->tcp)
+    {
+        ReportBus(hndl);
+    }
+
+    free(registers);
+    free(chunks);
+    ModbusClose(hndl);
+    ModbusExit();
+    return failures ? 1 : 0;
+}
+
+static atomic_bool loadContinue;
+
+// Keeps a CPU busy until loadContinue is cleared.
+static void *LoadThread(void *ptr)
+{
+    volatile uint64_t spins = 0;
+    while (atomic_load_explicit(&loadContinue, memory_order_relaxed))
+    {
+        spins++;
+    }
+    return NULL;
+}
+
+// Sends a read every period while load threads compete for the CPUs, with the I/O thread scheduled as asked. With
+// --cpu the load threads share the I/O thread's CPU, so only its scheduling policy decides when it runs.
+static int RunJitter(const benchmarkOptions *options, uint64_t *samples)
+{
+    serialSetup setup = {.baudRate = BAUD_SET_9600,
+                         .duplexMode = FULL_DUPLEX_MODE,
+                         .parityMode = PARITY_EVEN,
+                         .parityState = PARITY_OFF,
+                         .stopBits = 1,
+                         .wordLength = 8};
+
+    if (options->prefault && mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+    {
+        perror("mlockall");
+    }
+    modbusInitOptions init = {.handles = handles,
+                              .handleCount = sizeof(handles) / sizeof(handles[0]),
+                              .receiveBufferCount = 1,
+                              .ioThreadPolicy = options->ioPolicy,
+                              .ioThreadPriority = options->ioPriority,
+                              .ioThreadCpus = options->ioCpu >= 0 ? 1ULL << options->ioCpu : 0,
+                              .prefault = options->prefault};
+    if (!ModbusInitEx(&init))
+    {
+        fprintf(stderr, "Unable to start the I/O thread with the scheduling asked for\n");
+        return -1;
+    }
+    modbus_t hndl = options->tcp ? ModbusConnectTcp("127.0.0.1", TCP_PORT) : ModbusConnectRtu(setup, DEFAULT_TIMEOUT);
+    if (!hndl)
+    {
+        ModbusExit();
+        return -1;
+    }
+
+    pthread_t load[MAX_LOAD_THREADS];
+    atomic_store(&loadContinue, true);
+    for (int i = 0; i < options->loadThreads; i++)
+    {
+        pthread_create(&load[i], NULL, &LoadThread, NULL);
+        if (options->ioCpu >= 0)
+        {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(options->ioCpu, &cpus);
+            pthread_setaffinity_np(load[i], sizeof(cpus), &cpus);
+        }
+    }
+
+    uint16_t *registers = calloc(options->registers, sizeof(uint16_t));
+    int count = 0;
+    int failures = 0;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    uint64_t start = NowNs();
+    for (int i = 0; i < options->iterations; i++)
+    {
+        uint64_t t0 = NowNs();
+        if (!ReadMultipleHoldingRegisters(hndl, options->slave.slaveId, 0, options->registers, registers,
+                                          DEFAULT_TIMEOUT))
+        {
+            fprintf(stderr, "Read %d failed: %s\n", i, ModbusErrorToString((uint8_t)registers[0]));
+            failures++;
+        }
+        else
+        {
+            samples[count++] = NowNs() - t0;
+        }
+        next.tv_nsec += (long)options->periodUs * 1000;
+        while (next.tv_nsec >= 1000000000L)
+        {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+    uint64_t elapsedNs = NowNs() - start;
+
+    atomic_store(&loadContinue, false);
+    for (int i = 0; i < options->loadThreads; i++)
+    {
+        pthread_join(load[i], NULL);
+    }
+
+    const char *policy = options->ioPolicy == SCHED_FIFO ? "fifo" : options->ioPolicy == SCHED_RR ? "rr" : "other";
+    printf("jitter %s: I/O thread %s priority %d, cpu %d, %d load threads%s\n", options->tcp ? "tcp" : "rtu", policy,
+           options->ioPriority, options->ioCpu, options->loadThreads, options->prefault ? ", prefaulted" : "");
+    Report("jitter", samples, count, failures, elapsedNs, (size_t)options->registers * 2);
+    if (count)
+    {
+        // Report sorted the samples.
+        printf("  jitter us: p99-p50 %.1f max-min %.1f\n", (samples[(count * 99) / 100] - samples[count / 2]) / 1e3,
+               (samples[count - 1] - samples[0]) / 1e3);
+    }
+
+    free(registers);
+    ModbusClose(hndl);
+    ModbusExit();
+    return failures ? 1 : 0;
+}
+
+static uint16_t AnswerLocal(void *context, const uint8_t *request, uint16_t requestLength, uint8_t *response)
+{
+    (void)context;
+    (void)requestLength;
+    return (uint16_t)VirtualSlave_Answer(request, response);
+}
+
+static void *LocalServerThread(void *ptr)
+{
+    (void)ptr;
+    struct pollfd server = {.fd = ModbusGetLocalServerFd(localServer), .events = POLLIN};
+    while (atomic_load(&localServerContinue))
+    {
+        if (poll(&server, 1, 100) > 0)
+        {
+            ModbusRunLocalServer(localServer);
+        }
+    }
+    return NULL;
+}
+
+// Starts a local server on a thread of its own for the local mode, answering from the virtual slave as another
+// process acting as a gateway would.
+static bool StartLocalServer(const benchmarkOptions *options)
+{
+    snprintf(localPath, sizeof(localPath), "/tmp/modbus-benchmark-%d.sock", (int)getpid());
+    VirtualSlave_Init(&options->slave);
+    localServer = ModbusCreateLocalServer(localPath, 1, AnswerLocal, NULL);
+    if (!localServer)
+    {
+        return false;
+    }
+    atomic_store(&localServerContinue, true);
+    if (pthread_create(&localServerThread, NULL, LocalServerThread, NULL) != 0)
+    {
+        ModbusFreeLocalServer(localServer);
+        localServer = NULL;
+        return false;
+    }
+    return true;
+}
+
+static void StopLocalServer(void)
+{
+    if (localServer)
+    {
+        atomic_store(&localServerContinue, false);
+        pthread_join(localServerThread, NULL);
+        ModbusFreeLocalServer(localServer);
+        localServer = NULL;
+    }
+}
+
+// Opens a pseudo terminal for the serial mode. The virtual slave answers on its master side and the library opens
+// the other side as its serial port, in place of an M4 UART.
+static bool StartSerialSlave(benchmarkOptions *options)
+{
+    static char path[64];
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0 || ptsname_r(fd, path, sizeof(path)) != 0)
+    {
+        perror("Unable to open a pseudo terminal");
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return false;
+    }
+    options->device = path;
+    return VirtualSlave_StartFd(fd, &options->slave);
+}
+
+static void Usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [intercore|rtu|serial|local|scan|jitter] [-n iterations] [-r registers] [-s slave] [-t turnaround-us]\n"
+            "          [--external] [-c scan-registers] [-p in-flight] [--tcp] [--prepared]\n"
+            "          [--period us] [--load threads] [--fifo priority|--rr priority] [--cpu n] [--prefault]\n"
+            "          [--device path]\n"
+            "  --external  attach to a running ModbusOnSphereM4Host instead of starting the firmware here\n"
+            "  --device    serial port to use in serial mode instead of a virtual slave, at 9600 baud 8N1\n"
+            "  --tcp       use a virtual Modbus TCP slave on the loopback interface instead of the RTU slave,\n"
+            "              or in local mode instead of the local server\n"
+            "  --prepared  send one prepared request repeatedly in rtu, serial or local mode\n"
+            "  --period    time between reads in jitter mode, default %d us\n"
+            "  --load      threads that keep the CPUs busy in jitter mode\n"
+            "  --fifo/--rr run the Modbus I/O thread with a real-time policy and priority\n"
+            "  --cpu       pin the I/O thread, and the load threads, to one CPU\n"
+            "  --prefault  lock memory and prefault the I/O thread's stack and receive buffers\n",
+            name, DEFAULT_PERIOD_US);
+}
+
+int main(int argc, char *argv[])
+{
+    benchmarkOptions options = {.mode = rtuEndToEnd,
+                                .iterations = DEFAULT_ITERATIONS,
+                                .registers = DEFAULT_REGISTERS,
+                                .scanRegisters = DEFAULT_SCAN_REGISTERS,
+                                .periodUs = DEFAULT_PERIOD_US,
+                                .ioCpu = -1};
+    VirtualSlave_DefaultConfig(&options.slave, 1);
+    options.slave.lineRate = LINE_RATE;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "intercore") == 0)
+        {
+            options.mode = intercore;
+        }
+        else if (strcmp(argv[i], "rtu") == 0)
+        {
+            options.mode = rtuEndToEnd;
+        }
+        else if (strcmp(argv[i], "scan") == 0)
+        {
+            options.mode = scan;
+        }
+        else if (strcmp(argv[i], "jitter") == 0)
+        {
+            options.mode = jitter;
+        }
+        else if (strcmp(argv[i], "serial") == 0)
+        {
+            options.mode = serial;
+        }
+        else if (strcmp(argv[i], "local") == 0)
+        {
+            options.mode = local;
+        }
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+        {
+            options.iterations = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+        {
+            options.registers = (uint16_t)atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+        {
+            options.slave.slaveId = (uint8_t)atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+        {
+            options.slave.turnaroundUs = (uint32_t)strtoul(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+        {
+            options.scanRegisters = (uint32_t)strtoul(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+        {
+            options.inFlight = (uint8_t)atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--external") == 0)
+        {
+            options.external = true;
+        }
+        else if (strcmp(argv[i], "--tcp") == 0)
+        {
+            options.tcp = true;
+        }
+        else if (strcmp(argv[i], "--prepared") == 0)
+        {
+            options.prepared = true;
+        }
+        else if (strcmp(argv[i], "--period") == 0 && i + 1 < argc)
+        {
+            options.periodUs = (uint32_t)strtoul(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "--load") == 0 && i + 1 < argc)
+        {
+            options.loadThreads = atoi(argv[++i]);
+        }
+        else if ((strcmp(argv[i], "--fifo") == 0 || strcmp(argv[i], "--rr") == 0) && i + 1 < argc)
+        {
+            options.ioPolicy = strcmp(argv[i], "--fifo") == 0 ? SCHED_FIFO : SCHED_RR;
+            options.ioPriority = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--cpu") == 0 && i + 1 < argc)
+        {
+            options.ioCpu = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--prefault") == 0)
+        {
+            options.prefault = true;
+        }
+        else if (strcmp(argv[i], "--device") == 0 && i + 1 < argc)
+        {
+            options.device = argv[++i];
+        }
+        else
+        {
+            Usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (options.iterations <= 0 || options.registers == 0 || options.registers > 125 || options.scanRegisters == 0 ||
+        options.scanRegisters > VIRTUAL_SLAVE_REGISTER_COUNT || options.loadThreads < 0 ||
+        options.loadThreads > MAX_LOAD_THREADS || options.ioCpu >= 64)
+    {
+        Usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if ((options.mode == scan || options.mode == jitter || options.mode == local) && options.tcp)
+    {
+        if (!VirtualSlave_StartTcp(TCP_PORT, &options.slave))
+        {
+            return EXIT_FAILURE;
+        }
+    }
+    else if (options.mode == serial)
+    {
+        if (!options.device && !StartSerialSlave(&options))
+        {
+            return EXIT_FAILURE;
+        }
+    }
+    else if (options.mode == local)
+    {
+        if (!StartLocalServer(&options))
+        {
+            return EXIT_FAILURE;
+        }
+    }
+    else if (!options.external)
+    {
+        if (!HostEmu_OpenUart() || HostEmu_StartFirmware() != 0 ||
+            !VirtualSlave_Start(HostEmu_GetUartPath(), &options.slave))
+        {
+            return EXIT_FAILURE;
+        }
+    }
+
+    uint64_t *samples = calloc((size_t)options.iterations, sizeof(uint64_t));
+    int rc = 0;
+    switch (options.mode)
+    {
+    case intercore:
+        rc = RunIntercore(&options, samples);
+        break;
+    case scan:
+        rc = RunScan(&options, samples);
+        break;
+    case jitter:
+        rc = RunJitter(&options, samples);
+        break;
+    default:
+        rc = RunRtu(&options, samples);
+        break;
+    }
+    free(samples);
+    StopLocalServer();
+    return rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
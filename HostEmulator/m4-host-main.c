@@ -0,0 +1,72 @@
+/**
+ * @file    m4-host-main.c
+ * @brief   Runs the M4 real-time firmware as a standalone Linux process. A7 code built against the host emulator
+ *          attaches to it through the shared memory object, and a Modbus slave can be attached to the printed
+ *          pseudo terminal.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+
+#include "host-baremetal.h"
+#include "host-uart.h"
+#include "virtual-slave.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void Usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [--slave <id>] [--turnaround <us>]\n"
+            "  --slave <id>       answer requests for this unit ID with the built in virtual slave\n"
+            "  --turnaround <us>  virtual slave delay between request and response\n",
+            name);
+}
+
+int main(int argc, char *argv[])
+{
+    int slaveId = -1;
+    VirtualSlaveConfig slaveConfig;
+
+    VirtualSlave_DefaultConfig(&slaveConfig, 1);
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--slave") == 0 && i + 1 < argc)
+        {
+            slaveId = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--turnaround") == 0 && i + 1 < argc)
+        {
+            slaveConfig.turnaroundUs = (uint32_t)strtoul(argv[++i], NULL, 0);
+        }
+        else
+        {
+            Usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!HostEmu_OpenUart() || HostEmu_StartFirmware() != 0)
+    {
+        return EXIT_FAILURE;
+    }
+    printf("ISU0 is %s\n", HostEmu_GetUartPath());
+
+    if (slaveId >= 0)
+    {
+        slaveConfig.slaveId = (uint8_t)slaveId;
+        if (!VirtualSlave_Start(HostEmu_GetUartPath(), &slaveConfig))
+        {
+            return EXIT_FAILURE;
+        }
+        printf("Virtual slave %d attached\n", slaveId);
+    }
+    fflush(stdout);
+
+    for (;;)
+    {
+        pause();
+    }
+}
@@ -0,0 +1,611 @@
+/**
+ * @file    virtual-slave.c
+ * @brief   A Modbus RTU and Modbus TCP slave for exercising the library end to end on the host emulator.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+
+#include "virtual-slave.h"
+#include "../crc-util.h"
+#include "../modbusCommon.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_ADU_LENGTH (MAX_PDU_LENGTH + CRC_FOOTER_LENGTH)
+#define FIXED_REQUEST_LENGTH 8      // slave, fcode, address, quantity or value, CRC
+#define MULTIPLE_WRITE_HEADER_LENGTH 7 // slave, fcode, address, quantity, byte count
+#define SPEC_MAX_READ_REGISTERS 125
+#define SPEC_MAX_READ_BITS 2000
+#define LINE_CHAR_BITS 10              // start bit, 8 data bits, stop bit
+#define MBAP_HEADER_LENGTH 6           // transaction, protocol and length; the unit ID is part of the request
+#define FIFO_REQUEST_LENGTH 6          // slave, fcode, FIFO pointer address, CRC
+#define FIFO_CAPACITY 1024
+#define DEVICE_ID_REQUEST_LENGTH 7     // slave, fcode, MEI type, read device ID code, object ID, CRC
+#define DEVICE_ID_OBJECTS 3
+
+static VirtualSlaveConfig slaveConfig;
+static VirtualSlaveStats slaveStats;
+static int slaveFd = -1;
+static bool silent = false;
+static uint8_t rejectException = 0;
+static uint32_t rejectCount = 0;
+static uint32_t corruptCount = 0;
+
+static uint16_t holdingRegisters[VIRTUAL_SLAVE_REGISTER_COUNT];
+static uint16_t inputRegisters[VIRTUAL_SLAVE_REGISTER_COUNT];
+static uint8_t coils[VIRTUAL_SLAVE_REGISTER_COUNT];
+static uint8_t discreteInputs[VIRTUAL_SLAVE_REGISTER_COUNT];
+
+static pthread_mutex_t fifoLock = PTHREAD_MUTEX_INITIALIZER;
+static uint16_t fifo[FIFO_CAPACITY];
+static size_t fifoLength = 0;
+
+static size_t RequestLength(const uint8_t *request, size_t available);
+static size_t HandleRequest(const uint8_t *request, uint8_t *response);
+static size_t ExceptionResponse(const uint8_t *request, uint8_t *response, uint8_t exception);
+static void *SlaveThread(void *arg);
+static void *TcpListenThread(void *arg);
+static void *TcpConnectionThread(void *arg);
+static void InitRegisters(void);
+static void Delay(uint64_t delayUs);
+
+static uint16_t GetU16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static void PutU16(uint8_t *p, uint16_t value)
+{
+    p[0] = (uint8_t)(value >> 8);
+    p[1] = (uint8_t)(value & 0xFF);
+}
+
+// Returns the full request length including CRC, zero if more data is needed, or SIZE_MAX if the function code
+// cannot be framed.
+static size_t RequestLength(const uint8_t *request, size_t available)
+{
+    if (available < 2)
+    {
+        return 0;
+    }
+    switch (request[1])
+    {
+    case READ_COILS:
+    case READ_DISCRETE_INPUTS:
+    case READ_MULTIPLE_HOLDING_REGISTERS:
+    case READ_INPUT_REGISTERS:
+    case WRITE_SINGLE_COIL:
+    case WRITE_SINGLE_HOLDING_REGISTER:
+        return FIXED_REQUEST_LENGTH;
+    case MASK_WRITE_REGISTER:
+        return FIXED_REQUEST_LENGTH + 2;
+    case READ_FIFO_QUEUE:
+        return FIFO_REQUEST_LENGTH;
+    case ENCAPSULATED_INTERFACE_TRANSPORT:
+        return DEVICE_ID_REQUEST_LENGTH;
+    case WRITE_MULTIPLE_COILS:
+    case WRITE_MULTIPLE_HOLDING_REGISTERS:
+        if (available < MULTIPLE_WRITE_HEADER_LENGTH)
+        {
+            return 0;
+        }
+        return MULTIPLE_WRITE_HEADER_LENGTH + request[6] + CRC_FOOTER_LENGTH;
+    default:
+        return SIZE_MAX;
+    }
+}
+
+static size_t ExceptionResponse(const uint8_t *request, uint8_t *response, uint8_t exception)
+{
+    slaveStats.exceptions++;
+    response[0] = request[0];
+    response[1] = (uint8_t)(request[1] + FCODE_ERROR_OFFSET);
+    response[2] = exception;
+    return ERROR_CODE_LENGTH;
+}
+
+static size_t HandleRequest(const uint8_t *request, uint8_t *response)
+{
+    uint8_t fCode = request[1];
+    uint16_t address = GetU16(&request[2]);
+    uint16_t quantity = GetU16(&request[4]);
+
+    response[0] = request[0];
+    response[1] = fCode;
+
+    switch (fCode)
+    {
+    case READ_COILS:
+    case READ_DISCRETE_INPUTS: {
+        const uint8_t *bits = (fCode == READ_COILS) ? coils : discreteInputs;
+        if (quantity == 0 || quantity > slaveConfig.maxReadBits)
+        {
+            return ExceptionResponse(request, response, ILLEGAL_DATA_VALUE);
+        }
+        if ((uint32_t)address + quantity > VIRTUAL_SLAVE_REGISTER_COUNT)
+        {
+            return ExceptionResponse(request, response, ILLEGAL_DATA_ADDRESS);
+        }
+        uint8_t byteCount = (uint8_t)((quantity + 7) / 8);
+        response[2] = byteCount;
+        memset(&response[3], 0, byteCount);
+        for (uint16_t i = 0; i < quantity; i++)
+        {
+            if (bits[address + i])
+            {
+                response[3 + i / 8] |= (uint8_t)(1 << (i % 8));
+            }
+        }
+        return PDU_HEADER_LENGTH + byteCount;
+    }
+    case READ_MULTIPLE_HOLDING_REGISTERS:
+    case READ_INPUT_REGISTERS: {
+        const uint16_t *registers = (fCode == READ_INPUT_REGISTERS) ? inputRegisters : holdingRegisters;
+        if (quantity == 0 || quantity > slaveConfig.maxReadRegisters)
+        {
+            return ExceptionResponse(request, response, ILLEGAL_DATA_VALUE);
+        }
+        if ((uint32_t)address + quantity > VIRTUAL_SLAVE_REGISTER_COUNT)
+        {
+            return ExceptionResponse(request, response, ILLEGAL_DATA_ADDRESS);
+        }
+        response[2] = (uint8_t)(quantity * 2);
+        for (uint16_t i = 0; i < quantity; i++)
+        {
+            PutU16(&response[3 + i * 2], registers[address + i]);
+        }
+        return PDU_HEADER_LENGTH + (size_t)quantity * 2;
+    }
+    case WRITE_SINGLE_COIL:
+        if (address >= VIRTUAL_SLAVE_REGISTER_COUNT)
+        {
+            return ExceptionResponse(request, response, ILLEGAL_DATA_ADDRESS);
+        }
+        coils[address] = (quantity == 0xFF00);
+        memcpy(&response[2], &request[2], 4);
+        return PDU_HEADER_LENGTH + 3;
+    case WRITE_SINGLE_HOLDING_REGISTER:
+        if (address >= VIRTUAL_SLAVE_REGISTER_COUNT)
+        {
+            return ExceptionResponse(request, response, ILLEGAL_DATA_ADDRESS);
+        }
+        holdingRegisters[address] = quantity;
+        memcpy(&response[2], &request[2], 4);
+        return PDU_HEADER_LENGTH + 3;
+    case MASK_WRITE_REGISTER: {
+        uint16_t orMask = GetU16(&request[6]);
+        if (slaveConfig.noMaskWrite)
+        {
+            return ExceptionResponse(request, response, ILLEGAL_FUNCTION);
+        }
+        if (address >= VIRTUAL_SLAVE_REGISTER_COUNT)
+        {
+            return ExceptionResponse(request, response, ILLEGAL_DATA_ADDRESS);
+        }
+        // The AND mask is in the quantity field.
+        holdingRegisters[address] = (uint16_t)((holdingRegisters[address] & quantity) | (orMask & ~quantity));
+        memcpy(&response[2], &request[2], 6);
+        return PDU_HEADER_LENGTH + 5;
+    }
+    case READ_FIFO_QUEUE: {
+        pthread_mutex_lock(&fifoLock);
+        uint16_t count = (uint16_t)((fifoLength < MAX_FIFO_COUNT) ? fifoLength : MAX_FIFO_COUNT);
+        PutU16(&response[2], (uint16_t)(2 + count * 2));
+        PutU16(&response[4], count);
+        for (uint16_t i = 0; i < count; i++)
+        {
+            PutU16(&response[6 + i * 2], fifo[i]);
+        }
+        fifoLength -= count;
+        memmove(fifo, &fifo[count], fifoLength * sizeof(uint16_t));
+        pthread_mutex_unlock(&fifoLock);
+        return PDU_HEADER_LENGTH + 3 + (size_t)count * 2;
+    }
+    case ENCAPSULATED_INTERFACE_TRANSPORT: {
+        uint8_t objectId = request[4];
+        if (!slaveConfig.identity[0])
+        {
+            return ExceptionResponse(request, response, ILLEGAL_FUNCTION);
+        }
+        if (request[2] != MEI_READ_DEVICE_ID || request[3] != 1 || objectId >= DEVICE_ID_OBJECTS)
+        {
+            return ExceptionResponse(request, response, ILLEGAL_DATA_ADDRESS);
+        }
+        uint8_t count = (uint8_t)(DEVICE_ID_OBJECTS - objectId);
+        if (slaveConfig.identityPerResponse && count > slaveConfig.identityPerResponse)
+        {
+            count = slaveConfig.identityPerResponse;
+        }
+        response[2] = MEI_READ_DEVICE_ID;
+        response[3] = 1;    // Basic objects
+        response[4] = 0x01; // Conformity level: basic identification, stream access only
+        response[5] = (objectId + count < DEVICE_ID_OBJECTS) ? 0xFF : 0;
+        response[6] = (objectId + count < DEVICE_ID_OBJECTS) ? (uint8_t)(objectId + count) : 0;
+        response[7] = count;
+        size_t length = DEVICE_ID_HEADER_LENGTH;
+        for (uint8_t i = 0; i < count; i++)
+        {
+            const char *value = slaveConfig.identity[objectId + i] ? slaveConfig.identity[objectId + i] : "";
+            size_t valueLength = strlen(value);
+            response[length] = (uint8_t)(objectId + i);
+            response[length + 1] = (uint8_t)valueLength;
+            memcpy(&response[length + 2], value, valueLength);
+            length += 2 + valueLength;
+        }
+        return length;
+    }
+    case WRITE_MULTIPLE_COILS:
+        if ((uint32_t)address + quantity > VIRTUAL_SLAVE_REGISTER_COUNT)
+        {
+            return ExceptionResponse(request, response, ILLEGAL_DATA_ADDRESS);
+        }
+        for (uint16_t i = 0; i < quantity; i++)
+        {
+            coils[address + i] = (request[7 + i / 8] >> (i % 8)) & 1;
+        }
+        memcpy(&response[2], &request[2], 4);
+        return PDU_HEADER_LENGTH + 3;
+    case WRITE_MULTIPLE_HOLDING_REGISTERS:
+        if ((uint32_t)address + quantity > VIRTUAL_SLAVE_REGISTER_COUNT)
+        {
+            return ExceptionResponse(request, response, ILLEGAL_DATA_ADDRESS);
+        }
+        for (uint16_t i = 0; i < quantity; i++)
+        {
+            holdingRegisters[address + i] = GetU16(&request[7 + i * 2]);
+        }
+        memcpy(&response[2], &request[2], 4);
+        return PDU_HEADER_LENGTH + 3;
+    default:
+        return ExceptionResponse(request, response, ILLEGAL_FUNCTION);
+    }
+}
+
+// Takes one from a fault counter, returning true if it was not already zero.
+static bool TakeFault(uint32_t *count)
+{
+    uint32_t current = __atomic_load_n(count, __ATOMIC_RELAXED);
+    while (current && !__atomic_compare_exchange_n(count, &current, current - 1, false, __ATOMIC_RELAXED,
+                                                   __ATOMIC_RELAXED))
+    {
+    }
+    return current != 0;
+}
+
+// Handles a request, or rejects it with the exception set by VirtualSlave_RejectNext while any rejections remain.
+static size_t Answer(const uint8_t *request, uint8_t *response)
+{
+    if (TakeFault(&rejectCount))
+    {
+        return ExceptionResponse(request, response, __atomic_load_n(&rejectException, __ATOMIC_RELAXED));
+    }
+    return HandleRequest(request, response);
+}
+
+static void *SlaveThread(void *arg)
+{
+    (void)arg;
+    uint8_t request[MAX_ADU_LENGTH];
+    uint8_t response[MAX_ADU_LENGTH];
+    size_t length = 0;
+
+    for (;;)
+    {
+        ssize_t bytesRead = read(slaveFd, &request[length], sizeof(request) - length);
+        if (bytesRead <= 0)
+        {
+            if (bytesRead < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        length += (size_t)bytesRead;
+
+        size_t requestLength;
+        while ((requestLength = RequestLength(request, length)) != 0 && requestLength <= length)
+        {
+            if (requestLength == SIZE_MAX || requestLength > MAX_ADU_LENGTH)
+            {
+                // Lost framing; drop everything received so far and resynchronise on the next request.
+                length = 0;
+                break;
+            }
+            if (!ValidateCRC(request, (int)requestLength))
+            {
+                slaveStats.crcErrors++;
+            }
+            else if (request[0] == slaveConfig.slaveId && !__atomic_load_n(&silent, __ATOMIC_RELAXED))
+            {
+                slaveStats.requests++;
+                size_t responseLength = Answer(request, response);
+                AddCRC(response, (int)responseLength, MAX_ADU_LENGTH);
+                if (TakeFault(&corruptCount))
+                {
+                    response[responseLength] ^= 0xFF;
+                }
+                uint64_t delayUs = slaveConfig.turnaroundUs;
+                if (slaveConfig.lineRate)
+                {
+                    // Both frames plus the 3.5 character silent interval that follows each of them
+                    delayUs += ((uint64_t)(requestLength + responseLength + CRC_FOOTER_LENGTH) * 2 + 7) *
+                               LINE_CHAR_BITS * 1000000 / 2 / slaveConfig.lineRate;
+                }
+                Delay(delayUs);
+                if (write(slaveFd, response, responseLength + CRC_FOOTER_LENGTH) < 0)
+                {
+                    fprintf(stderr, "VirtualSlave: write failed: %s\n", strerror(errno));
+                }
+            }
+            memmove(request, &request[requestLength], length - requestLength);
+            length -= requestLength;
+        }
+        if (requestLength == SIZE_MAX)
+        {
+            length = 0;
+        }
+    }
+    return NULL;
+}
+
+bool VirtualSlave_QueueFifo(const uint16_t *values, size_t count)
+{
+    pthread_mutex_lock(&fifoLock);
+    bool fits = count <= FIFO_CAPACITY - fifoLength;
+    if (fits)
+    {
+        memcpy(&fifo[fifoLength], values, count * sizeof(uint16_t));
+        fifoLength += count;
+    }
+    pthread_mutex_unlock(&fifoLock);
+    return fits;
+}
+
+void VirtualSlave_DefaultConfig(VirtualSlaveConfig *config, uint8_t slaveId)
+{
+    memset(config, 0, sizeof(*config));
+    config->slaveId = slaveId;
+    config->maxReadRegisters = SPEC_MAX_READ_REGISTERS;
+    config->maxReadBits = SPEC_MAX_READ_BITS;
+    config->identity[0] = "Bsquare";
+    config->identity[1] = "VirtualSlave";
+    config->identity[2] = "1.0";
+}
+
+static void Delay(uint64_t delayUs)
+{
+    if (delayUs)
+    {
+        struct timespec t = {.tv_sec = (time_t)(delayUs / 1000000), .tv_nsec = (long)(delayUs % 1000000) * 1000};
+        nanosleep(&t, NULL);
+    }
+}
+
+static void InitRegisters(void)
+{
+    static bool initialised = false;
+    if (initialised)
+    {
+        return;
+    }
+    initialised = true;
+    for (uint32_t i = 0; i < VIRTUAL_SLAVE_REGISTER_COUNT; i++)
+    {
+        holdingRegisters[i] = (uint16_t)i;
+        inputRegisters[i] = (uint16_t)(i ^ 0x5555);
+        coils[i] = (uint8_t)(i & 1);
+        discreteInputs[i] = (uint8_t)((i & 1) ^ 1);
+    }
+}
+
+// Answers Modbus TCP requests on one connection. Requests are handled in the order they arrive, so several can be
+// outstanding at once. Each response is sent turnaroundUs after its request arrived, like a slave behind a link
+// with that latency, so pipelined requests overlap rather than queue.
+static void *TcpConnectionThread(void *arg)
+{
+    int fd = (int)(intptr_t)arg;
+    uint8_t request[MBAP_HEADER_LENGTH + MAX_PDU_LENGTH];
+    uint8_t response[MBAP_HEADER_LENGTH + MAX_PDU_LENGTH];
+    size_t length = 0;
+
+    for (;;)
+    {
+        ssize_t bytesRead = read(fd, &request[length], sizeof(request) - length);
+        if (bytesRead <= 0)
+        {
+            if (bytesRead < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        length += (size_t)bytesRead;
+        struct timespec due;
+        clock_gettime(CLOCK_MONOTONIC, &due);
+        due.tv_sec += slaveConfig.turnaroundUs / 1000000;
+        due.tv_nsec += (long)(slaveConfig.turnaroundUs % 1000000) * 1000;
+        if (due.tv_nsec >= 1000000000)
+        {
+            due.tv_sec++;
+            due.tv_nsec -= 1000000000;
+        }
+
+        while (length >= MBAP_HEADER_LENGTH)
+        {
+            size_t pduLength = GetU16(&request[4]);
+            if (pduLength < 2 || pduLength > MAX_PDU_LENGTH)
+            {
+                length = 0;
+                break;
+            }
+            if (length < MBAP_HEADER_LENGTH + pduLength)
+            {
+                break;
+            }
+            const uint8_t *pdu = &request[MBAP_HEADER_LENGTH];
+            if (pdu[0] == slaveConfig.slaveId && !__atomic_load_n(&silent, __ATOMIC_RELAXED))
+            {
+                slaveStats.requests++;
+                size_t responseLength = Answer(pdu, &response[MBAP_HEADER_LENGTH]);
+                memcpy(response, request, 4);
+                PutU16(&response[4], (uint16_t)responseLength);
+                while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR)
+                {
+                }
+                if (write(fd, response, MBAP_HEADER_LENGTH + responseLength) < 0)
+                {
+                    fprintf(stderr, "VirtualSlave: write failed: %s\n", strerror(errno));
+                }
+            }
+            memmove(request, &request[MBAP_HEADER_LENGTH + pduLength], length - MBAP_HEADER_LENGTH - pduLength);
+            length -= MBAP_HEADER_LENGTH + pduLength;
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+static void *TcpListenThread(void *arg)
+{
+    int listenFd = (int)(intptr_t)arg;
+    for (;;)
+    {
+        int fd = accept(listenFd, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, TcpConnectionThread, (void *)(intptr_t)fd) != 0)
+        {
+            close(fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    close(listenFd);
+    return NULL;
+}
+
+void VirtualSlave_Init(const VirtualSlaveConfig *config)
+{
+    slaveConfig = *config;
+    InitRegisters();
+}
+
+size_t VirtualSlave_Answer(const uint8_t *request, uint8_t *response)
+{
+    if (request[0] != slaveConfig.slaveId || __atomic_load_n(&silent, __ATOMIC_RELAXED))
+    {
+        return 0;
+    }
+    slaveStats.requests++;
+    size_t responseLength = Answer(request, response);
+    Delay(slaveConfig.turnaroundUs);
+    return responseLength;
+}
+
+bool VirtualSlave_StartTcp(uint16_t port, const VirtualSlaveConfig *config)
+{
+    slaveConfig = *config;
+    InitRegisters();
+
+    int listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenFd < 0)
+    {
+        return false;
+    }
+    int one = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = htons(port)};
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listenFd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(listenFd, 16) < 0)
+    {
+        fprintf(stderr, "VirtualSlave: unable to listen on port %u: %s\n", port, strerror(errno));
+        close(listenFd);
+        return false;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, TcpListenThread, (void *)(intptr_t)listenFd) != 0)
+    {
+        close(listenFd);
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+bool VirtualSlave_Start(const char *path, const VirtualSlaveConfig *config)
+{
+    int fd = open(path, O_RDWR | O_NOCTTY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "VirtualSlave: unable to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    return VirtualSlave_StartFd(fd, config);
+}
+
+bool VirtualSlave_StartFd(int fd, const VirtualSlaveConfig *config)
+{
+    slaveConfig = *config;
+    InitRegisters();
+
+    slaveFd = fd;
+    struct termios tio;
+    if (tcgetattr(slaveFd, &tio) == 0)
+    {
+        cfmakeraw(&tio);
+        tcsetattr(slaveFd, TCSANOW, &tio);
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, SlaveThread, NULL) != 0)
+    {
+        close(slaveFd);
+        slaveFd = -1;
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+void VirtualSlave_SetSilent(bool isSilent)
+{
+    __atomic_store_n(&silent, isSilent, __ATOMIC_RELAXED);
+}
+
+void VirtualSlave_RejectNext(uint8_t exception, uint32_t count)
+{
+    __atomic_store_n(&rejectException, exception, __ATOMIC_RELAXED);
+    __atomic_store_n(&rejectCount, count, __ATOMIC_RELAXED);
+}
+
+void VirtualSlave_CorruptNext(uint32_t count)
+{
+    __atomic_store_n(&corruptCount, count, __ATOMIC_RELAXED);
+}
+
+void VirtualSlave_GetStats(VirtualSlaveStats *stats)
+{
+    *stats = slaveStats;
+}
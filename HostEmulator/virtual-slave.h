@@ -0,0 +1,126 @@
+/**
+ * @file    virtual-slave.h
+ * @brief   A Modbus slave that runs on a thread of the host emulator and answers requests on a serial line,
+ *          normally the slave side of the emulated ISU0 pseudo terminal, or over Modbus TCP on the loopback
+ *          interface.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+#ifndef VIRTUAL_SLAVE_H
+#define VIRTUAL_SLAVE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define VIRTUAL_SLAVE_REGISTER_COUNT 10000
+
+typedef struct
+{
+    uint8_t slaveId;
+    uint32_t turnaroundUs;     // Delay between receiving a request and starting the response
+    uint16_t maxReadRegisters; // Larger register reads are rejected with ILLEGAL_DATA_VALUE
+    uint16_t maxReadBits;      // Larger coil and discrete input reads are rejected with ILLEGAL_DATA_VALUE
+    uint32_t lineRate;         // When non-zero, responses are delayed by the time the request, the response and
+                               // the silent intervals after them would take on a line at this rate
+    bool noMaskWrite;          // Mask Write Register is rejected with ILLEGAL_FUNCTION
+    const char *identity[3];   // Vendor name, product code and revision returned by Read Device Identification;
+                               // if the vendor name is NULL the request is rejected with ILLEGAL_FUNCTION
+    uint8_t identityPerResponse; // When non-zero, at most this many identification objects are sent per response
+} VirtualSlaveConfig;
+
+typedef struct
+{
+    uint32_t requests;
+    uint32_t exceptions;
+    uint32_t crcErrors;
+} VirtualSlaveStats;
+
+/// <summary>
+/// Fills a configuration with the limits from the Modbus specification, no turnaround delay and an identity of
+/// "Bsquare", "VirtualSlave", "1.0".
+/// </summary>
+/// <param name="config">The configuration to initialise</param>
+/// <param name="slaveId">The unit ID the slave answers to</param>
+void VirtualSlave_DefaultConfig(VirtualSlaveConfig *config, uint8_t slaveId);
+
+/// <summary>
+/// Opens the serial line and starts answering requests. Holding register n initially holds n, input register n
+/// holds n ^ 0x5555 and coils and discrete inputs alternate.
+/// </summary>
+/// <param name="path">Path of the serial device or pseudo terminal</param>
+/// <param name="config">The slave configuration</param>
+/// <returns>true on success, or false on failure</returns>
+bool VirtualSlave_Start(const char *path, const VirtualSlaveConfig *config);
+
+/// <summary>
+/// Starts answering requests on a serial line that is already open, such as the master side of a pseudo terminal
+/// whose other side the library opens as a serial port. The slave takes ownership of the descriptor.
+/// </summary>
+/// <param name="fd">The open serial line</param>
+/// <param name="config">The slave configuration</param>
+/// <returns>true on success, or false on failure</returns>
+bool VirtualSlave_StartFd(int fd, const VirtualSlaveConfig *config);
+
+/// <summary>
+/// Starts answering Modbus TCP requests on the loopback interface, using the same registers as the serial slave.
+/// Each response is sent turnaroundUs after its request arrived, whatever else is outstanding on the connection.
+/// </summary>
+/// <param name="port">TCP port to listen on</param>
+/// <param name="config">The slave configuration; lineRate is ignored</param>
+/// <returns>true on success, or false on failure</returns>
+bool VirtualSlave_StartTcp(uint16_t port, const VirtualSlaveConfig *config);
+
+/// <summary>
+/// Sets up the slave without opening a line, for a caller that passes it requests with VirtualSlave_Answer.
+/// </summary>
+/// <param name="config">The slave configuration; lineRate is ignored</param>
+void VirtualSlave_Init(const VirtualSlaveConfig *config);
+
+/// <summary>
+/// Answers one request as the slave does on its own lines, after its turnaround time, from the caller's thread.
+/// </summary>
+/// <param name="request">The request, starting at the slave ID, without transport framing</param>
+/// <param name="response">MAX_PDU_LENGTH buffer that receives the response, starting at the slave ID</param>
+/// <returns>The length of the response, or 0 if the request is not addressed to the slave or it is silent</returns>
+size_t VirtualSlave_Answer(const uint8_t *request, uint8_t *response);
+
+/// <summary>
+/// Adds values to the slave's FIFO queue. Read FIFO Queue returns and removes up to 31 values, whatever FIFO
+/// pointer address it is sent.
+/// </summary>
+/// <param name="values">The values to add</param>
+/// <param name="count">The number of values</param>
+/// <returns>true on success, or false if the queue is full</returns>
+bool VirtualSlave_QueueFifo(const uint16_t *values, size_t count);
+
+/// <summary>
+/// Stops or resumes answering, as if the slave had been disconnected from the line. Requests received while silent
+/// are ignored and not counted.
+/// </summary>
+/// <param name="isSilent">true to stop answering</param>
+void VirtualSlave_SetSilent(bool isSilent);
+
+/// <summary>
+/// Answers the next requests addressed to the slave with an exception instead of handling them, as a device that
+/// is busy would.
+/// </summary>
+/// <param name="exception">The exception code, such as 6 for Slave Device Busy</param>
+/// <param name="count">The number of requests to reject</param>
+void VirtualSlave_RejectNext(uint8_t exception, uint32_t count);
+
+/// <summary>
+/// Damages the CRC of the next responses sent on the serial line, as noise on the line would. Has no effect on
+/// Modbus TCP, which has no CRC.
+/// </summary>
+/// <param name="count">The number of responses to damage</param>
+void VirtualSlave_CorruptNext(uint32_t count);
+
+/// <summary>
+/// Gets the request counters for the running slave.
+/// </summary>
+/// <param name="stats">Receives the counters</param>
+void VirtualSlave_GetStats(VirtualSlaveStats *stats);
+
+#endif /* VIRTUAL_SLAVE_H */
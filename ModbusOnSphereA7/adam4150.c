@@ -9,6 +9,7 @@
 
 #include "adam4150.h"
 #include "azure_iot.h"
+#include "modbus_subscribe.h"
 #include "parson.h"
 #include <stdint.h>
 #include <stdio.h>
@@ -31,6 +32,7 @@ typedef struct {
 } ADAM4150_CONFIG;
 
 static ADAM4150_CONFIG config;
+static modbusSubscription_t inputSubscription;
 
 static bool digitalOutState[NUM_OUTPUTS];    // State of each digital outout
 static bool digitalInState[NUM_INPUTS];     // State of digital inputs
@@ -80,6 +82,17 @@ static void Adam4150_TwinUpdateCallback(JSON_Value* jPtr, TwinUpdateContext t)
     }
 }
 
+/// <summary>
+/// Called when the digital inputs change
+/// </summary>
+static void InputsChanged(void* context, const uint16_t* oldValues, const uint16_t* newValues, uint16_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        digitalInState[i] = newValues[i];
+    }
+    inputTwinUpdateRequired = true;
+}
+
 /// <summary>
 /// Set the modbus handle and slave address of the device.
 /// This can be updated at any time.
@@ -88,6 +101,10 @@ void Adam4150_SetConfig(modbus_t hndl, uint8_t slaveAddress)
 {
     config.hndl = hndl;
     config.slaveAddress = slaveAddress;
+
+    ModbusUnsubscribe(inputSubscription);
+    inputSubscription = hndl ? ModbusSubscribe(hndl, slaveAddress, MODBUS_TABLE_DISCRETE_INPUTS, BASE_INPUT_ADDRESS,
+                                               NUM_INPUTS, 0, InputsChanged, NULL) : NULL;
 }
 
 /// <summary>
@@ -97,7 +114,6 @@ void Adam4150_SetConfig(modbus_t hndl, uint8_t slaveAddress)
 void Adam4150_DigitalControl(void)
 {
     static uint8_t counterRTU = 0;
-    uint8_t data[4];
     // Write Coils
     counterRTU = (counterRTU + 1) & 7;
     bool newState = !digitalOutState[counterRTU];
@@ -109,20 +125,9 @@ void Adam4150_DigitalControl(void)
     Log_Debug("Toggle coil %d %s\n", counterRTU, (newState)?"on":"off");
     SetOutput(counterRTU, newState);
 
-    // Read digital inputs
-    if (ReadDiscreteInputs(config.hndl, config.slaveAddress, BASE_INPUT_ADDRESS, NUM_INPUTS, data, DEFAULT_ADAM4150_TIMEOUT)) {
-        // Put data into the digitalInState
-        uint8_t values = data[0];
-        for (size_t i = 0; i < NUM_INPUTS; i++) {
-            if (digitalInState[i] != (values & 0x1)) {
-                digitalInState[i] = values & 0x1;
-                inputTwinUpdateRequired = true;
-            }
-            values >>= 1;
-        }
-    }
-    else {
-        Log_Debug("Unable to read Adam4150 inputs: %s\n", ModbusErrorToString(data[0]));
+    // Read digital inputs, InputsChanged is called if any have changed
+    if (!ModbusPollSubscriptions(config.hndl, DEFAULT_ADAM4150_TIMEOUT)) {
+        Log_Debug("Unable to read Adam4150 inputs\n");
     }
 }
 
@@ -21,6 +21,7 @@
 
 #include "epoll_timerfd_utilities.h"
 #include "azure_iot.h"
+#include "json_arena.h"
 #include "parson.h"
 
 
@@ -221,8 +222,11 @@ static void AzureIoT_SetupClient(void)
 static void AzureIoT_TwinCallback(DEVICE_TWIN_UPDATE_STATE updateState, const unsigned char* payload,
     size_t payloadSize, void* userContextCallback)
 {
+    // The payload copy and the parsed document are released together when the arena is reset.
+    JsonArena_Begin();
+
     size_t nullTerminatedJsonSize = payloadSize + 1;
-    char* nullTerminatedJsonString = (char*)malloc(nullTerminatedJsonSize);
+    char* nullTerminatedJsonString = (char*)JsonArena_Alloc(nullTerminatedJsonSize);
     if (nullTerminatedJsonString == NULL) {
         Log_Debug("ERROR: Could not allocate buffer for twin update payload.\n");
         abort();
@@ -262,7 +266,8 @@ static void AzureIoT_TwinCallback(DEVICE_TWIN_UPDATE_STATE updateState, const un
 cleanup:
     // Release the allocated memory.
     json_value_free(rootProperties);
-    free(nullTerminatedJsonString);
+    JsonArena_Free(nullTerminatedJsonString);
+    JsonArena_End();
 }
 
 /// <summary>
@@ -0,0 +1,78 @@
+/**
+ * @file    json_arena.c
+ * @brief   Bump allocator for parson.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+
+#include "json_arena.h"
+#include "parson.h"
+#include <applibs/log.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define ARENA_ALIGNMENT _Alignof(max_align_t)
+
+static _Alignas(max_align_t) uint8_t arena[JSON_ARENA_SIZE];
+static size_t arenaUsed = 0;
+static bool arenaActive = false;
+static bool allocatorInstalled = false;
+static jsonArenaStats_t arenaStats = {.size = JSON_ARENA_SIZE};
+
+static bool InArena(const void *ptr)
+{
+    return (const uint8_t *)ptr >= arena && (const uint8_t *)ptr < arena + JSON_ARENA_SIZE;
+}
+
+void JsonArena_Begin(void)
+{
+    if (!allocatorInstalled)
+    {
+        json_set_allocation_functions(JsonArena_Alloc, JsonArena_Free);
+        allocatorInstalled = true;
+    }
+    arenaUsed = 0;
+    arenaActive = true;
+}
+
+void JsonArena_End(void)
+{
+    arenaActive = false;
+    arenaStats.operations++;
+    if (arenaUsed > arenaStats.highWater)
+    {
+        arenaStats.highWater = arenaUsed;
+        Log_Debug("INFO: JSON arena high water mark %zu of %zu bytes\n", arenaStats.highWater, arenaStats.size);
+    }
+    arenaUsed = 0;
+}
+
+void *JsonArena_Alloc(size_t size)
+{
+    if (arenaActive)
+    {
+        size_t aligned = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+        if (aligned <= JSON_ARENA_SIZE - arenaUsed)
+        {
+            void *ptr = &arena[arenaUsed];
+            arenaUsed += aligned;
+            return ptr;
+        }
+        arenaStats.heapFallbacks++;
+    }
+    return malloc(size);
+}
+
+void JsonArena_Free(void *ptr)
+{
+    if (!InArena(ptr))
+    {
+        free(ptr);
+    }
+}
+
+void JsonArena_GetStats(jsonArenaStats_t *stats)
+{
+    *stats = arenaStats;
+}
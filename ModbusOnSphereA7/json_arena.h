@@ -0,0 +1,60 @@
+/**
+ * @file    json_arena.h
+ * @brief   Bump allocator for parson. Between JsonArena_Begin and JsonArena_End every allocation parson makes comes
+ *          from a fixed buffer and frees are ignored; JsonArena_End then releases everything at once. Outside of an
+ *          operation, or if the buffer runs out, parson falls back to the heap.
+ *
+ *          Operations must not be nested or run from more than one thread, and no JSON value created during an
+ *          operation may be used after JsonArena_End.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Size of the arena. Parsing a document takes roughly three to four times the length of its text.
+#ifndef JSON_ARENA_SIZE
+#define JSON_ARENA_SIZE (16 * 1024)
+#endif
+
+typedef struct _jsonArenaStats
+{
+    size_t size;          // Size of the arena in bytes
+    size_t highWater;     // Most bytes used by a single operation
+    size_t operations;    // Operations completed
+    size_t heapFallbacks; // Allocations that did not fit in the arena and were taken from the heap
+} jsonArenaStats_t;
+
+/// <summary>
+/// Starts an operation. Installs the arena as parson's allocator on first use.
+/// </summary>
+void JsonArena_Begin( void );
+
+/// <summary>
+/// Ends an operation, releasing everything allocated from the arena since JsonArena_Begin. Logs the arena's high
+/// water mark when it increases.
+/// </summary>
+void JsonArena_End( void );
+
+/// <summary>
+/// Allocates memory from the arena during an operation, or from the heap otherwise.
+/// </summary>
+/// <param name="size">Number of bytes required</param>
+/// <returns>The memory, or NULL on failure</returns>
+void* JsonArena_Alloc( size_t size );
+
+/// <summary>
+/// Frees memory from JsonArena_Alloc. Memory in the arena is only released by JsonArena_End.
+/// </summary>
+/// <param name="ptr">The memory to free</param>
+void JsonArena_Free( void* ptr );
+
+/// <summary>
+/// Gets the arena's usage statistics.
+/// </summary>
+/// <param name="stats">Receives the statistics</param>
+void JsonArena_GetStats( jsonArenaStats_t* stats );
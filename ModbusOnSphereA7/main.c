@@ -22,6 +22,7 @@
 
 #include "epoll_timerfd_utilities.h"
 #include "modbus.h"
+#include "modbus_poll_group.h"
 #include "../modbusCommon.h"
 #include "tcw241.h"
 #include "adam4150.h"
@@ -31,6 +32,7 @@
 
 #define DEFAULT_ADAM4150_ID 5   // Slave ID of the device on the serial connection
 #define DEVICE_LIMIT 5          // The number of devices that can be connected to at any one time
+#define SEND_PERIOD_MS 10000    // Devices are read on every whole ten seconds of the wall clock
 
 typedef enum
 {
@@ -51,6 +53,10 @@ static int epollFd = -1;
 static int timerFd = -1;
 static int argNum;
 deviceConnection argConnections[DEVICE_LIMIT];
+// One handle per device, and one receive buffer as devices are polled one at a time, so nothing is allocated after
+// start up
+static modbusHandleStorage_t modbusHandles[DEVICE_LIMIT];
+static modbusReceiveBufferStorage_t modbusReceiveBuffers[1];
 static volatile sig_atomic_t terminationRequired = false;
 
 static void TerminationHandler(int signalNumber);
@@ -75,10 +81,14 @@ static void TerminationHandler(int signalNumber)
 /// <param name="eventData">Pointer to the EventData Class</param>
 static void TimerEventHandler(EventData *eventData)
 {
-    if (ConsumeTimerFdEvent(timerFd) != 0) {
+    int expiries = ModbusConsumeAlignedTimer(timerFd, SEND_PERIOD_MS, 0, NULL);
+    if (expiries < 0) {
         terminationRequired = true;
         return;
     }
+    if (expiries == 0) {
+        return;
+    }
 
     for (int i = 0; i < argNum; i++)
     {
@@ -174,9 +184,8 @@ static int InitHandlers(void)
         }
     }
     if (connectionMade){
-            // Register 10 second timer to read data from the Modbus device
-        static const struct timespec sendPeriod = { .tv_sec = 10, .tv_nsec = 0 };
-        timerFd = CreateTimerFdAndAddToEpoll(epollFd, &sendPeriod, &timerEventData, EPOLLIN);
+        // Register a timer on wall clock boundaries to read data from the Modbus device, so readings do not drift
+        timerFd = ModbusCreateAlignedTimer(SEND_PERIOD_MS, 0);
         if (timerFd < 0) {
             return -1;
         }
@@ -268,7 +277,11 @@ int main(int argc, char* argv[])
     Log_Debug("Uses Modbus TCP to communicate with TCW241.\n");
     Log_Debug("Uses Modbus RTU to communicate with ADAM4150.\n");
 
-    if (!ModbusInit()) {
+    modbusInitOptions modbusOptions = {.handles = modbusHandles,
+                                       .handleCount = DEVICE_LIMIT,
+                                       .receiveBuffers = modbusReceiveBuffers,
+                                       .receiveBufferCount = 1};
+    if (!ModbusInitEx(&modbusOptions)) {
         Log_Debug("Unable to Initialise Modbus\n");
         return 0;
     }
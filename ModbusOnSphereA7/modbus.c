@@ -6,190 +6,312 @@
  *          Licensed under the MIT License.
 */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for CPU affinity
+#endif
+
 #include "modbus.h"
 #include "../modbusCommon.h"
 #include "../crc-util.h"
+#include "../fcode-registry.h"
 #include "epoll_timerfd_utilities.h"
+#include "modbus_bus_stats.h"
+#include "modbus_internal.h"
 #include <applibs/application.h>
 #include <applibs/log.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <linux/serial.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <termios.h>
 #include <time.h>
+#include <unistd.h>
 
 static const char rtAppComponentId[] = "005180bc-402f-4cb3-a662-72937dbcde47";
 
+// All RTU handles share the M4's ISU0 bus. Requests wait for the M4's 10ms poll of the A7 before reaching the bus,
+// so on average half of that period is transport latency rather than bus time.
+#define M4_BUS_NAME "M4 ISU0"
+#define M4_TRANSPORT_LATENCY_US 5000
+// Driver buffering between a request leaving the library and reaching a serial port that is opened directly
+#define SERIAL_TRANSPORT_LATENCY_US 1000
+// A local server usually answers in a few microseconds, well before the first sleep while waiting would end, so
+// local handles poll without sleeping for this long first.
+#define LOCAL_SPIN_US 100
+
 /* Other definitions */
-#define WRITE_RESPONSE_START 2
-#define WRITE_RESPONSE_BYTES 4
+#define MASK_WRITE_RESPONSE_BYTES 6
 #define TCP_LENGTH_MSB_OFFSET 4
 #define TCP_LENGTH_LSB_OFFSET 5
-#define TCP_HEADER_LENGTH 6
-#define MODBUS_EXCEPTION_BIT 0x80
-
-#define MESSAGE_HEADER_LENGTH 4
-
-/* Values for overrun detection */
-//#define BUFFER_CHECK_ON // Uncomment to turn buffer checking on.
-#ifdef BUFFER_CHECK_ON
-#define BUFFER_ZONE_SIZE 16
-#define BUFFER_ZONE_VAL1 0xca
-#define BUFFER_ZONE_VAL2 0xbc
-#endif
-
-// Helper define for filling the header - requires _a exists and is the right size.
-#define SET_MODBUS_HEADER(_a, _b, _c, _d, _e)                                                                          \
-    do                                                                                                                 \
-    {                                                                                                                  \
-        /*slave id*/                                                                                                   \
-        _a[0] = (_b);                                                                                                  \
-        /*function code*/                                                                                              \
-        _a[1] = (_c);                                                                                                  \
-        /*data (first address to write to in the device)*/                                                             \
-        _a[2] = (uint8_t)(((_d) >> 8) & 0xFF);                                                                         \
-        _a[3] = (uint8_t)((_d)&0xFF);                                                                                  \
-        /*data (content to write to)*/                                                                                 \
-        _a[4] = (uint8_t)(((_e) >> 8) & 0xFF);                                                                         \
-        _a[5] = (uint8_t)((_e)&0xFF);                                                                                  \
-    } while (0);
 
-/*
-Type: modbus_transport_type
-
-Description:
-    Determines the protocol used to transmit the message.
+// Adaptive timeouts: the smallest allowance for variation, as TCP's clock granularity, and the most a slave's
+// timeout is doubled after it stops answering
+#define MIN_RTT_VARIATION_US 1000
+#define MAX_TIMEOUT_BACKOFF 6
+// The most an open circuit breaker's time is doubled after failed probes, before maxOpenTime applies
+#define MAX_BREAKER_BACKOFF 16
 
-Values:
-    tcp: Sending data using EtherNet.
-    rtuOverTcp: Sending an rtu package using EtherNet
-    rtu: Sending from the A7 to the M4 processors on the Microsoft� sphere.
-*/
+// Why a request is to be retried under a handle's retry policy
 typedef enum
 {
-    tcp,
-    rtuOverTcp,
-    rtu
-} modbusTransportType_t;
+    retryNone,
+    retryBusy,
+    retryAcknowledge,
+    retryCorrupt
+} retryReason_t;
+
 typedef enum
 {
     success,
     failure,
     waiting
 } messageHandlerState_t;
-struct _TCP
-{
-    char *ip;
-    uint16_t port;
-};
-struct _RTU
-{
-    uint16_t baudRate;
-    uint8_t halfDuplexMode;
-    uint8_t parityMode;
-    uint8_t parityState;
-    uint8_t stopBits;
-    uint8_t wordLength;
-};
-
-union _connectData {
-    struct _TCP TCP;
-    struct _RTU RTU;
-};
-
-typedef enum
-{
-    Idle,
-    SendingRequest,
-    WaitingForResponse,
-    DataReceived,
-    TransactionFailed,
-    Disconnected
-} MODBUS_STATE;
-
-struct _modbus_t
-{
-    modbusTransportType_t type;     // The method of data transfer being used
-    union _connectData connectData; // Any additional data required for that transfer method.
-    int fd;                         // The file descriptor
-    uint16_t transactionId;         // Used to check TCP responses
-    uint16_t lastTransactionId;     // Used to check for wraparound when overflowing the transaction identifier
-    MODBUS_STATE state;             // The current state of a transaction
-    uint16_t bufferedMessageLength; // The current length of the data written since the last successful read
-    uint16_t pduLength;             // After a successful read it will be length of valid data in the pdu buffer
-    bool isCFG;                     // Bool to let the device know to add a modbus header or a config header.
-    uint8_t
-        bufferedMessage[MAX_PDU_LENGTH]; // The buffer storing data since the last successful message from the device
-#ifdef BUFFER_CHECK_ON
-    uint8_t bufferZone1[BUFFER_ZONE_SIZE]; // Debug only - used to detect possible buffer overrun
-#endif
-    uint8_t pdu[MAX_PDU_LENGTH]; // The data buffer used to store the pdu received from the device
-#ifdef BUFFER_CHECK_ON
-    uint8_t bufferZone2[BUFFER_ZONE_SIZE]; // Debug only - used to detect possible buffer overrun
-#endif
-};
-typedef struct _modbus_t *modbus_t;
 
 /// Forward declarations
 static modbus_t ModbusConnectIp(const char* ip, uint16_t port);
 static void *EpollThread(void *ptr);
-static bool ModBusWrite(modbus_t hndl, uint8_t *modBusPacket, uint16_t packetLength);
+static bool ModBusWrite(modbus_t hndl, uint8_t *modBusPacket, uint16_t packetLength, uint8_t *response);
 static messageHandlerState_t ModBusRead(modbus_t hndl);
-static bool SendToSlave(modbus_t hndl, uint8_t *modBusADU, int pduLength);
+static bool SendToSlave(modbus_t hndl, const uint8_t *modBusADU, int pduLength);
+static uint16_t AwaitResponse(modbus_t hndl);
+static bool RequestSent(modbus_t hndl, bool sent);
+static bool BeginRequest(modbus_t hndl, uint8_t slaveId, uint8_t functionCode, uint16_t pduLength, uint8_t *response);
 static messageHandlerState_t MessageHandler(modbus_t handl, uint8_t *message, uint16_t inputLength);
-static uint16_t GetFcodeLength(uint8_t fCode, uint8_t dataLength);
 static bool WaitForData(modbus_t hndl, size_t timeout);
-static uint16_t PduDataLength(modbus_t hndl, uint16_t expected);
+static uint8_t DecodeResponse(modbus_t hndl, const uint8_t *request, uint16_t requestLength, void *out,
+                              uint16_t *count);
 static MODBUS_STATE NotReadyReason(modbus_t hndl);
 #ifdef BUFFER_CHECK_ON
-static void SetBufferZones(modbus_t hndl);
-static bool BufferZonesValid(modbus_t hndl);
+static void SetBufferZones(struct _modbusRx *rx);
+static bool BufferZonesValid(struct _modbusRx *rx);
 #endif
 static bool WriteSerialConfig(modbus_t hndl, uint8_t *receivedMessage, size_t timeout);
+static bool ConfigureSerialPort(int fd, const serialSetup *setup);
+static bool SendFcodeToM4(uint8_t functionCode);
+static modbus_t AllocHandle(void);
+static void FreeHandle(modbus_t hndl);
+static bool AcquireRx(modbus_t hndl);
+static void ReleaseRx(modbus_t hndl);
+static uint16_t FrameTcp(uint8_t *adu, uint16_t transactionId, const uint8_t *pdu, uint16_t pduLength);
+static bool SendBatch(modbus_t hndl, struct _modbusBatch *batch, modbusPending_t *requests, size_t count);
+static messageHandlerState_t StoreBatchResponse(modbus_t hndl, uint16_t rxTransaction, const uint8_t *pdu,
+                                                uint16_t pduLength);
+static void NoteResponse(modbus_t hndl, const uint8_t *pdu, uint16_t pduLength);
+static size_t AdaptiveTimeout(modbus_t hndl, uint8_t slaveId, size_t timeout);
+static void NoteRoundTrip(modbus_t hndl, bool answered, uint64_t elapsedUs);
+static bool BreakerAllows(modbus_t hndl, uint8_t slaveId);
+static void NoteHealth(modbus_t hndl, uint8_t slaveId, bool answered);
+static uint8_t SendFailReason(modbus_t hndl);
+static bool WaitForResponse(modbus_t hndl, size_t timeout);
+static bool CompleteRequest(modbus_t hndl, bool timed, bool cancelled);
+static bool SendPrepared(modbus_t hndl, const struct _modbusPrepared *prepared, uint8_t *response);
+static bool RunGroups(modbus_t hndl, modbusPending_t *requests, size_t count, size_t timeout);
+static retryReason_t RetryReason(const modbusRetryPolicy_t *policy, const uint8_t *request, const uint8_t *response,
+                                 uint16_t responseLength, bool corrupt);
+static void CountRetry(modbus_t hndl, retryReason_t reason, uint8_t slaveId, uint8_t functionCode);
+static void RetryWait(struct _modbusRetry *retry, uint8_t attempt);
+
+_Static_assert(sizeof(struct _modbus_t) <= MODBUS_HANDLE_STORAGE_SIZE, "MODBUS_HANDLE_STORAGE_SIZE is too small");
+_Static_assert(offsetof(struct _modbus_t, connectData) <= MODBUS_CACHE_LINE, "Hot handle fields exceed a cache line");
+_Static_assert(sizeof(struct _modbusRx) <= MODBUS_RECEIVE_BUFFER_STORAGE_SIZE,
+               "MODBUS_RECEIVE_BUFFER_STORAGE_SIZE is too small");
 
 /// Static variables used by whole modbus system
 static int epollFd = -1;
 static int sockFd = -1;
-static pthread_t epollThreadId = NULL;
+// Function codes added with ModbusRegisterFunctionCode, which the M4 is told about when it is connected
+static uint8_t customFcodes[(FCODE_RANGE + 1) / 8];
+static pthread_t epollThreadId = 0;
 static bool epollThreadContinue = true;
 static uint16_t transactionIdentifier = 0;
 
+// Handles provided by the application through ModbusInitEx, kept on a free list
+static modbusHandleStorage_t *handleStorage = NULL;
+static size_t handleStorageCount = 0;
+static modbus_t freeHandles = NULL;
+static pthread_mutex_t handleLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Receive buffers for transactions in flight. Heap allocated buffers are kept for reuse, so the number allocated is
+// the largest number of transactions that have been in flight at once. rxLock also serialises the Epoll thread's
+// use of a buffer with its release when a transaction completes or times out.
+static modbusReceiveBufferStorage_t *rxStorage = NULL;
+static struct _modbusRx *freeRx = NULL;
+static pthread_mutex_t rxLock = PTHREAD_MUTEX_INITIALIZER;
+// Receive buffers allocated at start up for the prefault option, freed by ModbusExit
+static modbusReceiveBufferStorage_t *preallocatedRx = NULL;
+// Stack the I/O thread touches when it starts, for the prefault option
+#define PREFAULT_STACK_BYTES (64 * 1024)
+static bool prefaultStack = false;
+
+// Creates the Epoll thread with the scheduling and CPU affinity asked for in options. The affinity is set once the
+// thread exists, since not every C library can put it in the thread's attributes.
+static int CreateEpollThread(const modbusInitOptions *options)
+{
+    pthread_attr_t attr;
+    int err = pthread_attr_init(&attr);
+    if (err != 0)
+    {
+        return err;
+    }
+    if (options && options->ioThreadPolicy)
+    {
+        struct sched_param param = {.sched_priority = options->ioThreadPriority};
+        err = pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        if (!err)
+        {
+            err = pthread_attr_setschedpolicy(&attr, options->ioThreadPolicy);
+        }
+        if (!err)
+        {
+            err = pthread_attr_setschedparam(&attr, &param);
+        }
+    }
+    if (!err)
+    {
+        err = pthread_create(&epollThreadId, &attr, &EpollThread, NULL);
+    }
+    pthread_attr_destroy(&attr);
+    if (err || !options || !options->ioThreadCpus)
+    {
+        return err;
+    }
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (int cpu = 0; cpu < 64; cpu++)
+    {
+        if (options->ioThreadCpus & (1ULL << cpu))
+        {
+            CPU_SET(cpu, &cpus);
+        }
+    }
+    err = pthread_setaffinity_np(epollThreadId, sizeof(cpus), &cpus);
+    if (err)
+    {
+        epollThreadContinue = false;
+        pthread_join(epollThreadId, NULL);
+    }
+    return err;
+}
+
+// Frees the receive buffers taken from the heap, including those preallocated by ModbusInitEx, and empties the free
+// list.
+static void FreeReceiveBuffers(void)
+{
+    pthread_mutex_lock(&rxLock);
+    while (!rxStorage && freeRx)
+    {
+        struct _modbusRx *rx = freeRx;
+        freeRx = rx->nextFree;
+        free(rx);
+    }
+    freeRx = NULL;
+    rxStorage = NULL;
+    free(preallocatedRx);
+    preallocatedRx = NULL;
+    pthread_mutex_unlock(&rxLock);
+}
+
 /// Publically available functions
 bool ModbusInit(void)
 {
+    return ModbusInitEx(NULL);
+}
+
+bool ModbusInitEx(const modbusInitOptions *options)
+{
+    pthread_mutex_lock(&handleLock);
+    handleStorage = NULL;
+    handleStorageCount = 0;
+    freeHandles = NULL;
+    if (options && options->handles && options->handleCount)
+    {
+        handleStorage = options->handles;
+        handleStorageCount = options->handleCount;
+        for (size_t i = handleStorageCount; i > 0; i--)
+        {
+            modbus_t hndl = (modbus_t)&handleStorage[i - 1];
+            hndl->nextFree = freeHandles;
+            freeHandles = hndl;
+        }
+    }
+    pthread_mutex_unlock(&handleLock);
+
+    pthread_mutex_lock(&rxLock);
+    rxStorage = NULL;
+    freeRx = NULL;
+    if (options && options->prefault && !options->receiveBuffers && options->receiveBufferCount)
+    {
+        preallocatedRx = malloc(options->receiveBufferCount * sizeof(modbusReceiveBufferStorage_t));
+        if (!preallocatedRx)
+        {
+            pthread_mutex_unlock(&rxLock);
+            Log_Debug("Error: Unable to allocate %zu receive buffers\n", options->receiveBufferCount);
+            return false;
+        }
+        // Touch every page now rather than on the first transaction.
+        memset(preallocatedRx, 0, options->receiveBufferCount * sizeof(modbusReceiveBufferStorage_t));
+    }
+    if (options && (options->receiveBuffers || preallocatedRx) && options->receiveBufferCount)
+    {
+        rxStorage = options->receiveBuffers ? options->receiveBuffers : preallocatedRx;
+        for (size_t i = options->receiveBufferCount; i > 0; i--)
+        {
+            struct _modbusRx *rx = (struct _modbusRx *)&rxStorage[i - 1];
+#ifdef BUFFER_CHECK_ON
+            SetBufferZones(rx);
+#endif
+            rx->nextFree = freeRx;
+            freeRx = rx;
+        }
+    }
+    pthread_mutex_unlock(&rxLock);
+
     epollFd = CreateEpollFd();
     if (epollFd < 0)
     {
+        FreeReceiveBuffers();
         return false;
     }
-    // Set up epoll thread
-    int err = pthread_create(&epollThreadId, NULL, &EpollThread, NULL);
+    // Set up epoll thread. A real-time thread can run before pthread_create returns, so it must already be told to
+    // continue.
+    prefaultStack = options && options->prefault;
+    epollThreadContinue = true;
+    int err = CreateEpollThread(options);
     if (err != 0)
     {
+        epollThreadContinue = false;
+        epollThreadId = 0;
         Log_Debug("Unable to create Modbus Epoll thread - %d\n", err);
+        close(epollFd);
+        epollFd = -1;
+        FreeReceiveBuffers();
         return false;
     }
-    epollThreadContinue = true;
     return true;
 }
 
 modbus_t ModbusConnectRtu(serialSetup setup, size_t timeout)
 {
-    modbus_t hndl = malloc(sizeof(struct _modbus_t));
+    modbus_t hndl = AllocHandle();
     if (hndl)
     {
-        memset(hndl, 0, sizeof(struct _modbus_t));
         // Open connection to real-time capable application.
         sockFd = Application_Socket(rtAppComponentId);
         if (sockFd == -1)
         {
             Log_Debug("Error: Unable to create Application socket: %d (%s)\n", errno, strerror(errno));
-            free(hndl);
+            FreeHandle(hndl);
             return NULL;
         }
         struct epoll_event event;
@@ -210,25 +332,31 @@ modbus_t ModbusConnectRtu(serialSetup setup, size_t timeout)
         if (epollAddOk)
         {
             hndl->type = rtu;
+            hndl->maxInFlight = 1;
             hndl->fd = sockFd;
             hndl->state = Idle;
-#ifdef BUFFER_CHECK_ON
-            SetBufferZones(hndl);
-#endif
             hndl->connectData.RTU.baudRate = setup.baudRate;
             hndl->connectData.RTU.halfDuplexMode = setup.duplexMode;
             hndl->connectData.RTU.parityState = setup.parityState;
             hndl->connectData.RTU.parityMode = setup.parityMode;
             hndl->connectData.RTU.wordLength = setup.wordLength;
             hndl->connectData.RTU.stopBits = setup.stopBits;
+            hndl->bus = BusStatsAttach(M4_BUS_NAME, &hndl->connectData.RTU, M4_TRANSPORT_LATENCY_US);
             uint8_t receivedMessage[4];
             Log_Debug("Config sent\n");
             WriteSerialConfig(hndl, receivedMessage, timeout);
+            for (uint8_t fCode = 1; fCode <= FCODE_RANGE; fCode++)
+            {
+                if (customFcodes[fCode / 8] & (1u << (fCode % 8)))
+                {
+                    SendFcodeToM4(fCode);
+                }
+            }
         }
         else
         {
             close(sockFd);
-            free(hndl);
+            FreeHandle(hndl);
             hndl = NULL;
             return NULL;
         }
@@ -236,11 +364,90 @@ modbus_t ModbusConnectRtu(serialSetup setup, size_t timeout)
     return hndl;
 }
 
+modbus_t ModbusConnectRtuSerial(const char *device, serialSetup setup)
+{
+    modbus_t hndl = AllocHandle();
+    if (!hndl)
+    {
+        return NULL;
+    }
+    int fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+    {
+        Log_Debug("Error: Unable to open %s: %d (%s)\n", device, errno, strerror(errno));
+        FreeHandle(hndl);
+        return NULL;
+    }
+    if (!ConfigureSerialPort(fd, &setup))
+    {
+        close(fd);
+        FreeHandle(hndl);
+        return NULL;
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLHUP;
+    event.data.ptr = hndl;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0 && epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &event) < 0)
+    {
+        Log_Debug("Error: Unable to add serial port to Epoll system: %d\n", errno);
+        close(fd);
+        FreeHandle(hndl);
+        return NULL;
+    }
+    hndl->type = rtuSerial;
+    hndl->maxInFlight = 1;
+    hndl->fd = fd;
+    hndl->state = Idle;
+    hndl->connectData.RTU.baudRate = setup.baudRate;
+    hndl->connectData.RTU.halfDuplexMode = setup.duplexMode;
+    hndl->connectData.RTU.parityState = setup.parityState;
+    hndl->connectData.RTU.parityMode = setup.parityMode;
+    hndl->connectData.RTU.wordLength = setup.wordLength;
+    hndl->connectData.RTU.stopBits = setup.stopBits;
+    hndl->bus = BusStatsAttach(device, &hndl->connectData.RTU, SERIAL_TRANSPORT_LATENCY_US);
+    return hndl;
+}
+
+modbus_t ModbusConnectLocal(const char *path, size_t timeout)
+{
+    modbus_t hndl = AllocHandle();
+    if (!hndl)
+    {
+        return NULL;
+    }
+    struct _LOCAL *channel = &hndl->connectData.LOCAL;
+    if (!LocalConnect(channel, path, timeout))
+    {
+        FreeHandle(hndl);
+        return NULL;
+    }
+
+    // Responses are signalled by the doorbell; the socket is only watched for the server going away.
+    struct epoll_event responses = {.events = EPOLLIN, .data.ptr = hndl};
+    struct epoll_event hangup = {.events = EPOLLRDHUP, .data.ptr = hndl};
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, channel->responseFd, &responses) < 0 ||
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, channel->socketFd, &hangup) < 0)
+    {
+        Log_Debug("Error: Unable to add local channel to Epoll system: %d\n", errno);
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, channel->responseFd, NULL);
+        LocalClose(channel);
+        FreeHandle(hndl);
+        return NULL;
+    }
+    hndl->type = local;
+    hndl->maxInFlight = MODBUS_DEFAULT_IN_FLIGHT;
+    hndl->fd = channel->responseFd;
+    hndl->state = Idle;
+    return hndl;
+}
+
 modbus_t ModbusConnectRtuOverTcp(const char* ip, uint16_t port) {
     modbus_t hndl;
     hndl = ModbusConnectIp(ip, port);
     if (hndl) {
         hndl->type = rtuOverTcp;
+        hndl->maxInFlight = 1;
     }
     return hndl;
 }
@@ -250,6 +457,7 @@ modbus_t ModbusConnectTcp(const char* ip, uint16_t port) {
     hndl = ModbusConnectIp(ip, port);
     if (hndl) {
         hndl->type = tcp;
+        hndl->maxInFlight = MODBUS_DEFAULT_IN_FLIGHT;
     }
     return hndl;
 }
@@ -257,10 +465,9 @@ modbus_t ModbusConnectTcp(const char* ip, uint16_t port) {
 static modbus_t ModbusConnectIp(const char *ip, uint16_t port)
 {
     Log_Debug("Modbus TCP connecting to %s\n", ip);
-    modbus_t hndl = (modbus_t)malloc(sizeof(struct _modbus_t));
+    modbus_t hndl = AllocHandle();
     if (hndl)
     {
-        memset(hndl, 0, sizeof(struct _modbus_t));
         int socket_desc;
         struct sockaddr_in server;
 
@@ -269,7 +476,7 @@ static modbus_t ModbusConnectIp(const char *ip, uint16_t port)
         if (socket_desc == -1)
         {
             Log_Debug("Error: Could not create socket\n");
-            free(hndl);
+            FreeHandle(hndl);
             return NULL;
         }
 
@@ -282,7 +489,7 @@ static modbus_t ModbusConnectIp(const char *ip, uint16_t port)
         {
             Log_Debug("Error: Could not connect. errno: %d\n", errno);
             close(socket_desc);
-            free(hndl);
+            FreeHandle(hndl);
             hndl = NULL;
             return NULL;
         }
@@ -306,19 +513,16 @@ static modbus_t ModbusConnectIp(const char *ip, uint16_t port)
             }
             if (epollAddOk)
             {
-                hndl->connectData.TCP.ip = strdup(ip);
+                strncpy(hndl->connectData.TCP.ip, ip, MODBUS_IP_LENGTH - 1);
                 hndl->connectData.TCP.port = port;
                 hndl->lastTransactionId = 0;
                 hndl->fd = socket_desc;
                 hndl->state = Idle;
-#ifdef BUFFER_CHECK_ON
-                SetBufferZones(hndl);
-#endif
             }
             else
             {
                 close(socket_desc);
-                free(hndl);
+                FreeHandle(hndl);
                 hndl = NULL;
             }
         }
@@ -331,18 +535,204 @@ void ModbusClose(modbus_t hndl)
 {
     if (hndl)
     {
-        if (hndl->type == tcp)
+        if (hndl->type == tcp || hndl->type == rtuOverTcp || hndl->type == rtuSerial)
         {
-            if (hndl->connectData.TCP.ip)
-            {
-                free(hndl->connectData.TCP.ip);
-            }
             // Remove callback from ePoll
             epoll_ctl(epollFd, EPOLL_CTL_DEL, hndl->fd, NULL);
             close(hndl->fd);
         }
-        free(hndl);
+        else if (hndl->type == local)
+        {
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, hndl->fd, NULL);
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, hndl->connectData.LOCAL.socketFd, NULL);
+            LocalClose(&hndl->connectData.LOCAL);
+        }
+        BusStatsDetach(hndl->bus);
+        while (hndl->slaves)
+        {
+            struct _modbusSlave *next = hndl->slaves->next;
+            free(hndl->slaves);
+            hndl->slaves = next;
+        }
+        free(hndl->adaptive);
+        free(hndl->breaker);
+        free(hndl->retry);
+        FreeHandle(hndl);
+    }
+}
+
+void ModbusSetMaxInFlight(modbus_t hndl, uint8_t maxInFlight)
+{
+    if (hndl)
+    {
+        if (maxInFlight < 1)
+        {
+            maxInFlight = 1;
+        }
+        hndl->maxInFlight = (maxInFlight > MODBUS_MAX_IN_FLIGHT) ? MODBUS_MAX_IN_FLIGHT : maxInFlight;
+    }
+}
+
+bool ModbusSetReadLimit(modbus_t hndl, uint8_t slaveID, modbusTable_t table, uint16_t maxRead)
+{
+    if (!hndl || (uint32_t)table > MODBUS_TABLE_INPUT_REGISTERS)
+    {
+        return false;
+    }
+    // Requests for bits are split on byte boundaries, so bit limits are kept to whole bytes.
+    if (table == MODBUS_TABLE_COILS || table == MODBUS_TABLE_DISCRETE_INPUTS)
+    {
+        if (maxRead && maxRead < 8)
+        {
+            return false;
+        }
+        maxRead = (uint16_t)(maxRead & ~7u);
+    }
+    struct _modbusSlave *slave = ModbusFindSlave(hndl, slaveID, maxRead != 0);
+    if (slave)
+    {
+        slave->maxRead[table] = maxRead;
+    }
+    return slave || maxRead == 0;
+}
+
+bool ModbusSetAdaptiveTimeout(modbus_t hndl, size_t minTimeout, size_t maxTimeout)
+{
+    if (!hndl || (maxTimeout && minTimeout > maxTimeout) || maxTimeout > UINT32_MAX)
+    {
+        return false;
+    }
+    if (!maxTimeout)
+    {
+        free(hndl->adaptive);
+        hndl->adaptive = NULL;
+        return true;
+    }
+    // Changing the bounds keeps what has been learned about the slaves.
+    if (!hndl->adaptive)
+    {
+        hndl->adaptive = calloc(1, sizeof(struct _modbusAdaptive));
+        if (!hndl->adaptive)
+        {
+            Log_Debug("Error: Unable to allocate adaptive timeouts\n");
+            return false;
+        }
+    }
+    hndl->adaptive->minTimeout = (uint32_t)minTimeout;
+    hndl->adaptive->maxTimeout = (uint32_t)maxTimeout;
+    return true;
+}
+
+size_t ModbusGetAdaptiveTimeout(modbus_t hndl, uint8_t slaveID, size_t timeout)
+{
+    return hndl ? AdaptiveTimeout(hndl, slaveID, timeout) : timeout;
+}
+
+bool ModbusSetCircuitBreaker(modbus_t hndl, uint8_t failureThreshold, size_t openTime, size_t maxOpenTime,
+                             modbusBreakerCallback_t callback, void *context)
+{
+    if (!hndl)
+    {
+        return false;
+    }
+    if (!failureThreshold)
+    {
+        free(hndl->breaker);
+        hndl->breaker = NULL;
+        return true;
+    }
+    if (!openTime || openTime > maxOpenTime || maxOpenTime > UINT32_MAX)
+    {
+        return false;
+    }
+    if (!hndl->breaker)
+    {
+        hndl->breaker = calloc(1, sizeof(struct _modbusBreaker));
+        if (!hndl->breaker)
+        {
+            Log_Debug("Error: Unable to allocate circuit breaker\n");
+            return false;
+        }
+    }
+    // Changing the settings keeps the state of each slave's breaker.
+    hndl->breaker->failureThreshold = failureThreshold;
+    hndl->breaker->openTime = (uint32_t)openTime;
+    hndl->breaker->maxOpenTime = (uint32_t)maxOpenTime;
+    hndl->breaker->callback = callback;
+    hndl->breaker->context = context;
+    return true;
+}
+
+modbusBreakerState_t ModbusGetBreakerState(modbus_t hndl, uint8_t slaveID)
+{
+    return (hndl && hndl->breaker) ? (modbusBreakerState_t)hndl->breaker->slaves[slaveID].state
+                                   : MODBUS_BREAKER_CLOSED;
+}
+
+bool ModbusSetRetryPolicy(modbus_t hndl, const modbusRetryPolicy_t *policy)
+{
+    if (!hndl)
+    {
+        return false;
+    }
+    if (!policy)
+    {
+        free(hndl->retry);
+        hndl->retry = NULL;
+        return true;
+    }
+    if (!policy->maxAttempts || policy->backoff > policy->maxBackoff || policy->jitterPercent > 100)
+    {
+        return false;
+    }
+    if (!hndl->retry)
+    {
+        hndl->retry = calloc(1, sizeof(struct _modbusRetry));
+        if (!hndl->retry)
+        {
+            Log_Debug("Error: Unable to allocate retry policy\n");
+            return false;
+        }
+        hndl->retry->seed = (unsigned int)(ModbusMonotonicUs() ^ (uintptr_t)hndl);
+    }
+    hndl->retry->policy = *policy;
+    return true;
+}
+
+bool ModbusGetRetryStats(modbus_t hndl, modbusRetryStats_t *stats, bool reset)
+{
+    if (!hndl || !hndl->retry)
+    {
+        return false;
+    }
+    *stats = hndl->retry->stats;
+    if (reset)
+    {
+        memset(&hndl->retry->stats, 0, sizeof(hndl->retry->stats));
+    }
+    return true;
+}
+
+struct _modbusSlave *ModbusFindSlave(modbus_t hndl, uint8_t slaveID, bool create)
+{
+    struct _modbusSlave *slave = hndl->slaves;
+    while (slave && slave->slaveID != slaveID)
+    {
+        slave = slave->next;
+    }
+    if (!slave && create)
+    {
+        slave = calloc(1, sizeof(struct _modbusSlave));
+        if (!slave)
+        {
+            Log_Debug("Error: Unable to allocate slave record\n");
+            return NULL;
+        }
+        slave->slaveID = slaveID;
+        slave->next = hndl->slaves;
+        hndl->slaves = slave;
     }
+    return slave;
 }
 
 void ModbusExit(void)
@@ -355,7 +745,9 @@ void ModbusExit(void)
     if (epollFd >= 0)
     {
         close(epollFd);
+        epollFd = -1;
     }
+    FreeReceiveBuffers();
 }
 
 /*------Read------*/
@@ -363,12 +755,8 @@ bool ReadCoils(modbus_t hndl, uint8_t slaveID, uint16_t address, uint16_t bitsTo
                size_t timeout)
 {
     // create structure to send
-    uint8_t bytesToRead = (uint8_t)(bitsToRead / 8);
-    if (bitsToRead % 8)
-    {
-        bytesToRead++;
-    }
     uint8_t modBusMessage[6];
+    uint8_t response[MAX_PDU_LENGTH];
 
     if (hndl->state != Idle)
     {
@@ -380,9 +768,9 @@ bool ReadCoils(modbus_t hndl, uint8_t slaveID, uint16_t address, uint16_t bitsTo
     SET_MODBUS_HEADER(modBusMessage, slaveID, READ_COILS, address, bitsToRead);
     hndl->isCFG = false;
     // write structure
-    if (!ModBusWrite(hndl, modBusMessage, sizeof(modBusMessage)))
+    if (!ModBusWrite(hndl, modBusMessage, sizeof(modBusMessage), response))
     {
-        readArray[0] = MESSAGE_SEND_FAIL;
+        readArray[0] = SendFailReason(hndl);
         return false;
     }
     // read response into array
@@ -393,24 +781,12 @@ bool ReadCoils(modbus_t hndl, uint8_t slaveID, uint16_t address, uint16_t bitsTo
         return false;
     }
 
-    // if the response returns an exception, passes the exception code and returns false
-    if (hndl->pdu[1] & MODBUS_EXCEPTION_BIT)
+    uint8_t error = DecodeResponse(hndl, modBusMessage, sizeof(modBusMessage), readArray, NULL);
+    if (error)
     {
-        readArray[0] = hndl->pdu[2];
+        readArray[0] = error;
         return false;
     }
-    else if (hndl->pdu[1] != READ_COILS)
-    {
-        Log_Debug("Error: Wrong Function code returned\n");
-        readArray[0] = INVALID_RESPONSE;
-        return false;
-    }
-    else
-    {
-        // copy the message to the array (with all other data stripped)
-        memcpy(readArray, &hndl->pdu[PDU_HEADER_LENGTH], PduDataLength(hndl, bytesToRead));
-    }
-    // return true if success*/
     return true;
 }
 
@@ -418,12 +794,8 @@ bool ReadDiscreteInputs(modbus_t hndl, uint8_t slaveID, uint16_t address, uint16
                         size_t timeout)
 {
     // create structure to send
-    uint8_t bytesToRead = (uint8_t)(bitsToRead / 8);
-    if (bitsToRead % 8)
-    {
-        bytesToRead++;
-    }
     uint8_t modBusMessage[6];
+    uint8_t response[MAX_PDU_LENGTH];
 
     if (hndl->state != Idle)
     {
@@ -436,9 +808,9 @@ bool ReadDiscreteInputs(modbus_t hndl, uint8_t slaveID, uint16_t address, uint16
 
     hndl->isCFG = false;
     // write structure
-    if (!ModBusWrite(hndl, modBusMessage, 6))
+    if (!ModBusWrite(hndl, modBusMessage, 6, response))
     {
-        readArray[0] = MESSAGE_SEND_FAIL;
+        readArray[0] = SendFailReason(hndl);
         return false;
     }
     // read response into array
@@ -448,24 +820,12 @@ bool ReadDiscreteInputs(modbus_t hndl, uint8_t slaveID, uint16_t address, uint16
         readArray[0] = MODBUS_TIMEOUT;
         return false;
     }
-    // if the response returns an exception, pass it through the read array and return false
-    if (hndl->pdu[1] & MODBUS_EXCEPTION_BIT)
-    {
-        readArray[0] = hndl->pdu[2];
-        return false;
-    }
-    else if (hndl->pdu[1] != READ_DISCRETE_INPUTS)
+    uint8_t error = DecodeResponse(hndl, modBusMessage, sizeof(modBusMessage), readArray, NULL);
+    if (error)
     {
-        Log_Debug("Error: Wrong Function code returned\n");
-        readArray[0] = INVALID_RESPONSE;
+        readArray[0] = error;
         return false;
     }
-    else
-    {
-        // copy the message to the array (with all other data stripped)
-        memcpy(readArray, &hndl->pdu[PDU_HEADER_LENGTH], PduDataLength(hndl, bytesToRead));
-    }
-    // return true if success
     return true;
 }
 
@@ -474,6 +834,7 @@ bool ReadMultipleHoldingRegisters(modbus_t hndl, uint8_t slaveID, uint16_t addre
 {
     // create structure to send
     uint8_t modBusMessage[6];
+    uint8_t response[MAX_PDU_LENGTH];
 
     if (hndl->state != Idle)
     {
@@ -486,9 +847,9 @@ bool ReadMultipleHoldingRegisters(modbus_t hndl, uint8_t slaveID, uint16_t addre
 
     hndl->isCFG = false;
     // write structure
-    if (!ModBusWrite(hndl, modBusMessage, 6))
+    if (!ModBusWrite(hndl, modBusMessage, 6, response))
     {
-        readArray[0] = MESSAGE_SEND_FAIL;
+        readArray[0] = SendFailReason(hndl);
         return false;
     }
     // read response into array
@@ -498,29 +859,12 @@ bool ReadMultipleHoldingRegisters(modbus_t hndl, uint8_t slaveID, uint16_t addre
         readArray[0] = MODBUS_TIMEOUT;
         return false;
     }
-    // if the response returns an exception, pass it through the read array and return false
-    if (hndl->pdu[1] & MODBUS_EXCEPTION_BIT)
+    uint8_t error = DecodeResponse(hndl, modBusMessage, sizeof(modBusMessage), readArray, NULL);
+    if (error)
     {
-        readArray[0] = hndl->pdu[2];
+        readArray[0] = error;
         return false;
     }
-    else if (hndl->pdu[1] != READ_MULTIPLE_HOLDING_REGISTERS)
-    {
-        Log_Debug("Error: Wrong Function code returned\n");
-        readArray[0] = INVALID_RESPONSE;
-        return false;
-    }
-    else
-    {
-        // copy the message to the array (with all other data stripped)
-        int dataLength = PduDataLength(hndl, (uint16_t)(registersToRead * 2)) / 2;
-        for (int i = 0; i < dataLength; i++)
-        {
-            // Don't use memcpy to ensure correct endianness
-            readArray[i] = (uint16_t)((hndl->pdu[(i * 2) + 3] << 8) | hndl->pdu[(i * 2) + 4]);
-        }
-    }
-    // return true if success
     return true;
 }
 
@@ -529,6 +873,7 @@ bool ReadInputRegisters(modbus_t hndl, uint8_t slaveID, uint16_t address, uint16
 {
     // create structure to send
     uint8_t modBusMessage[6];
+    uint8_t response[MAX_PDU_LENGTH];
 
     if (hndl->state != Idle)
     {
@@ -540,9 +885,9 @@ bool ReadInputRegisters(modbus_t hndl, uint8_t slaveID, uint16_t address, uint16
     SET_MODBUS_HEADER(modBusMessage, slaveID, READ_INPUT_REGISTERS, address, registersToRead);
     hndl->isCFG = false;
     // write structure
-    if (!ModBusWrite(hndl, modBusMessage, 6))
+    if (!ModBusWrite(hndl, modBusMessage, 6, response))
     {
-        readArray[0] = MESSAGE_SEND_FAIL;
+        readArray[0] = SendFailReason(hndl);
         return false;
     }
     // read response into array
@@ -551,49 +896,134 @@ bool ReadInputRegisters(modbus_t hndl, uint8_t slaveID, uint16_t address, uint16
         readArray[0] = MODBUS_TIMEOUT;
         return false;
     }
-    // if the response returns an exception, pass it through the read array and return false
-    if (hndl->pdu[1] & MODBUS_EXCEPTION_BIT)
-    {
-        readArray[0] = hndl->pdu[2];
-        return false;
-    }
-    else if (hndl->pdu[1] != READ_INPUT_REGISTERS)
+    uint8_t error = DecodeResponse(hndl, modBusMessage, sizeof(modBusMessage), readArray, NULL);
+    if (error)
     {
-        Log_Debug("Error: Wrong Function code returned\n");
-        readArray[0] = INVALID_RESPONSE;
+        readArray[0] = error;
         return false;
     }
-    else
-    {
-        // copy the message to the array (with all other data stripped)
-        int datasize = PduDataLength(hndl, (uint16_t)(registersToRead * 2)) / 2;
-        for (int i = 0; i < datasize; i++)
-        {
-            // Don't use memcpy to ensure correct endianness
-            readArray[i] = (uint16_t)((hndl->pdu[(i * 2) + 3] << 8) | hndl->pdu[(i * 2) + 4]);
-        }
-    }
-    // return true if success
     return true;
 }
 
-// TODO: Passive read still in progress
-bool PassiveRead(modbus_t hndl, uint8_t *readArray, uint8_t bytesToRead, size_t timeout)
+bool ReadFifoQueue(modbus_t hndl, uint8_t slaveID, uint16_t fifoAddress, uint16_t *readArray, uint16_t *fifoCount,
+                   size_t timeout)
 {
-    if (!WaitForData(hndl, timeout))
+    // create structure to send
+    uint8_t modBusMessage[4];
+    uint8_t response[MAX_PDU_LENGTH];
+
+    *fifoCount = 0;
+    if (hndl->state != Idle)
     {
-        readArray[0] = MODBUS_TIMEOUT;
+        Log_Debug("Call to %s while Handle not Idle\n", __FUNCTION__);
+        readArray[0] = NotReadyReason(hndl);
         return false;
     }
-    memcpy(readArray, &hndl->pdu[PDU_HEADER_LENGTH], (bytesToRead > hndl->pdu[2]) ? hndl->pdu[2] : bytesToRead);
-    return false;
-}
+
+    modBusMessage[0] = slaveID;
+    modBusMessage[1] = READ_FIFO_QUEUE;
+    modBusMessage[2] = (uint8_t)((fifoAddress >> 8) & 0xFF);
+    modBusMessage[3] = (uint8_t)(fifoAddress & 0xFF);
+    hndl->isCFG = false;
+    // write structure
+    if (!ModBusWrite(hndl, modBusMessage, 4, response))
+    {
+        readArray[0] = SendFailReason(hndl);
+        return false;
+    }
+    // read response into array
+    if (!WaitForData(hndl, timeout))
+    {
+        readArray[0] = MODBUS_TIMEOUT;
+        return false;
+    }
+    uint8_t error = DecodeResponse(hndl, modBusMessage, sizeof(modBusMessage), readArray, fifoCount);
+    if (error)
+    {
+        readArray[0] = error;
+        return false;
+    }
+    return true;
+}
+
+bool ModbusDrainFifoQueue(modbus_t hndl, uint8_t slaveID, uint16_t fifoAddress, uint16_t *readArray,
+                          size_t maxValues, size_t *valueCount, size_t timeout)
+{
+    *valueCount = 0;
+
+    // A full queue is returned as MAX_FIFO_COUNT values, so a shorter read means it has been emptied. Stop before
+    // a read that might not fit rather than lose values.
+    for (;;)
+    {
+        uint16_t count = 0;
+        if (maxValues - *valueCount < MAX_FIFO_COUNT)
+        {
+            return true;
+        }
+        if (!ReadFifoQueue(hndl, slaveID, fifoAddress, &readArray[*valueCount], &count, timeout))
+        {
+            if (*valueCount > 0)
+            {
+                // Leave the values read so far in place; the error code goes after them.
+                Log_Debug("Error: FIFO drain stopped after %zu values: %s\n", *valueCount,
+                          ModbusErrorToString((uint8_t)readArray[*valueCount]));
+            }
+            return false;
+        }
+        *valueCount += count;
+        if (count < MAX_FIFO_COUNT)
+        {
+            return true;
+        }
+    }
+}
+
+// TODO: Passive read still in progress
+bool PassiveRead(modbus_t hndl, uint8_t *readArray, uint8_t bytesToRead, size_t timeout)
+{
+    uint8_t response[MAX_PDU_LENGTH] = {0};
+
+    if (hndl->state != Idle)
+    {
+        Log_Debug("Call to %s while Handle not Idle\n", __FUNCTION__);
+        readArray[0] = NotReadyReason(hndl);
+        return false;
+    }
+
+    // Nothing is sent, so the handle waits as if for a request that was, with a receive buffer of its own.
+    hndl->isCFG = false;
+    if (!BeginRequest(hndl, 0, 0, 0, response))
+    {
+        readArray[0] = SendFailReason(hndl);
+        return false;
+    }
+    AwaitResponse(hndl);
+    uint64_t deadlineUs = ModbusMonotonicUs() + (uint64_t)timeout * 1000;
+    while (!ModbusRequestDone(hndl) && (timeout == 0 || ModbusMonotonicUs() < deadlineUs))
+    {
+        struct timespec t = {.tv_sec = 0, .tv_nsec = 100000};
+        nanosleep(&t, NULL);
+    }
+    // No slave was asked, so the wait is not charged to one.
+    bool received = CompleteRequest(hndl, false, true);
+    if (received)
+    {
+        memcpy(readArray, &response[PDU_HEADER_LENGTH], (bytesToRead > response[2]) ? response[2] : bytesToRead);
+    }
+    else
+    {
+        readArray[0] = MODBUS_TIMEOUT;
+    }
+    hndl->pdu = NULL;
+    return received;
+}
 
 /*------Write------*/
 bool WriteSingleCoil(modbus_t hndl, uint8_t slaveID, uint16_t address, bool bit, uint8_t *readArray, size_t timeout)
 {
     // create structure to send
     uint8_t modBusMessage[6];
+    uint8_t response[MAX_PDU_LENGTH];
 
     if (hndl->state != Idle)
     {
@@ -606,9 +1036,9 @@ bool WriteSingleCoil(modbus_t hndl, uint8_t slaveID, uint16_t address, bool bit,
 
     hndl->isCFG = false;
     // write structure
-    if (!ModBusWrite(hndl, modBusMessage, 6))
+    if (!ModBusWrite(hndl, modBusMessage, 6, response))
     {
-        readArray[0] = MESSAGE_SEND_FAIL;
+        readArray[0] = SendFailReason(hndl);
         return false;
     }
     // read response into array
@@ -619,23 +1049,12 @@ bool WriteSingleCoil(modbus_t hndl, uint8_t slaveID, uint16_t address, bool bit,
         return false;
     }
 
-    // if the response returns an exception, pass it through the read array and return false
-    if (hndl->pdu[1] & MODBUS_EXCEPTION_BIT)
+    uint8_t error = DecodeResponse(hndl, modBusMessage, sizeof(modBusMessage), readArray, NULL);
+    if (error)
     {
-        readArray[0] = hndl->pdu[2];
+        readArray[0] = error;
         return false;
     }
-    else if (hndl->pdu[1] != WRITE_SINGLE_COIL)
-    {
-        Log_Debug("Error: Wrong Function code returned\n");
-        readArray[0] = INVALID_RESPONSE;
-        return false;
-    }
-    else
-    {
-        // copy the message to the array (with all other data stripped)
-        memcpy(readArray, &hndl->pdu[WRITE_RESPONSE_START], WRITE_RESPONSE_BYTES);
-    }
     return true;
 }
 
@@ -644,6 +1063,7 @@ bool WriteSingleHoldingRegister(modbus_t hndl, uint8_t slaveID, uint16_t address
 {
     // create structure to send
     uint8_t modBusMessage[6];
+    uint8_t response[MAX_PDU_LENGTH];
 
     if (hndl->state != Idle)
     {
@@ -656,9 +1076,9 @@ bool WriteSingleHoldingRegister(modbus_t hndl, uint8_t slaveID, uint16_t address
 
     hndl->isCFG = false;
     // write structure
-    if (!ModBusWrite(hndl, modBusMessage, 6))
+    if (!ModBusWrite(hndl, modBusMessage, 6, response))
     {
-        readArray[0] = MESSAGE_SEND_FAIL;
+        readArray[0] = SendFailReason(hndl);
         return false;
     }
     // read response into array
@@ -667,32 +1087,94 @@ bool WriteSingleHoldingRegister(modbus_t hndl, uint8_t slaveID, uint16_t address
         readArray[0] = MODBUS_TIMEOUT;
         return false;
     }
-    // if the response returns an exception, pass it through the read array and return false
-    if (hndl->pdu[1] & MODBUS_EXCEPTION_BIT)
+    uint8_t error = DecodeResponse(hndl, modBusMessage, sizeof(modBusMessage), readArray, NULL);
+    if (error)
     {
-        readArray[0] = hndl->pdu[2];
+        readArray[0] = error;
         return false;
     }
-    else if (hndl->pdu[1] != WRITE_SINGLE_HOLDING_REGISTER)
+    return true;
+}
+
+bool MaskWriteRegister(modbus_t hndl, uint8_t slaveID, uint16_t address, uint16_t andMask, uint16_t orMask,
+                       uint8_t *readArray, size_t timeout)
+{
+    // create structure to send
+    uint8_t modBusMessage[8];
+    uint8_t response[MAX_PDU_LENGTH];
+
+    if (hndl->state != Idle)
     {
-        Log_Debug("Error: Wrong Function code returned\n");
-        readArray[0] = INVALID_RESPONSE;
+        Log_Debug("Call to %s while Handle not Idle\n", __FUNCTION__);
+        readArray[0] = NotReadyReason(hndl);
         return false;
     }
-    else
+
+    SET_MODBUS_HEADER(modBusMessage, slaveID, MASK_WRITE_REGISTER, address, andMask);
+    modBusMessage[6] = (uint8_t)((orMask >> 8) & 0xFF);
+    modBusMessage[7] = (uint8_t)(orMask & 0xFF);
+
+    hndl->isCFG = false;
+    // write structure
+    if (!ModBusWrite(hndl, modBusMessage, 8, response))
+    {
+        readArray[0] = SendFailReason(hndl);
+        return false;
+    }
+    // read response into array
+    if (!WaitForData(hndl, timeout))
+    {
+        readArray[0] = MODBUS_TIMEOUT;
+        return false;
+    }
+    uint8_t error = DecodeResponse(hndl, modBusMessage, sizeof(modBusMessage), readArray, NULL);
+    if (error)
     {
-        // copy the message to the array (with all other data stripped)
-        memcpy(readArray, &hndl->pdu[WRITE_RESPONSE_START], WRITE_RESPONSE_BYTES);
+        readArray[0] = error;
+        return false;
     }
     return true;
 }
 
+bool WriteHoldingRegisterBits(modbus_t hndl, uint8_t slaveID, uint16_t address, uint16_t bitMask, uint16_t bits,
+                              uint8_t *readArray, size_t timeout)
+{
+    uint8_t response[MASK_WRITE_RESPONSE_BYTES];
+    uint16_t mbRegister = 0;
+
+    if (!(hndl->noMaskWrite[slaveID / 8] & (1 << (slaveID % 8))))
+    {
+        if (MaskWriteRegister(hndl, slaveID, address, (uint16_t)~bitMask, (uint16_t)(bits & bitMask), response,
+                              timeout))
+        {
+            return true;
+        }
+        if (response[0] != ILLEGAL_FUNCTION)
+        {
+            readArray[0] = response[0];
+            return false;
+        }
+        Log_Debug("Slave %u does not support Mask Write Register, using read-modify-write\n", slaveID);
+        hndl->noMaskWrite[slaveID / 8] |= (uint8_t)(1 << (slaveID % 8));
+    }
+
+    // The register may be changed by another master between the read and the write.
+    if (!ReadMultipleHoldingRegisters(hndl, slaveID, address, 1, &mbRegister, timeout))
+    {
+        readArray[0] = (uint8_t)mbRegister;
+        return false;
+    }
+    mbRegister = (uint16_t)((mbRegister & ~bitMask) | (bits & bitMask));
+    return WriteSingleHoldingRegister(hndl, slaveID, address, mbRegister, readArray, timeout);
+}
+
 bool WriteMultipleCoils(modbus_t hndl, uint8_t slaveID, uint16_t address, uint16_t numToWrite, uint8_t *bitArray,
                         uint8_t *readArray, size_t timeout)
 {
     // create structure to send
     uint8_t dataByteCount = (uint8_t)(numToWrite / 8 + (numToWrite & 0x7) ? 1 : 0);
     uint8_t modBusMessage[MAX_PDU_LENGTH];
+    uint8_t response[MAX_PDU_LENGTH];
 
     if (hndl->state != Idle)
     {
@@ -709,9 +1191,9 @@ bool WriteMultipleCoils(modbus_t hndl, uint8_t slaveID, uint16_t address, uint16
     memcpy(&modBusMessage[7], bitArray, dataByteCount);
     hndl->isCFG = false;
     // write structure
-    if (!ModBusWrite(hndl, modBusMessage, (uint16_t)(7 + dataByteCount)))
+    if (!ModBusWrite(hndl, modBusMessage, (uint16_t)(7 + dataByteCount), response))
     {
-        readArray[0] = MESSAGE_SEND_FAIL;
+        readArray[0] = SendFailReason(hndl);
         return false;
     }
     // read response into array
@@ -720,23 +1202,12 @@ bool WriteMultipleCoils(modbus_t hndl, uint8_t slaveID, uint16_t address, uint16
         readArray[0] = MODBUS_TIMEOUT;
         return false;
     }
-    // if the response returns an exception, pass it through the read array and return false
-    if (hndl->pdu[1] & MODBUS_EXCEPTION_BIT)
-    {
-        readArray[0] = hndl->pdu[2];
-        return false;
-    }
-    else if (hndl->pdu[1] != WRITE_MULTIPLE_COILS)
+    uint8_t error = DecodeResponse(hndl, modBusMessage, (uint16_t)(7 + dataByteCount), readArray, NULL);
+    if (error)
     {
-        Log_Debug("Error: Wrong Function code returned\n");
-        readArray[0] = INVALID_RESPONSE;
+        readArray[0] = error;
         return false;
     }
-    else
-    {
-        // copy the message to the array (with all other data stripped)
-        memcpy(readArray, &hndl->pdu[WRITE_RESPONSE_START], WRITE_RESPONSE_BYTES);
-    }
     return true;
 }
 
@@ -746,6 +1217,7 @@ bool WriteMultipleHoldingRegisters(modbus_t hndl, uint8_t slaveID, uint16_t addr
     // create structure to send
     uint8_t dataByteCount = (uint8_t)(numToWrite * 2);
     uint8_t modBusMessage[MAX_PDU_LENGTH];
+    uint8_t response[MAX_PDU_LENGTH];
 
     if (hndl->state != Idle)
     {
@@ -767,9 +1239,9 @@ bool WriteMultipleHoldingRegisters(modbus_t hndl, uint8_t slaveID, uint16_t addr
     }
     hndl->isCFG = false;
     // write structure
-    if (!ModBusWrite(hndl, modBusMessage, (uint8_t)(7 + dataByteCount)))
+    if (!ModBusWrite(hndl, modBusMessage, (uint8_t)(7 + dataByteCount), response))
     {
-        readArray[0] = MESSAGE_SEND_FAIL;
+        readArray[0] = SendFailReason(hndl);
         return false;
     }
     // read response into array
@@ -778,23 +1250,12 @@ bool WriteMultipleHoldingRegisters(modbus_t hndl, uint8_t slaveID, uint16_t addr
         readArray[0] = MODBUS_TIMEOUT;
         return false;
     }
-    // if the response returns an exception, pass it through the readArray and return false
-    if (hndl->pdu[1] & MODBUS_EXCEPTION_BIT)
-    {
-        readArray[0] = hndl->pdu[2];
-        return false;
-    }
-    else if (hndl->pdu[1] != WRITE_MULTIPLE_HOLDING_REGISTERS)
+    uint8_t error = DecodeResponse(hndl, modBusMessage, (uint16_t)(7 + dataByteCount), readArray, NULL);
+    if (error)
     {
-        Log_Debug("Error: Wrong Function code returned\n");
-        readArray[0] = INVALID_RESPONSE;
+        readArray[0] = error;
         return false;
     }
-    else
-    {
-        // copy the message to the array (with all other data stripped)
-        memcpy(readArray, &hndl->pdu[WRITE_RESPONSE_START], WRITE_RESPONSE_BYTES);
-    }
     return true;
 }
 
@@ -816,7 +1277,6 @@ uint8_t ReadFileSubRequestBuilder(uint8_t* messageArray, uint8_t currentMessageI
 
 bool ReadFile(modbus_t hndl, uint8_t slaveID, uint8_t* messageArray, uint8_t messageLength, uint8_t* readArray, size_t timeout)
 {
-    uint16_t expectedMessageLength=0;
     if (hndl->state != Idle)
     {
         Log_Debug("Call to %s while Handle not Idle\n", __FUNCTION__);
@@ -825,6 +1285,7 @@ bool ReadFile(modbus_t hndl, uint8_t slaveID, uint8_t* messageArray, uint8_t mes
     }
 
     uint8_t modbusMessage[MAX_PDU_LENGTH + PDU_HEADER_LENGTH];
+    uint8_t response[MAX_PDU_LENGTH];
     modbusMessage[0] = slaveID;
     modbusMessage[1] = READ_FILE;
     modbusMessage[2] = messageLength;
@@ -837,23 +1298,11 @@ bool ReadFile(modbus_t hndl, uint8_t slaveID, uint8_t* messageArray, uint8_t mes
         readArray[0] = MESSAGE_SEND_FAIL;
         return false;
     }
-    for (int i = 0; i < messageLength; i++)
-    {
-    //finds the sum of the record lengths of each subrequest combined with length of the subrequests themselves to find the total expected length of the response (to help with validation)
-        if (i % 7 == 6)
-        {
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wconversion"
-            expectedMessageLength += (messageArray[i] * 2) + 2;
-#pragma GCC diagnostic pop
-        }
-    }
-
     hndl->isCFG = false;
     // write structure
-    if (!ModBusWrite(hndl, modbusMessage, (uint16_t)(3 + messageLength)))
+    if (!ModBusWrite(hndl, modbusMessage, (uint16_t)(3 + messageLength), response))
     {
-        readArray[0] = MESSAGE_SEND_FAIL;
+        readArray[0] = SendFailReason(hndl);
         return false;
     }
     // read response into array
@@ -863,24 +1312,13 @@ bool ReadFile(modbus_t hndl, uint8_t slaveID, uint8_t* messageArray, uint8_t mes
         readArray[0] = MODBUS_TIMEOUT;
         return false;
     }    
-    // if the response returns an exception, pass it through the readArray and return false
-    if (hndl->pdu[1] & MODBUS_EXCEPTION_BIT)
-    {
-        readArray[0] = hndl->pdu[2];
-        return false;
-    }
-    else if (hndl->pdu[1] != READ_FILE)
+    uint8_t error = DecodeResponse(hndl, modbusMessage, (uint16_t)(3 + messageLength), readArray, NULL);
+    if (error)
     {
-        Log_Debug("Error: Wrong Function code returned\n");
-        readArray[0] = INVALID_RESPONSE;
+        readArray[0] = error;
         return false;
     }
-    else
-    {
-        // copy the message to the array (with all other data stripped)
-        memcpy(readArray, &hndl->pdu[PDU_HEADER_LENGTH], PduDataLength(hndl, expectedMessageLength));
-        return true;
-    }
+    return true;
 }
 
 uint8_t WriteFileSubRequestBuilder(uint8_t* messageArray, uint8_t currentMessageIndex, uint16_t fileNumber, uint16_t recordNumber, uint8_t recordLength, uint16_t* record)
@@ -912,6 +1350,7 @@ bool WriteFile(modbus_t hndl, uint8_t slaveID, uint8_t* messageArray, uint8_t me
     }
 
     uint8_t modbusMessage[MAX_PDU_LENGTH];
+    uint8_t response[MAX_PDU_LENGTH];
     modbusMessage[0] = slaveID;
     modbusMessage[1] = WRITE_FILE;
     modbusMessage[2] = messageLength;
@@ -920,9 +1359,9 @@ bool WriteFile(modbus_t hndl, uint8_t slaveID, uint8_t* messageArray, uint8_t me
 
     hndl->isCFG = false;
     // write structure
-    if (!ModBusWrite(hndl, modbusMessage, (uint16_t)(PDU_HEADER_LENGTH + messageLength)))
+    if (!ModBusWrite(hndl, modbusMessage, (uint16_t)(PDU_HEADER_LENGTH + messageLength), response))
     {
-        readArray[0] = MESSAGE_SEND_FAIL;
+        readArray[0] = SendFailReason(hndl);
         return false;
     }
     // read response into array
@@ -932,29 +1371,191 @@ bool WriteFile(modbus_t hndl, uint8_t slaveID, uint8_t* messageArray, uint8_t me
         readArray[0] = MODBUS_TIMEOUT;
         return false;
     }    
-    // if the response returns an exception, pass it through the read array and return false
-    if (hndl->pdu[1] & MODBUS_EXCEPTION_BIT)
+    uint8_t error = DecodeResponse(hndl, modbusMessage, (uint16_t)(PDU_HEADER_LENGTH + messageLength), readArray, NULL);
+    if (error)
     {
-        readArray[0] = hndl->pdu[2];
+        readArray[0] = error;
         return false;
     }
-    else if (hndl->pdu[1] != WRITE_FILE)
+    return true;
+}
+
+bool ModbusRegisterFunctionCode(uint8_t functionCode, fcodeLengthRule lengthRule, uint8_t length, uint8_t echoLength)
+{
+    fcodeDescriptor descriptor = {(uint8_t)lengthRule, length, echoLength, FCODE_DATA_BYTES};
+    if (!FcodeRegister(functionCode, &descriptor))
     {
-        Log_Debug("Error: Wrong Function code returned\n");
-        readArray[0] = INVALID_RESPONSE;
+        Log_Debug("Error: Unable to register function code %u\n", functionCode);
         return false;
     }
-    else
+    customFcodes[functionCode / 8] |= (uint8_t)(1u << (functionCode % 8));
+    return sockFd < 0 || SendFcodeToM4(functionCode);
+}
+
+bool SendCustomFunction(modbus_t hndl, uint8_t slaveID, uint8_t functionCode, const uint8_t *data, uint8_t dataLength,
+                        uint8_t *readArray, uint8_t *readLength, size_t timeout)
+{
+    if (hndl->state != Idle)
     {
-        // copy the message to the array (with all other data stripped)
-        memcpy(readArray, &hndl->pdu[PDU_HEADER_LENGTH], PduDataLength(hndl, messageLength));
-        return true;
+        Log_Debug("Call to %s while Handle not Idle\n", __FUNCTION__);
+        readArray[0] = NotReadyReason(hndl);
+        return false;
+    }
+    if (functionCode > FCODE_RANGE || FcodeDescriptor(functionCode)->lengthRule == FCODE_UNKNOWN ||
+        dataLength > MAX_PDU_LENGTH - 2)
+    {
+        Log_Debug("Error: Function code %u is not registered or the request is too long\n", functionCode);
+        readArray[0] = ILLEGAL_FUNCTION;
+        return false;
+    }
+
+    uint8_t modbusMessage[MAX_PDU_LENGTH];
+    uint8_t response[MAX_PDU_LENGTH];
+    modbusMessage[0] = slaveID;
+    modbusMessage[1] = functionCode;
+    memcpy(&modbusMessage[2], data, dataLength);
+
+    hndl->isCFG = false;
+    // write structure
+    if (!ModBusWrite(hndl, modbusMessage, (uint16_t)(2 + dataLength), response))
+    {
+        readArray[0] = SendFailReason(hndl);
+        return false;
+    }
+    // read response into array
+    // deal with timeout due to no response
+    if (!WaitForData(hndl, timeout))
+    {
+        readArray[0] = MODBUS_TIMEOUT;
+        return false;
+    }
+    uint8_t error = DecodeResponse(hndl, modbusMessage, (uint16_t)(2 + dataLength), NULL, NULL);
+    if (error)
+    {
+        readArray[0] = error;
+        return false;
+    }
+    // copy the message to the array (with the slave ID and function code stripped)
+    *readLength = (uint8_t)(hndl->pduLength - 2);
+    memcpy(readArray, &hndl->pdu[2], *readLength);
+    return true;
+}
+
+// Tells the M4 how to frame responses to a registered function code. The M4 does not answer.
+static bool SendFcodeToM4(uint8_t functionCode)
+{
+    const fcodeDescriptor *descriptor = FcodeDescriptor(functionCode);
+    uint8_t message[MESSAGE_HEADER_LENGTH + 1 + sizeof(fcodeDescriptor)] = {0};
+    message[PROTOCOL_OFFSET] = MODBUS;
+    message[COMMAND_OFFSET] = MODBUS_FCODE_MESSAGE;
+    message[HEADER_LENGTH_OFFSET] = MESSAGE_HEADER_LENGTH;
+    message[MESSAGE_HEADER_LENGTH] = functionCode;
+    message[MESSAGE_HEADER_LENGTH + 1] = descriptor->lengthRule;
+    message[MESSAGE_HEADER_LENGTH + 2] = descriptor->length;
+    message[MESSAGE_HEADER_LENGTH + 3] = descriptor->echoLength;
+    message[MESSAGE_HEADER_LENGTH + 4] = descriptor->dataRule;
+    if (send(sockFd, message, sizeof(message), 0) != (ssize_t)sizeof(message))
+    {
+        Log_Debug("Error: Unable to send function code %u to the M4: %d\n", functionCode, errno);
+        return false;
+    }
+    return true;
+}
+
+static speed_t SerialSpeed(uint16_t baudRate)
+{
+    switch (baudRate)
+    {
+    case BAUD_SET_300:
+        return B300;
+    case BAUD_SET_600:
+        return B600;
+    case BAUD_SET_1200:
+        return B1200;
+    case BAUD_SET_2400:
+        return B2400;
+    case BAUD_SET_4800:
+        return B4800;
+    case BAUD_SET_9600:
+        return B9600;
+    case BAUD_SET_19200:
+        return B19200;
+    case BAUD_SET_38400:
+        return B38400;
+    case BAUD_SET_57600:
+        return B57600;
+    case BAUD_SET_115200:
+        return B115200;
+    default:
+        // Linux has no standard speed for 14400 baud
+        return B0;
+    }
+}
+
+// Sets up a serial port opened by ModbusConnectRtuSerial: raw mode with the line settings, low latency where the
+// driver allows it, and RS-485 direction control by the driver in half duplex mode.
+static bool ConfigureSerialPort(int fd, const serialSetup *setup)
+{
+    struct termios tio;
+    speed_t speed = SerialSpeed(setup->baudRate);
+    if (speed == B0)
+    {
+        Log_Debug("Error: Unsupported baud rate setting %u\n", setup->baudRate);
+        return false;
+    }
+    if (tcgetattr(fd, &tio) != 0)
+    {
+        Log_Debug("Error: Not a serial port: %d (%s)\n", errno, strerror(errno));
+        return false;
+    }
+    cfmakeraw(&tio);
+    tio.c_cflag &= (tcflag_t) ~(CSIZE | PARENB | PARODD | CSTOPB | CRTSCTS);
+    tio.c_cflag |= CLOCAL | CREAD | ((setup->wordLength == 7) ? CS7 : CS8);
+    if (setup->parityState == PARITY_ON)
+    {
+        tio.c_cflag |= PARENB | ((setup->parityMode == PARITY_ODD) ? PARODD : 0);
+    }
+    if (setup->stopBits == 2)
+    {
+        tio.c_cflag |= CSTOPB;
+    }
+    // Reads return whatever has arrived without waiting; epoll says when something has, and responses are delimited
+    // by the length their function code gives.
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+    if (cfsetispeed(&tio, speed) != 0 || cfsetospeed(&tio, speed) != 0 || tcsetattr(fd, TCSANOW, &tio) != 0)
+    {
+        Log_Debug("Error: Unable to configure serial port: %d (%s)\n", errno, strerror(errno));
+        return false;
+    }
+
+    // Without low latency some drivers hold received bytes back for several milliseconds. Not every driver has it.
+    struct serial_struct serial;
+    if (ioctl(fd, TIOCGSERIAL, &serial) == 0)
+    {
+        serial.flags |= ASYNC_LOW_LATENCY;
+        ioctl(fd, TIOCSSERIAL, &serial);
+    }
+
+    if (setup->duplexMode == HALF_DUPLEX_MODE)
+    {
+        struct serial_rs485 rs485;
+        memset(&rs485, 0, sizeof(rs485));
+        rs485.flags = SER_RS485_ENABLED | SER_RS485_RTS_ON_SEND;
+        if (ioctl(fd, TIOCSRS485, &rs485) != 0)
+        {
+            Log_Debug("Error: Serial port has no RS-485 direction control: %d (%s)\n", errno, strerror(errno));
+            return false;
+        }
     }
+    tcflush(fd, TCIOFLUSH);
+    return true;
 }
 
 static bool WriteSerialConfig(modbus_t hndl, uint8_t *receivedMessage, size_t timeout)
 {
     uint8_t serialConfigMessage[7];
+    uint8_t response[MAX_PDU_LENGTH];
     serialConfigMessage[BAUD_RATE_OFFSET_UPPER] = (uint8_t)((hndl->connectData.RTU.baudRate >> 8) & 0xFF);
     serialConfigMessage[BAUD_RATE_OFFSET_LOWER] = (uint8_t)(hndl->connectData.RTU.baudRate & 0xFF);
     serialConfigMessage[DUPLEX_MODE_OFFSET] = hndl->connectData.RTU.halfDuplexMode;
@@ -964,7 +1565,7 @@ static bool WriteSerialConfig(modbus_t hndl, uint8_t *receivedMessage, size_t ti
     serialConfigMessage[WORD_LENGTH_OFFSET] = hndl->connectData.RTU.wordLength;
     hndl->isCFG = true;
     // write structure
-    if (!ModBusWrite(hndl, serialConfigMessage, 7))
+    if (!ModBusWrite(hndl, serialConfigMessage, 7, response))
     {
         receivedMessage[0] = MESSAGE_SEND_FAIL;
         return false;
@@ -986,24 +1587,19 @@ static bool WriteSerialConfig(modbus_t hndl, uint8_t *receivedMessage, size_t ti
 /// Static functions
 
 #ifdef BUFFER_CHECK_ON
-static void SetBufferZones(modbus_t hndl)
+static void SetBufferZones(struct _modbusRx *rx)
 {
     for (size_t i = 0; i < BUFFER_ZONE_SIZE; i++)
     {
-        hndl->bufferZone1[i] = BUFFER_ZONE_VAL1;
-        hndl->bufferZone2[i] = BUFFER_ZONE_VAL2;
+        rx->bufferZone[i] = BUFFER_ZONE_VAL1;
     }
 }
 
-static bool BufferZonesValid(modbus_t hndl)
+static bool BufferZonesValid(struct _modbusRx *rx)
 {
     for (size_t i = 0; i < BUFFER_ZONE_SIZE; i++)
     {
-        if (hndl->bufferZone1[i] != BUFFER_ZONE_VAL1)
-        {
-            return false;
-        }
-        if (hndl->bufferZone2[i] != BUFFER_ZONE_VAL2)
+        if (rx->bufferZone[i] != BUFFER_ZONE_VAL1)
         {
             return false;
         }
@@ -1015,6 +1611,14 @@ static bool BufferZonesValid(modbus_t hndl)
 static void *EpollThread(void *ptr)
 {
     Log_Debug("Starting Modbus Thread\n");
+    if (prefaultStack)
+    {
+        volatile uint8_t stack[PREFAULT_STACK_BYTES];
+        for (size_t i = 0; i < sizeof(stack); i += 256)
+        {
+            stack[i] = 0;
+        }
+    }
     while (epollThreadContinue)
     {
         struct epoll_event event;
@@ -1040,21 +1644,7 @@ static void *EpollThread(void *ptr)
 
             if (event.events & EPOLLIN)
             {
-#ifdef BUFFER_CHECK_ON
-                if (!BufferZonesValid(mh))
-                {
-                    Log_Debug("Probably buffer overrun detected\n");
-                }
-#endif
-                messageHandlerState_t mhsState = ModBusRead(mh);
-                if (mhsState == success)
-                {
-                    mh->state = DataReceived;
-                }
-                else if (mhsState == failure)
-                {
-                    mh->state = TransactionFailed;
-                }
+                ModBusRead(mh);
             }
             if (event.events & (EPOLLRDHUP | EPOLLHUP))
             {
@@ -1067,29 +1657,54 @@ static void *EpollThread(void *ptr)
     return NULL;
 }
 
-static bool ModBusWrite(modbus_t hndl, uint8_t *modBusPacket, uint16_t packetLength)
+static bool BeginRequest(modbus_t hndl, uint8_t slaveId, uint8_t functionCode, uint16_t pduLength, uint8_t *response)
 {
-    // Attach MBAP header to turn modbus PDU to modbus ADU
+    if (!hndl->isCFG && !BreakerAllows(hndl, slaveId))
+    {
+        return false;
+    }
     hndl->state = SendingRequest;
     hndl->pduLength = 0;
+    hndl->pdu = response;
+    hndl->responseCorrupt = false;
+    if (!AcquireRx(hndl))
+    {
+        hndl->state = Idle;
+        return false;
+    }
+    hndl->requestSlaveId = slaveId;
+    hndl->requestFunctionCode = functionCode;
+    hndl->requestLength = pduLength;
+    return true;
+}
 
-    if (hndl->type == tcp)
+static bool ModBusWrite(modbus_t hndl, uint8_t *modBusPacket, uint16_t packetLength, uint8_t *response)
+{
+    if (!BeginRequest(hndl, modBusPacket[0], modBusPacket[1], packetLength, response))
+    {
+        return false;
+    }
+    if (hndl->retry)
+    {
+        hndl->retry->request = modBusPacket;
+        hndl->retry->requestLength = packetLength;
+        hndl->retry->prepared = NULL;
+    }
+
+    // Attach MBAP header to turn modbus PDU to modbus ADU
+    if (hndl->type == tcp || hndl->type == local)
     {
         uint8_t modBusPacketTCP[MAX_PDU_LENGTH + TCP_HEADER_LENGTH];
-        memcpy(&modBusPacketTCP[TCP_HEADER_LENGTH], modBusPacket, packetLength);
-        modBusPacketTCP[0] = (uint8_t)((transactionIdentifier >> 8) & 0xFF);
-        modBusPacketTCP[1] = (uint8_t)(transactionIdentifier & 0xFF);
-        modBusPacketTCP[2] = 0x00;
-        modBusPacketTCP[3] = 0x00;
-        modBusPacketTCP[4] = (uint8_t)((packetLength >> 8) & 0xFF);
-        modBusPacketTCP[5] = (uint8_t)(packetLength & 0xFF);
-        return SendToSlave(hndl, modBusPacketTCP, packetLength + TCP_HEADER_LENGTH);
+        uint16_t transactionId = AwaitResponse(hndl);
+        return SendToSlave(hndl, modBusPacketTCP, FrameTcp(modBusPacketTCP, transactionId, modBusPacket,
+                                                           packetLength));
     }
-    else if (hndl->type == rtuOverTcp) 
+    else if (hndl->type == rtuOverTcp || hndl->type == rtuSerial)
     {
         uint8_t modBusPacketRTU[MAX_PDU_LENGTH + CRC_FOOTER_LENGTH];
         memcpy(modBusPacketRTU, modBusPacket, packetLength);
         AddCRC(modBusPacketRTU, packetLength, MAX_PDU_LENGTH);
+        AwaitResponse(hndl);
         return SendToSlave(hndl, modBusPacketRTU, packetLength + CRC_FOOTER_LENGTH);
     }
     else if (hndl->type == rtu)
@@ -1109,6 +1724,7 @@ static bool ModBusWrite(modbus_t hndl, uint8_t *modBusPacket, uint16_t packetLen
         }
         modBusPacketRTU[HEADER_LENGTH_OFFSET] = MESSAGE_HEADER_LENGTH;
 
+        AwaitResponse(hndl);
         return SendToSlave(hndl, modBusPacketRTU, packetLength + MESSAGE_HEADER_LENGTH);
     }
     Log_Debug("Error: Handle type is unknown.\n");
@@ -1118,22 +1734,78 @@ static bool ModBusWrite(modbus_t hndl, uint8_t *modBusPacket, uint16_t packetLen
 static messageHandlerState_t ModBusRead(modbus_t hndl)
 {
     uint8_t message[MAX_PDU_LENGTH];
-    
-    int bytesReceived = recv(hndl->fd, message, sizeof(message), 0);
-    return MessageHandler(hndl, message, (uint16_t)bytesReceived);
-}
+    size_t room = sizeof(message);
 
-const char *ModbusErrorToString(uint8_t errorNo)
-{
-    switch (errorNo)
+    // A TCP stream can hold the start of the next response behind this one, so only read what the receive buffer
+    // has room for and leave the rest in the socket. Intercore messages have to be read whole.
+    pthread_mutex_lock(&rxLock);
+    if (hndl->type != rtu && hndl->rx)
     {
-    case ILLEGAL_FUNCTION:
-        return "Exception: Illegal Function";
-    case ILLEGAL_DATA_ADDRESS:
-        return "Exception: Illegal data address";
-    case ILLEGAL_DATA_VALUE:
-        return "Exception: Illegal data value";
-    case SLAVE_DEVICE_FAILURE:
+        room = MAX_PDU_LENGTH - 1u - hndl->rx->length;
+    }
+    pthread_mutex_unlock(&rxLock);
+
+    int bytesReceived;
+    if (hndl->type == rtuSerial)
+    {
+        bytesReceived = (int)read(hndl->fd, message, room);
+    }
+    else if (hndl->type == local)
+    {
+        bytesReceived = (int)LocalReceive(&hndl->connectData.LOCAL, message, room);
+    }
+    else
+    {
+        bytesReceived = recv(hndl->fd, message, room, 0);
+    }
+    if (bytesReceived < 0 && (errno == EAGAIN || errno == EINTR))
+    {
+        return waiting;
+    }
+
+    // The state is updated under the lock so a transaction that times out cannot be completed after it has given
+    // up its receive buffer.
+    pthread_mutex_lock(&rxLock);
+#ifdef BUFFER_CHECK_ON
+    if (hndl->rx && !BufferZonesValid(hndl->rx))
+    {
+        Log_Debug("Probably buffer overrun detected\n");
+    }
+#endif
+    messageHandlerState_t mhsState = MessageHandler(hndl, message, (uint16_t)bytesReceived);
+    // One read can hold several responses to a batch, so keep going while complete messages are found.
+    while (mhsState == waiting && hndl->batch && hndl->rx && hndl->rx->length > 0)
+    {
+        uint16_t before = hndl->rx->length;
+        mhsState = MessageHandler(hndl, message, 0);
+        if (hndl->rx->length == before)
+        {
+            break;
+        }
+    }
+    if (mhsState == success)
+    {
+        hndl->state = DataReceived;
+    }
+    else if (mhsState == failure)
+    {
+        hndl->state = TransactionFailed;
+    }
+    pthread_mutex_unlock(&rxLock);
+    return mhsState;
+}
+
+const char *ModbusErrorToString(uint8_t errorNo)
+{
+    switch (errorNo)
+    {
+    case ILLEGAL_FUNCTION:
+        return "Exception: Illegal Function";
+    case ILLEGAL_DATA_ADDRESS:
+        return "Exception: Illegal data address";
+    case ILLEGAL_DATA_VALUE:
+        return "Exception: Illegal data value";
+    case SLAVE_DEVICE_FAILURE:
         return "Exception: Slave device failure";
     case ACKNOWLEDGE:
         return "Exception: Acknowledge";
@@ -1157,22 +1829,60 @@ const char *ModbusErrorToString(uint8_t errorNo)
         return "Exception: Wrong Function Code returned from device";
     case DEVICE_DISCONNECTED:
         return "Exception: Device Disconnected - reconnect required";
+    case SLAVE_UNAVAILABLE:
+        return "Exception: Slave unavailable - circuit breaker open";
     default:
         return "Exception: Unknown exception";
     }
 }
 
-static bool SendToSlave(modbus_t hndl, uint8_t *modBusADU, int pduLength)
+// Sends a frame once the handle is waiting for its response, see AwaitResponse.
+static bool SendToSlave(modbus_t hndl, const uint8_t *modBusADU, int pduLength)
 {
-    if (pduLength == send(hndl->fd, modBusADU, (size_t)pduLength, 0))
+    if (hndl->type == rtuSerial)
+    {
+        return RequestSent(hndl, pduLength == write(hndl->fd, modBusADU, (size_t)pduLength));
+    }
+    if (hndl->type == local)
+    {
+        struct iovec iov = {.iov_base = (void *)modBusADU, .iov_len = (size_t)pduLength};
+        return RequestSent(hndl, LocalSend(&hndl->connectData.LOCAL, &iov, 1));
+    }
+    return RequestSent(hndl, pduLength == send(hndl->fd, modBusADU, (size_t)pduLength, 0));
+}
+
+// Called just before a request is framed and handed to the transport. A local server can answer before the call that
+// sends the request returns, so the handle must already be waiting for the response. Returns the transaction ID
+// reserved for the request, which Modbus TCP frames carry.
+static uint16_t AwaitResponse(modbus_t hndl)
+{
+    if (hndl->type == rtuSerial)
+    {
+        // Whatever is waiting is the end of a response that was given up on, or noise; it is not part of the
+        // response to this request.
+        tcflush(hndl->fd, TCIFLUSH);
+    }
+    uint16_t transactionId = __atomic_fetch_add(&transactionIdentifier, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&rxLock);
+    hndl->transactionId = transactionId;
+    hndl->state = WaitingForResponse;
+    pthread_mutex_unlock(&rxLock);
+    hndl->requestSentUs = ModbusMonotonicUs();
+    return transactionId;
+}
+
+static bool RequestSent(modbus_t hndl, bool sent)
+{
+    if (sent)
     {
-        hndl->transactionId = transactionIdentifier++;
-        hndl->state = WaitingForResponse;
         return true;
     }
     else
     {
+        pthread_mutex_lock(&rxLock);
+        ReleaseRx(hndl);
         hndl->state = Idle;
+        pthread_mutex_unlock(&rxLock);
         return false;
     }
 }
@@ -1188,28 +1898,34 @@ static messageHandlerState_t MessageHandler(modbus_t hndl, uint8_t *message, uin
 {
     messageHandlerState_t ret = waiting;
 
-    if (hndl->state != WaitingForResponse)
+    if (hndl->state != WaitingForResponse || !hndl->rx)
     {
         Log_Debug("Warning: Data received while not waiting for response. Discarding data.\n");
-        hndl->bufferedMessageLength = 0;
         return ret;
     }
+    struct _modbusRx *rx = hndl->rx;
     // writing to buffer
-    if (hndl->bufferedMessageLength + inputLength < MAX_PDU_LENGTH)
+    if (rx->length + inputLength < MAX_PDU_LENGTH)
     {
-        memcpy(&hndl->bufferedMessage[hndl->bufferedMessageLength], message, (size_t)inputLength);
-        hndl->bufferedMessageLength = (uint16_t)(hndl->bufferedMessageLength + inputLength);
+        memcpy(&rx->buffer[rx->length], message, (size_t)inputLength);
+        rx->length = (uint16_t)(rx->length + inputLength);
     }
     else
     {
         Log_Debug("Error: Message longer than %d bytes, discarding data\n", MAX_PDU_LENGTH);
-        hndl->bufferedMessageLength = 0;
+        rx->length = 0;
         return ret;
     }
+    // The M4 reports a response that failed its CRC check instead of passing it on.
+    if (hndl->type == rtu && !hndl->isCFG && rx->length >= MESSAGE_HEADER_LENGTH &&
+        rx->buffer[COMMAND_OFFSET] == MODBUS_CRC_ERROR_MESSAGE)
+    {
+        hndl->responseCorrupt = true;
+        rx->length = 0;
+        return failure;
+    }
 
     size_t minLength = 0;             // How much data do we need to find the message length?
-    size_t fCodeOffset = 0;           // Position of Function Code in the message.
-    size_t pduLengthOffset = 0;       // Position of data length (where used)
     size_t transportHeaderLength = 0; // Length of header removed when returning data
     size_t transportFooterLength = 0; // Length of footer removed when returning data
     bool checkTransaction = false;
@@ -1218,36 +1934,30 @@ static messageHandlerState_t MessageHandler(modbus_t hndl, uint8_t *message, uin
     if (hndl->type == rtu)
     {
         minLength = MESSAGE_HEADER_LENGTH + PDU_HEADER_LENGTH;
-        fCodeOffset = MESSAGE_HEADER_LENGTH + 1;
-        pduLengthOffset = fCodeOffset + 1;
         transportHeaderLength = MESSAGE_HEADER_LENGTH;
     }
-    else if (hndl->type == rtuOverTcp) {
+    else if (hndl->type == rtuOverTcp || hndl->type == rtuSerial) {
         minLength = CRC_FOOTER_LENGTH + PDU_HEADER_LENGTH;
-        fCodeOffset = 1;
-        pduLengthOffset = fCodeOffset + 1;
         transportFooterLength = CRC_FOOTER_LENGTH;
         checkCRC = true;
     }
-    else if (hndl->type == tcp)
+    else if (hndl->type == tcp || hndl->type == local)
     {
         minLength = TCP_HEADER_LENGTH + PDU_HEADER_LENGTH;
-        fCodeOffset = TCP_HEADER_LENGTH + 1;
-        pduLengthOffset = fCodeOffset + 1;
         transportHeaderLength = TCP_HEADER_LENGTH;
         checkTransaction = true;
     }
     else
     {
         Log_Debug("Error: Type not set to valid value (%d), discarding data\n", hndl->type);
-        hndl->bufferedMessageLength = 0;
+        rx->length = 0;
         return ret;
     }
 
     // reading buffer
     uint16_t pduMessageLength = 0;
     bool fullMessageAvailable = false;
-    if (hndl->bufferedMessageLength >= minLength || hndl->type == rtu)
+    if (rx->length >= minLength || hndl->type == rtu)
     {
         if (hndl->isCFG)
         {
@@ -1255,10 +1965,15 @@ static messageHandlerState_t MessageHandler(modbus_t hndl, uint8_t *message, uin
         }
         else
         {
-            pduMessageLength =
-                (uint16_t)(GetFcodeLength(hndl->bufferedMessage[fCodeOffset], hndl->bufferedMessage[pduLengthOffset]));
+            size_t available = (rx->length > transportHeaderLength) ? rx->length - transportHeaderLength : 0;
+            size_t length = FcodeResponseLength(&rx->buffer[transportHeaderLength], available);
+            if (length == 0)
+            {
+                Log_Debug("Error: Unsupported function code.\n");
+            }
+            pduMessageLength = (uint16_t)((length > MAX_PDU_LENGTH) ? MAX_PDU_LENGTH + 1 : length);
         }
-        if (hndl->bufferedMessageLength >= pduMessageLength + transportHeaderLength + transportFooterLength)
+        if (rx->length >= pduMessageLength + transportHeaderLength + transportFooterLength)
         {
             fullMessageAvailable = true;
         }
@@ -1275,8 +1990,12 @@ static messageHandlerState_t MessageHandler(modbus_t hndl, uint8_t *message, uin
         bool crcFailed = false;
 
         // First two bytes of the message in the TCP header are the ID.
-        uint16_t rxTransaction = (uint16_t)(hndl->bufferedMessage[0] << 8 | hndl->bufferedMessage[1]);
-        if (checkTransaction)
+        uint16_t rxTransaction = (uint16_t)(rx->buffer[0] << 8 | rx->buffer[1]);
+        if (checkTransaction && hndl->batch)
+        {
+            ret = StoreBatchResponse(hndl, rxTransaction, &rx->buffer[transportHeaderLength], pduMessageLength);
+        }
+        else if (checkTransaction)
         {
             //Checks to see if the received message id is less than the expected message ID.
             if(hndl->transactionId != rxTransaction) 
@@ -1291,7 +2010,7 @@ static messageHandlerState_t MessageHandler(modbus_t hndl, uint8_t *message, uin
                         //we are receiving a message from the future. panic.
                         Log_Debug("Transaction ID received has not been requested yet. Expect 0x%04x, got 0x%04x. Message discarded, search failed.\n",
                             hndl->transactionId, rxTransaction);
-                        hndl->bufferedMessageLength = 0;
+                        rx->length = 0;
                         return failure;
                     }
                     else if (rxTransaction < hndl->transactionId)
@@ -1321,35 +2040,38 @@ static messageHandlerState_t MessageHandler(modbus_t hndl, uint8_t *message, uin
                         //we are receiving a message from the future. panic
                         Log_Debug("Transaction ID received has not been requested yet. Expect 0x%04x, got 0x%04x. Message discarded, search failed.\n",
                             hndl->transactionId, rxTransaction);
-                        hndl->bufferedMessageLength = 0;
+                        rx->length = 0;
                         return failure;
                     }
                 }
             }
         }
         if (checkCRC)
-            if (!ValidateCRC(hndl->bufferedMessage, pduMessageLength + CRC_FOOTER_LENGTH)) {
+            if (!ValidateCRC(rx->buffer, pduMessageLength + CRC_FOOTER_LENGTH)) {
                 Log_Debug("CRC check failed. Message discarded.\n");
                 crcFailed = true;
+                // The slave will not send it again, so stop waiting.
+                hndl->responseCorrupt = true;
+                ret = failure;
             }
         // Pass back only the PDU portion of the message
-        if (pduMessageLength <= MAX_PDU_LENGTH && !isTransactionTooLow && !crcFailed)
+        if (pduMessageLength <= MAX_PDU_LENGTH && !isTransactionTooLow && !crcFailed && !hndl->batch)
         {
             hndl->pduLength = pduMessageLength;
             hndl->lastTransactionId = rxTransaction;
-            memcpy(hndl->pdu, &hndl->bufferedMessage[transportHeaderLength], pduMessageLength);
+            memcpy(hndl->pdu, &rx->buffer[transportHeaderLength], pduMessageLength);
             ret = success;
         }
         // Keep data not part of this message by shifting it to the beginning of the buffer
         size_t totalMessageLength = pduMessageLength + transportHeaderLength + transportFooterLength;
-        size_t remainingDataLength = (hndl->bufferedMessageLength - totalMessageLength);
+        size_t remainingDataLength = (rx->length - totalMessageLength);
 
         if (remainingDataLength > 0)
         {
-            memmove(hndl->bufferedMessage, &hndl->bufferedMessage[totalMessageLength], remainingDataLength);
+            memmove(rx->buffer, &rx->buffer[totalMessageLength], remainingDataLength);
         }
         // Update the message size to match what is valid data in the buffer
-        hndl->bufferedMessageLength = (uint16_t)remainingDataLength;
+        rx->length = (uint16_t)remainingDataLength;
     }
     return ret;
 }
@@ -1358,82 +2080,375 @@ static messageHandlerState_t MessageHandler(modbus_t hndl, uint8_t *message, uin
 
 
 
-static uint16_t GetFcodeLength(uint8_t fCode, uint8_t dataLength)
+// Records which function codes a slave with a record has answered or rejected.
+static void NoteResponse(modbus_t hndl, const uint8_t *pdu, uint16_t pduLength)
 {
-    if ((fCode > FCODE_ERROR_OFFSET) && (fCode <= FCODE_ERROR_OFFSET + FCODE_RANGE))
+    if (!hndl->slaves || !pdu || pduLength < 2)
     {
-        // Error response length is always three bytes
-        return ERROR_CODE_LENGTH;
+        return;
     }
-    switch (fCode)
+    struct _modbusSlave *slave = ModbusFindSlave(hndl, pdu[0], false);
+    if (!slave)
+    {
+        return;
+    }
+    uint8_t functionCode = pdu[1] & (uint8_t)~MODBUS_EXCEPTION_BIT;
+    if (!(pdu[1] & MODBUS_EXCEPTION_BIT))
+    {
+        slave->supported[functionCode / 8] |= (uint8_t)(1u << (functionCode % 8));
+        slave->unsupported[functionCode / 8] &= (uint8_t)~(1u << (functionCode % 8));
+    }
+    else if (pduLength >= ERROR_CODE_LENGTH && pdu[2] == ILLEGAL_FUNCTION)
+    {
+        slave->unsupported[functionCode / 8] |= (uint8_t)(1u << (functionCode % 8));
+    }
+}
+
+// Works out how long to wait for a response from a slave when adaptive timeouts are on.
+static size_t AdaptiveTimeout(modbus_t hndl, uint8_t slaveId, size_t timeout)
+{
+    struct _modbusAdaptive *adaptive = hndl->adaptive;
+    if (!adaptive)
+    {
+        return timeout;
+    }
+    size_t limit = (timeout && timeout < adaptive->maxTimeout) ? timeout : adaptive->maxTimeout;
+    const struct _modbusRtt *rtt =
+        adaptive->slaves[slaveId].rtt.srttUs ? &adaptive->slaves[slaveId].rtt : &adaptive->rtt;
+    if (!rtt->srttUs)
+    {
+        return limit;
+    }
+
+    uint64_t variationUs = 4 * (uint64_t)rtt->rttvarUs;
+    uint64_t waitUs = rtt->srttUs + ((variationUs < MIN_RTT_VARIATION_US) ? MIN_RTT_VARIATION_US : variationUs);
+    waitUs <<= adaptive->slaves[slaveId].timeoutBackoff;
+    size_t wait = (size_t)((waitUs + 999) / 1000);
+    wait = (wait < adaptive->minTimeout) ? adaptive->minTimeout : wait;
+    return (wait > limit) ? limit : wait;
+}
+
+// Folds the round trip of an answered request into an estimate, in the manner of RFC 6298.
+static void UpdateRtt(struct _modbusRtt *rtt, uint64_t elapsedUs)
+{
+    uint32_t sampleUs = (elapsedUs > UINT32_MAX) ? UINT32_MAX : (uint32_t)elapsedUs;
+    if (!rtt->srttUs)
+    {
+        rtt->srttUs = sampleUs ? sampleUs : 1;
+        rtt->rttvarUs = sampleUs / 2;
+        return;
+    }
+    uint32_t deviationUs = (sampleUs > rtt->srttUs) ? sampleUs - rtt->srttUs : rtt->srttUs - sampleUs;
+    rtt->rttvarUs = (uint32_t)(((uint64_t)rtt->rttvarUs * 3 + deviationUs) / 4);
+    rtt->srttUs = (uint32_t)(((uint64_t)rtt->srttUs * 7 + sampleUs) / 8);
+    rtt->srttUs = rtt->srttUs ? rtt->srttUs : 1;
+}
+
+static void NoteRoundTrip(modbus_t hndl, bool answered, uint64_t elapsedUs)
+{
+    struct _modbusAdaptive *adaptive = hndl->adaptive;
+    if (!answered)
+    {
+        if (adaptive->slaves[hndl->requestSlaveId].timeoutBackoff < MAX_TIMEOUT_BACKOFF)
+        {
+            adaptive->slaves[hndl->requestSlaveId].timeoutBackoff++;
+        }
+        return;
+    }
+    UpdateRtt(&adaptive->rtt, elapsedUs);
+    UpdateRtt(&adaptive->slaves[hndl->requestSlaveId].rtt, elapsedUs);
+    adaptive->slaves[hndl->requestSlaveId].timeoutBackoff = 0;
+}
+
+static void SetBreakerState(modbus_t hndl, uint8_t slaveId, modbusBreakerState_t state)
+{
+    if (hndl->breaker->slaves[slaveId].state == state)
+    {
+        return;
+    }
+    hndl->breaker->slaves[slaveId].state = (uint8_t)state;
+    Log_Debug("Slave %u circuit breaker %s\n", slaveId,
+              (state == MODBUS_BREAKER_OPEN) ? "open" : (state == MODBUS_BREAKER_HALF_OPEN) ? "half open" : "closed");
+    if (hndl->breaker->callback)
+    {
+        hndl->breaker->callback(hndl->breaker->context, hndl, slaveId, state);
+    }
+}
+
+// Checks whether a request for a slave may be sent. Once an open breaker's time has passed, the request is let
+// through as the probe.
+static bool BreakerAllows(modbus_t hndl, uint8_t slaveId)
+{
+    struct _modbusBreaker *breaker = hndl->breaker;
+    if (!breaker)
+    {
+        return true;
+    }
+    bool open = breaker->slaves[slaveId].state == MODBUS_BREAKER_OPEN;
+    breaker->refused = open && ModbusMonotonicUs() < breaker->slaves[slaveId].openUntilUs;
+    if (open && !breaker->refused)
+    {
+        SetBreakerState(hndl, slaveId, MODBUS_BREAKER_HALF_OPEN);
+    }
+    return !breaker->refused;
+}
+
+// Counts a request that was answered or timed out towards its slave's circuit breaker.
+static void NoteHealth(modbus_t hndl, uint8_t slaveId, bool answered)
+{
+    struct _modbusBreaker *breaker = hndl->breaker;
+    if (!breaker)
+    {
+        return;
+    }
+    if (answered)
+    {
+        breaker->slaves[slaveId].consecutiveTimeouts = 0;
+        breaker->slaves[slaveId].backoff = 0;
+        SetBreakerState(hndl, slaveId, MODBUS_BREAKER_CLOSED);
+        return;
+    }
+
+    if (breaker->slaves[slaveId].consecutiveTimeouts < UINT8_MAX)
+    {
+        breaker->slaves[slaveId].consecutiveTimeouts++;
+    }
+    bool probeFailed = breaker->slaves[slaveId].state == MODBUS_BREAKER_HALF_OPEN;
+    if (!probeFailed && breaker->slaves[slaveId].consecutiveTimeouts < breaker->failureThreshold)
+    {
+        return;
+    }
+    if (probeFailed && breaker->slaves[slaveId].backoff < MAX_BREAKER_BACKOFF)
+    {
+        breaker->slaves[slaveId].backoff++;
+    }
+    uint64_t openUs = ((uint64_t)breaker->openTime * 1000) << breaker->slaves[slaveId].backoff;
+    uint64_t maxOpenUs = (uint64_t)breaker->maxOpenTime * 1000;
+    breaker->slaves[slaveId].openUntilUs = ModbusMonotonicUs() + ((openUs > maxOpenUs) ? maxOpenUs : openUs);
+    SetBreakerState(hndl, slaveId, MODBUS_BREAKER_OPEN);
+}
+
+static uint8_t SendFailReason(modbus_t hndl)
+{
+    return (hndl->breaker && hndl->breaker->refused) ? SLAVE_UNAVAILABLE : MESSAGE_SEND_FAIL;
+}
+
+// Whether a request only reads, so sending it again cannot change the slave. Reading a FIFO queue takes the values
+// out of it, and function code 43 also carries requests other than Read Device Identification.
+static bool IsRead(const uint8_t *request)
+{
+    switch (request[1])
     {
     case READ_COILS:
-        return (uint16_t)(PDU_HEADER_LENGTH + dataLength);
     case READ_DISCRETE_INPUTS:
-        return (uint16_t)(PDU_HEADER_LENGTH + dataLength);
     case READ_MULTIPLE_HOLDING_REGISTERS:
-        return (uint16_t)(PDU_HEADER_LENGTH + dataLength);
     case READ_INPUT_REGISTERS:
-        return (uint16_t)(PDU_HEADER_LENGTH + dataLength);
-    case READ_FILE:
-        return (uint16_t)(PDU_HEADER_LENGTH + dataLength);
-    case WRITE_SINGLE_COIL:
-        return PDU_HEADER_LENGTH + 3;
-    case WRITE_SINGLE_HOLDING_REGISTER:
-        return PDU_HEADER_LENGTH + 3;
     case READ_EXCEPTION_STATUS:
-        return PDU_HEADER_LENGTH;
-    case WRITE_MULTIPLE_COILS:
-        return PDU_HEADER_LENGTH + 3;
-    case WRITE_MULTIPLE_HOLDING_REGISTERS:
-        return PDU_HEADER_LENGTH + 3;
-    case WRITE_FILE:
-        return (uint16_t)(PDU_HEADER_LENGTH + dataLength);
+    case READ_FILE:
+        return true;
+    case ENCAPSULATED_INTERFACE_TRANSPORT:
+        return request[2] == MEI_READ_DEVICE_ID;
+    default:
+        return false;
+    }
+}
 
+const uint8_t *ModbusPreparedPdu(const struct _modbusPrepared *prepared)
+{
+    switch (prepared->type)
+    {
+    case tcp:
+    case local:
+        return &prepared->adu[TCP_HEADER_LENGTH];
+    case rtu:
+        return &prepared->adu[MESSAGE_HEADER_LENGTH];
     default:
-        Log_Debug("Error: Unsupported function code.\n");
-        return 0;
+        return prepared->adu;
+    }
+}
+
+// Works out whether a retry policy covers the outcome of a request.
+static retryReason_t RetryReason(const modbusRetryPolicy_t *policy, const uint8_t *request, const uint8_t *response,
+                                 uint16_t responseLength, bool corrupt)
+{
+    if (responseLength >= ERROR_CODE_LENGTH && (response[1] & MODBUS_EXCEPTION_BIT))
+    {
+        if (response[2] == SLAVE_DEVICE_BUSY && policy->retryBusy)
+        {
+            return retryBusy;
+        }
+        if (response[2] == ACKNOWLEDGE && policy->retryAcknowledge)
+        {
+            return retryAcknowledge;
+        }
+        return retryNone;
+    }
+    return (!responseLength && corrupt && policy->retryCorruptReads && IsRead(request)) ? retryCorrupt : retryNone;
+}
+
+static void CountRetry(modbus_t hndl, retryReason_t reason, uint8_t slaveId, uint8_t functionCode)
+{
+    modbusRetryStats_t *stats = &hndl->retry->stats;
+    if (reason == retryBusy)
+    {
+        stats->busyRetries++;
+    }
+    else if (reason == retryAcknowledge)
+    {
+        stats->acknowledgeRetries++;
+    }
+    else
+    {
+        stats->crcRetries++;
+    }
+    if (hndl->bus)
+    {
+        BusStatsRetry(hndl->bus, slaveId, functionCode);
+    }
+}
+
+// Waits before a retry: the backoff doubled for each earlier retry, less a random part of it.
+static void RetryWait(struct _modbusRetry *retry, uint8_t attempt)
+{
+    uint64_t waitUs = (uint64_t)retry->policy.backoff * 1000;
+    for (uint8_t i = 1; i < attempt && waitUs < (uint64_t)retry->policy.maxBackoff * 1000; i++)
+    {
+        waitUs *= 2;
+    }
+    if (waitUs > (uint64_t)retry->policy.maxBackoff * 1000)
+    {
+        waitUs = (uint64_t)retry->policy.maxBackoff * 1000;
+    }
+    if (retry->policy.jitterPercent)
+    {
+        waitUs -= waitUs * (uint64_t)(rand_r(&retry->seed) % (retry->policy.jitterPercent + 1u)) / 100;
+    }
+    struct timespec t = {.tv_sec = (time_t)(waitUs / 1000000), .tv_nsec = (long)(waitUs % 1000000) * 1000};
+    while (nanosleep(&t, &t) != 0 && errno == EINTR)
+    {
     }
 }
 
 /* timeout measured in milliseconds. A value of zero means never timeout.
- * Returns true if data is received, false on timeout.
+ * Returns true if data is received, false on timeout. A request the handle's retry policy covers is sent again
+ * until it succeeds or runs out of attempts.
  */
 static bool WaitForData(modbus_t hndl, size_t timeout)
 {
-    bool retval = true;
-    size_t counter = 0;
+    struct _modbusRetry *retry = hndl->retry;
+    if (!retry || hndl->isCFG || hndl->batch || retry->deferred)
+    {
+        return WaitForResponse(hndl, timeout);
+    }
 
-    while ((hndl->state != DataReceived) && (hndl->state != TransactionFailed) 
-        && (hndl->state != Disconnected))
+    uint8_t *response = hndl->pdu;
+    uint8_t slaveId = hndl->requestSlaveId;
+    uint8_t functionCode = hndl->requestFunctionCode;
+    const uint8_t *request = retry->prepared ? ModbusPreparedPdu(retry->prepared) : retry->request;
+    for (uint8_t attempt = 1;; attempt++)
     {
+        bool received = WaitForResponse(hndl, timeout);
+        retryReason_t reason = RetryReason(&retry->policy, request, response, received ? hndl->pduLength : 0,
+                                           hndl->responseCorrupt);
+        if (reason == retryNone)
+        {
+            return received;
+        }
+        if (attempt >= retry->policy.maxAttempts)
+        {
+            retry->stats.exhausted++;
+            return received;
+        }
+        CountRetry(hndl, reason, slaveId, functionCode);
+        RetryWait(retry, attempt);
+        bool sent = retry->prepared ? SendPrepared(hndl, retry->prepared, response)
+                                    : ModBusWrite(hndl, retry->request, retry->requestLength, response);
+        if (!sent)
+        {
+            return false;
+        }
+    }
+}
+
+// Waits for the response to a request that has been sent once. Timeout as for WaitForData.
+static bool WaitForResponse(modbus_t hndl, size_t timeout)
+{
+    // A single request is timed against what its slave needs; a batch waits for the slowest of several.
+    bool timed = !hndl->isCFG && !hndl->batch;
+
+    if (timed)
+    {
+        timeout = AdaptiveTimeout(hndl, hndl->requestSlaveId, timeout);
+    }
+    uint64_t deadlineUs = ModbusMonotonicUs() + (uint64_t)timeout * 1000;
+    uint64_t spinUntilUs = (hndl->type == local) ? ModbusMonotonicUs() + LOCAL_SPIN_US : 0;
+
+    while (!ModbusRequestDone(hndl))
+    {
+        if (spinUntilUs && ModbusMonotonicUs() < spinUntilUs)
+        {
+            sched_yield();
+            continue;
+        }
         struct timespec t = {.tv_sec = 0, .tv_nsec = 100000};
 
         nanosleep(&t, NULL);
 
-        if (timeout > 0 && counter++ > timeout)
+        if (timeout > 0 && ModbusMonotonicUs() >= deadlineUs)
         {
             break;
         }
     }
+    return CompleteRequest(hndl, timed, false);
+}
 
-    if (hndl->state != DataReceived)
+// Accounts for a request that has been answered, has timed out or is being abandoned, and returns the handle to
+// Idle. An abandoned request is not charged to its slave. Returns true if a response was received.
+static bool CompleteRequest(modbus_t hndl, bool timed, bool cancelled)
+{
+    bool retval = hndl->state == DataReceived;
+    timed = timed && !cancelled;
+    uint64_t elapsedUs = ModbusMonotonicUs() - hndl->requestSentUs;
+    // Serial configuration messages stop at the M4 and never reach the bus.
+    if (hndl->bus && !hndl->isCFG && hndl->state != Disconnected)
     {
-        retval = false;
+        BusStatsRecord(hndl->bus, hndl->requestSlaveId, hndl->requestFunctionCode, hndl->requestLength,
+                       hndl->pduLength, elapsedUs, retval);
     }
-    // The request is finished or timed out, so set state back to Idle
+    if (timed && hndl->adaptive && hndl->state != Disconnected)
+    {
+        NoteRoundTrip(hndl, retval, elapsedUs);
+    }
+    // A response that failed its checks still shows the slave is there.
+    if (timed && hndl->state != Disconnected)
+    {
+        NoteHealth(hndl, hndl->requestSlaveId, hndl->state == DataReceived || hndl->state == TransactionFailed);
+    }
+    if (retval && timed)
+    {
+        NoteResponse(hndl, hndl->pdu, hndl->pduLength);
+    }
+    // The request is finished or timed out, so give up the receive buffer and set state back to Idle
+    pthread_mutex_lock(&rxLock);
+    ReleaseRx(hndl);
+    hndl->batch = NULL;
     hndl->state = Idle;
+    pthread_mutex_unlock(&rxLock);
 
     return retval;
 }
 
-static uint16_t PduDataLength(modbus_t hndl, uint16_t expected)
+// Checks the response to a request against the function code table and unpacks its data into out. Returns 0, the
+// exception code of an exception response, or INVALID_RESPONSE.
+static uint8_t DecodeResponse(modbus_t hndl, const uint8_t *request, uint16_t requestLength, void *out,
+                              uint16_t *count)
 {
-    if (hndl->pduLength != expected + PDU_HEADER_LENGTH)
+    uint8_t error = FcodeDecodeResponse(request, requestLength, hndl->pdu, hndl->pduLength, out, count);
+    if (error == INVALID_RESPONSE)
     {
-        Log_Debug("Warning: Got %d bytes in pdu when expecting %d\n", hndl->pduLength, expected + PDU_HEADER_LENGTH);
+        Log_Debug("Error: Invalid response to function code %u\n", request[1]);
     }
-    return (uint16_t)(hndl->pduLength - PDU_HEADER_LENGTH);
+    return error;
 }
 
 static MODBUS_STATE NotReadyReason(modbus_t hndl)
@@ -1443,3 +2458,517 @@ static MODBUS_STATE NotReadyReason(modbus_t hndl)
     }
     return HANDLE_IN_USE;
 }
+
+// Takes a cleared handle from the application's storage if it was provided, otherwise from the heap.
+static modbus_t AllocHandle(void)
+{
+    modbus_t hndl;
+    pthread_mutex_lock(&handleLock);
+    if (handleStorage)
+    {
+        hndl = freeHandles;
+        if (hndl)
+        {
+            freeHandles = hndl->nextFree;
+        }
+    }
+    else
+    {
+        hndl = aligned_alloc(MODBUS_CACHE_LINE, sizeof(struct _modbus_t));
+    }
+    pthread_mutex_unlock(&handleLock);
+
+    if (!hndl)
+    {
+        Log_Debug("Error: No Modbus handles available\n");
+        return NULL;
+    }
+    memset(hndl, 0, sizeof(struct _modbus_t));
+    return hndl;
+}
+
+static void FreeHandle(modbus_t hndl)
+{
+    pthread_mutex_lock(&handleLock);
+    if (handleStorage && (modbusHandleStorage_t *)hndl >= handleStorage &&
+        (modbusHandleStorage_t *)hndl < handleStorage + handleStorageCount)
+    {
+        hndl->nextFree = freeHandles;
+        freeHandles = hndl;
+    }
+    else
+    {
+        free(hndl);
+    }
+    pthread_mutex_unlock(&handleLock);
+}
+
+// Gives a handle a receive buffer for the transaction it is about to start.
+static bool AcquireRx(modbus_t hndl)
+{
+    pthread_mutex_lock(&rxLock);
+    struct _modbusRx *rx = freeRx;
+    if (rx)
+    {
+        freeRx = rx->nextFree;
+    }
+    else if (!rxStorage)
+    {
+        rx = malloc(sizeof(struct _modbusRx));
+#ifdef BUFFER_CHECK_ON
+        if (rx)
+        {
+            SetBufferZones(rx);
+        }
+#endif
+    }
+    if (rx)
+    {
+        rx->length = 0;
+        hndl->rx = rx;
+    }
+    pthread_mutex_unlock(&rxLock);
+
+    if (!rx)
+    {
+        Log_Debug("Error: No Modbus receive buffers available\n");
+        return false;
+    }
+    return true;
+}
+
+// Returns a handle's receive buffer to the pool. Any data left in it is discarded. Must be called with rxLock held.
+static void ReleaseRx(modbus_t hndl)
+{
+    if (hndl->rx)
+    {
+        hndl->rx->nextFree = freeRx;
+        freeRx = hndl->rx;
+        hndl->rx = NULL;
+    }
+}
+
+static uint16_t FrameTcp(uint8_t *adu, uint16_t transactionId, const uint8_t *pdu, uint16_t pduLength)
+{
+    adu[0] = (uint8_t)((transactionId >> 8) & 0xFF);
+    adu[1] = (uint8_t)(transactionId & 0xFF);
+    adu[2] = 0x00;
+    adu[3] = 0x00;
+    adu[4] = (uint8_t)((pduLength >> 8) & 0xFF);
+    adu[5] = (uint8_t)(pduLength & 0xFF);
+    memcpy(&adu[TCP_HEADER_LENGTH], pdu, pduLength);
+    return (uint16_t)(pduLength + TCP_HEADER_LENGTH);
+}
+
+// Matches a response to a request in the handle's batch. Must be called with rxLock held.
+static messageHandlerState_t StoreBatchResponse(modbus_t hndl, uint16_t rxTransaction, const uint8_t *pdu,
+                                                uint16_t pduLength)
+{
+    struct _modbusBatch *batch = hndl->batch;
+    uint16_t index = (uint16_t)(rxTransaction - batch->firstTransactionId);
+    if (index >= batch->count || batch->requests[index].responseLength)
+    {
+        Log_Debug("Transaction ID 0x%04x is not part of this batch. Message discarded.\n", rxTransaction);
+        return waiting;
+    }
+    modbusPending_t *request = &batch->requests[index];
+    memcpy(request->response, pdu, pduLength);
+    request->responseLength = pduLength;
+    request->error = 0;
+    hndl->lastTransactionId = rxTransaction;
+    return (--batch->outstanding == 0) ? success : waiting;
+}
+
+// Sends a group of Modbus TCP requests with consecutive transaction IDs. The handle is waiting for responses before
+// the first request is sent, so none can be missed. Returns false if nothing could be sent.
+static bool SendBatch(modbus_t hndl, struct _modbusBatch *batch, modbusPending_t *requests, size_t count)
+{
+    hndl->state = SendingRequest;
+    hndl->pduLength = 0;
+    hndl->pdu = NULL;
+    if (!AcquireRx(hndl))
+    {
+        hndl->state = Idle;
+        return false;
+    }
+
+    batch->firstTransactionId = __atomic_fetch_add(&transactionIdentifier, (uint16_t)count, __ATOMIC_RELAXED);
+    batch->count = (uint16_t)count;
+    batch->outstanding = (uint16_t)count;
+    batch->requests = requests;
+    for (size_t i = 0; i < count; i++)
+    {
+        requests[i].responseLength = 0;
+        requests[i].error = MODBUS_TIMEOUT;
+    }
+
+    pthread_mutex_lock(&rxLock);
+    hndl->batch = batch;
+    hndl->state = WaitingForResponse;
+    pthread_mutex_unlock(&rxLock);
+
+    // The frames go out in one write so the stack does not hold any of them back waiting for acknowledgements.
+    uint8_t adus[MODBUS_MAX_IN_FLIGHT * (MAX_PDU_LENGTH + TCP_HEADER_LENGTH)];
+    size_t aduEnd[MODBUS_MAX_IN_FLIGHT];
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        total += FrameTcp(&adus[total], (uint16_t)(batch->firstTransactionId + i), requests[i].request,
+                          requests[i].requestLength);
+        aduEnd[i] = total;
+    }
+    hndl->requestSentUs = ModbusMonotonicUs();
+    ssize_t sent;
+    if (hndl->type == local)
+    {
+        struct iovec iov = {.iov_base = adus, .iov_len = total};
+        sent = LocalSend(&hndl->connectData.LOCAL, &iov, 1) ? (ssize_t)total : -1;
+    }
+    else
+    {
+        sent = send(hndl->fd, adus, total, 0);
+    }
+
+    // Requests that did not go out in full will not be answered, so stop waiting for them.
+    size_t sentCount = 0;
+    while (sent > 0 && sentCount < count && aduEnd[sentCount] <= (size_t)sent)
+    {
+        sentCount++;
+    }
+    if (sentCount < count)
+    {
+        pthread_mutex_lock(&rxLock);
+        for (size_t i = sentCount; i < count; i++)
+        {
+            requests[i].error = MESSAGE_SEND_FAIL;
+        }
+        batch->count = (uint16_t)sentCount;
+        batch->outstanding = (uint16_t)(batch->outstanding - (count - sentCount));
+        if (sentCount == 0)
+        {
+            ReleaseRx(hndl);
+            hndl->batch = NULL;
+            hndl->state = Idle;
+        }
+        pthread_mutex_unlock(&rxLock);
+    }
+    if (sentCount > 0)
+    {
+        hndl->transactionId = (uint16_t)(batch->firstTransactionId + sentCount - 1);
+    }
+    return sentCount > 0;
+}
+
+bool ModbusRunRequests(modbus_t hndl, modbusPending_t *requests, size_t count, size_t timeout)
+{
+    struct _modbusRetry *retry = hndl->retry;
+    size_t window = ((hndl->type == tcp || hndl->type == local) && hndl->maxInFlight > 1) ? hndl->maxInFlight : 1;
+
+    // Requests sent together, or when other slaves are to have the bus first, are retried in rounds once every
+    // request has been sent. Otherwise WaitForData retries each request before the next is sent.
+    if (!retry || (!retry->policy.yieldBus && window == 1))
+    {
+        return RunGroups(hndl, requests, count, timeout);
+    }
+
+    retry->deferred = true;
+    RunGroups(hndl, requests, count, timeout);
+    for (uint8_t attempt = 1;; attempt++)
+    {
+        modbusPending_t group[MODBUS_MAX_IN_FLIGHT];
+        size_t origin[MODBUS_MAX_IN_FLIGHT];
+        size_t groupSize = 0;
+        bool retrying = false;
+
+        for (size_t i = 0; i < count; i++)
+        {
+            modbusPending_t *request = &requests[i];
+            retryReason_t reason = RetryReason(&retry->policy, request->request, request->response,
+                                               request->responseLength, request->corrupt);
+            if (reason == retryNone)
+            {
+                continue;
+            }
+            if (attempt >= retry->policy.maxAttempts)
+            {
+                retry->stats.exhausted++;
+                continue;
+            }
+            if (!retrying)
+            {
+                RetryWait(retry, attempt);
+                retrying = true;
+            }
+            CountRetry(hndl, reason, request->request[0], request->request[1]);
+            origin[groupSize] = i;
+            group[groupSize++] = *request;
+            if (groupSize == MODBUS_MAX_IN_FLIGHT)
+            {
+                RunGroups(hndl, group, groupSize, timeout);
+                for (size_t j = 0; j < groupSize; j++)
+                {
+                    requests[origin[j]] = group[j];
+                }
+                groupSize = 0;
+            }
+        }
+        if (groupSize > 0)
+        {
+            RunGroups(hndl, group, groupSize, timeout);
+            for (size_t j = 0; j < groupSize; j++)
+            {
+                requests[origin[j]] = group[j];
+            }
+        }
+        if (!retrying)
+        {
+            break;
+        }
+    }
+    retry->deferred = false;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!requests[i].responseLength)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Sends requests in groups of up to maxInFlight, each request once.
+static bool RunGroups(modbus_t hndl, modbusPending_t *requests, size_t count, size_t timeout)
+{
+    bool allAnswered = true;
+    size_t window = ((hndl->type == tcp || hndl->type == local) && hndl->maxInFlight > 1) ? hndl->maxInFlight : 1;
+    size_t next = 0;
+
+    while (next < count)
+    {
+        // Requests for slaves whose circuit breaker is open fail at once and take no place in the group. A half
+        // open breaker lets one probe into the group and refuses the slave's other requests until it completes.
+        modbusPending_t group[MODBUS_MAX_IN_FLIGHT];
+        size_t origin[MODBUS_MAX_IN_FLIGHT];
+        uint8_t probing[MODBUS_MAX_IN_FLIGHT];
+        size_t groupSize = 0;
+        size_t probes = 0;
+        for (; next < count && groupSize < window; next++)
+        {
+            uint8_t slaveId = requests[next].request[0];
+            if (memchr(probing, slaveId, probes) || !BreakerAllows(hndl, slaveId))
+            {
+                requests[next].responseLength = 0;
+                requests[next].error = SLAVE_UNAVAILABLE;
+                allAnswered = false;
+                continue;
+            }
+            if (ModbusGetBreakerState(hndl, slaveId) == MODBUS_BREAKER_HALF_OPEN)
+            {
+                probing[probes++] = slaveId;
+            }
+            requests[next].corrupt = false;
+            origin[groupSize] = next;
+            group[groupSize++] = requests[next];
+        }
+        if (groupSize == 0)
+        {
+            break;
+        }
+
+        if (hndl->state != Idle)
+        {
+            for (size_t i = 0; i < groupSize; i++)
+            {
+                group[i].responseLength = 0;
+                group[i].error = NotReadyReason(hndl);
+            }
+            allAnswered = false;
+        }
+        else if (groupSize == 1)
+        {
+            hndl->isCFG = false;
+            group->responseLength = 0;
+            if (!ModBusWrite(hndl, group->request, group->requestLength, group->response))
+            {
+                group->error = SendFailReason(hndl);
+                allAnswered = false;
+            }
+            else if (!WaitForData(hndl, timeout))
+            {
+                group->error = MODBUS_TIMEOUT;
+                group->corrupt = hndl->responseCorrupt;
+                allAnswered = false;
+            }
+            else
+            {
+                group->responseLength = hndl->pduLength;
+                group->error = 0;
+            }
+        }
+        else
+        {
+            struct _modbusBatch batch;
+            hndl->isCFG = false;
+            if (!SendBatch(hndl, &batch, group, groupSize))
+            {
+                for (size_t i = 0; i < groupSize; i++)
+                {
+                    group[i].error = MESSAGE_SEND_FAIL;
+                }
+                allAnswered = false;
+            }
+            else if (!WaitForData(hndl, timeout))
+            {
+                allAnswered = false;
+            }
+            for (size_t i = 0; i < groupSize; i++)
+            {
+                NoteResponse(hndl, group[i].response, group[i].responseLength);
+                if (group[i].error != MESSAGE_SEND_FAIL && hndl->state != Disconnected)
+                {
+                    NoteHealth(hndl, group[i].request[0], group[i].responseLength > 0);
+                }
+            }
+        }
+        for (size_t i = 0; i < groupSize; i++)
+        {
+            requests[origin[i]] = group[i];
+        }
+    }
+    return allAnswered;
+}
+
+uint16_t ModbusMaxReadQuantity(modbus_t hndl, uint8_t slaveID, modbusTable_t table)
+{
+    // A response, with its transport framing, has to fit in the receive buffer with a byte to spare.
+    size_t framing = 0;
+    if (hndl->type == rtu)
+    {
+        framing = MESSAGE_HEADER_LENGTH;
+    }
+    else if (hndl->type == tcp || hndl->type == local)
+    {
+        framing = TCP_HEADER_LENGTH;
+    }
+    else
+    {
+        framing = CRC_FOOTER_LENGTH;
+    }
+    size_t dataBytes = MAX_PDU_LENGTH - 1 - framing - PDU_HEADER_LENGTH;
+    uint16_t quantity = 0;
+
+    if (table == MODBUS_TABLE_HOLDING_REGISTERS || table == MODBUS_TABLE_INPUT_REGISTERS)
+    {
+        quantity = (uint16_t)((dataBytes / 2 < MAX_READ_REGISTERS) ? dataBytes / 2 : MAX_READ_REGISTERS);
+    }
+    else
+    {
+        quantity = (uint16_t)((dataBytes * 8 < MAX_READ_BITS) ? dataBytes * 8 : MAX_READ_BITS);
+    }
+
+    const struct _modbusSlave *slave = hndl->slaves ? ModbusFindSlave(hndl, slaveID, false) : NULL;
+    if (slave && slave->maxRead[table] && slave->maxRead[table] < quantity)
+    {
+        quantity = slave->maxRead[table];
+    }
+    return quantity;
+}
+
+bool ModbusStartRequest(modbus_t hndl, uint8_t *request, uint16_t requestLength, uint8_t *response, uint8_t *error)
+{
+    if (hndl->state != Idle)
+    {
+        Log_Debug("Call to %s while Handle not Idle\n", __FUNCTION__);
+        *error = NotReadyReason(hndl);
+        return false;
+    }
+
+    hndl->isCFG = false;
+    if (!ModBusWrite(hndl, request, requestLength, response))
+    {
+        *error = SendFailReason(hndl);
+        return false;
+    }
+    return true;
+}
+
+bool ModbusRequestDone(modbus_t hndl)
+{
+    MODBUS_STATE state = __atomic_load_n(&hndl->state, __ATOMIC_ACQUIRE);
+    return state == DataReceived || state == TransactionFailed || state == Disconnected;
+}
+
+uint16_t ModbusFinishRequest(modbus_t hndl, bool cancel, uint8_t *error)
+{
+    if (!CompleteRequest(hndl, true, cancel))
+    {
+        *error = MODBUS_TIMEOUT;
+        return 0;
+    }
+    return hndl->pduLength;
+}
+
+// Begins a transaction and sends a prepared request.
+static bool SendPrepared(modbus_t hndl, const struct _modbusPrepared *prepared, uint8_t *response)
+{
+    if (!BeginRequest(hndl, prepared->slaveId, prepared->functionCode, prepared->pduLength, response))
+    {
+        return false;
+    }
+    if (hndl->retry)
+    {
+        hndl->retry->prepared = prepared;
+    }
+
+    if (hndl->type == tcp)
+    {
+        // The frame is shared, so the transaction ID is sent from here in place of its first two bytes.
+        uint8_t transactionId[2];
+        SET_MODBUS_U16(transactionId, AwaitResponse(hndl));
+        struct iovec iov[2] = {{.iov_base = transactionId, .iov_len = sizeof(transactionId)},
+                               {.iov_base = (void *)&prepared->adu[2], .iov_len = prepared->aduLength - 2u}};
+        struct msghdr message = {.msg_iov = iov, .msg_iovlen = 2};
+        return RequestSent(hndl, sendmsg(hndl->fd, &message, 0) == prepared->aduLength);
+    }
+    if (hndl->type == local)
+    {
+        uint8_t transactionId[2];
+        SET_MODBUS_U16(transactionId, AwaitResponse(hndl));
+        struct iovec iov[2] = {{.iov_base = transactionId, .iov_len = sizeof(transactionId)},
+                               {.iov_base = (void *)&prepared->adu[2], .iov_len = prepared->aduLength - 2u}};
+        return RequestSent(hndl, LocalSend(&hndl->connectData.LOCAL, iov, 2));
+    }
+    AwaitResponse(hndl);
+    return SendToSlave(hndl, prepared->adu, prepared->aduLength);
+}
+
+uint16_t ModbusRunPrepared(modbus_t hndl, const struct _modbusPrepared *prepared, uint8_t *response, size_t timeout,
+                           uint8_t *error)
+{
+    if (hndl->state != Idle)
+    {
+        Log_Debug("Call to %s while Handle not Idle\n", __FUNCTION__);
+        *error = NotReadyReason(hndl);
+        return 0;
+    }
+    if (hndl->type != prepared->type)
+    {
+        Log_Debug("Error: Request was prepared for a different transport\n");
+        *error = MESSAGE_SEND_FAIL;
+        return 0;
+    }
+
+    hndl->isCFG = false;
+    if (!SendPrepared(hndl, prepared, response))
+    {
+        *error = SendFailReason(hndl);
+        return 0;
+    }
+    if (!WaitForData(hndl, timeout))
+    {
+        *error = MODBUS_TIMEOUT;
+        return 0;
+    }
+    return hndl->pduLength;
+}
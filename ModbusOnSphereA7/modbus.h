@@ -9,12 +9,99 @@
 
 #pragma once
 
+#include "../fcode-registry.h"
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
 typedef struct _modbus_t* modbus_t;
 
+// Storage for one handle or one receive buffer when they are provided by the application. The sizes are checked
+// against the library's structures when the library is built.
+#define MODBUS_HANDLE_STORAGE_SIZE 192
+#define MODBUS_RECEIVE_BUFFER_STORAGE_SIZE 288
+
+typedef union _modbusHandleStorage
+{
+    _Alignas(64) uint8_t bytes[MODBUS_HANDLE_STORAGE_SIZE];
+    uint64_t alignment;
+    void* pointerAlignment;
+} modbusHandleStorage_t;
+
+typedef union _modbusReceiveBufferStorage
+{
+    uint8_t bytes[MODBUS_RECEIVE_BUFFER_STORAGE_SIZE];
+    uint64_t alignment;
+    void* pointerAlignment;
+} modbusReceiveBufferStorage_t;
+
+// The four Modbus data tables
+typedef enum
+{
+    MODBUS_TABLE_COILS,
+    MODBUS_TABLE_DISCRETE_INPUTS,
+    MODBUS_TABLE_HOLDING_REGISTERS,
+    MODBUS_TABLE_INPUT_REGISTERS
+} modbusTable_t;
+
+// States of a slave's circuit breaker, see ModbusSetCircuitBreaker
+typedef enum
+{
+    MODBUS_BREAKER_CLOSED,   // Requests are sent as normal
+    MODBUS_BREAKER_OPEN,     // Requests fail at once with SLAVE_UNAVAILABLE
+    MODBUS_BREAKER_HALF_OPEN // One request is being sent to find out whether the slave has come back
+} modbusBreakerState_t;
+
+// Called from the thread using the handle when a slave's circuit breaker changes state
+typedef void (*modbusBreakerCallback_t)( void* context, modbus_t hndl, uint8_t slaveID, modbusBreakerState_t state );
+
+// Which failed requests a handle sends again, and how long it waits first, see ModbusSetRetryPolicy
+typedef struct _modbusRetryPolicy
+{
+    uint8_t maxAttempts;    // Times a request is sent in all, including the first
+    uint32_t backoff;       // Milliseconds to wait before the first retry, doubled before each further retry
+    uint32_t maxBackoff;    // Longest wait in milliseconds
+    uint8_t jitterPercent;  // Up to this percentage of each wait is taken off at random, so that retries from
+                            // several handles spread out
+    bool retryBusy;         // Retry requests answered with SLAVE_DEVICE_BUSY
+    bool retryAcknowledge;  // Retry requests answered with ACKNOWLEDGE, sent by a slave that has started a long
+                            // operation; the request is sent again once the wait has passed
+    bool retryCorruptReads; // Retry reads whose response failed its CRC check. Writes are never retried for this,
+                            // as the slave may have carried them out, and neither are FIFO queue reads, which
+                            // take the values out of the queue.
+    bool yieldBus;          // When a function sends several requests, send the others before retrying any
+} modbusRetryPolicy_t;
+
+// How often a handle has retried requests, see ModbusGetRetryStats
+typedef struct _modbusRetryStats
+{
+    uint32_t busyRetries;        // Retries after SLAVE_DEVICE_BUSY
+    uint32_t acknowledgeRetries; // Retries after ACKNOWLEDGE
+    uint32_t crcRetries;         // Retries after a response failed its CRC check
+    uint32_t exhausted;          // Requests that still failed in one of these ways after the last attempt
+} modbusRetryStats_t;
+
+// Largest number of requests a Modbus TCP handle will have outstanding at once
+#define MODBUS_MAX_IN_FLIGHT 8
+// Number of requests a Modbus TCP handle has outstanding at once unless changed with ModbusSetMaxInFlight
+#define MODBUS_DEFAULT_IN_FLIGHT 4
+
+typedef struct _modbusInitOptions
+{
+    modbusHandleStorage_t* handles; // Storage for handles, e.g. a static array. NULL to allocate handles from the heap
+    size_t handleCount;             // Number of elements in handles
+    modbusReceiveBufferStorage_t* receiveBuffers; // Storage for receive buffers, one for each transaction that can
+                                                  // be in flight at once. NULL to allocate them from the heap as needed
+    size_t receiveBufferCount;      // Number of elements in receiveBuffers, or with prefault and no receiveBuffers
+                                    // the number to allocate from the heap at start up
+    int ioThreadPolicy;             // Scheduling policy of the Modbus I/O thread: SCHED_FIFO or SCHED_RR, or 0 to
+                                    // inherit the caller's. Real-time policies need CAP_SYS_NICE or RLIMIT_RTPRIO
+    int ioThreadPriority;           // Priority of the I/O thread for SCHED_FIFO or SCHED_RR, from 1 to 99
+    uint64_t ioThreadCpus;          // Bit per CPU the I/O thread may run on, bit 0 for CPU 0. 0 for any CPU
+    bool prefault;                  // Allocate and touch the receive buffers and the I/O thread's stack at start up,
+                                    // so that after mlockall the I/O path takes no page faults
+} modbusInitOptions;
+
 typedef struct _serialSetup
 {
     uint16_t baudRate;
@@ -32,6 +119,18 @@ typedef struct _serialSetup
 /// <returns>true on success, or false on failure</returns>
 bool ModbusInit( void );
 
+/// <summary>
+/// Initialises the Epoll thread and sets up the relevant variables using the options provided. When options->handles
+/// is set, connections take their handles from it and no memory is allocated when connecting or closing. Receive
+/// buffers are only needed while a transaction is in flight; when options->receiveBuffers is also set, no memory is
+/// allocated during transactions either, and a request fails to send if all the buffers are in use. The Epoll
+/// thread is created with the scheduling policy, priority and CPUs given in the options.
+/// </summary>
+/// <param name="options">The options, or NULL for the same behaviour as ModbusInit</param>
+/// <returns>true on success, or false on failure, including when the thread could not be given the scheduling
+/// asked for</returns>
+bool ModbusInitEx( const modbusInitOptions* options );
+
 /// <summary>
 /// Closes the Epoll thread and cleans up relevant variables.
 /// </summary>
@@ -71,13 +170,130 @@ modbus_t ModbusConnectRtuOverTcp( const char* ip, uint16_t port );
 /// <returns>Modbus handle on success, or null on failure</returns>
 modbus_t ModbusConnectRtu( serialSetup setup, size_t timeout );
 
+/// <summary>
+/// Opens a serial port directly for Modbus RTU, for Linux gateways that have no M4. The port is set to the baud rate,
+/// parity, stop bits and word length in setup, with the kernel's low latency mode where the driver has one. In half
+/// duplex mode the driver switches the RS-485 transceiver's direction (TIOCSRS485), so the driver must support it.
+/// Responses are read as they arrive and delimited by their length, and a CRC is added to and checked on every frame.
+/// Handles on the same device share its bus statistics.
+/// </summary>
+/// <param name="device">The path of the serial port, such as /dev/ttyS1 or /dev/ttyUSB0</param>
+/// <param name="setup">The line settings; baudRate is one of the BAUD_SET_ values other than BAUD_SET_14400</param>
+/// <returns>Modbus handle on success, or null on failure</returns>
+modbus_t ModbusConnectRtuSerial( const char* device, serialSetup setup );
 
 /// <summary>
-/// Closes the connetion created by ModbusConnectIp/ModbusConnectRtu and frees the memory taken up by the handle.
+/// Connects to a local server in another process on the same machine, created with ModbusCreateLocalServer. Frames
+/// are Modbus TCP frames, passed through shared memory instead of the TCP stack, so the handle works as a Modbus TCP
+/// handle does, including requests in flight together.
+/// </summary>
+/// <param name="path">The path of the server's Unix domain socket</param>
+/// <param name="timeout">Time in milliseconds to wait for the server to accept the connection, and later for the
+/// server to make room for a request when it has fallen behind; 0 waits for as long as the server is there</param>
+/// <returns>Modbus handle on success, or null on failure</returns>
+modbus_t ModbusConnectLocal( const char* path, size_t timeout );
+
+
+/// <summary>
+/// Closes the connetion created by ModbusConnectIp/ModbusConnectRtu and frees the memory taken up by the handle,
+/// or returns it to the storage passed to ModbusInitEx.
 /// </summary>
 /// <param name="hndl">The modbus handle to be freed</param>
 void ModbusClose( modbus_t hndl );
 
+/// <summary>
+/// Sets how many requests may be outstanding at once when a function sends several requests, such as
+/// ModbusScanRegisters. Only Modbus TCP matches responses to requests, so other handles always send one at a time.
+/// Use 1 for devices that cannot queue requests.
+/// </summary>
+/// <param name="hndl">The modbus handle</param>
+/// <param name="maxInFlight">Number of requests, from 1 to MODBUS_MAX_IN_FLIGHT</param>
+void ModbusSetMaxInFlight( modbus_t hndl, uint8_t maxInFlight );
+
+/// <summary>
+/// Limits how many registers or bits are read from a table of a slave in one request, for devices that reject
+/// requests the protocol allows. Functions that split a range into several requests, such as ModbusScanRegisters
+/// and ModbusTransact, use the limit. Limits for coils and discrete inputs are rounded down to a multiple of eight.
+/// Must be called from the thread using the handle.
+/// </summary>
+/// <param name="hndl">The modbus handle</param>
+/// <param name="slaveID">The slave</param>
+/// <param name="table">The table</param>
+/// <param name="maxRead">The largest quantity to read at once, or 0 to remove the limit</param>
+/// <returns>true on success, false if the table or limit is not valid or memory could not be allocated</returns>
+bool ModbusSetReadLimit( modbus_t hndl, uint8_t slaveID, modbusTable_t table, uint16_t maxRead );
+
+/// <summary>
+/// Turns on adaptive timeouts, so each request waits about as long as its slave has been seen to need rather than
+/// the timeout passed to the call. As for TCP's retransmission timeout, the wait is the smoothed round trip time of
+/// the slave's responses plus four times their mean deviation, doubled after each timeout until the slave answers
+/// again. A slave that has not answered yet is given the estimate for the handle's other slaves, or the full timeout
+/// if none has answered. The wait is kept between the bounds and never exceeds a non-zero timeout passed to the call.
+/// Batches of Modbus TCP requests sent together keep the timeout passed to the call.
+/// Must be called from the thread using the handle.
+/// </summary>
+/// <param name="hndl">The modbus handle</param>
+/// <param name="minTimeout">The shortest wait in milliseconds</param>
+/// <param name="maxTimeout">The longest wait in milliseconds, or 0 to turn adaptive timeouts off</param>
+/// <returns>true on success, false if the bounds are not valid or memory could not be allocated</returns>
+bool ModbusSetAdaptiveTimeout( modbus_t hndl, size_t minTimeout, size_t maxTimeout );
+
+/// <summary>
+/// Gets how long a request to a slave would wait for its response.
+/// </summary>
+/// <param name="hndl">The modbus handle</param>
+/// <param name="slaveID">The slave</param>
+/// <param name="timeout">The timeout that would be passed to the call</param>
+/// <returns>The wait in milliseconds, which is timeout if adaptive timeouts are off</returns>
+size_t ModbusGetAdaptiveTimeout( modbus_t hndl, uint8_t slaveID, size_t timeout );
+
+/// <summary>
+/// Turns on a circuit breaker for each slave on a handle, so a slave that has stopped answering does not cost a
+/// timeout on every request and hold a shared bus for it. After failureThreshold timeouts in a row the slave's
+/// breaker opens, and its requests fail at once with SLAVE_UNAVAILABLE. Once openTime has passed, the next request
+/// for the slave is sent as a probe: an answer, even an exception, closes the breaker; another timeout opens it
+/// again for twice as long, up to maxOpenTime. Other requests for the slave sent with the probe in one group fail
+/// with SLAVE_UNAVAILABLE. Must be called from the thread using the handle.
+/// </summary>
+/// <param name="hndl">The modbus handle</param>
+/// <param name="failureThreshold">Timeouts in a row that open a breaker, or 0 to turn the breakers off</param>
+/// <param name="openTime">Time in milliseconds a breaker first stays open</param>
+/// <param name="maxOpenTime">The longest time in milliseconds a breaker stays open</param>
+/// <param name="callback">If not NULL, called when a breaker changes state</param>
+/// <param name="context">Passed to the callback</param>
+/// <returns>true on success, false if the times are not valid or memory could not be allocated</returns>
+bool ModbusSetCircuitBreaker( modbus_t hndl, uint8_t failureThreshold, size_t openTime, size_t maxOpenTime,
+                              modbusBreakerCallback_t callback, void* context );
+
+/// <summary>
+/// Gets the state of a slave's circuit breaker.
+/// </summary>
+/// <param name="hndl">The modbus handle</param>
+/// <param name="slaveID">The slave</param>
+/// <returns>The state, which is MODBUS_BREAKER_CLOSED if breakers are off</returns>
+modbusBreakerState_t ModbusGetBreakerState( modbus_t hndl, uint8_t slaveID );
+
+/// <summary>
+/// Sets how a handle retries requests that a slave was too busy to carry out, or whose response was corrupted on
+/// the line, so each caller does not have to. Every function that sends requests through the handle retries them.
+/// The error returned after the last attempt is the one the last attempt received.
+/// Must be called from the thread using the handle.
+/// </summary>
+/// <param name="hndl">The modbus handle</param>
+/// <param name="policy">The policy, or NULL to stop retrying</param>
+/// <returns>true on success, false if the policy is not valid or memory could not be allocated</returns>
+bool ModbusSetRetryPolicy( modbus_t hndl, const modbusRetryPolicy_t* policy );
+
+/// <summary>
+/// Gets how often a handle has retried requests since its retry policy was set or the counts were last cleared.
+/// On an RTU handle, the retries are also counted in the bus statistics.
+/// </summary>
+/// <param name="hndl">The modbus handle</param>
+/// <param name="stats">Receives the counts</param>
+/// <param name="reset">Whether to clear the counts</param>
+/// <returns>true on success, false if the handle has no retry policy</returns>
+bool ModbusGetRetryStats( modbus_t hndl, modbusRetryStats_t* stats, bool reset );
+
 
 /*--------------------------READ FUNCTIONS----------------------------------*/
 
@@ -133,6 +349,33 @@ bool ReadMultipleHoldingRegisters( modbus_t hndl, uint8_t slaveID, uint16_t addr
 /// <returns>true on success, or false on failure</returns>
 bool ReadInputRegisters( modbus_t hndl, uint8_t slaveID, uint16_t address, uint16_t registersToRead, uint16_t *readArray, size_t timeout );
 
+/// <summary>
+/// Sends a request to read the contents of a FIFO queue of registers.
+/// </summary>
+/// <param name="hndl">The message handle</param>
+/// <param name="slaveID">Address of the slave device</param>
+/// <param name="fifoAddress">Address of the FIFO pointer register on the device</param>
+/// <param name="readArray">Pointer to an array of at least MAX_FIFO_COUNT registers to store the values read or the error code</param>
+/// <param name="fifoCount">Receives the number of values read</param>
+/// <param name="timeout">Time in milliseconds after which function will return an error if no response a has been received from the device</param>
+/// <returns>true on success, or false on failure</returns>
+bool ReadFifoQueue( modbus_t hndl, uint8_t slaveID, uint16_t fifoAddress, uint16_t* readArray, uint16_t* fifoCount, size_t timeout );
+
+/// <summary>
+/// Empties a device FIFO queue into an array. Read FIFO Queue is repeated only while the queue returns the
+/// most values a response can hold, so a queue that has been emptied takes a single request. Reading stops
+/// without an error when the array has less than MAX_FIFO_COUNT registers left.
+/// </summary>
+/// <param name="hndl">The message handle</param>
+/// <param name="slaveID">Address of the slave device</param>
+/// <param name="fifoAddress">Address of the FIFO pointer register on the device</param>
+/// <param name="readArray">Pointer to an array to store the values read; on failure the error code follows the values read</param>
+/// <param name="maxValues">The number of registers in readArray</param>
+/// <param name="valueCount">Receives the number of values read</param>
+/// <param name="timeout">Time in milliseconds after which function will return an error if no response a has been received from each request</param>
+/// <returns>true on success, or false on failure</returns>
+bool ModbusDrainFifoQueue( modbus_t hndl, uint8_t slaveID, uint16_t fifoAddress, uint16_t* readArray, size_t maxValues, size_t* valueCount, size_t timeout );
+
 /// PassiveRead is still in progress
 /// <summary>
 /// Listens for any incoming messages that fit the handle, and passes it on to the user.
@@ -197,6 +440,37 @@ bool WriteSingleCoil( modbus_t hndl, uint8_t slaveID, uint16_t address, bool bit
 bool WriteSingleHoldingRegister( modbus_t hndl, uint8_t slaveID, uint16_t address, uint16_t mbRegister, uint8_t* readArray, size_t timeout );
 
 
+/// <summary>
+/// Sends a request to change bits of a holding register in a single transaction. The slave sets the register to
+/// (current AND andMask) OR (orMask AND NOT andMask).
+/// </summary>
+/// <param name="hndl">The message handle</param>
+/// <param name="slaveID">Address of the slave device</param>
+/// <param name="address">Address of the holding register to change on the device</param>
+/// <param name="andMask">Bits set here keep their current value</param>
+/// <param name="orMask">Value of the bits cleared in andMask</param>
+/// <param name="readArray">Pointer to an array of at least 6 bytes to store the echoed address and masks, or the error code</param>
+/// <param name="timeout">Time in milliseconds after which function will return an error if no response a has been received from the device</param>
+/// <returns>true on success, or false on failure</returns>
+bool MaskWriteRegister( modbus_t hndl, uint8_t slaveID, uint16_t address, uint16_t andMask, uint16_t orMask, uint8_t* readArray, size_t timeout );
+
+
+/// <summary>
+/// Sets some bits of a holding register, leaving the others unchanged. Mask Write Register is used so the change
+/// is made in one transaction; if the slave rejects it with ILLEGAL_FUNCTION, this and later calls for the slave
+/// read the register and write it back instead, which is not safe against other masters writing the register.
+/// </summary>
+/// <param name="hndl">The message handle</param>
+/// <param name="slaveID">Address of the slave device</param>
+/// <param name="address">Address of the holding register to change on the device</param>
+/// <param name="bitMask">The bits to change</param>
+/// <param name="bits">The new values of the bits in bitMask</param>
+/// <param name="readArray">Pointer to an array of at least 6 bytes to store the error code response if present</param>
+/// <param name="timeout">Time in milliseconds after which function will return an error if no response a has been received from each request</param>
+/// <returns>true on success, or false on failure</returns>
+bool WriteHoldingRegisterBits( modbus_t hndl, uint8_t slaveID, uint16_t address, uint16_t bitMask, uint16_t bits, uint8_t* readArray, size_t timeout );
+
+
 /// <summary>
 /// Sends a request to write to a variable number of coils.
 /// </summary>
@@ -246,4 +520,37 @@ bool WriteFile(modbus_t hndl, uint8_t slaveID, uint8_t* messageArray, uint8_t me
 /// <param name="recordLength">How many pairs of bytes to write</param>
 /// <param name="record">The data to be written</param>
 /// <returns>The new length of the messageArray (to be used for messageLength in WriteFile and currentMessageIndex if you want to use WriteFileSubRequestBuilder to add multiple requests in a single message)</returns>
-uint8_t WriteFileSubRequestBuilder(uint8_t* messageArray, uint8_t currentMessageIndex, uint16_t fileNumber, uint16_t recordNumber, uint8_t recordLength, uint16_t* record);
\ No newline at end of file
+uint8_t WriteFileSubRequestBuilder(uint8_t* messageArray, uint8_t currentMessageIndex, uint16_t fileNumber, uint16_t recordNumber, uint8_t recordLength, uint16_t* record);
+
+/// <summary>
+/// Registers a function code the library does not know, such as a vendor specific code, so that its responses can be
+/// framed on every transport and it can be sent with SendCustomFunction. The code is also registered with the M4,
+/// now if it is connected or when ModbusConnectRtu is called. Register codes before sending requests that use them.
+/// </summary>
+/// <param name="functionCode">The function code, from 1 to 127. The standard codes cannot be registered</param>
+/// <param name="lengthRule">How the length of a response is found: FCODE_FIXED_LENGTH, FCODE_BYTE_COUNT or
+/// FCODE_WORD_COUNT</param>
+/// <param name="length">The length of every response, or of the header that ends with the count, counting from the
+/// slave ID and leaving out the CRC</param>
+/// <param name="echoLength">Bytes at the start of a response that repeat the request, at least 2 for the slave ID
+/// and function code</param>
+/// <returns>true on success, false if the code or its description is not valid, it is already registered
+/// differently, or it could not be sent to the M4</returns>
+bool ModbusRegisterFunctionCode( uint8_t functionCode, fcodeLengthRule lengthRule, uint8_t length, uint8_t echoLength );
+
+/// <summary>
+/// Sends a request with any function code the library can frame, including those registered with
+/// ModbusRegisterFunctionCode, and checks the response against the function code's description.
+/// </summary>
+/// <param name="hndl">The message handle</param>
+/// <param name="slaveID">Address of the slave device</param>
+/// <param name="functionCode">The function code</param>
+/// <param name="data">The request after the function code</param>
+/// <param name="dataLength">The length of data</param>
+/// <param name="readArray">Receives the response after the function code, or on failure a Modbus exception code or
+/// one of the library's error codes in its first element. Must hold MAX_PDU_LENGTH bytes</param>
+/// <param name="readLength">Receives the number of bytes written to readArray on success</param>
+/// <param name="timeout">Time in milliseconds after which function will return an error if no response a has been received from the device</param>
+/// <returns>true on success, or false on failure</returns>
+bool SendCustomFunction( modbus_t hndl, uint8_t slaveID, uint8_t functionCode, const uint8_t* data, uint8_t dataLength,
+                         uint8_t* readArray, uint8_t* readLength, size_t timeout );
\ No newline at end of file
@@ -0,0 +1,297 @@
+/**
+ * @file    modbus_bus_stats.c
+ * @brief   Line occupancy accounting for Modbus RTU buses.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+
+#include "modbus_bus_stats.h"
+#include "modbus_internal.h"
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#define MODBUS_MAX_BUSES 4
+#define BUS_NAME_LENGTH 32
+
+// Baud rate divisors in serialSetup are relative to this rate
+#define BASE_BAUD_RATE 115200
+
+// Above 19200 baud the specification fixes the inter-frame gap rather than scaling it with the character time
+#define FIXED_GAP_BAUD_THRESHOLD 19200
+#define FIXED_FRAME_GAP_US 1750
+
+#define START_BITS 1
+
+struct _modbusBus
+{
+    char name[BUS_NAME_LENGTH];
+    unsigned int users;
+    modbusBusStats_t stats;
+    uint64_t windowStartUs;
+    size_t consumerCount;
+    modbusBusConsumer_t consumers[MODBUS_BUS_MAX_CONSUMERS];
+};
+
+static struct _modbusBus buses[MODBUS_MAX_BUSES];
+static pthread_mutex_t busLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void ApplySettings(struct _modbusBus *bus, const struct _RTU *setup);
+static uint64_t WireTimeUs(const modbusBusStats_t *stats, uint32_t bytes);
+static modbusBusConsumer_t *FindConsumer(struct _modbusBus *bus, uint8_t slaveId, uint8_t functionCode);
+static void UpdateWindow(struct _modbusBus *bus, modbusBusStats_t *stats);
+
+uint64_t ModbusMonotonicUs(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000 + (uint64_t)t.tv_nsec / 1000;
+}
+
+static void ApplySettings(struct _modbusBus *bus, const struct _RTU *setup)
+{
+    modbusBusStats_t *stats = &bus->stats;
+
+    stats->baudRate = setup->baudRate ? BASE_BAUD_RATE / setup->baudRate : BASE_BAUD_RATE;
+    stats->bitsPerChar = (uint8_t)(START_BITS + setup->wordLength + (setup->parityState == PARITY_ON ? 1 : 0) +
+                                   (setup->stopBits == 2 ? 2 : 1));
+    stats->charTimeNs = (uint32_t)((uint64_t)stats->bitsPerChar * 1000000000 / stats->baudRate);
+    if (stats->baudRate > FIXED_GAP_BAUD_THRESHOLD)
+    {
+        stats->frameGapUs = FIXED_FRAME_GAP_US;
+    }
+    else
+    {
+        stats->frameGapUs = (uint32_t)((uint64_t)stats->charTimeNs * 7 / 2 / 1000);
+    }
+}
+
+static uint64_t WireTimeUs(const modbusBusStats_t *stats, uint32_t bytes)
+{
+    return (uint64_t)bytes * stats->charTimeNs / 1000;
+}
+
+static modbusBusConsumer_t *FindConsumer(struct _modbusBus *bus, uint8_t slaveId, uint8_t functionCode)
+{
+    for (size_t i = 0; i < bus->consumerCount; i++)
+    {
+        if (bus->consumers[i].slaveId == slaveId && bus->consumers[i].functionCode == functionCode)
+        {
+            return &bus->consumers[i];
+        }
+    }
+    if (bus->consumerCount < MODBUS_BUS_MAX_CONSUMERS - 1)
+    {
+        modbusBusConsumer_t *consumer = &bus->consumers[bus->consumerCount++];
+        memset(consumer, 0, sizeof(*consumer));
+        consumer->slaveId = slaveId;
+        consumer->functionCode = functionCode;
+        return consumer;
+    }
+
+    // Table full: the last entry collects everything else.
+    modbusBusConsumer_t *other = &bus->consumers[MODBUS_BUS_MAX_CONSUMERS - 1];
+    if (bus->consumerCount < MODBUS_BUS_MAX_CONSUMERS)
+    {
+        bus->consumerCount = MODBUS_BUS_MAX_CONSUMERS;
+        memset(other, 0, sizeof(*other));
+        other->slaveId = MODBUS_BUS_OTHER_SLAVE;
+    }
+    return other;
+}
+
+static void UpdateWindow(struct _modbusBus *bus, modbusBusStats_t *stats)
+{
+    *stats = bus->stats;
+    stats->windowUs = ModbusMonotonicUs() - bus->windowStartUs;
+    stats->utilization = stats->windowUs ? (float)stats->busyUs / (float)stats->windowUs : 0.0f;
+    if (stats->utilization > 1.0f)
+    {
+        stats->utilization = 1.0f;
+    }
+    stats->headroom = 1.0f - stats->utilization;
+}
+
+const char *BusStatsName(const struct _modbusBus *bus)
+{
+    return bus->name;
+}
+
+struct _modbusBus *BusStatsAttach(const char *name, const struct _RTU *setup, uint32_t transportLatencyUs)
+{
+    struct _modbusBus *bus = NULL;
+
+    pthread_mutex_lock(&busLock);
+    for (size_t i = 0; i < MODBUS_MAX_BUSES && !bus; i++)
+    {
+        if (buses[i].users && strncmp(buses[i].name, name, BUS_NAME_LENGTH) == 0)
+        {
+            bus = &buses[i];
+        }
+    }
+    for (size_t i = 0; i < MODBUS_MAX_BUSES && !bus; i++)
+    {
+        if (!buses[i].users)
+        {
+            bus = &buses[i];
+            memset(bus, 0, sizeof(*bus));
+            strncpy(bus->name, name, BUS_NAME_LENGTH - 1);
+            bus->stats.transportLatencyUs = transportLatencyUs;
+            bus->windowStartUs = ModbusMonotonicUs();
+        }
+    }
+    if (bus)
+    {
+        bus->users++;
+        // All handles on a bus share its line settings, so the most recent connection wins.
+        ApplySettings(bus, setup);
+    }
+    pthread_mutex_unlock(&busLock);
+    return bus;
+}
+
+void BusStatsDetach(struct _modbusBus *bus)
+{
+    if (bus)
+    {
+        pthread_mutex_lock(&busLock);
+        bus->users--;
+        pthread_mutex_unlock(&busLock);
+    }
+}
+
+void BusStatsRecord(struct _modbusBus *bus, uint8_t slaveId, uint8_t functionCode, uint16_t requestLength,
+                    uint16_t responseLength, uint64_t elapsedUs, bool responded)
+{
+    pthread_mutex_lock(&busLock);
+    modbusBusStats_t *stats = &bus->stats;
+
+    uint64_t requestWire = WireTimeUs(stats, (uint32_t)requestLength + CRC_FOOTER_LENGTH);
+    uint64_t responseWire = responded ? WireTimeUs(stats, (uint32_t)responseLength + CRC_FOOTER_LENGTH) : 0;
+    uint64_t gap = (uint64_t)stats->frameGapUs * (responded ? 2 : 1);
+
+    // Whatever is left of the measured time once the frames, the silent intervals that end them and transport
+    // latency are accounted for is time the bus spent waiting for the slave. For a timeout that is the whole wait.
+    uint64_t accounted = requestWire + responseWire + gap + stats->transportLatencyUs;
+    uint64_t turnaround = elapsedUs > accounted ? elapsedUs - accounted : 0;
+    uint64_t busy = requestWire + responseWire + gap + turnaround;
+
+    stats->wireUs += requestWire + responseWire;
+    stats->gapUs += gap;
+    stats->turnaroundUs += turnaround;
+    stats->busyUs += busy;
+    stats->transactions++;
+
+    modbusBusConsumer_t *consumer = FindConsumer(bus, slaveId, functionCode);
+    consumer->transactions++;
+    consumer->busyUs += busy;
+    if (!responded)
+    {
+        stats->timeouts++;
+        consumer->timeouts++;
+    }
+    pthread_mutex_unlock(&busLock);
+}
+
+void BusStatsRetry(struct _modbusBus *bus, uint8_t slaveId, uint8_t functionCode)
+{
+    pthread_mutex_lock(&busLock);
+    bus->stats.retries++;
+    FindConsumer(bus, slaveId, functionCode)->retries++;
+    pthread_mutex_unlock(&busLock);
+}
+
+bool ModbusGetBusStats(modbus_t hndl, modbusBusStats_t *stats)
+{
+    if (!hndl || !hndl->bus)
+    {
+        return false;
+    }
+    pthread_mutex_lock(&busLock);
+    UpdateWindow(hndl->bus, stats);
+    pthread_mutex_unlock(&busLock);
+    return true;
+}
+
+size_t ModbusGetBusTopConsumers(modbus_t hndl, modbusBusConsumer_t *consumers, size_t maxConsumers)
+{
+    if (!hndl || !hndl->bus)
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&busLock);
+    struct _modbusBus *bus = hndl->bus;
+    modbusBusStats_t stats;
+    UpdateWindow(bus, &stats);
+
+    // Selection of the largest entries; the table is small and this is not on a transaction path.
+    bool taken[MODBUS_BUS_MAX_CONSUMERS] = {false};
+    size_t count = 0;
+    while (count < maxConsumers && count < bus->consumerCount)
+    {
+        size_t best = SIZE_MAX;
+        for (size_t i = 0; i < bus->consumerCount; i++)
+        {
+            if (!taken[i] && (best == SIZE_MAX || bus->consumers[i].busyUs > bus->consumers[best].busyUs))
+            {
+                best = i;
+            }
+        }
+        taken[best] = true;
+        consumers[count] = bus->consumers[best];
+        float share = stats.windowUs ? (float)consumers[count].busyUs / (float)stats.windowUs : 0.0f;
+        consumers[count].share = share > 1.0f ? 1.0f : share;
+        count++;
+    }
+    pthread_mutex_unlock(&busLock);
+    return count;
+}
+
+void ModbusResetBusStats(modbus_t hndl)
+{
+    if (!hndl || !hndl->bus)
+    {
+        return;
+    }
+    pthread_mutex_lock(&busLock);
+    struct _modbusBus *bus = hndl->bus;
+    modbusBusStats_t *stats = &bus->stats;
+    stats->busyUs = 0;
+    stats->wireUs = 0;
+    stats->gapUs = 0;
+    stats->turnaroundUs = 0;
+    stats->transactions = 0;
+    stats->timeouts = 0;
+    stats->retries = 0;
+    bus->consumerCount = 0;
+    bus->windowStartUs = ModbusMonotonicUs();
+    pthread_mutex_unlock(&busLock);
+}
+
+void ModbusSetBusTransportLatency(modbus_t hndl, uint32_t latencyUs)
+{
+    if (hndl && hndl->bus)
+    {
+        pthread_mutex_lock(&busLock);
+        hndl->bus->stats.transportLatencyUs = latencyUs;
+        pthread_mutex_unlock(&busLock);
+    }
+}
+
+uint32_t ModbusEstimateTransactionUs(modbus_t hndl, uint16_t requestPduLength, uint16_t responsePduLength,
+                                     uint32_t turnaroundUs)
+{
+    if (!hndl || !hndl->bus)
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&busLock);
+    const modbusBusStats_t *stats = &hndl->bus->stats;
+    uint64_t estimate = WireTimeUs(stats, (uint32_t)requestPduLength + CRC_FOOTER_LENGTH) +
+                        WireTimeUs(stats, (uint32_t)responsePduLength + CRC_FOOTER_LENGTH) +
+                        2 * (uint64_t)stats->frameGapUs + turnaroundUs;
+    pthread_mutex_unlock(&busLock);
+    return (uint32_t)estimate;
+}
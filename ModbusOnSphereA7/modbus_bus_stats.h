@@ -0,0 +1,94 @@
+/**
+ * @file    modbus_bus_stats.h
+ * @brief   Line occupancy accounting for Modbus RTU buses. Every transaction on an RTU handle is charged with the
+ *          time its frames spend on the wire, the silent intervals that must separate frames and the time the bus is
+ *          held waiting for the slave to respond. The totals can be used to decide whether another device will fit
+ *          on an existing bus.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+
+#pragma once
+
+#include "modbus.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Maximum number of slave / function code pairs tracked per bus. Further pairs are added to a shared entry
+// with slaveId MODBUS_BUS_OTHER_SLAVE.
+#define MODBUS_BUS_MAX_CONSUMERS 32
+#define MODBUS_BUS_OTHER_SLAVE 0xFF
+
+typedef struct _modbusBusStats
+{
+    uint32_t baudRate;       // Line speed in bits per second
+    uint8_t bitsPerChar;     // Start bit, data bits, parity bit and stop bits
+    uint32_t charTimeNs;     // Time to send one character
+    uint32_t frameGapUs;     // Minimum silent interval between frames (3.5 characters, or 1750us above 19200 baud)
+    uint32_t transportLatencyUs; // Latency between the library and the bus, excluded from the turnaround time
+    uint64_t windowUs;       // Time since the statistics were last reset
+    uint64_t busyUs;         // Total occupancy: wireUs + gapUs + turnaroundUs
+    uint64_t wireUs;         // Time spent transmitting request and response frames
+    uint64_t gapUs;          // Silent intervals between frames
+    uint64_t turnaroundUs;   // Time spent waiting for slaves, including the full wait for requests that timed out
+    uint32_t transactions;   // Completed transactions, successful or not
+    uint32_t timeouts;       // Transactions that received no response
+    uint32_t retries;        // Transactions that were retries under a handle's retry policy
+    float utilization;       // busyUs / windowUs, from 0 to 1
+    float headroom;          // 1 - utilization
+} modbusBusStats_t;
+
+typedef struct _modbusBusConsumer
+{
+    uint8_t slaveId;
+    uint8_t functionCode;
+    uint32_t transactions;
+    uint32_t timeouts;
+    uint32_t retries;
+    uint64_t busyUs;         // Occupancy charged to this slave and function code
+    float share;             // Fraction of the bus window used by this slave and function code
+} modbusBusConsumer_t;
+
+/// <summary>
+/// Gets the occupancy totals for the bus used by an RTU handle.
+/// </summary>
+/// <param name="hndl">An RTU handle</param>
+/// <param name="stats">Receives the totals</param>
+/// <returns>true on success, or false if the handle is not attached to an RTU bus</returns>
+bool ModbusGetBusStats( modbus_t hndl, modbusBusStats_t* stats );
+
+/// <summary>
+/// Gets the slave and function code pairs that have used the most bus time, largest first.
+/// </summary>
+/// <param name="hndl">An RTU handle</param>
+/// <param name="consumers">Array to receive the consumers</param>
+/// <param name="maxConsumers">Number of elements in consumers</param>
+/// <returns>The number of consumers written</returns>
+size_t ModbusGetBusTopConsumers( modbus_t hndl, modbusBusConsumer_t* consumers, size_t maxConsumers );
+
+/// <summary>
+/// Clears the totals for the bus used by an RTU handle and starts a new measurement window.
+/// </summary>
+/// <param name="hndl">An RTU handle</param>
+void ModbusResetBusStats( modbus_t hndl );
+
+/// <summary>
+/// Sets the latency between the library and the bus that is not bus time. For the M4 this defaults to half of its
+/// polling period. Measured response times are reduced by this value before being charged as turnaround.
+/// </summary>
+/// <param name="hndl">An RTU handle</param>
+/// <param name="latencyUs">The latency in microseconds</param>
+void ModbusSetBusTransportLatency( modbus_t hndl, uint32_t latencyUs );
+
+/// <summary>
+/// Estimates how long one transaction will occupy the bus used by an RTU handle, so a new poll can be compared with
+/// the headroom reported by <see cref="ModbusGetBusStats" />.
+/// </summary>
+/// <param name="hndl">An RTU handle</param>
+/// <param name="requestPduLength">Length of the request, from the slave ID to the last data byte</param>
+/// <param name="responsePduLength">Length of the expected response, from the slave ID to the last data byte</param>
+/// <param name="turnaroundUs">Expected time for the slave to start responding</param>
+/// <returns>The estimated occupancy in microseconds, or 0 if the handle is not attached to an RTU bus</returns>
+uint32_t ModbusEstimateTransactionUs( modbus_t hndl, uint16_t requestPduLength, uint16_t responsePduLength, uint32_t turnaroundUs );
@@ -0,0 +1,338 @@
+/**
+ * @file    modbus_discovery.c
+ * @brief   Finds the devices on a serial bus or a subnet.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+
+#include "modbus_discovery.h"
+#include "modbus_internal.h"
+#include <applibs/log.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define PROBE_REQUEST_LENGTH 6
+#define PROBE_TCP_LENGTH (TCP_HEADER_LENGTH + PROBE_REQUEST_LENGTH)
+#define PROBE_TRANSACTION_ID 0x4D44
+#define PROBE_RESPONSE_MIN_LENGTH (TCP_HEADER_LENGTH + ERROR_CODE_LENGTH)
+// Once a device has answered, each further ID is given this many times the slowest round trip seen
+#define ADAPTIVE_TIMEOUT_FACTOR 4
+// Shortest wait for an ID, in milliseconds, so a device that is a little slower than the others is not missed
+#define MIN_PROBE_TIMEOUT 10
+
+typedef enum
+{
+    probeIdle,
+    probeConnecting,
+    probeWaiting
+} probeState_t;
+
+typedef struct
+{
+    probeState_t state;
+    int fd;
+    uint32_t ip;      // Host byte order
+    uint64_t startUs; // When the connect was started
+    uint64_t sentUs;  // When the request was sent
+    size_t received;
+    uint8_t buffer[PROBE_RESPONSE_MIN_LENGTH + 2];
+} tcpProbe_t;
+
+static void BuildProbe(uint8_t *request, uint8_t slaveID, uint16_t address)
+{
+    request[0] = slaveID;
+    request[1] = READ_MULTIPLE_HOLDING_REGISTERS;
+    request[2] = (uint8_t)(address >> 8);
+    request[3] = (uint8_t)(address & 0xFF);
+    request[4] = 0;
+    request[5] = 1;
+}
+
+static int CompareResponders(const void *a, const void *b)
+{
+    const modbusResponder_t *x = a;
+    const modbusResponder_t *y = b;
+    uint32_t xIp = 0;
+    uint32_t yIp = 0;
+
+    inet_pton(AF_INET, x->ip, &xIp);
+    inet_pton(AF_INET, y->ip, &yIp);
+    if (xIp != yIp)
+    {
+        return (ntohl(xIp) < ntohl(yIp)) ? -1 : 1;
+    }
+    return (x->slaveID < y->slaveID) ? -1 : (x->slaveID > y->slaveID);
+}
+
+size_t ModbusDiscoverSlaves(modbus_t hndl, uint8_t firstID, uint8_t lastID, uint16_t address,
+                            modbusResponder_t *responders, size_t maxResponders, size_t timeout)
+{
+    uint8_t request[PROBE_REQUEST_LENGTH];
+    uint8_t response[MAX_PDU_LENGTH];
+    uint8_t found[32] = {0};
+    size_t count = 0;
+    uint32_t slowestUs = 0;
+
+    for (uint32_t id = firstID; id <= lastID && count < maxResponders; id++)
+    {
+        size_t probeTimeout = timeout;
+        if (slowestUs)
+        {
+            size_t adaptive = (ADAPTIVE_TIMEOUT_FACTOR * (size_t)slowestUs + 999) / 1000;
+            probeTimeout = (adaptive < MIN_PROBE_TIMEOUT) ? MIN_PROBE_TIMEOUT : adaptive;
+            probeTimeout = (probeTimeout > timeout) ? timeout : probeTimeout;
+        }
+
+        BuildProbe(request, (uint8_t)id, address);
+        modbusPending_t pending = {.request = request, .requestLength = PROBE_REQUEST_LENGTH, .response = response};
+        uint64_t startUs = ModbusMonotonicUs();
+        ModbusRunRequests(hndl, &pending, 1, probeTimeout);
+        uint32_t rttUs = (uint32_t)(ModbusMonotonicUs() - startUs);
+        if (pending.error || pending.responseLength < ERROR_CODE_LENGTH)
+        {
+            continue;
+        }
+
+        // A serial response carries no transaction ID, so a device that answered after its wait was cut short is
+        // taken for the next ID. Record it under the ID it answered from.
+        uint8_t responder = response[0];
+        if (responder < firstID || responder > lastID || (found[responder / 8] & (1u << (responder % 8))))
+        {
+            continue;
+        }
+        found[responder / 8] |= (uint8_t)(1u << (responder % 8));
+        responders[count++] = (modbusResponder_t){
+            .slaveID = responder,
+            .error = (response[1] & MODBUS_EXCEPTION_BIT) ? response[2] : 0,
+            .rttUs = rttUs};
+        if (responder == id && rttUs > slowestUs)
+        {
+            slowestUs = rttUs;
+        }
+    }
+    qsort(responders, count, sizeof(modbusResponder_t), CompareResponders);
+    return count;
+}
+
+static bool ParseCidr(const char *cidr, uint32_t *first, uint32_t *last)
+{
+    char ip[MODBUS_IP_LENGTH];
+    unsigned int prefix = 0;
+    struct in_addr address;
+    const char *slash = strchr(cidr, '/');
+
+    if (!slash || (size_t)(slash - cidr) >= sizeof(ip) || sscanf(slash + 1, "%u", &prefix) != 1 || prefix < 16 ||
+        prefix > 32)
+    {
+        return false;
+    }
+    memcpy(ip, cidr, (size_t)(slash - cidr));
+    ip[slash - cidr] = '\0';
+    if (inet_pton(AF_INET, ip, &address) != 1)
+    {
+        return false;
+    }
+
+    uint32_t mask = (prefix == 32) ? 0xFFFFFFFFu : ~(0xFFFFFFFFu >> prefix);
+    *first = ntohl(address.s_addr) & mask;
+    *last = *first | ~mask;
+    // The network and broadcast addresses are not hosts, except in the point to point ranges.
+    if (prefix < 31)
+    {
+        (*first)++;
+        (*last)--;
+    }
+    return true;
+}
+
+static void CloseProbe(int epollFd, tcpProbe_t *probe)
+{
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, probe->fd, NULL);
+    close(probe->fd);
+    probe->state = probeIdle;
+}
+
+static bool StartProbe(int epollFd, tcpProbe_t *probe, uint32_t index, uint32_t ip, uint16_t port)
+{
+    struct sockaddr_in server = {.sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(ip)};
+    struct epoll_event event = {.events = EPOLLOUT, .data.u32 = index};
+
+    probe->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (probe->fd < 0)
+    {
+        Log_Debug("Error: Unable to create discovery socket: %s\n", strerror(errno));
+        return false;
+    }
+    if ((connect(probe->fd, (struct sockaddr *)&server, sizeof(server)) < 0 && errno != EINPROGRESS) ||
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, probe->fd, &event) < 0)
+    {
+        // Refused at once, nothing listens there.
+        close(probe->fd);
+        return true;
+    }
+    probe->state = probeConnecting;
+    probe->ip = ip;
+    probe->startUs = ModbusMonotonicUs();
+    probe->received = 0;
+    return true;
+}
+
+// Sends the request once a probe has connected, or reads the response. Returns true once enough of a response
+// has arrived to check it.
+static bool AdvanceProbe(int epollFd, tcpProbe_t *probe, uint8_t unitID)
+{
+    if (probe->state == probeConnecting)
+    {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        uint8_t request[PROBE_TCP_LENGTH] = {PROBE_TRANSACTION_ID >> 8, PROBE_TRANSACTION_ID & 0xFF, 0, 0, 0,
+                                             PROBE_REQUEST_LENGTH};
+        BuildProbe(&request[TCP_HEADER_LENGTH], unitID, 0);
+
+        if (getsockopt(probe->fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0 ||
+            send(probe->fd, request, sizeof(request), MSG_NOSIGNAL) != (ssize_t)sizeof(request))
+        {
+            CloseProbe(epollFd, probe);
+            return false;
+        }
+        probe->sentUs = ModbusMonotonicUs();
+        probe->state = probeWaiting;
+        return false;
+    }
+
+    ssize_t received = recv(probe->fd, &probe->buffer[probe->received], sizeof(probe->buffer) - probe->received, 0);
+    if (received <= 0)
+    {
+        CloseProbe(epollFd, probe);
+        return false;
+    }
+    probe->received += (size_t)received;
+    return probe->received >= PROBE_RESPONSE_MIN_LENGTH;
+}
+
+int ModbusDiscoverTcpServers(const char *cidr, uint16_t port, uint8_t unitID, modbusResponder_t *responders,
+                             size_t maxResponders, size_t maxParallel, size_t timeout)
+{
+    uint32_t next = 0;
+    uint32_t last = 0;
+    tcpProbe_t probes[MODBUS_MAX_DISCOVERY_CONNECTIONS];
+    size_t active = 0;
+    size_t count = 0;
+
+    if (!cidr || !ParseCidr(cidr, &next, &last))
+    {
+        Log_Debug("Error: Invalid address range for %s\n", __FUNCTION__);
+        return -1;
+    }
+    maxParallel = (maxParallel < 1) ? 1 : maxParallel;
+    maxParallel = (maxParallel > MODBUS_MAX_DISCOVERY_CONNECTIONS) ? MODBUS_MAX_DISCOVERY_CONNECTIONS : maxParallel;
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0)
+    {
+        Log_Debug("Error: Unable to create discovery epoll: %s\n", strerror(errno));
+        return -1;
+    }
+    for (size_t i = 0; i < maxParallel; i++)
+    {
+        probes[i].state = probeIdle;
+    }
+
+    bool more = next <= last;
+    while (more || active > 0)
+    {
+        // Keep every slot busy while there are addresses left.
+        for (uint32_t i = 0; i < maxParallel && more; i++)
+        {
+            if (probes[i].state == probeIdle)
+            {
+                if (!StartProbe(epollFd, &probes[i], i, next, port))
+                {
+                    more = false;
+                    break;
+                }
+                more = next++ != last;
+            }
+        }
+
+        uint64_t nowUs = ModbusMonotonicUs();
+        uint64_t waitUs = (uint64_t)timeout * 1000;
+        active = 0;
+        for (size_t i = 0; i < maxParallel; i++)
+        {
+            if (probes[i].state == probeIdle)
+            {
+                continue;
+            }
+            uint64_t elapsedUs = nowUs - probes[i].startUs;
+            if (elapsedUs >= (uint64_t)timeout * 1000)
+            {
+                CloseProbe(epollFd, &probes[i]);
+                continue;
+            }
+            active++;
+            if ((uint64_t)timeout * 1000 - elapsedUs < waitUs)
+            {
+                waitUs = (uint64_t)timeout * 1000 - elapsedUs;
+            }
+        }
+        if (active == 0)
+        {
+            continue;
+        }
+
+        struct epoll_event events[MODBUS_MAX_DISCOVERY_CONNECTIONS];
+        int ready = epoll_wait(epollFd, events, (int)maxParallel, (int)((waitUs + 999) / 1000));
+        for (int e = 0; e < ready; e++)
+        {
+            tcpProbe_t *probe = &probes[events[e].data.u32];
+            if (probe->state == probeIdle)
+            {
+                continue;
+            }
+            if (probe->state == probeConnecting)
+            {
+                struct epoll_event event = {.events = EPOLLIN | EPOLLRDHUP, .data.u32 = events[e].data.u32};
+                AdvanceProbe(epollFd, probe, unitID);
+                if (probe->state == probeWaiting)
+                {
+                    epoll_ctl(epollFd, EPOLL_CTL_MOD, probe->fd, &event);
+                }
+                continue;
+            }
+            if (!AdvanceProbe(epollFd, probe, unitID))
+            {
+                continue;
+            }
+
+            const uint8_t *pdu = &probe->buffer[TCP_HEADER_LENGTH];
+            // Anything else on the port is not a Modbus TCP server.
+            bool valid = probe->buffer[0] == (PROBE_TRANSACTION_ID >> 8) &&
+                         probe->buffer[1] == (PROBE_TRANSACTION_ID & 0xFF) && probe->buffer[2] == 0 &&
+                         probe->buffer[3] == 0 &&
+                         (pdu[1] & (uint8_t)~MODBUS_EXCEPTION_BIT) == READ_MULTIPLE_HOLDING_REGISTERS;
+            if (valid && count < maxResponders)
+            {
+                struct in_addr address = {.s_addr = htonl(probe->ip)};
+                responders[count] = (modbusResponder_t){
+                    .slaveID = pdu[0],
+                    .error = (pdu[1] & MODBUS_EXCEPTION_BIT) ? pdu[2] : 0,
+                    .rttUs = (uint32_t)(ModbusMonotonicUs() - probe->sentUs)};
+                inet_ntop(AF_INET, &address, responders[count].ip, sizeof(responders[count].ip));
+                count++;
+            }
+            CloseProbe(epollFd, probe);
+        }
+    }
+    close(epollFd);
+
+    qsort(responders, count, sizeof(modbusResponder_t), CompareResponders);
+    return (int)count;
+}
@@ -0,0 +1,63 @@
+/**
+ * @file    modbus_discovery.h
+ * @brief   Finds the devices on a new installation: which unit IDs answer on a serial bus, and which addresses in
+ *          a subnet run a Modbus TCP server, with the round trip time of each.
+ *
+ *          A serial bus can only carry one request at a time, so unit IDs are probed one after another; once a
+ *          device has answered, the wait for each remaining ID is cut to a few times the slowest round trip seen,
+ *          so absent IDs cost little more than a live one. Modbus TCP servers are probed in parallel with
+ *          non-blocking connects. On Azure Sphere the addresses probed must be allowed by the application manifest.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+
+#pragma once
+
+#include "modbus.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Longest number of TCP probes ModbusDiscoverTcpServers has in flight at once
+#define MODBUS_MAX_DISCOVERY_CONNECTIONS 64
+
+// A device that answered a probe
+typedef struct _modbusResponder
+{
+    char ip[16];     // Dotted IPv4 address of a Modbus TCP server, empty for a serial device
+    uint8_t slaveID; // The unit ID that answered
+    uint8_t error;   // 0, or the exception code the device answered with; an exception still shows it is there
+    uint32_t rttUs;  // Time from sending the probe to receiving the response, in microseconds
+} modbusResponder_t;
+
+/// <summary>
+/// Probes a range of unit IDs through a handle by reading one holding register from each, and lists the IDs that
+/// answer, including those that answer with an exception. Must be called from the thread using the handle.
+/// </summary>
+/// <param name="hndl">The modbus handle for the bus</param>
+/// <param name="firstID">The first unit ID to probe</param>
+/// <param name="lastID">The last unit ID to probe, normally 247</param>
+/// <param name="address">The holding register read by each probe</param>
+/// <param name="responders">Receives the devices that answered, in unit ID order</param>
+/// <param name="maxResponders">The number of entries in responders; probing stops when it is full</param>
+/// <param name="timeout">Time in milliseconds to wait for each ID until a device has answered. After that the wait is four times the slowest round trip seen, and never more than this</param>
+/// <returns>The number of devices that answered</returns>
+size_t ModbusDiscoverSlaves( modbus_t hndl, uint8_t firstID, uint8_t lastID, uint16_t address,
+                             modbusResponder_t* responders, size_t maxResponders, size_t timeout );
+
+/// <summary>
+/// Probes every host address in an IPv4 CIDR range, such as "192.168.1.0/24", for a Modbus TCP server, and lists
+/// the servers that answer. Each probe connects without blocking and reads one holding register; many probes are in
+/// flight at once, so a subnet takes little longer than one timeout. Connections are closed once probed.
+/// </summary>
+/// <param name="cidr">The range, as a dotted IPv4 address and a prefix length from 16 to 32</param>
+/// <param name="port">The TCP port, normally 502</param>
+/// <param name="unitID">The unit ID of the probes, normally 255 for a server that is not a gateway</param>
+/// <param name="responders">Receives the servers that answered, in address order</param>
+/// <param name="maxResponders">The number of entries in responders</param>
+/// <param name="maxParallel">The number of probes in flight at once, up to MODBUS_MAX_DISCOVERY_CONNECTIONS</param>
+/// <param name="timeout">Time in milliseconds to wait for each server to connect and answer</param>
+/// <returns>The number of servers that answered, or -1 if the range is not valid or the probes could not start</returns>
+int ModbusDiscoverTcpServers( const char* cidr, uint16_t port, uint8_t unitID, modbusResponder_t* responders,
+                              size_t maxResponders, size_t maxParallel, size_t timeout );
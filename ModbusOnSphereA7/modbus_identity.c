@@ -0,0 +1,404 @@
+/**
+ * @file    modbus_identity.c
+ * @brief   Device identification and the capability cache.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+
+#include "modbus_identity.h"
+#include "modbus_internal.h"
+#include <applibs/log.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DEVICE_ID_REQUEST_LENGTH 5
+#define READ_DEVICE_ID_BASIC 1
+#define DEVICE_ID_MORE_FOLLOWS 0xFF
+#define DEVICE_ID_MORE_FOLLOWS_OFFSET 5
+#define DEVICE_ID_NEXT_OBJECT_OFFSET 6
+#define DEVICE_ID_BASIC_OBJECTS 3
+
+#define CAPABILITY_FILE_MAGIC 0x43434D42 // "MBCC"
+#define CAPABILITY_FILE_VERSION 1
+#define ADDRESS_KEY_LENGTH 32
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t recordSize; // sizeof(cacheEntry_t), so a file from a build with a different layout is rejected
+    uint32_t count;
+} capabilityFileHeader_t;
+
+typedef struct
+{
+    char address[ADDRESS_KEY_LENGTH]; // How the device is reached, see AddressKey
+    uint8_t slaveID;
+    modbusCapabilities_t capabilities;
+} cacheEntry_t;
+
+// The file is the header followed by the entries, most recently identified first
+typedef struct
+{
+    capabilityFileHeader_t header;
+    cacheEntry_t entries[MODBUS_CAPABILITY_CACHE_SIZE];
+} capabilityFile_t;
+
+_Static_assert(offsetof(capabilityFile_t, entries) == sizeof(capabilityFileHeader_t),
+               "Capability file entries must follow the header");
+
+// Most recently identified first
+static cacheEntry_t cache[MODBUS_CAPABILITY_CACHE_SIZE];
+static size_t cacheCount = 0;
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Copies the objects in one response into the identity. Returns 0 or the reason the response was rejected.
+static uint8_t DecodeIdentification(const modbusPending_t *pending, modbusDeviceIdentity_t *identity)
+{
+    const uint8_t *response = pending->response;
+
+    if (pending->error)
+    {
+        return pending->error;
+    }
+    if (pending->responseLength >= ERROR_CODE_LENGTH && (response[1] & MODBUS_EXCEPTION_BIT))
+    {
+        return response[2];
+    }
+    if (pending->responseLength < DEVICE_ID_HEADER_LENGTH || response[1] != ENCAPSULATED_INTERFACE_TRANSPORT ||
+        response[2] != MEI_READ_DEVICE_ID)
+    {
+        Log_Debug("Error: Invalid response to Read Device Identification\n");
+        return INVALID_RESPONSE;
+    }
+
+    char *objects[DEVICE_ID_BASIC_OBJECTS] = {identity->vendorName, identity->productCode, identity->revision};
+    size_t offset = DEVICE_ID_HEADER_LENGTH;
+    for (uint8_t i = 0; i < response[DEVICE_ID_OBJECT_COUNT_OFFSET]; i++)
+    {
+        if (offset + 2 > pending->responseLength || offset + 2 + response[offset + 1] > pending->responseLength)
+        {
+            Log_Debug("Error: Device identification object overruns the response\n");
+            return INVALID_RESPONSE;
+        }
+        uint8_t objectId = response[offset];
+        uint8_t length = response[offset + 1];
+        if (objectId < DEVICE_ID_BASIC_OBJECTS)
+        {
+            size_t kept = (length < MODBUS_DEVICE_ID_LENGTH) ? length : MODBUS_DEVICE_ID_LENGTH - 1;
+            memcpy(objects[objectId], &response[offset + 2], kept);
+            objects[objectId][kept] = '\0';
+        }
+        offset += 2u + length;
+    }
+    return 0;
+}
+
+bool ModbusReadDeviceIdentification(modbus_t hndl, uint8_t slaveID, modbusDeviceIdentity_t *identity,
+                                     uint8_t *error, size_t timeout)
+{
+    uint8_t request[DEVICE_ID_REQUEST_LENGTH] = {slaveID, ENCAPSULATED_INTERFACE_TRANSPORT, MEI_READ_DEVICE_ID,
+                                                 READ_DEVICE_ID_BASIC, 0};
+    uint8_t response[MAX_PDU_LENGTH];
+
+    memset(identity, 0, sizeof(modbusDeviceIdentity_t));
+    // Each further request starts where the last response stopped, so the basic objects take at most three.
+    for (int attempt = 0; attempt < DEVICE_ID_BASIC_OBJECTS; attempt++)
+    {
+        modbusPending_t pending = {
+            .request = request, .requestLength = DEVICE_ID_REQUEST_LENGTH, .response = response};
+        ModbusRunRequests(hndl, &pending, 1, timeout);
+        *error = DecodeIdentification(&pending, identity);
+        if (*error)
+        {
+            return false;
+        }
+
+        uint8_t nextObject = response[DEVICE_ID_NEXT_OBJECT_OFFSET];
+        if (response[DEVICE_ID_MORE_FOLLOWS_OFFSET] != DEVICE_ID_MORE_FOLLOWS || nextObject <= request[4] ||
+            nextObject >= DEVICE_ID_BASIC_OBJECTS)
+        {
+            return true;
+        }
+        request[4] = nextObject;
+    }
+    return true;
+}
+
+// Identifies how a handle reaches its devices. RTU handles all share the M4's serial port.
+static void AddressKey(modbus_t hndl, char *key)
+{
+    if (hndl->type == rtu)
+    {
+        snprintf(key, ADDRESS_KEY_LENGTH, "rtu");
+    }
+    else if (hndl->type == rtuSerial)
+    {
+        snprintf(key, ADDRESS_KEY_LENGTH, "serial:%s", hndl->bus ? BusStatsName(hndl->bus) : "");
+    }
+    else if (hndl->type == local)
+    {
+        char path[ADDRESS_KEY_LENGTH];
+        snprintf(key, ADDRESS_KEY_LENGTH, "local:%s", LocalPath(&hndl->connectData.LOCAL, path, sizeof(path)));
+    }
+    else
+    {
+        snprintf(key, ADDRESS_KEY_LENGTH, "%s:%s:%u", (hndl->type == tcp) ? "tcp" : "rtu-tcp",
+                 hndl->connectData.TCP.ip, hndl->connectData.TCP.port);
+    }
+}
+
+// Must be called with cacheLock held. Returns the index of the entry, or cacheCount if there is none.
+static size_t FindEntry(const char *address, uint8_t slaveID)
+{
+    size_t i = 0;
+    while (i < cacheCount && (cache[i].slaveID != slaveID || strcmp(cache[i].address, address) != 0))
+    {
+        i++;
+    }
+    return i;
+}
+
+// Must be called with cacheLock held. Moves an entry, or a new one if index is cacheCount, to the front of the
+// cache, dropping the oldest entry if it is full.
+static cacheEntry_t *MoveToFront(size_t index)
+{
+    cacheEntry_t entry = {0};
+    if (index < cacheCount)
+    {
+        entry = cache[index];
+    }
+    else if (cacheCount < MODBUS_CAPABILITY_CACHE_SIZE)
+    {
+        index = cacheCount++;
+    }
+    else
+    {
+        index = cacheCount - 1;
+    }
+    memmove(&cache[1], &cache[0], index * sizeof(cacheEntry_t));
+    cache[0] = entry;
+    return &cache[0];
+}
+
+static void SetBit(uint8_t *bits, uint8_t bit)
+{
+    bits[bit / 8] |= (uint8_t)(1u << (bit % 8));
+}
+
+static bool GetBit(const uint8_t *bits, uint8_t bit)
+{
+    return (bits[bit / 8] >> (bit % 8)) & 1;
+}
+
+static void ApplyCapabilities(modbus_t hndl, struct _modbusSlave *slave, const modbusCapabilities_t *capabilities)
+{
+    for (modbusTable_t table = MODBUS_TABLE_COILS; table <= MODBUS_TABLE_INPUT_REGISTERS; table++)
+    {
+        ModbusSetReadLimit(hndl, slave->slaveID, table, capabilities->maxRead[table]);
+    }
+    memcpy(slave->supported, capabilities->supported, sizeof(slave->supported));
+    memcpy(slave->unsupported, capabilities->unsupported, sizeof(slave->unsupported));
+    if (capabilities->maxInFlight && (hndl->type == tcp || hndl->type == local))
+    {
+        ModbusSetMaxInFlight(hndl, capabilities->maxInFlight);
+    }
+    if (GetBit(capabilities->unsupported, MASK_WRITE_REGISTER))
+    {
+        SetBit(hndl->noMaskWrite, slave->slaveID);
+    }
+}
+
+bool ModbusIdentifyDevice(modbus_t hndl, uint8_t slaveID, modbusCapabilities_t *capabilities, bool *cached,
+                          uint8_t *error, size_t timeout)
+{
+    modbusDeviceIdentity_t identity;
+    char address[ADDRESS_KEY_LENGTH];
+    bool supportsIdentification = true;
+
+    if (cached)
+    {
+        *cached = false;
+    }
+    if (!ModbusReadDeviceIdentification(hndl, slaveID, &identity, error, timeout))
+    {
+        if (*error != ILLEGAL_FUNCTION)
+        {
+            return false;
+        }
+        supportsIdentification = false;
+        *error = 0;
+    }
+    struct _modbusSlave *slave = ModbusFindSlave(hndl, slaveID, true);
+    if (!slave)
+    {
+        *error = SLAVE_DEVICE_FAILURE;
+        return false;
+    }
+    AddressKey(hndl, address);
+
+    pthread_mutex_lock(&cacheLock);
+    size_t index = FindEntry(address, slaveID);
+    bool found = index < cacheCount &&
+                 memcmp(&cache[index].capabilities.identity, &identity, sizeof(modbusDeviceIdentity_t)) == 0;
+    cacheEntry_t *entry = MoveToFront(index);
+    if (!found)
+    {
+        // A different device at a known address has to be learned about afresh.
+        *entry = (cacheEntry_t){.slaveID = slaveID, .capabilities = {.identity = identity}};
+        strcpy(entry->address, address);
+        SetBit(supportsIdentification ? entry->capabilities.supported : entry->capabilities.unsupported,
+               ENCAPSULATED_INTERFACE_TRANSPORT);
+    }
+    ApplyCapabilities(hndl, slave, &entry->capabilities);
+    if (capabilities)
+    {
+        *capabilities = entry->capabilities;
+    }
+    pthread_mutex_unlock(&cacheLock);
+
+    if (cached)
+    {
+        *cached = found;
+    }
+    return true;
+}
+
+bool ModbusRememberCapabilities(modbus_t hndl, uint8_t slaveID)
+{
+    char address[ADDRESS_KEY_LENGTH];
+    AddressKey(hndl, address);
+    const struct _modbusSlave *slave = ModbusFindSlave(hndl, slaveID, false);
+
+    pthread_mutex_lock(&cacheLock);
+    size_t index = FindEntry(address, slaveID);
+    if (index == cacheCount || !slave)
+    {
+        pthread_mutex_unlock(&cacheLock);
+        return false;
+    }
+    modbusCapabilities_t *capabilities = &cache[index].capabilities;
+    memcpy(capabilities->maxRead, slave->maxRead, sizeof(capabilities->maxRead));
+    memcpy(capabilities->supported, slave->supported, sizeof(capabilities->supported));
+    memcpy(capabilities->unsupported, slave->unsupported, sizeof(capabilities->unsupported));
+    if (GetBit(hndl->noMaskWrite, slaveID))
+    {
+        SetBit(capabilities->unsupported, MASK_WRITE_REGISTER);
+    }
+    if (hndl->type == tcp || hndl->type == local)
+    {
+        capabilities->maxInFlight = hndl->maxInFlight;
+    }
+    pthread_mutex_unlock(&cacheLock);
+    return true;
+}
+
+// Reads or writes all of a buffer, as a file may transfer less than asked for at once.
+static bool TransferAll(int fd, void *buffer, size_t length, bool isWrite)
+{
+    uint8_t *next = buffer;
+    while (length > 0)
+    {
+        ssize_t transferred = isWrite ? write(fd, next, length) : read(fd, next, length);
+        if (transferred < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (transferred <= 0)
+        {
+            return false;
+        }
+        next += transferred;
+        length -= (size_t)transferred;
+    }
+    return true;
+}
+
+// Terminates the strings in an entry read from a file and checks its limits are ones the setters would accept.
+static bool ValidEntry(cacheEntry_t *entry)
+{
+    modbusCapabilities_t *capabilities = &entry->capabilities;
+
+    entry->address[ADDRESS_KEY_LENGTH - 1] = '\0';
+    capabilities->identity.vendorName[MODBUS_DEVICE_ID_LENGTH - 1] = '\0';
+    capabilities->identity.productCode[MODBUS_DEVICE_ID_LENGTH - 1] = '\0';
+    capabilities->identity.revision[MODBUS_DEVICE_ID_LENGTH - 1] = '\0';
+    if (capabilities->maxInFlight > MODBUS_MAX_IN_FLIGHT)
+    {
+        return false;
+    }
+    for (modbusTable_t table = MODBUS_TABLE_COILS; table <= MODBUS_TABLE_INPUT_REGISTERS; table++)
+    {
+        uint16_t maxRead = capabilities->maxRead[table];
+        bool bits = (table == MODBUS_TABLE_COILS || table == MODBUS_TABLE_DISCRETE_INPUTS);
+        if (maxRead > (bits ? MAX_READ_BITS : MAX_READ_REGISTERS) || (bits && (maxRead & 7u)))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ModbusLoadCapabilities(int fd)
+{
+    capabilityFile_t file;
+
+    if (lseek(fd, 0, SEEK_SET) != 0 || !TransferAll(fd, &file.header, sizeof(file.header), false) ||
+        file.header.magic != CAPABILITY_FILE_MAGIC || file.header.version != CAPABILITY_FILE_VERSION ||
+        file.header.recordSize != sizeof(cacheEntry_t))
+    {
+        Log_Debug("Error: Capability cache file is not valid\n");
+        return false;
+    }
+    size_t count =
+        (file.header.count < MODBUS_CAPABILITY_CACHE_SIZE) ? file.header.count : MODBUS_CAPABILITY_CACHE_SIZE;
+    if (!TransferAll(fd, file.entries, count * sizeof(cacheEntry_t), false))
+    {
+        Log_Debug("Error: Capability cache file is truncated\n");
+        return false;
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (ValidEntry(&file.entries[i]))
+        {
+            file.entries[kept++] = file.entries[i];
+        }
+        else
+        {
+            Log_Debug("Error: Ignoring invalid capability cache entry for slave %u\n", file.entries[i].slaveID);
+        }
+    }
+
+    pthread_mutex_lock(&cacheLock);
+    memcpy(cache, file.entries, kept * sizeof(cacheEntry_t));
+    cacheCount = kept;
+    pthread_mutex_unlock(&cacheLock);
+    return true;
+}
+
+bool ModbusSaveCapabilities(int fd)
+{
+    capabilityFile_t file;
+
+    pthread_mutex_lock(&cacheLock);
+    file.header = (capabilityFileHeader_t){.magic = CAPABILITY_FILE_MAGIC,
+                                           .version = CAPABILITY_FILE_VERSION,
+                                           .recordSize = sizeof(cacheEntry_t),
+                                           .count = (uint32_t)cacheCount};
+    memcpy(file.entries, cache, cacheCount * sizeof(cacheEntry_t));
+    pthread_mutex_unlock(&cacheLock);
+
+    size_t length = sizeof(file.header) + file.header.count * sizeof(cacheEntry_t);
+    if (lseek(fd, 0, SEEK_SET) != 0 || !TransferAll(fd, &file, length, true) || ftruncate(fd, (off_t)length) != 0)
+    {
+        Log_Debug("Error: Unable to write capability cache: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,101 @@
+/**
+ * @file    modbus_identity.h
+ * @brief   Reads a device's identification (function code 43, MEI type 14) and remembers what has been learned
+ *          about each device, so it does not have to be found out again after a restart or reconnect.
+ *
+ *          The capability cache holds, for each address and slave, the device's identification, the largest reads
+ *          it accepts, how many requests it handles at once and which function codes it has answered or rejected.
+ *          ModbusIdentifyDevice applies a cached entry to a handle when the device still identifies itself the same
+ *          way; ModbusRememberCapabilities updates the entry from what the handle has since learned. The cache is
+ *          kept in memory and written to and read from a file the application opens, such as the file returned by
+ *          Storage_OpenMutableFile.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+
+#pragma once
+
+#include "modbus.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Longest identification string kept, including the terminator. Longer strings are truncated.
+#define MODBUS_DEVICE_ID_LENGTH 32
+// Number of devices the capability cache holds. The least recently identified device is dropped when it is full.
+#define MODBUS_CAPABILITY_CACHE_SIZE 32
+
+// The basic identification objects every device that supports Read Device Identification must provide
+typedef struct _modbusDeviceIdentity
+{
+    char vendorName[MODBUS_DEVICE_ID_LENGTH];
+    char productCode[MODBUS_DEVICE_ID_LENGTH];
+    char revision[MODBUS_DEVICE_ID_LENGTH];
+} modbusDeviceIdentity_t;
+
+// What is known about a device. Zero means not known.
+typedef struct _modbusCapabilities
+{
+    modbusDeviceIdentity_t identity; // Empty strings if the device does not support Read Device Identification
+    uint16_t maxRead[4];             // Largest quantity accepted per read of each modbusTable_t
+    uint8_t maxInFlight;             // Requests the device handles at once over Modbus TCP
+    uint8_t supported[16];           // Bit per function code the device has answered
+    uint8_t unsupported[16];         // Bit per function code the device has rejected with ILLEGAL_FUNCTION
+} modbusCapabilities_t;
+
+/// <summary>
+/// Reads the basic identification objects (vendor name, product code and revision) from a slave, sending further
+/// requests if the device cannot return them all in one response.
+/// </summary>
+/// <param name="hndl">The modbus handle</param>
+/// <param name="slaveID">The slave to identify</param>
+/// <param name="identity">Receives the identification. Objects the device did not return are empty strings</param>
+/// <param name="error">Receives a Modbus exception code or one of the library's error codes on failure</param>
+/// <param name="timeout">Time in milliseconds after which function will return an error if no response a has been received from the device</param>
+/// <returns>true on success, false otherwise</returns>
+bool ModbusReadDeviceIdentification( modbus_t hndl, uint8_t slaveID, modbusDeviceIdentity_t* identity,
+                                     uint8_t* error, size_t timeout );
+
+/// <summary>
+/// Identifies a slave and looks it up in the capability cache. If the cache holds the same device at the same
+/// address, its limits and function codes are applied to the handle, so they do not have to be found out again.
+/// Otherwise a new entry is started for it, replacing any entry for a different device at that address. Devices
+/// that reject Read Device Identification are cached with an empty identification.
+/// Must be called from the thread using the handle.
+/// </summary>
+/// <param name="hndl">The modbus handle</param>
+/// <param name="slaveID">The slave to identify</param>
+/// <param name="capabilities">If not NULL, receives what is known about the device</param>
+/// <param name="cached">If not NULL, set to true if the device was found in the cache</param>
+/// <param name="error">Receives a Modbus exception code or one of the library's error codes on failure</param>
+/// <param name="timeout">Time in milliseconds after which function will return an error if no response a has been received from the device</param>
+/// <returns>true on success, false if the device could not be identified</returns>
+bool ModbusIdentifyDevice( modbus_t hndl, uint8_t slaveID, modbusCapabilities_t* capabilities, bool* cached,
+                           uint8_t* error, size_t timeout );
+
+/// <summary>
+/// Updates a device's cache entry with what the handle has learned about it since it was identified: read limits,
+/// the number of requests in flight and the function codes it has answered or rejected.
+/// Must be called from the thread using the handle.
+/// </summary>
+/// <param name="hndl">The modbus handle</param>
+/// <param name="slaveID">The slave, which must have been identified with ModbusIdentifyDevice</param>
+/// <returns>true on success, false if the device is not in the cache</returns>
+bool ModbusRememberCapabilities( modbus_t hndl, uint8_t slaveID );
+
+/// <summary>
+/// Replaces the capability cache with one saved by ModbusSaveCapabilities. Entries with limits outside those the
+/// library accepts are left out.
+/// </summary>
+/// <param name="fd">A file open for reading, read from the start</param>
+/// <returns>true on success, false if the file could not be read or was not written by this version of the library,
+/// in which case the cache is unchanged</returns>
+bool ModbusLoadCapabilities( int fd );
+
+/// <summary>
+/// Writes the capability cache to a file, replacing its contents.
+/// </summary>
+/// <param name="fd">A file open for reading and writing</param>
+/// <returns>true on success, false otherwise</returns>
+bool ModbusSaveCapabilities( int fd );
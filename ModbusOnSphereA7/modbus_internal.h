@@ -0,0 +1,446 @@
+/**
+ * @file    modbus_internal.h
+ * @brief   Definitions shared between the modules of the modbus library. Not for use by applications.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+
+#pragma once
+
+#include "modbus.h"
+#include "../modbusCommon.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define TCP_HEADER_LENGTH 6
+#define MODBUS_EXCEPTION_BIT 0x80
+
+#define MESSAGE_HEADER_LENGTH 4
+
+// Largest quantities a single request may read or write, from the Modbus application protocol specification
+#define MAX_READ_REGISTERS 125
+#define MAX_READ_BITS 2000
+#define MAX_WRITE_REGISTERS 123
+#define MAX_WRITE_BITS 1968
+
+// Helper define for filling the header - requires _a exists and is the right size.
+#define SET_MODBUS_HEADER(_a, _b, _c, _d, _e)                                                                          \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        /*slave id*/                                                                                                   \
+        _a[0] = (_b);                                                                                                  \
+        /*function code*/                                                                                              \
+        _a[1] = (_c);                                                                                                  \
+        /*data (first address to write to in the device)*/                                                             \
+        _a[2] = (uint8_t)(((_d) >> 8) & 0xFF);                                                                         \
+        _a[3] = (uint8_t)((_d)&0xFF);                                                                                  \
+        /*data (content to write to)*/                                                                                 \
+        _a[4] = (uint8_t)(((_e) >> 8) & 0xFF);                                                                         \
+        _a[5] = (uint8_t)((_e)&0xFF);                                                                                  \
+    } while (0);
+
+// Helper define for filling a 16 bit field of a frame, most significant byte first - requires _a has two bytes.
+#define SET_MODBUS_U16(_a, _v)                                                                                         \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        (_a)[0] = (uint8_t)(((_v) >> 8) & 0xFF);                                                                       \
+        (_a)[1] = (uint8_t)((_v)&0xFF);                                                                                \
+    } while (0)
+
+/* Values for overrun detection */
+//#define BUFFER_CHECK_ON // Uncomment to turn buffer checking on.
+#ifdef BUFFER_CHECK_ON
+#define BUFFER_ZONE_SIZE 16
+#define BUFFER_ZONE_VAL1 0xca
+#define BUFFER_ZONE_VAL2 0xbc
+#endif
+
+/*
+Type: modbus_transport_type
+
+Description:
+    Determines the protocol used to transmit the message.
+
+Values:
+    tcp: Sending data using EtherNet.
+    rtuOverTcp: Sending an rtu package using EtherNet
+    rtu: Sending from the A7 to the M4 processors on the Microsoft� sphere.
+    rtuSerial: Sending an rtu package on a serial port opened directly, where there is no M4
+    local: Sending a TCP package through shared memory to a local server in another process
+*/
+typedef enum
+{
+    tcp,
+    rtuOverTcp,
+    rtu,
+    rtuSerial,
+    local
+} modbusTransportType_t;
+
+// Long enough for a dotted IPv4 address and the terminator
+#define MODBUS_IP_LENGTH 16
+
+struct _TCP
+{
+    char ip[MODBUS_IP_LENGTH];
+    uint16_t port;
+};
+struct _RTU
+{
+    uint16_t baudRate;
+    uint8_t halfDuplexMode;
+    uint8_t parityMode;
+    uint8_t parityState;
+    uint8_t stopBits;
+    uint8_t wordLength;
+};
+
+// The client's end of a channel to a local server, see modbus_local.c
+struct _LOCAL
+{
+    struct _localChannel *channel; // The memory shared with the server
+    int socketFd;                  // Only used to connect, and to see the server go away
+    int requestFd;                 // Rung by the client when it has written requests
+    int responseFd;                // Rung by the server when it has written responses
+    uint32_t timeout;              // Milliseconds to wait for room for a request, 0 to wait while the server is there
+};
+
+union _connectData {
+    struct _TCP TCP;
+    struct _RTU RTU;
+    struct _LOCAL LOCAL;
+};
+
+typedef enum
+{
+    Idle,
+    SendingRequest,
+    WaitingForResponse,
+    DataReceived,
+    TransactionFailed,
+    Disconnected
+} MODBUS_STATE;
+
+// Holds a partly received response while a transaction is in flight. Taken from a shared pool when a request is
+// sent and returned when the transaction completes, so idle handles hold no receive memory.
+struct _modbusRx
+{
+    uint16_t length;                     // The current length of the data received since the last complete message
+    struct _modbusRx *nextFree;          // Links unused buffers in the pool
+    uint8_t buffer[MAX_PDU_LENGTH];      // The data received since the last complete message from the device
+#ifdef BUFFER_CHECK_ON
+    uint8_t bufferZone[BUFFER_ZONE_SIZE]; // Debug only - used to detect possible buffer overrun
+#endif
+};
+
+// One request sent by ModbusRunRequests
+typedef struct _modbusPending
+{
+    uint8_t *request;        // Request PDU, from the slave ID, without transport framing
+    uint16_t requestLength;  // Length of the request
+    uint8_t *response;       // MAX_PDU_LENGTH buffer that receives the response PDU
+    uint16_t responseLength; // Length of the response, or 0 if none was received
+    uint8_t error;           // Why there is no response: MESSAGE_SEND_FAIL, MODBUS_TIMEOUT or HANDLE_IN_USE
+    bool corrupt;            // A response arrived but failed its CRC check
+} modbusPending_t;
+
+// Modbus TCP requests in flight together, matched to their responses by transaction ID
+struct _modbusBatch
+{
+    uint16_t firstTransactionId; // Request i was sent with firstTransactionId + i
+    uint16_t count;              // Number of requests sent
+    uint16_t outstanding;        // Number of responses still expected
+    modbusPending_t *requests;
+};
+
+// A request encoded once for a transport by the ModbusPrepare functions. Never changed after it is built.
+struct _modbusPrepared
+{
+    modbusTransportType_t type;      // Transport the frame was encoded for
+    uint8_t slaveId;                 // Slave the request is addressed to
+    uint8_t functionCode;            // Function code of the request
+    uint16_t pduLength;              // Length of the request from the slave ID, without transport framing
+    uint16_t aduLength;              // Length of the encoded frame
+    uint8_t adu[MAX_PDU_LENGTH + TCP_HEADER_LENGTH]; // The frame as sent; a Modbus TCP transaction ID is sent in
+                                                     // place of the first two bytes
+};
+
+// Smoothed round trip time and its mean deviation, as TCP keeps them to set its retransmission timeout.
+// Zero until the first response.
+struct _modbusRtt
+{
+    uint32_t srttUs;
+    uint32_t rttvarUs;
+};
+
+// Every value of a slave ID, for tables indexed by one
+#define SLAVE_ID_COUNT 256
+
+// Adaptive timeout state of a handle, see ModbusSetAdaptiveTimeout. Allocated when adaptive timeouts are turned on,
+// with room for every slave, so nothing is allocated while requests are in flight.
+struct _modbusAdaptive
+{
+    uint32_t minTimeout;   // Bounds of the wait in milliseconds
+    uint32_t maxTimeout;
+    struct _modbusRtt rtt; // Round trip times of all slaves, for slaves that have not answered yet
+    struct
+    {
+        struct _modbusRtt rtt;  // Round trip times of the slave's responses
+        uint8_t timeoutBackoff; // Timeouts since the slave last answered; each doubles its wait
+    } slaves[SLAVE_ID_COUNT];
+};
+
+// Circuit breakers of a handle, see ModbusSetCircuitBreaker. Allocated when they are turned on, with a breaker for
+// every slave, so nothing is allocated while requests are in flight.
+struct _modbusBreaker
+{
+    uint8_t failureThreshold;
+    uint32_t openTime;
+    uint32_t maxOpenTime;
+    modbusBreakerCallback_t callback;
+    void *context;
+    bool refused; // The last request was not sent because its slave's breaker is open
+    struct
+    {
+        uint64_t openUntilUs;        // When an open breaker lets a probe through
+        uint8_t consecutiveTimeouts; // Timeouts since the slave last answered
+        uint8_t state;               // modbusBreakerState_t
+        uint8_t backoff;             // Times the breaker has reopened after a failed probe; each doubles its open time
+    } slaves[SLAVE_ID_COUNT];
+};
+
+// Retry policy of a handle, see ModbusSetRetryPolicy
+struct _modbusRetry
+{
+    modbusRetryPolicy_t policy;
+    modbusRetryStats_t stats;
+    unsigned int seed;          // For the jitter
+    bool deferred;              // Retries are left to ModbusRunRequests, which sends other requests first
+    uint8_t *request;           // The request ModBusWrite is sending, kept to send it again
+    uint16_t requestLength;
+    const struct _modbusPrepared *prepared; // Or the prepared request being sent
+};
+
+// What has been learned about one slave on a handle. Only slaves that have been given limits or identified have
+// one, so most handles have none.
+struct _modbusSlave
+{
+    uint8_t slaveID;
+    uint16_t maxRead[4];            // Largest quantity the slave accepts per read of each modbusTable_t, 0 if not known
+    uint8_t supported[16];          // Bit per function code the slave has answered
+    uint8_t unsupported[16];        // Bit per function code the slave has rejected with ILLEGAL_FUNCTION
+    struct _modbusSlave *next;
+};
+
+#define MODBUS_CACHE_LINE 64
+
+struct _modbus_t
+{
+    // Used on every transaction; kept within the first cache line.
+    _Alignas(MODBUS_CACHE_LINE) MODBUS_STATE state; // The current state of a transaction
+    modbusTransportType_t type;     // The method of data transfer being used
+    int fd;                         // The file descriptor
+    uint16_t transactionId;         // Used to check TCP responses
+    uint16_t lastTransactionId;     // Used to check for wraparound when overflowing the transaction identifier
+    uint16_t pduLength;             // After a successful read it will be length of valid data in the pdu buffer
+    uint16_t requestLength;         // Length of the current request PDU, including the slave ID
+    uint8_t requestSlaveId;         // Slave ID of the current request
+    uint8_t requestFunctionCode;    // Function code of the current request
+    bool isCFG;                     // Bool to let the device know to add a modbus header or a config header.
+    uint8_t *pdu;                   // The caller's buffer, MAX_PDU_LENGTH long, that receives the response pdu
+    struct _modbusRx *rx;           // Receive buffer, only held while a transaction is in flight
+    struct _modbusBatch *batch;     // Requests in flight when several are sent at once, otherwise NULL
+    uint64_t requestSentUs;         // When the current request was handed to the transport
+
+    // Only used when connecting and closing.
+    union _connectData connectData; // Any additional data required for that transfer method.
+    struct _modbusBus *bus;         // Occupancy accounting for RTU handles, NULL for TCP
+    struct _modbus_t *nextFree;     // Links unused handles in the storage passed to ModbusInitEx
+    uint8_t maxInFlight;            // Requests a Modbus TCP handle may have outstanding at once
+    uint8_t noMaskWrite[32];        // Bit per slave ID, set when a slave rejects Mask Write Register
+    struct _modbusSlave *slaves;    // Limits and function codes learned per slave, see ModbusFindSlave
+    bool noReadLimitDiscovery;      // Set to stop ModbusTransact searching for the read limits of slaves
+    bool responseCorrupt;           // A response to the current request failed its CRC check
+    struct _modbusAdaptive *adaptive; // NULL unless adaptive timeouts are on
+    struct _modbusBreaker *breaker; // NULL unless circuit breakers are on
+    struct _modbusRetry *retry;     // NULL unless a retry policy is set
+};
+
+/// <summary>
+/// Sends a set of requests and collects their responses. A Modbus TCP handle keeps up to maxInFlight requests
+/// outstanding at once; other handles send them one at a time.
+/// </summary>
+/// <param name="hndl">The modbus handle</param>
+/// <param name="requests">The requests; the response fields are filled in</param>
+/// <param name="count">Number of requests</param>
+/// <param name="timeout">Time to wait for each group of responses, as for the single request functions</param>
+/// <returns>true if every request received a response, which may be an exception</returns>
+bool ModbusRunRequests(modbus_t hndl, modbusPending_t *requests, size_t count, size_t timeout);
+
+/// <summary>
+/// Sends a prepared request and waits for the response.
+/// </summary>
+/// <param name="hndl">The modbus handle, which must use the transport the request was prepared for</param>
+/// <param name="prepared">The request</param>
+/// <param name="response">MAX_PDU_LENGTH buffer that receives the response, from the slave ID</param>
+/// <param name="timeout">Time to wait for the response, as for the single request functions</param>
+/// <param name="error">Receives HANDLE_IN_USE, MESSAGE_SEND_FAIL or MODBUS_TIMEOUT if there is no response</param>
+/// <returns>The length of the response, or 0 if there is none</returns>
+uint16_t ModbusRunPrepared(modbus_t hndl, const struct _modbusPrepared *prepared, uint8_t *response, size_t timeout,
+                           uint8_t *error);
+
+/// <summary>
+/// Finds the request in a prepared frame.
+/// </summary>
+/// <param name="prepared">The request</param>
+/// <returns>The request PDU, from the slave ID, pduLength bytes long</returns>
+const uint8_t *ModbusPreparedPdu(const struct _modbusPrepared *prepared);
+
+/// <summary>
+/// Sends a request without waiting for the response, so that requests on several handles can be in flight at once.
+/// The transaction must be ended with ModbusFinishRequest.
+/// </summary>
+/// <param name="hndl">The modbus handle, which must be Idle</param>
+/// <param name="request">Request PDU, from the slave ID, without transport framing</param>
+/// <param name="requestLength">Length of the request</param>
+/// <param name="response">MAX_PDU_LENGTH buffer that receives the response, from the slave ID</param>
+/// <param name="error">Receives HANDLE_IN_USE, DEVICE_DISCONNECTED, MESSAGE_SEND_FAIL or SLAVE_UNAVAILABLE if the
+/// request was not sent</param>
+/// <returns>true if the request was sent</returns>
+bool ModbusStartRequest(modbus_t hndl, uint8_t *request, uint16_t requestLength, uint8_t *response, uint8_t *error);
+
+/// <summary>
+/// Checks, without waiting, whether a request sent with ModbusStartRequest has been answered or has failed.
+/// </summary>
+/// <param name="hndl">The modbus handle</param>
+/// <returns>true if ModbusFinishRequest will not find the request still outstanding</returns>
+bool ModbusRequestDone(modbus_t hndl);
+
+/// <summary>
+/// Ends a transaction begun with ModbusStartRequest and returns the handle to Idle. A request still outstanding
+/// counts as timed out unless it is cancelled; a cancelled request is not charged to its slave's round trip times,
+/// adaptive timeout or circuit breaker, and a late response to it is discarded.
+/// </summary>
+/// <param name="hndl">The modbus handle</param>
+/// <param name="cancel">Whether the request is being abandoned rather than waited for</param>
+/// <param name="error">Receives MODBUS_TIMEOUT if there is no response</param>
+/// <returns>The length of the response in the buffer passed to ModbusStartRequest, or 0 if there is none</returns>
+uint16_t ModbusFinishRequest(modbus_t hndl, bool cancel, uint8_t *error);
+
+/// <summary>
+/// Gets the largest number of registers or bits that can be read from a table in one request, allowing for the
+/// size of the library's receive buffer and the framing of the handle's transport.
+/// A limit set for the slave with ModbusSetReadLimit lowers it further.
+/// </summary>
+/// <param name="hndl">The modbus handle</param>
+/// <param name="slaveID">The slave to be read</param>
+/// <param name="table">The table to be read</param>
+/// <returns>The maximum quantity for one request</returns>
+uint16_t ModbusMaxReadQuantity(modbus_t hndl, uint8_t slaveID, modbusTable_t table);
+
+/// <summary>
+/// Finds what has been learned about a slave on a handle. Must be called from the thread using the handle.
+/// </summary>
+/// <param name="hndl">The modbus handle</param>
+/// <param name="slaveID">The slave</param>
+/// <param name="create">Whether to add an empty record if there is none</param>
+/// <returns>The record, or NULL if there is none or it could not be allocated</returns>
+struct _modbusSlave *ModbusFindSlave(modbus_t hndl, uint8_t slaveID, bool create);
+
+/// <summary>
+/// Gets the monotonic time used to time transactions.
+/// </summary>
+/// <returns>Microseconds since an arbitrary point</returns>
+uint64_t ModbusMonotonicUs(void);
+
+/// <summary>
+/// Attaches to the occupancy accounting for a bus, creating it on first use, and applies the line settings.
+/// </summary>
+/// <param name="name">Identifies the physical bus; handles with the same name share the accounting</param>
+/// <param name="setup">The line settings</param>
+/// <param name="transportLatencyUs">Latency between the library and the bus that should not be charged to it</param>
+/// <returns>The bus, or NULL if all bus entries are in use</returns>
+struct _modbusBus *BusStatsAttach(const char *name, const struct _RTU *setup, uint32_t transportLatencyUs);
+
+/// <summary>
+/// Gets the name a bus was attached with.
+/// </summary>
+/// <param name="bus">The bus</param>
+/// <returns>The name</returns>
+const char *BusStatsName(const struct _modbusBus *bus);
+
+/// <summary>
+/// Connects to a local server and maps the channel it gives the client. The server rings responseFd when it has
+/// written responses, and socketFd hangs up when the server goes away.
+/// </summary>
+/// <param name="local">Receives the client's end of the channel</param>
+/// <param name="path">The path of the server's socket</param>
+/// <param name="timeout">Time in milliseconds to wait for the server to accept the connection, and for room for a
+/// request</param>
+/// <returns>true on success, false otherwise, with nothing left open</returns>
+bool LocalConnect(struct _LOCAL *local, const char *path, size_t timeout);
+
+/// <summary>
+/// Gets the path of the server a channel is connected to.
+/// </summary>
+/// <param name="local">The channel</param>
+/// <param name="path">Receives the path, or an empty string if it can't be found</param>
+/// <param name="length">The size of path</param>
+/// <returns>path</returns>
+char *LocalPath(const struct _LOCAL *local, char *path, size_t length);
+
+/// <summary>
+/// Writes a frame to the server, all of it or none of it, and rings its doorbell if it is waiting. While the ring is
+/// full, waits for the server to make room for up to the timeout given to LocalConnect.
+/// </summary>
+/// <param name="local">The channel</param>
+/// <param name="iov">The parts of the frame</param>
+/// <param name="count">The number of parts</param>
+/// <returns>true if the frame was written, false if there was still not room for it or the server has gone</returns>
+bool LocalSend(struct _LOCAL *local, const struct iovec *iov, int count);
+
+/// <summary>
+/// Reads what the server has written, as recv would from a Modbus TCP socket. Called when the doorbell is readable.
+/// </summary>
+/// <param name="local">The channel</param>
+/// <param name="buffer">Receives the data</param>
+/// <param name="length">The size of the buffer</param>
+/// <returns>The number of bytes read, or -1 with errno set to EAGAIN if there were none</returns>
+ssize_t LocalReceive(struct _LOCAL *local, uint8_t *buffer, size_t length);
+
+/// <summary>
+/// Unmaps a channel and closes its descriptors.
+/// </summary>
+/// <param name="local">The channel</param>
+void LocalClose(struct _LOCAL *local);
+
+/// <summary>
+/// Releases a bus attached with <see cref="BusStatsAttach" />.
+/// </summary>
+/// <param name="bus">The bus</param>
+void BusStatsDetach(struct _modbusBus *bus);
+
+/// <summary>
+/// Charges a completed transaction to a bus.
+/// </summary>
+/// <param name="bus">The bus</param>
+/// <param name="slaveId">Slave ID of the request</param>
+/// <param name="functionCode">Function code of the request</param>
+/// <param name="requestLength">Request PDU length including the slave ID, excluding the CRC</param>
+/// <param name="responseLength">Response PDU length including the slave ID, excluding the CRC</param>
+/// <param name="elapsedUs">Time from handing the request to the transport until the transaction completed</param>
+/// <param name="responded">false if the slave did not respond before the timeout</param>
+void BusStatsRecord(struct _modbusBus *bus, uint8_t slaveId, uint8_t functionCode, uint16_t requestLength,
+                    uint16_t responseLength, uint64_t elapsedUs, bool responded);
+
+/// <summary>
+/// Counts a request that is about to be sent again under a handle's retry policy.
+/// </summary>
+/// <param name="bus">The bus</param>
+/// <param name="slaveId">Slave ID of the request</param>
+/// <param name="functionCode">Function code of the request</param>
+void BusStatsRetry(struct _modbusBus *bus, uint8_t slaveId, uint8_t functionCode);
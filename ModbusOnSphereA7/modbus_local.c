@@ -0,0 +1,612 @@
+/**
+ * @file    modbus_local.c
+ * @brief   Modbus between processes on the same machine through shared memory rings and eventfd doorbells.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+
+#include "modbus_local.h"
+#include "modbus_internal.h"
+#include <applibs/log.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOCAL_MAGIC 0x434C424D // "MBLC"
+#define LOCAL_VERSION 1
+#define LOCAL_RING_SIZE 4096
+#define LOCAL_CHANNEL_FDS 3 // The channel's memory, then the request and response doorbells
+#define LOCAL_EVENTS 16     // Events taken from the server's epoll at once
+
+_Static_assert((LOCAL_RING_SIZE & (LOCAL_RING_SIZE - 1)) == 0, "LOCAL_RING_SIZE must be a power of two");
+_Static_assert(LOCAL_RING_SIZE >= MODBUS_MAX_IN_FLIGHT * (TCP_HEADER_LENGTH + MAX_PDU_LENGTH),
+               "A local ring must hold a full batch of requests");
+
+// One direction of a channel, with a single producer and a single consumer. tail and head count the bytes written
+// and read since the channel was created, and are only reduced to an offset when the data is accessed. Each is
+// written by one side only, so they are kept on separate cache lines. Frames are always written whole.
+typedef struct
+{
+    _Alignas(MODBUS_CACHE_LINE) uint32_t tail; // Written by the producer
+    _Alignas(MODBUS_CACHE_LINE) uint32_t head; // Written by the consumer
+    _Alignas(MODBUS_CACHE_LINE) uint32_t armed; // Set by the consumer when it has emptied the ring and will wait
+                                                // for the doorbell, cleared by whichever side sees it first
+    _Alignas(MODBUS_CACHE_LINE) uint8_t data[LOCAL_RING_SIZE];
+} localRing_t;
+
+// The memory shared by a client and the server. Created and filled in by the server before the client has it.
+typedef struct _localChannel
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t ringSize;
+    localRing_t requests;  // Client to server
+    localRing_t responses; // Server to client
+} localChannel_t;
+
+// The server's end of a channel; socketFd is -1 when the slot is free
+typedef struct
+{
+    localChannel_t *channel;
+    int socketFd;
+    int requestFd;
+    int responseFd;
+} localClient_t;
+
+struct _modbusLocalServer
+{
+    int listenFd;
+    int epollFd; // The listening socket with a NULL pointer, and each client's socket and request doorbell
+    modbusLocalHandler_t handler;
+    void *context;
+    uint8_t maxClients;
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    localClient_t clients[MODBUS_LOCAL_MAX_CLIENTS];
+};
+
+static uint32_t RingUsed(const localRing_t *ring)
+{
+    return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+}
+
+// Writes the parts of one frame, or nothing if there is not room for all of it.
+static bool RingWrite(localRing_t *ring, const struct iovec *iov, int count)
+{
+    size_t total = 0;
+    for (int i = 0; i < count; i++)
+    {
+        total += iov[i].iov_len;
+    }
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    uint32_t used = tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (used > LOCAL_RING_SIZE || total > LOCAL_RING_SIZE - used)
+    {
+        return false;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        const uint8_t *source = iov[i].iov_base;
+        size_t length = iov[i].iov_len;
+        size_t offset = tail & (LOCAL_RING_SIZE - 1);
+        size_t first = (length < LOCAL_RING_SIZE - offset) ? length : LOCAL_RING_SIZE - offset;
+        memcpy(&ring->data[offset], source, first);
+        memcpy(ring->data, source + first, length - first);
+        tail += (uint32_t)length;
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Copies bytes from the front of the ring, and consumes them if consume is set.
+static void RingCopy(localRing_t *ring, uint8_t *buffer, size_t length, bool consume)
+{
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    size_t offset = head & (LOCAL_RING_SIZE - 1);
+    size_t first = (length < LOCAL_RING_SIZE - offset) ? length : LOCAL_RING_SIZE - offset;
+    memcpy(buffer, &ring->data[offset], first);
+    memcpy(buffer + first, ring->data, length - first);
+    if (consume)
+    {
+        __atomic_store_n(&ring->head, head + (uint32_t)length, __ATOMIC_RELEASE);
+    }
+}
+
+static void RingDoorbell(int doorbellFd)
+{
+    uint64_t one = 1;
+    if (write(doorbellFd, &one, sizeof(one)) < 0)
+    {
+        Log_Debug("Error: Unable to ring local doorbell: %s\n", strerror(errno));
+    }
+}
+
+// Rings the consumer's doorbell if it is waiting for it. Called by the producer after writing.
+static void RingNotify(localRing_t *ring, int doorbellFd)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&ring->armed, 0, __ATOMIC_SEQ_CST))
+    {
+        RingDoorbell(doorbellFd);
+    }
+}
+
+// Called by the consumer when it has emptied the ring. Returns false if a frame arrived meanwhile and the producer
+// did not see the ring armed, so the consumer must read it rather than wait for the doorbell.
+static bool RingArm(localRing_t *ring)
+{
+    __atomic_store_n(&ring->armed, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == __atomic_load_n(&ring->head, __ATOMIC_RELAXED))
+    {
+        return true;
+    }
+    return !__atomic_exchange_n(&ring->armed, 0, __ATOMIC_SEQ_CST);
+}
+
+static void ClearDoorbell(int doorbellFd)
+{
+    uint64_t count;
+    // Fails with EAGAIN when the doorbell was not rung, as when a wake up was left over from an earlier read.
+    if (read(doorbellFd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    {
+        Log_Debug("Error: Unable to clear local doorbell: %s\n", strerror(errno));
+    }
+}
+
+static bool SetSocketPath(struct sockaddr_un *address, char *copy, const char *path)
+{
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (!path || strlen(path) >= sizeof(address->sun_path))
+    {
+        Log_Debug("Error: Local socket path is not valid\n");
+        return false;
+    }
+    strcpy(address->sun_path, path);
+    if (copy)
+    {
+        strcpy(copy, path);
+    }
+    return true;
+}
+
+bool LocalConnect(struct _LOCAL *local, const char *path, size_t timeout)
+{
+    struct sockaddr_un address;
+    *local = (struct _LOCAL){.socketFd = -1, .requestFd = -1, .responseFd = -1};
+    if (!SetSocketPath(&address, NULL, path))
+    {
+        return false;
+    }
+    local->timeout = (timeout > UINT32_MAX) ? UINT32_MAX : (uint32_t)timeout;
+    local->socketFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct timeval wait = {.tv_sec = (time_t)(timeout / 1000), .tv_usec = (suseconds_t)(timeout % 1000) * 1000};
+    if (local->socketFd < 0 || setsockopt(local->socketFd, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait)) != 0 ||
+        connect(local->socketFd, (struct sockaddr *)&address, sizeof(address)) != 0)
+    {
+        Log_Debug("Error: Unable to connect to local server %s: %s\n", path, strerror(errno));
+        goto fail;
+    }
+
+    // The server answers the connection with its version and the channel's descriptors, or closes it if it is full.
+    uint8_t version = 0;
+    struct iovec iov = {.iov_base = &version, .iov_len = sizeof(version)};
+    union
+    {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(LOCAL_CHANNEL_FDS * sizeof(int))];
+    } control;
+    struct msghdr message = {.msg_iov = &iov,
+                             .msg_iovlen = 1,
+                             .msg_control = control.buffer,
+                             .msg_controllen = sizeof(control.buffer)};
+    ssize_t received = recvmsg(local->socketFd, &message, MSG_CMSG_CLOEXEC);
+    struct cmsghdr *header = (received == 1) ? CMSG_FIRSTHDR(&message) : NULL;
+    int fds[LOCAL_CHANNEL_FDS] = {-1, -1, -1};
+    if (header && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS)
+    {
+        size_t fdCount = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(header), ((fdCount < LOCAL_CHANNEL_FDS) ? fdCount : LOCAL_CHANNEL_FDS) * sizeof(int));
+    }
+    local->requestFd = fds[1];
+    local->responseFd = fds[2];
+    struct stat status;
+    if (fds[0] < 0 || fds[1] < 0 || fds[2] < 0 || version != LOCAL_VERSION || fstat(fds[0], &status) != 0 ||
+        (size_t)status.st_size < sizeof(localChannel_t))
+    {
+        Log_Debug("Error: Local server %s refused the connection\n", path);
+        if (fds[0] >= 0)
+        {
+            close(fds[0]);
+        }
+        goto fail;
+    }
+    void *memory = mmap(NULL, sizeof(localChannel_t), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+    if (memory == MAP_FAILED)
+    {
+        Log_Debug("Error: Unable to map local channel: %s\n", strerror(errno));
+        goto fail;
+    }
+    local->channel = memory;
+    if (local->channel->magic != LOCAL_MAGIC || local->channel->version != LOCAL_VERSION ||
+        local->channel->ringSize != LOCAL_RING_SIZE)
+    {
+        Log_Debug("Error: Local channel from %s has an unknown layout\n", path);
+        goto fail;
+    }
+    return true;
+
+fail:
+    LocalClose(local);
+    return false;
+}
+
+char *LocalPath(const struct _LOCAL *local, char *path, size_t length)
+{
+    // The server's socket is still bound to the path it was connected by.
+    struct sockaddr_un address = {0};
+    socklen_t addressLength = sizeof(address);
+    if (getpeername(local->socketFd, (struct sockaddr *)&address, &addressLength) != 0 ||
+        addressLength <= offsetof(struct sockaddr_un, sun_path))
+    {
+        address.sun_path[0] = '\0';
+    }
+    address.sun_path[sizeof(address.sun_path) - 1] = '\0';
+    snprintf(path, length, "%s", address.sun_path);
+    return path;
+}
+
+bool LocalSend(struct _LOCAL *local, const struct iovec *iov, int count)
+{
+    localRing_t *ring = &local->channel->requests;
+    uint64_t deadlineUs = ModbusMonotonicUs() + (uint64_t)local->timeout * 1000;
+
+    // As a send on a full socket would block, wait for the server to make room, unless it has gone.
+    while (!RingWrite(ring, iov, count))
+    {
+        uint8_t byte;
+        if ((local->timeout && ModbusMonotonicUs() >= deadlineUs) ||
+            recv(local->socketFd, &byte, sizeof(byte), MSG_PEEK | MSG_DONTWAIT) == 0)
+        {
+            Log_Debug("Error: Local server is not reading requests\n");
+            return false;
+        }
+        struct timespec t = {.tv_sec = 0, .tv_nsec = 100000};
+        nanosleep(&t, NULL);
+    }
+    RingNotify(ring, local->requestFd);
+    return true;
+}
+
+ssize_t LocalReceive(struct _LOCAL *local, uint8_t *buffer, size_t length)
+{
+    localRing_t *ring = &local->channel->responses;
+    ClearDoorbell(local->responseFd);
+    uint32_t used = RingUsed(ring);
+    if (used > LOCAL_RING_SIZE)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    size_t received = (used < length) ? used : length;
+    RingCopy(ring, buffer, received, true);
+
+    // The doorbell has been cleared, so if anything is left, or arrives before the ring is armed, ring it here to
+    // be called again.
+    if (used > received || !RingArm(ring))
+    {
+        RingDoorbell(local->responseFd);
+    }
+    if (received == 0)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    return (ssize_t)received;
+}
+
+void LocalClose(struct _LOCAL *local)
+{
+    if (local->channel)
+    {
+        munmap(local->channel, sizeof(localChannel_t));
+    }
+    if (local->socketFd >= 0)
+    {
+        close(local->socketFd);
+    }
+    if (local->requestFd >= 0)
+    {
+        close(local->requestFd);
+    }
+    if (local->responseFd >= 0)
+    {
+        close(local->responseFd);
+    }
+    *local = (struct _LOCAL){.socketFd = -1, .requestFd = -1, .responseFd = -1};
+}
+
+static void DropClient(modbusLocalServer_t server, localClient_t *client)
+{
+    epoll_ctl(server->epollFd, EPOLL_CTL_DEL, client->requestFd, NULL);
+    epoll_ctl(server->epollFd, EPOLL_CTL_DEL, client->socketFd, NULL);
+    close(client->requestFd);
+    close(client->responseFd);
+    close(client->socketFd);
+    munmap(client->channel, sizeof(localChannel_t));
+    client->socketFd = -1;
+}
+
+// Creates a channel for a new connection and passes it to the client.
+static void AcceptClient(modbusLocalServer_t server)
+{
+    int socketFd = accept4(server->listenFd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (socketFd < 0)
+    {
+        return;
+    }
+    localClient_t *client = NULL;
+    for (uint8_t i = 0; i < server->maxClients && !client; i++)
+    {
+        if (server->clients[i].socketFd < 0)
+        {
+            client = &server->clients[i];
+        }
+    }
+    if (!client)
+    {
+        Log_Debug("Error: Local server is full, connection refused\n");
+        close(socketFd);
+        return;
+    }
+
+    // The channel can't be resized once the client has it, so the client can trust the size it maps.
+    int memoryFd = memfd_create("modbus-local", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    void *memory = MAP_FAILED;
+    if (memoryFd >= 0 && ftruncate(memoryFd, sizeof(localChannel_t)) == 0 &&
+        fcntl(memoryFd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == 0)
+    {
+        memory = mmap(NULL, sizeof(localChannel_t), PROT_READ | PROT_WRITE, MAP_SHARED, memoryFd, 0);
+    }
+    client->requestFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    client->responseFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (memory == MAP_FAILED || client->requestFd < 0 || client->responseFd < 0)
+    {
+        Log_Debug("Error: Unable to create local channel: %s\n", strerror(errno));
+        goto fail;
+    }
+    client->channel = memory;
+    client->channel->magic = LOCAL_MAGIC;
+    client->channel->version = LOCAL_VERSION;
+    client->channel->ringSize = LOCAL_RING_SIZE;
+    client->channel->requests.armed = 1;
+    client->channel->responses.armed = 1;
+
+    uint8_t version = LOCAL_VERSION;
+    struct iovec iov = {.iov_base = &version, .iov_len = sizeof(version)};
+    union
+    {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(LOCAL_CHANNEL_FDS * sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr message = {.msg_iov = &iov,
+                             .msg_iovlen = 1,
+                             .msg_control = control.buffer,
+                             .msg_controllen = sizeof(control.buffer)};
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(LOCAL_CHANNEL_FDS * sizeof(int));
+    int fds[LOCAL_CHANNEL_FDS] = {memoryFd, client->requestFd, client->responseFd};
+    memcpy(CMSG_DATA(header), fds, sizeof(fds));
+
+    struct epoll_event requests = {.events = EPOLLIN, .data.ptr = client};
+    struct epoll_event hangup = {.events = EPOLLRDHUP, .data.ptr = client};
+    if (sendmsg(socketFd, &message, MSG_NOSIGNAL) != 1 ||
+        epoll_ctl(server->epollFd, EPOLL_CTL_ADD, client->requestFd, &requests) != 0 ||
+        epoll_ctl(server->epollFd, EPOLL_CTL_ADD, socketFd, &hangup) != 0)
+    {
+        Log_Debug("Error: Unable to pass local channel to client: %s\n", strerror(errno));
+        epoll_ctl(server->epollFd, EPOLL_CTL_DEL, client->requestFd, NULL);
+        goto fail;
+    }
+    close(memoryFd);
+    client->socketFd = socketFd;
+    return;
+
+fail:
+    if (memory != MAP_FAILED)
+    {
+        munmap(memory, sizeof(localChannel_t));
+    }
+    if (memoryFd >= 0)
+    {
+        close(memoryFd);
+    }
+    if (client->requestFd >= 0)
+    {
+        close(client->requestFd);
+    }
+    if (client->responseFd >= 0)
+    {
+        close(client->responseFd);
+    }
+    close(socketFd);
+}
+
+// Answers every request a client has written. Returns the number answered, or -1 if the client's ring is not
+// valid and it must be dropped.
+static int ServeClient(modbusLocalServer_t server, localClient_t *client)
+{
+    localRing_t *requests = &client->channel->requests;
+    localRing_t *responses = &client->channel->responses;
+    int answered = 0;
+
+    ClearDoorbell(client->requestFd);
+    do
+    {
+        bool responded = false;
+        for (uint32_t used = RingUsed(requests); used > 0; used = RingUsed(requests))
+        {
+            uint8_t request[TCP_HEADER_LENGTH + MAX_PDU_LENGTH];
+            uint8_t response[TCP_HEADER_LENGTH + MAX_PDU_LENGTH];
+            if (used > LOCAL_RING_SIZE || used < TCP_HEADER_LENGTH)
+            {
+                return -1;
+            }
+            RingCopy(requests, request, TCP_HEADER_LENGTH, false);
+            uint16_t pduLength = (uint16_t)(request[4] << 8 | request[5]);
+            if (pduLength < 2 || pduLength > MAX_PDU_LENGTH || used < TCP_HEADER_LENGTH + (uint32_t)pduLength)
+            {
+                return -1;
+            }
+            RingCopy(requests, request, TCP_HEADER_LENGTH + (size_t)pduLength, true);
+
+            uint16_t responseLength =
+                server->handler(server->context, &request[TCP_HEADER_LENGTH], pduLength, &response[TCP_HEADER_LENGTH]);
+            if (responseLength == 0 || responseLength > MAX_PDU_LENGTH)
+            {
+                continue;
+            }
+            // The response carries the request's transaction and protocol IDs.
+            memcpy(response, request, 4);
+            response[4] = (uint8_t)(responseLength >> 8);
+            response[5] = (uint8_t)(responseLength & 0xFF);
+            struct iovec iov = {.iov_base = response, .iov_len = TCP_HEADER_LENGTH + (size_t)responseLength};
+            if (!RingWrite(responses, &iov, 1))
+            {
+                Log_Debug("Warning: Local client is not reading its responses. Response discarded.\n");
+                continue;
+            }
+            responded = true;
+            answered++;
+        }
+        if (responded)
+        {
+            RingNotify(responses, client->responseFd);
+        }
+    } while (!RingArm(requests));
+    return answered;
+}
+
+modbusLocalServer_t ModbusCreateLocalServer(const char *path, uint8_t maxClients, modbusLocalHandler_t handler,
+                                            void *context)
+{
+    if (maxClients == 0 || maxClients > MODBUS_LOCAL_MAX_CLIENTS || !handler)
+    {
+        return NULL;
+    }
+    struct _modbusLocalServer *server = calloc(1, sizeof(struct _modbusLocalServer));
+    struct sockaddr_un address;
+    if (!server || !SetSocketPath(&address, server->path, path))
+    {
+        free(server);
+        return NULL;
+    }
+    server->handler = handler;
+    server->context = context;
+    server->maxClients = maxClients;
+    for (size_t i = 0; i < MODBUS_LOCAL_MAX_CLIENTS; i++)
+    {
+        server->clients[i].socketFd = -1;
+    }
+
+    server->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    server->listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (server->epollFd < 0 || server->listenFd < 0 ||
+        bind(server->listenFd, (struct sockaddr *)&address, sizeof(address)) != 0)
+    {
+        Log_Debug("Error: Unable to create local server %s: %s\n", path, strerror(errno));
+        server->path[0] = '\0';
+        ModbusFreeLocalServer(server);
+        return NULL;
+    }
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+    if (listen(server->listenFd, maxClients) != 0 ||
+        epoll_ctl(server->epollFd, EPOLL_CTL_ADD, server->listenFd, &event) != 0)
+    {
+        Log_Debug("Error: Unable to listen on local server %s: %s\n", path, strerror(errno));
+        ModbusFreeLocalServer(server);
+        return NULL;
+    }
+    return server;
+}
+
+int ModbusGetLocalServerFd(modbusLocalServer_t server)
+{
+    return server->epollFd;
+}
+
+int ModbusRunLocalServer(modbusLocalServer_t server)
+{
+    struct epoll_event events[LOCAL_EVENTS];
+    int count = epoll_wait(server->epollFd, events, LOCAL_EVENTS, 0);
+    if (count < 0)
+    {
+        return (errno == EINTR) ? 0 : -1;
+    }
+
+    int answered = 0;
+    for (int i = 0; i < count; i++)
+    {
+        localClient_t *client = events[i].data.ptr;
+        if (!client)
+        {
+            AcceptClient(server);
+        }
+        // A client dropped earlier in this loop may still have events in the list.
+        else if (client->socketFd >= 0)
+        {
+            int served = (events[i].events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR)) ? -1 : ServeClient(server, client);
+            if (served < 0)
+            {
+                DropClient(server, client);
+            }
+            else
+            {
+                answered += served;
+            }
+        }
+    }
+    return answered;
+}
+
+void ModbusFreeLocalServer(modbusLocalServer_t server)
+{
+    if (server)
+    {
+        for (size_t i = 0; i < MODBUS_LOCAL_MAX_CLIENTS; i++)
+        {
+            if (server->clients[i].socketFd >= 0)
+            {
+                DropClient(server, &server->clients[i]);
+            }
+        }
+        if (server->listenFd >= 0)
+        {
+            close(server->listenFd);
+        }
+        if (server->epollFd >= 0)
+        {
+            close(server->epollFd);
+        }
+        if (server->path[0])
+        {
+            unlink(server->path);
+        }
+        free(server);
+    }
+}
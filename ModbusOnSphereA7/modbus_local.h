@@ -0,0 +1,74 @@
+/**
+ * @file    modbus_local.h
+ * @brief   A transport for Modbus between processes on the same machine, without the TCP stack. An application
+ *          acting as a gateway creates a local server on a Unix domain socket path, and client processes connect
+ *          to it with ModbusConnectLocal, which returns an ordinary modbus handle.
+ *
+ *          Connecting is the only use of the socket: the server gives each client a shared memory channel and two
+ *          eventfds. Requests and responses are Modbus TCP (MBAP) frames in two single producer, single consumer
+ *          rings in the channel, written and read without locks or system calls. An eventfd doorbell is only rung
+ *          when the other side has emptied its ring and is about to wait, so a busy client or server is not woken
+ *          once per frame. A client sees the server go away as a hang up on the socket.
+ *
+ *          The server is run from the application's epoll loop: its descriptor becomes readable when a client
+ *          connects or sends requests, and ModbusRunLocalServer answers them by calling the application's handler
+ *          on the caller's thread.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+
+#pragma once
+
+#include "modbus.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Largest number of clients one local server accepts
+#define MODBUS_LOCAL_MAX_CLIENTS 64
+
+typedef struct _modbusLocalServer* modbusLocalServer_t;
+
+/// <summary>
+/// Answers one request received by a local server.
+/// </summary>
+/// <param name="context">The context passed to ModbusCreateLocalServer</param>
+/// <param name="request">The request, starting at the slave ID, without transport framing</param>
+/// <param name="requestLength">The length of the request</param>
+/// <param name="response">MAX_PDU_LENGTH buffer that receives the response, starting at the slave ID</param>
+/// <returns>The length of the response, or 0 to send none, as a slave that is not there would</returns>
+typedef uint16_t (*modbusLocalHandler_t)( void* context, const uint8_t* request, uint16_t requestLength,
+                                          uint8_t* response );
+
+/// <summary>
+/// Creates a local server listening on a Unix domain socket.
+/// </summary>
+/// <param name="path">The path of the socket, which must not exist; it is removed by ModbusFreeLocalServer</param>
+/// <param name="maxClients">The largest number of clients connected at once, up to MODBUS_LOCAL_MAX_CLIENTS</param>
+/// <param name="handler">Called to answer each request</param>
+/// <param name="context">Passed to the handler</param>
+/// <returns>The server, or NULL if it could not be created</returns>
+modbusLocalServer_t ModbusCreateLocalServer( const char* path, uint8_t maxClients, modbusLocalHandler_t handler,
+                                             void* context );
+
+/// <summary>
+/// Gets the descriptor of a local server, to add to the application's epoll loop.
+/// </summary>
+/// <param name="server">The server</param>
+/// <returns>A file descriptor that is readable when ModbusRunLocalServer has work to do</returns>
+int ModbusGetLocalServerFd( modbusLocalServer_t server );
+
+/// <summary>
+/// Accepts clients that are connecting, drops those that have gone and answers the requests waiting, without
+/// blocking. Call when the server's descriptor is readable.
+/// </summary>
+/// <param name="server">The server</param>
+/// <returns>The number of requests answered, or -1 on failure</returns>
+int ModbusRunLocalServer( modbusLocalServer_t server );
+
+/// <summary>
+/// Disconnects every client, closes a local server and removes its socket.
+/// </summary>
+/// <param name="server">The server</param>
+void ModbusFreeLocalServer( modbusLocalServer_t server );
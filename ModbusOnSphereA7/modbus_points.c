@@ -0,0 +1,272 @@
+/**
+ * @file    modbus_points.c
+ * @brief   A table of the latest values read from the bus, readable from any thread without locks.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+
+#include "modbus_points.h"
+#include "modbus_points_layout.h"
+#include "modbus_subscribe.h"
+#include "modbus_internal.h"
+#include <applibs/log.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Added in Linux 5.1; older C libraries do not define it.
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010
+#endif
+
+typedef struct
+{
+    modbusPointTable_t table;
+    uint32_t block;
+    modbusSubscription_t subscription;
+} pointFeed_t;
+
+// The table itself is one block of memory laid out as described in modbus_points_layout.h, so the same layout can
+// be read wherever it is mapped.
+struct _modbusPointTable
+{
+    modbusPointsHeader_t *header;
+    modbusPointsBlock_t *blocks;
+    uint16_t *values;
+    pointFeed_t *feeds;
+    size_t size;
+    int fd;
+    int readOnlyFd;
+    char *name;
+};
+
+static size_t TableSize(uint32_t maxBlocks, uint32_t maxValues)
+{
+    uint64_t size = sizeof(modbusPointsHeader_t) + (uint64_t)maxBlocks * sizeof(modbusPointsBlock_t) +
+                    (uint64_t)maxValues * sizeof(uint16_t);
+    return (size > UINT32_MAX) ? 0 : (size_t)size;
+}
+
+// Wraps a zeroed block of memory as a table. Returns NULL, leaving the memory to the caller, on failure.
+static modbusPointTable_t InitTable(void *memory, size_t size, uint32_t maxBlocks, uint32_t maxValues)
+{
+    struct _modbusPointTable *table = calloc(1, sizeof(struct _modbusPointTable));
+    pointFeed_t *feeds = calloc(maxBlocks ? maxBlocks : 1, sizeof(pointFeed_t));
+    if (!table || !feeds)
+    {
+        Log_Debug("Error: Unable to allocate point table\n");
+        free(table);
+        free(feeds);
+        return NULL;
+    }
+
+    modbusPointsHeader_t *header = memory;
+    header->version = MODBUS_POINTS_VERSION;
+    header->headerSize = sizeof(modbusPointsHeader_t);
+    header->blockSize = sizeof(modbusPointsBlock_t);
+    header->blockOffset = sizeof(modbusPointsHeader_t);
+    header->valueOffset = (uint32_t)(sizeof(modbusPointsHeader_t) + maxBlocks * sizeof(modbusPointsBlock_t));
+    header->size = (uint32_t)size;
+    header->maxBlocks = maxBlocks;
+    header->maxValues = maxValues;
+    // Readers in other processes wait for the magic number before trusting the rest of the header.
+    __atomic_store_n(&header->magic, MODBUS_POINTS_MAGIC, __ATOMIC_RELEASE);
+
+    table->header = header;
+    table->blocks = (modbusPointsBlock_t *)((uint8_t *)memory + header->blockOffset);
+    table->values = (uint16_t *)((uint8_t *)memory + header->valueOffset);
+    table->feeds = feeds;
+    table->size = size;
+    table->fd = -1;
+    table->readOnlyFd = -1;
+    return table;
+}
+
+modbusPointTable_t ModbusCreatePointTable(uint32_t maxBlocks, uint32_t maxValues)
+{
+    size_t size = TableSize(maxBlocks, maxValues);
+    void *memory = size ? calloc(1, size) : NULL;
+    if (!memory)
+    {
+        Log_Debug("Error: Unable to allocate point table\n");
+        return NULL;
+    }
+    modbusPointTable_t table = InitTable(memory, size, maxBlocks, maxValues);
+    if (!table)
+    {
+        free(memory);
+    }
+    return table;
+}
+
+modbusPointTable_t ModbusCreateSharedPointTable(const char *name, uint32_t maxBlocks, uint32_t maxValues)
+{
+    size_t size = TableSize(maxBlocks, maxValues);
+    if (!size)
+    {
+        Log_Debug("Error: Point table is too large\n");
+        return NULL;
+    }
+
+    // A named table is created without write permission, so only this descriptor can write it.
+    int fd = name ? shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0444)
+                  : memfd_create("modbus-points", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+    {
+        Log_Debug("Error: Unable to create shared point table: %s\n", strerror(errno));
+        return NULL;
+    }
+    if (ftruncate(fd, (off_t)size) != 0)
+    {
+        Log_Debug("Error: Unable to size shared point table: %s\n", strerror(errno));
+        goto fail;
+    }
+    // A memfd can't be resized once readers have it, so they can trust the size they map.
+    if (!name && fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) != 0)
+    {
+        Log_Debug("Error: Unable to seal shared point table: %s\n", strerror(errno));
+        goto fail;
+    }
+
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (memory == MAP_FAILED)
+    {
+        Log_Debug("Error: Unable to map shared point table: %s\n", strerror(errno));
+        goto fail;
+    }
+    // Once the writer's mapping exists, nothing else may write the memfd or map it writable, even by reopening the
+    // read-only descriptor through /proc.
+    if (!name && fcntl(fd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE | F_SEAL_SEAL) != 0)
+    {
+        Log_Debug("Error: Unable to seal shared point table: %s\n", strerror(errno));
+        munmap(memory, size);
+        goto fail;
+    }
+    modbusPointTable_t table = InitTable(memory, size, maxBlocks, maxValues);
+    if (!table)
+    {
+        munmap(memory, size);
+        goto fail;
+    }
+
+    // Reopening through /proc gives a descriptor that can only be mapped read-only, to hand to other processes.
+    char path[32];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    table->readOnlyFd = open(path, O_RDONLY | O_CLOEXEC);
+    if (table->readOnlyFd < 0)
+    {
+        Log_Debug("Error: Unable to reopen shared point table read-only: %s\n", strerror(errno));
+        munmap(memory, size);
+        free(table->feeds);
+        free(table);
+        goto fail;
+    }
+    table->fd = fd;
+    table->name = name ? strdup(name) : NULL;
+    return table;
+
+fail:
+    close(fd);
+    if (name)
+    {
+        shm_unlink(name);
+    }
+    return NULL;
+}
+
+int ModbusGetPointTableFd(modbusPointTable_t table)
+{
+    return table->readOnlyFd;
+}
+
+// Subscription callback: the single writer of a block's values.
+static void StorePoints(void *context, const uint16_t *oldValues, const uint16_t *newValues, uint16_t count)
+{
+    pointFeed_t *feed = context;
+    modbusPointsBlock_t *block = &feed->table->blocks[feed->block];
+    uint16_t *values = &feed->table->values[block->valueOffset];
+    uint32_t sequence = __atomic_load_n(&block->sequence, __ATOMIC_RELAXED);
+    (void)oldValues;
+
+    __atomic_store_n(&block->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (uint16_t i = 0; i < count; i++)
+    {
+        __atomic_store_n(&values[i], newValues[i], __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&block->updatedUs, ModbusMonotonicUs(), __ATOMIC_RELAXED);
+    __atomic_store_n(&block->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+int ModbusAddPoints(modbusPointTable_t table, modbus_t hndl, uint8_t slaveID, modbusTable_t modbusTable,
+                    uint16_t address, uint16_t count)
+{
+    modbusPointsHeader_t *header = table->header;
+    uint32_t index = header->blockCount;
+
+    if (index >= header->maxBlocks || count > header->maxValues - header->valueCount)
+    {
+        Log_Debug("Error: Point table is full\n");
+        return -1;
+    }
+
+    pointFeed_t *feed = &table->feeds[index];
+    *feed = (pointFeed_t){.table = table, .block = index};
+    table->blocks[index] = (modbusPointsBlock_t){.valueOffset = header->valueCount,
+                                                 .slaveID = slaveID,
+                                                 .table = (uint8_t)modbusTable,
+                                                 .address = address,
+                                                 .count = count};
+    feed->subscription = ModbusSubscribe(hndl, slaveID, modbusTable, address, count, 0, StorePoints, feed);
+    if (!feed->subscription)
+    {
+        return -1;
+    }
+
+    header->valueCount += count;
+    __atomic_store_n(&header->blockCount, index + 1, __ATOMIC_RELEASE);
+    return (int)index;
+}
+
+bool ModbusReadPoints(modbusPointTable_t table, int block, uint16_t offset, uint16_t count, uint16_t *values,
+                      uint64_t *updatedUs)
+{
+    return block >= 0 && ModbusPointsLayout_Read(table->header, (uint32_t)block, offset, count, values, updatedUs);
+}
+
+void ModbusFreePointTable(modbusPointTable_t table)
+{
+    if (!table)
+    {
+        return;
+    }
+    for (uint32_t i = 0; i < table->header->blockCount; i++)
+    {
+        ModbusUnsubscribe(table->feeds[i].subscription);
+    }
+    if (table->fd >= 0)
+    {
+        munmap(table->header, table->size);
+        close(table->fd);
+        if (table->readOnlyFd >= 0)
+        {
+            close(table->readOnlyFd);
+        }
+        if (table->name)
+        {
+            shm_unlink(table->name);
+            free(table->name);
+        }
+    }
+    else
+    {
+        free(table->header);
+    }
+    free(table->feeds);
+    free(table);
+}
@@ -0,0 +1,89 @@
+/**
+ * @file    modbus_points.h
+ * @brief   A table of the latest values read from the bus, so any number of threads can use a value without
+ *          sending a request of their own. Blocks of points are filled by the subscription poll engine: each block
+ *          is a subscription, and ModbusPollSubscriptions stores new values in the table when they change.
+ *
+ *          Values are kept in one flat array, and each block has a sequence counter that is odd while the block is
+ *          being written. Readers copy the values and retry if the counter changed, so they take no locks, make no
+ *          system calls and never hold up the thread polling the bus. Blocks must be added, and the table polled and
+ *          freed, from the thread that polls the subscriptions; ModbusReadPoints may be called from any thread.
+ *
+ *          On Linux a table can also be created in shared memory, so other processes can map it read-only and read
+ *          the values without opening connections of their own. Its layout is described in modbus_points_layout.h.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+
+#pragma once
+
+#include "modbus.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct _modbusPointTable* modbusPointTable_t;
+
+/// <summary>
+/// Creates an empty point table. All of its memory is allocated here, so it never moves while it is being read.
+/// </summary>
+/// <param name="maxBlocks">The largest number of blocks that will be added</param>
+/// <param name="maxValues">The largest total number of values in all blocks</param>
+/// <returns>The point table, or NULL if memory could not be allocated</returns>
+modbusPointTable_t ModbusCreatePointTable( uint32_t maxBlocks, uint32_t maxValues );
+
+/// <summary>
+/// Creates an empty point table in shared memory that other processes can map read-only. With a name the table
+/// is created with shm_open, without write permission, and can be opened by that name; otherwise it is an anonymous
+/// memfd, sealed so no other descriptor can write it, whose descriptor from ModbusGetPointTableFd is passed to the
+/// other processes. The layout is described in modbus_points_layout.h.
+/// </summary>
+/// <param name="name">A shm_open name such as "/modbus-points", or NULL for a memfd. The name must not exist</param>
+/// <param name="maxBlocks">The largest number of blocks that will be added</param>
+/// <param name="maxValues">The largest total number of values in all blocks</param>
+/// <returns>The point table, or NULL if it could not be created</returns>
+modbusPointTable_t ModbusCreateSharedPointTable( const char* name, uint32_t maxBlocks, uint32_t maxValues );
+
+/// <summary>
+/// Gets a read-only descriptor for a shared point table, to pass to other processes over a Unix domain socket.
+/// It remains owned by the table.
+/// </summary>
+/// <param name="table">The point table</param>
+/// <returns>The descriptor, or -1 if the table is not shared</returns>
+int ModbusGetPointTableFd( modbusPointTable_t table );
+
+/// <summary>
+/// Adds a block of points read from a slave, and subscribes to them so they are updated whenever
+/// ModbusPollSubscriptions is called for the handle.
+/// </summary>
+/// <param name="table">The point table</param>
+/// <param name="hndl">The handle to poll through</param>
+/// <param name="slaveID">The slave to read from</param>
+/// <param name="modbusTable">The table to read</param>
+/// <param name="address">The first address of the block</param>
+/// <param name="count">The number of registers or bits in the block</param>
+/// <returns>The index of the block, or -1 if the table is full or the block is not valid</returns>
+int ModbusAddPoints( modbusPointTable_t table, modbus_t hndl, uint8_t slaveID, modbusTable_t modbusTable,
+                     uint16_t address, uint16_t count );
+
+/// <summary>
+/// Reads a consistent snapshot of values from a block. Coils and discrete inputs are returned one per element as
+/// 0 or 1.
+/// </summary>
+/// <param name="table">The point table</param>
+/// <param name="block">The index returned by ModbusAddPoints</param>
+/// <param name="offset">The offset of the first value within the block</param>
+/// <param name="count">The number of values to read</param>
+/// <param name="values">Receives the values</param>
+/// <param name="updatedUs">If not NULL, receives the monotonic time in microseconds at which the values last changed</param>
+/// <returns>true on success, or false if the range is not in the block or the block has not been read yet</returns>
+bool ModbusReadPoints( modbusPointTable_t table, int block, uint16_t offset, uint16_t count, uint16_t* values,
+                       uint64_t* updatedUs );
+
+/// <summary>
+/// Unsubscribes every block and frees a point table. No thread may be reading the table. A named shared table is
+/// unlinked; processes that have it mapped keep their mapping.
+/// </summary>
+/// <param name="table">The point table, or NULL</param>
+void ModbusFreePointTable( modbusPointTable_t table );
@@ -0,0 +1,105 @@
+/**
+ * @file    modbus_points_layout.h
+ * @brief   The memory layout of a point table, for processes that map a table shared with
+ *          ModbusCreateSharedPointTable. This header has no dependencies on the rest of the library.
+ *
+ *          The table starts with a header describing where the block descriptors and values are. The creator
+ *          stores the magic number last, so a reader should wait until it is MODBUS_POINTS_MAGIC and then check
+ *          the version. Blocks are only ever added: a block below blockCount never changes its descriptor, and
+ *          its values are read with ModbusPointsLayout_Read, which retries while the block is being written.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define MODBUS_POINTS_MAGIC 0x5450424D // "MBPT"
+#define MODBUS_POINTS_VERSION 1
+
+typedef struct
+{
+    uint32_t magic;       // MODBUS_POINTS_MAGIC once the table is ready
+    uint16_t version;     // MODBUS_POINTS_VERSION
+    uint16_t headerSize;  // sizeof(modbusPointsHeader_t)
+    uint16_t blockSize;   // sizeof(modbusPointsBlock_t)
+    uint16_t reserved;
+    uint32_t blockOffset; // Byte offset of the first block descriptor
+    uint32_t valueOffset; // Byte offset of the value array
+    uint32_t size;        // Total size of the table in bytes
+    uint32_t blockCount;  // Number of blocks added, read with acquire
+    uint32_t maxBlocks;
+    uint32_t valueCount;
+    uint32_t maxValues;
+} modbusPointsHeader_t;
+
+typedef struct
+{
+    uint32_t sequence;    // Odd while the block is being written
+    uint32_t valueOffset; // Index of the block's first value in the value array
+    uint8_t slaveID;
+    uint8_t table;        // modbusTable_t
+    uint16_t address;
+    uint16_t count;
+    uint16_t reserved;
+    uint64_t updatedUs;   // CLOCK_MONOTONIC time of the last change in microseconds, 0 until first read
+} modbusPointsBlock_t;
+
+/// <summary>
+/// Gets a block descriptor, or NULL if the block has not been added.
+/// </summary>
+static inline const modbusPointsBlock_t* ModbusPointsLayout_Block(const modbusPointsHeader_t* header, uint32_t block)
+{
+    if (block >= __atomic_load_n(&header->blockCount, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+    return (const modbusPointsBlock_t*)((const uint8_t*)header + header->blockOffset +
+                                        (uint32_t)header->blockSize * block);
+}
+
+/// <summary>
+/// Copies a consistent snapshot of values from a block.
+/// </summary>
+/// <param name="header">The start of the table</param>
+/// <param name="block">The index of the block</param>
+/// <param name="offset">The offset of the first value within the block</param>
+/// <param name="count">The number of values to read</param>
+/// <param name="values">Receives the values</param>
+/// <param name="updatedUs">If not NULL, receives the time the values last changed</param>
+/// <returns>true on success, or false if the range is not in the block or the block has not been read yet</returns>
+static inline bool ModbusPointsLayout_Read(const modbusPointsHeader_t* header, uint32_t block, uint16_t offset,
+                                           uint16_t count, uint16_t* values, uint64_t* updatedUs)
+{
+    const modbusPointsBlock_t* descriptor = ModbusPointsLayout_Block(header, block);
+    if (!descriptor || (uint32_t)offset + count > descriptor->count)
+    {
+        return false;
+    }
+    const uint16_t* source =
+        (const uint16_t*)((const uint8_t*)header + header->valueOffset) + descriptor->valueOffset + offset;
+
+    uint32_t before;
+    uint32_t after;
+    uint64_t updated;
+    do
+    {
+        before = __atomic_load_n(&descriptor->sequence, __ATOMIC_ACQUIRE);
+        for (uint16_t i = 0; i < count; i++)
+        {
+            values[i] = __atomic_load_n(&source[i], __ATOMIC_RELAXED);
+        }
+        updated = __atomic_load_n(&descriptor->updatedUs, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&descriptor->sequence, __ATOMIC_RELAXED);
+    } while ((before & 1) || before != after);
+
+    if (updatedUs)
+    {
+        *updatedUs = updated;
+    }
+    return updated != 0;
+}
@@ -0,0 +1,362 @@
+/**
+ * @file    modbus_poll_group.c
+ * @brief   Polling aligned to the wall clock.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+
+#include "modbus_poll_group.h"
+#include "modbus_internal.h"
+#include "../fcode-registry.h"
+#include <applibs/log.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#define REQUEST_LENGTH 6
+#define NS_PER_MS 1000000LL
+#define NS_PER_SECOND 1000000000LL
+
+typedef struct
+{
+    modbusSample_t sample;
+    uint8_t request[REQUEST_LENGTH];
+    uint16_t *values;
+    uint64_t deadlineUs; // When the read in flight times out
+} groupRead_t;
+
+// A handle of the group, which carries one of the group's reads at a time
+typedef struct
+{
+    modbus_t hndl;
+    size_t next;     // Index of the next read through the handle to send
+    int inFlight;    // Index of the read in flight, or -1
+    uint8_t response[MAX_PDU_LENGTH];
+} lane_t;
+
+struct _modbusPollGroup
+{
+    int timerFd;
+    uint32_t period;
+    uint32_t offset;
+    modbusCycleCallback_t callback;
+    void *context;
+    size_t readCount;
+    groupRead_t reads[MODBUS_POLL_GROUP_MAX_READS];
+    size_t laneCount;
+    lane_t lanes[MODBUS_POLL_GROUP_MAX_READS];
+};
+
+static bool IsBitTable(modbusTable_t table)
+{
+    return table == MODBUS_TABLE_COILS || table == MODBUS_TABLE_DISCRETE_INPUTS;
+}
+
+static int64_t TimespecNs(const struct timespec *time)
+{
+    return (int64_t)time->tv_sec * NS_PER_SECOND + time->tv_nsec;
+}
+
+static struct timespec NsTimespec(int64_t ns)
+{
+    struct timespec time = {.tv_sec = (time_t)(ns / NS_PER_SECOND), .tv_nsec = (long)(ns % NS_PER_SECOND)};
+    return time;
+}
+
+// The latest boundary at or before a wall clock time.
+static int64_t BoundaryNs(int64_t nowNs, uint32_t period, uint32_t offset)
+{
+    int64_t periodNs = period * NS_PER_MS;
+    int64_t offsetNs = offset * NS_PER_MS;
+    return (nowNs - offsetNs) / periodNs * periodNs + offsetNs;
+}
+
+// Arms a timer for the next boundary after the current wall clock time.
+static bool ArmAlignedTimer(int timerFd, uint32_t period, uint32_t offset)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    struct itimerspec spec = {
+        .it_interval = NsTimespec(period * NS_PER_MS),
+        .it_value = NsTimespec(BoundaryNs(TimespecNs(&now), period, offset) + period * NS_PER_MS)};
+    // Cancelled when the wall clock is set, so the timer can be moved to the boundaries of the new time.
+    if (timerfd_settime(timerFd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &spec, NULL) != 0)
+    {
+        Log_Debug("Error: Unable to set aligned timer: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+int ModbusCreateAlignedTimer(uint32_t period, uint32_t offset)
+{
+    if (period == 0 || offset >= period)
+    {
+        Log_Debug("Error: Invalid period %u and offset %u for an aligned timer\n", period, offset);
+        return -1;
+    }
+    int timerFd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timerFd < 0)
+    {
+        Log_Debug("Error: Unable to create aligned timer: %s\n", strerror(errno));
+        return -1;
+    }
+    if (!ArmAlignedTimer(timerFd, period, offset))
+    {
+        close(timerFd);
+        return -1;
+    }
+    return timerFd;
+}
+
+int ModbusConsumeAlignedTimer(int timerFd, uint32_t period, uint32_t offset, struct timespec *boundary)
+{
+    uint64_t expiries = 0;
+    if (read(timerFd, &expiries, sizeof(expiries)) != sizeof(expiries))
+    {
+        if (errno == EAGAIN)
+        {
+            return 0;
+        }
+        if (errno == ECANCELED)
+        {
+            Log_Debug("Wall clock set, moving aligned timer\n");
+            return ArmAlignedTimer(timerFd, period, offset) ? 0 : -1;
+        }
+        Log_Debug("Error: Unable to read aligned timer: %s\n", strerror(errno));
+        return -1;
+    }
+    if (boundary)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        *boundary = NsTimespec(BoundaryNs(TimespecNs(&now), period, offset));
+    }
+    return (expiries > INT32_MAX) ? INT32_MAX : (int)expiries;
+}
+
+modbusPollGroup_t ModbusCreatePollGroup(uint32_t period, uint32_t offset, modbusCycleCallback_t callback,
+                                        void *context)
+{
+    if (!callback)
+    {
+        Log_Debug("Error: A poll group needs a callback\n");
+        return NULL;
+    }
+    struct _modbusPollGroup *group = calloc(1, sizeof(struct _modbusPollGroup));
+    if (!group)
+    {
+        Log_Debug("Error: Unable to allocate poll group\n");
+        return NULL;
+    }
+    group->timerFd = ModbusCreateAlignedTimer(period, offset);
+    if (group->timerFd < 0)
+    {
+        free(group);
+        return NULL;
+    }
+    group->period = period;
+    group->offset = offset;
+    group->callback = callback;
+    group->context = context;
+    return group;
+}
+
+int ModbusAddGroupRead(modbusPollGroup_t group, modbus_t hndl, uint8_t slaveID, modbusTable_t table,
+                       uint16_t address, uint16_t count)
+{
+    static const uint8_t functionCodes[] = {READ_COILS, READ_DISCRETE_INPUTS, READ_MULTIPLE_HOLDING_REGISTERS,
+                                            READ_INPUT_REGISTERS};
+    if (group->readCount >= MODBUS_POLL_GROUP_MAX_READS || table > MODBUS_TABLE_INPUT_REGISTERS || count == 0 ||
+        count > ModbusMaxReadQuantity(hndl, slaveID, table))
+    {
+        Log_Debug("Error: Unable to add read of %u from slave %u to poll group\n", count, slaveID);
+        return -1;
+    }
+    groupRead_t *read = &group->reads[group->readCount];
+    read->values = malloc(count * sizeof(uint16_t));
+    if (!read->values)
+    {
+        Log_Debug("Error: Unable to allocate poll group read\n");
+        return -1;
+    }
+    read->sample = (modbusSample_t){
+        .hndl = hndl, .slaveID = slaveID, .table = table, .address = address, .count = count};
+    SET_MODBUS_HEADER(read->request, slaveID, functionCodes[table], address, count);
+
+    size_t lane = 0;
+    while (lane < group->laneCount && group->lanes[lane].hndl != hndl)
+    {
+        lane++;
+    }
+    if (lane == group->laneCount)
+    {
+        group->lanes[lane].hndl = hndl;
+        group->laneCount++;
+    }
+    return (int)group->readCount++;
+}
+
+int ModbusGetPollGroupFd(modbusPollGroup_t group)
+{
+    return group->timerFd;
+}
+
+// Sends a lane's next read, if it has one. Returns true if a read is in flight.
+static bool StartNext(modbusPollGroup_t group, lane_t *lane, size_t timeout)
+{
+    while (lane->next < group->readCount)
+    {
+        size_t index = lane->next++;
+        groupRead_t *read = &group->reads[index];
+        if (read->sample.hndl != lane->hndl)
+        {
+            continue;
+        }
+        clock_gettime(CLOCK_REALTIME, &read->sample.requestTime);
+        read->deadlineUs = ModbusMonotonicUs() + (uint64_t)timeout * 1000;
+        if (ModbusStartRequest(lane->hndl, read->request, REQUEST_LENGTH, lane->response, &read->sample.error))
+        {
+            lane->inFlight = (int)index;
+            return true;
+        }
+        read->sample.responseTime = read->sample.requestTime;
+    }
+    lane->inFlight = -1;
+    return false;
+}
+
+// Checks the response to a read and unpacks its values, a bit to a value for the bit tables.
+static void DecodeResponse(groupRead_t *read, const uint8_t *response, uint16_t responseLength)
+{
+    modbusSample_t *sample = &read->sample;
+    uint8_t bits[MAX_PDU_LENGTH];
+    bool isBitTable = IsBitTable(sample->table);
+
+    sample->error = FcodeDecodeResponse(read->request, REQUEST_LENGTH, response, responseLength,
+                                        isBitTable ? (void *)bits : (void *)read->values, NULL);
+    if (sample->error)
+    {
+        if (sample->error == INVALID_RESPONSE)
+        {
+            Log_Debug("Error: Invalid response to poll group read from slave %u\n", sample->slaveID);
+        }
+        return;
+    }
+    for (uint16_t i = 0; isBitTable && i < sample->count; i++)
+    {
+        read->values[i] = (bits[i / 8] >> (i % 8)) & 1;
+    }
+    sample->values = read->values;
+}
+
+bool ModbusRunPollGroup(modbusPollGroup_t group, size_t timeout)
+{
+    modbusCycle_t cycle = {0};
+    int expiries = ModbusConsumeAlignedTimer(group->timerFd, group->period, group->offset, &cycle.boundary);
+    if (expiries <= 0)
+    {
+        return false;
+    }
+    cycle.missed = (uint32_t)(expiries - 1);
+
+    for (size_t i = 0; i < group->readCount; i++)
+    {
+        group->reads[i].sample.values = NULL;
+        group->reads[i].sample.error = 0;
+    }
+    // Every handle's first read goes out together; after that each handle sends its next read when it is free.
+    size_t busy = 0;
+    for (size_t i = 0; i < group->laneCount; i++)
+    {
+        group->lanes[i].next = 0;
+        if (StartNext(group, &group->lanes[i], timeout))
+        {
+            busy++;
+        }
+    }
+    while (busy)
+    {
+        uint64_t nowUs = ModbusMonotonicUs();
+        for (size_t i = 0; i < group->laneCount; i++)
+        {
+            lane_t *lane = &group->lanes[i];
+            if (lane->inFlight < 0)
+            {
+                continue;
+            }
+            groupRead_t *read = &group->reads[lane->inFlight];
+            if (!ModbusRequestDone(lane->hndl) && (!timeout || nowUs < read->deadlineUs))
+            {
+                continue;
+            }
+            uint16_t responseLength = ModbusFinishRequest(lane->hndl, false, &read->sample.error);
+            clock_gettime(CLOCK_REALTIME, &read->sample.responseTime);
+            if (responseLength)
+            {
+                DecodeResponse(read, lane->response, responseLength);
+            }
+            if (!StartNext(group, lane, timeout))
+            {
+                busy--;
+            }
+        }
+        if (busy)
+        {
+            struct timespec t = {.tv_sec = 0, .tv_nsec = 100000};
+            nanosleep(&t, NULL);
+        }
+    }
+
+    // Skew across the group: when the requests went out, and when each device most likely took its values.
+    int64_t boundaryNs = TimespecNs(&cycle.boundary);
+    int64_t firstRequestNs = INT64_MAX, lastRequestNs = INT64_MIN;
+    int64_t firstSampleNs = INT64_MAX, lastSampleNs = INT64_MIN;
+    for (size_t i = 0; i < group->readCount; i++)
+    {
+        const modbusSample_t *sample = &group->reads[i].sample;
+        int64_t requestNs = TimespecNs(&sample->requestTime);
+        firstRequestNs = (requestNs < firstRequestNs) ? requestNs : firstRequestNs;
+        lastRequestNs = (requestNs > lastRequestNs) ? requestNs : lastRequestNs;
+        if (sample->values)
+        {
+            int64_t sampleNs = requestNs + (TimespecNs(&sample->responseTime) - requestNs) / 2;
+            firstSampleNs = (sampleNs < firstSampleNs) ? sampleNs : firstSampleNs;
+            lastSampleNs = (sampleNs > lastSampleNs) ? sampleNs : lastSampleNs;
+        }
+    }
+    if (group->readCount)
+    {
+        cycle.dispatchUs = (firstRequestNs > boundaryNs) ? (uint32_t)((firstRequestNs - boundaryNs) / 1000) : 0;
+        cycle.requestSkewUs = (uint32_t)((lastRequestNs - firstRequestNs) / 1000);
+    }
+    if (lastSampleNs >= firstSampleNs)
+    {
+        cycle.sampleSkewUs = (uint32_t)((lastSampleNs - firstSampleNs) / 1000);
+    }
+
+    modbusSample_t samples[MODBUS_POLL_GROUP_MAX_READS];
+    for (size_t i = 0; i < group->readCount; i++)
+    {
+        samples[i] = group->reads[i].sample;
+    }
+    group->callback(group->context, &cycle, samples, group->readCount);
+    return true;
+}
+
+void ModbusFreePollGroup(modbusPollGroup_t group)
+{
+    if (!group)
+    {
+        return;
+    }
+    for (size_t i = 0; i < group->readCount; i++)
+    {
+        free(group->reads[i].values);
+    }
+    close(group->timerFd);
+    free(group);
+}
@@ -0,0 +1,134 @@
+/**
+ * @file    modbus_poll_group.h
+ * @brief   Polling aligned to the wall clock, so that values read from different devices in one cycle can be
+ *          correlated. A poll group fires on absolute boundaries of CLOCK_REALTIME, such as every whole second or
+ *          minute, rather than a fixed time after the previous poll, so it does not drift and groups on different
+ *          gateways sample at the same moments when their clocks are synchronised.
+ *
+ *          At each boundary the first read for every handle in the group is sent at once, and each handle's next
+ *          read is sent as soon as it is free. Each sample carries the wall clock times its request was sent and its
+ *          response arrived, and each cycle reports how far apart the devices were sampled. Every handle in flight
+ *          holds a receive buffer, so ModbusInitEx needs one for each handle in the group.
+ *
+ *          The group's timer is a file descriptor for the application's epoll loop. All of these functions, and the
+ *          callback, run on the caller's thread, which must be the thread using the handles.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+
+#pragma once
+
+#include "modbus.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Largest number of reads in one poll group
+#define MODBUS_POLL_GROUP_MAX_READS 32
+
+typedef struct _modbusPollGroup* modbusPollGroup_t;
+
+// One read of a cycle
+typedef struct _modbusSample
+{
+    modbus_t hndl;
+    uint8_t slaveID;
+    modbusTable_t table;
+    uint16_t address;
+    uint16_t count;
+    const uint16_t* values;       // Registers as read, coils and discrete inputs one per element as 0 or 1; NULL
+                                  // if the read failed
+    uint8_t error;                // 0, or a Modbus exception code or one of the library's error codes
+    struct timespec requestTime;  // Wall clock time the request was sent
+    struct timespec responseTime; // Wall clock time the response arrived, or the read failed
+} modbusSample_t;
+
+// Timing of one cycle of a poll group
+typedef struct _modbusCycle
+{
+    struct timespec boundary; // The wall clock boundary the cycle was run for
+    uint32_t dispatchUs;      // From the boundary to the first request being sent
+    uint32_t requestSkewUs;   // From the first request of the cycle being sent to the last
+    uint32_t sampleSkewUs;    // Spread across the successful reads of the midpoint between request and response,
+                              // the best estimate of when each device took its values
+    uint32_t missed;          // Boundaries that passed without a cycle since the previous one
+} modbusCycle_t;
+
+/// <summary>
+/// Called once at the end of each cycle with every read of the group, in the order they were added.
+/// </summary>
+/// <param name="context">The context passed to ModbusCreatePollGroup</param>
+/// <param name="cycle">Timing of the cycle</param>
+/// <param name="samples">The reads; the values are only valid during the call</param>
+/// <param name="count">The number of reads</param>
+typedef void (*modbusCycleCallback_t)( void* context, const modbusCycle_t* cycle, const modbusSample_t* samples,
+                                       size_t count );
+
+/// <summary>
+/// Creates a timer that expires on boundaries of the wall clock: every period milliseconds since the start of the
+/// epoch, plus offset. If the wall clock is set, the timer is moved to the next boundary of the new time.
+/// </summary>
+/// <param name="period">The time between boundaries in milliseconds, such as 1000 or 60000</param>
+/// <param name="offset">Time in milliseconds after each boundary to expire, less than period</param>
+/// <returns>A timer file descriptor to wait on for EPOLLIN, or -1 on failure</returns>
+int ModbusCreateAlignedTimer( uint32_t period, uint32_t offset );
+
+/// <summary>
+/// Consumes the expiries of a timer created with ModbusCreateAlignedTimer.
+/// </summary>
+/// <param name="timerFd">The timer</param>
+/// <param name="period">The period the timer was created with</param>
+/// <param name="offset">The offset the timer was created with</param>
+/// <param name="boundary">If not NULL, receives the latest boundary that has passed</param>
+/// <returns>The number of boundaries that have passed since the last call, 0 if none has or the wall clock was set,
+/// or -1 on failure</returns>
+int ModbusConsumeAlignedTimer( int timerFd, uint32_t period, uint32_t offset, struct timespec* boundary );
+
+/// <summary>
+/// Creates a poll group whose cycles start on wall clock boundaries.
+/// </summary>
+/// <param name="period">The time between cycles in milliseconds, such as 1000 or 60000</param>
+/// <param name="offset">Time in milliseconds after each boundary to start the cycle, less than period</param>
+/// <param name="callback">Called at the end of each cycle</param>
+/// <param name="context">Passed to the callback</param>
+/// <returns>The group, or NULL if the times or callback are not valid or the timer or memory could not be
+/// allocated</returns>
+modbusPollGroup_t ModbusCreatePollGroup( uint32_t period, uint32_t offset, modbusCycleCallback_t callback,
+                                         void* context );
+
+/// <summary>
+/// Adds a read to a poll group. Reads through the same handle are sent in the order they were added.
+/// </summary>
+/// <param name="group">The group</param>
+/// <param name="hndl">The modbus handle</param>
+/// <param name="slaveID">The slave to read</param>
+/// <param name="table">The table to read</param>
+/// <param name="address">The address of the first register or bit to read</param>
+/// <param name="count">The number of registers or bits to read, no more than one request can carry</param>
+/// <returns>The index of the read in the samples passed to the callback, or -1 if the group is full or the read is
+/// not valid</returns>
+int ModbusAddGroupRead( modbusPollGroup_t group, modbus_t hndl, uint8_t slaveID, modbusTable_t table,
+                        uint16_t address, uint16_t count );
+
+/// <summary>
+/// Gets the timer of a poll group, to add to the application's epoll loop.
+/// </summary>
+/// <param name="group">The group</param>
+/// <returns>A file descriptor that is readable when a cycle is due</returns>
+int ModbusGetPollGroupFd( modbusPollGroup_t group );
+
+/// <summary>
+/// Runs a cycle of a poll group if one is due, then calls its callback. Call when the group's timer is readable.
+/// </summary>
+/// <param name="group">The group</param>
+/// <param name="timeout">Time in milliseconds to wait for each response</param>
+/// <returns>true if a cycle was run, false if none was due</returns>
+bool ModbusRunPollGroup( modbusPollGroup_t group, size_t timeout );
+
+/// <summary>
+/// Frees a poll group and closes its timer. The handles are not closed.
+/// </summary>
+/// <param name="group">The group</param>
+void ModbusFreePollGroup( modbusPollGroup_t group );
@@ -0,0 +1,191 @@
+/**
+ * @file    modbus_prepared.c
+ * @brief   Prepared requests for polls that repeat the same requests every cycle.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+
+#include "modbus_prepared.h"
+#include "modbus_internal.h"
+#include "../crc-util.h"
+#include "../fcode-registry.h"
+#include <applibs/log.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define REQUEST_HEADER_LENGTH 6
+
+static bool IsRegisterRead(uint8_t functionCode)
+{
+    return functionCode == READ_MULTIPLE_HOLDING_REGISTERS || functionCode == READ_INPUT_REGISTERS;
+}
+
+// Encodes a request PDU in the framing of the handle's transport.
+static modbusPrepared_t Prepare(modbus_t hndl, const uint8_t *pdu, uint16_t pduLength)
+{
+    struct _modbusPrepared *prepared = malloc(sizeof(struct _modbusPrepared));
+    if (!prepared)
+    {
+        Log_Debug("Error: Unable to allocate a prepared request\n");
+        return NULL;
+    }
+
+    prepared->type = hndl->type;
+    prepared->slaveId = pdu[0];
+    prepared->functionCode = pdu[1];
+    prepared->pduLength = pduLength;
+
+    if (hndl->type == tcp || hndl->type == local)
+    {
+        // The transaction ID is supplied when the request is sent.
+        memset(prepared->adu, 0, 4);
+        SET_MODBUS_U16(&prepared->adu[4], pduLength);
+        memcpy(&prepared->adu[TCP_HEADER_LENGTH], pdu, pduLength);
+        prepared->aduLength = (uint16_t)(pduLength + TCP_HEADER_LENGTH);
+    }
+    else if (hndl->type == rtuOverTcp || hndl->type == rtuSerial)
+    {
+        memcpy(prepared->adu, pdu, pduLength);
+        AddCRC(prepared->adu, pduLength, sizeof(prepared->adu));
+        prepared->aduLength = (uint16_t)(pduLength + CRC_FOOTER_LENGTH);
+    }
+    else
+    {
+        // CRC footer for the RTU is appended on M4.
+        prepared->adu[PROTOCOL_OFFSET] = MODBUS;
+        prepared->adu[COMMAND_OFFSET] = MODBUS_DATA_MESSAGE;
+        prepared->adu[HEADER_LENGTH_OFFSET] = MESSAGE_HEADER_LENGTH;
+        prepared->adu[3] = 0;
+        memcpy(&prepared->adu[MESSAGE_HEADER_LENGTH], pdu, pduLength);
+        prepared->aduLength = (uint16_t)(pduLength + MESSAGE_HEADER_LENGTH);
+    }
+    return prepared;
+}
+
+static modbusPrepared_t PrepareRead(modbus_t hndl, uint8_t slaveID, uint8_t functionCode, modbusTable_t table,
+                                    uint16_t address, uint16_t quantity)
+{
+    if (quantity == 0 || quantity > ModbusMaxReadQuantity(hndl, slaveID, table))
+    {
+        Log_Debug("Error: Invalid count %u for function code %u\n", quantity, functionCode);
+        return NULL;
+    }
+    uint8_t pdu[REQUEST_HEADER_LENGTH] = {slaveID, functionCode};
+    SET_MODBUS_U16(&pdu[2], address);
+    SET_MODBUS_U16(&pdu[4], quantity);
+    return Prepare(hndl, pdu, sizeof(pdu));
+}
+
+modbusPrepared_t ModbusPrepareReadCoils(modbus_t hndl, uint8_t slaveID, uint16_t address, uint16_t bitsToRead)
+{
+    return PrepareRead(hndl, slaveID, READ_COILS, MODBUS_TABLE_COILS, address, bitsToRead);
+}
+
+modbusPrepared_t ModbusPrepareReadDiscreteInputs(modbus_t hndl, uint8_t slaveID, uint16_t address,
+                                                 uint16_t bitsToRead)
+{
+    return PrepareRead(hndl, slaveID, READ_DISCRETE_INPUTS, MODBUS_TABLE_DISCRETE_INPUTS, address, bitsToRead);
+}
+
+modbusPrepared_t ModbusPrepareReadMultipleHoldingRegisters(modbus_t hndl, uint8_t slaveID, uint16_t address,
+                                                           uint16_t registersToRead)
+{
+    return PrepareRead(hndl, slaveID, READ_MULTIPLE_HOLDING_REGISTERS, MODBUS_TABLE_HOLDING_REGISTERS, address,
+                       registersToRead);
+}
+
+modbusPrepared_t ModbusPrepareReadInputRegisters(modbus_t hndl, uint8_t slaveID, uint16_t address,
+                                                 uint16_t registersToRead)
+{
+    return PrepareRead(hndl, slaveID, READ_INPUT_REGISTERS, MODBUS_TABLE_INPUT_REGISTERS, address, registersToRead);
+}
+
+modbusPrepared_t ModbusPrepareWriteSingleCoil(modbus_t hndl, uint8_t slaveID, uint16_t address, bool bit)
+{
+    uint8_t pdu[REQUEST_HEADER_LENGTH] = {slaveID, WRITE_SINGLE_COIL};
+    SET_MODBUS_U16(&pdu[2], address);
+    SET_MODBUS_U16(&pdu[4], bit ? 0xFF00 : 0x0000);
+    return Prepare(hndl, pdu, sizeof(pdu));
+}
+
+modbusPrepared_t ModbusPrepareWriteSingleHoldingRegister(modbus_t hndl, uint8_t slaveID, uint16_t address,
+                                                         uint16_t mbRegister)
+{
+    uint8_t pdu[REQUEST_HEADER_LENGTH] = {slaveID, WRITE_SINGLE_HOLDING_REGISTER};
+    SET_MODBUS_U16(&pdu[2], address);
+    SET_MODBUS_U16(&pdu[4], mbRegister);
+    return Prepare(hndl, pdu, sizeof(pdu));
+}
+
+modbusPrepared_t ModbusPrepareWriteMultipleCoils(modbus_t hndl, uint8_t slaveID, uint16_t address,
+                                                 uint16_t numToWrite, const uint8_t *bitArray)
+{
+    if (numToWrite == 0 || numToWrite > MAX_WRITE_BITS)
+    {
+        Log_Debug("Error: Invalid count %u for function code %u\n", numToWrite, WRITE_MULTIPLE_COILS);
+        return NULL;
+    }
+    uint8_t pdu[MAX_PDU_LENGTH] = {slaveID, WRITE_MULTIPLE_COILS};
+    uint8_t dataByteCount = (uint8_t)((numToWrite + 7) / 8);
+    SET_MODBUS_U16(&pdu[2], address);
+    SET_MODBUS_U16(&pdu[4], numToWrite);
+    pdu[6] = dataByteCount;
+    memcpy(&pdu[7], bitArray, dataByteCount);
+    return Prepare(hndl, pdu, (uint16_t)(REQUEST_HEADER_LENGTH + 1 + dataByteCount));
+}
+
+modbusPrepared_t ModbusPrepareWriteMultipleHoldingRegisters(modbus_t hndl, uint8_t slaveID, uint16_t address,
+                                                            uint16_t numToWrite, const uint16_t *registerArray)
+{
+    if (numToWrite == 0 || numToWrite > MAX_WRITE_REGISTERS)
+    {
+        Log_Debug("Error: Invalid count %u for function code %u\n", numToWrite, WRITE_MULTIPLE_HOLDING_REGISTERS);
+        return NULL;
+    }
+    uint8_t pdu[MAX_PDU_LENGTH] = {slaveID, WRITE_MULTIPLE_HOLDING_REGISTERS};
+    uint8_t dataByteCount = (uint8_t)(numToWrite * 2);
+    SET_MODBUS_U16(&pdu[2], address);
+    SET_MODBUS_U16(&pdu[4], numToWrite);
+    pdu[6] = dataByteCount;
+    for (uint16_t i = 0; i < numToWrite; i++)
+    {
+        SET_MODBUS_U16(&pdu[7 + (i * 2)], registerArray[i]);
+    }
+    return Prepare(hndl, pdu, (uint16_t)(REQUEST_HEADER_LENGTH + 1 + dataByteCount));
+}
+
+bool ModbusSendPrepared(modbus_t hndl, modbusPrepared_t request, void *readArray, size_t timeout)
+{
+    uint8_t response[MAX_PDU_LENGTH];
+    uint8_t error = 0;
+
+    uint16_t responseLength = ModbusRunPrepared(hndl, request, response, timeout, &error);
+    if (responseLength > 0)
+    {
+        error = FcodeDecodeResponse(ModbusPreparedPdu(request), request->pduLength, response, responseLength,
+                                    readArray, NULL);
+        if (error == INVALID_RESPONSE)
+        {
+            Log_Debug("Error: Invalid response to prepared request with function code %u\n", request->functionCode);
+        }
+    }
+    if (error)
+    {
+        if (IsRegisterRead(request->functionCode))
+        {
+            ((uint16_t *)readArray)[0] = error;
+        }
+        else
+        {
+            ((uint8_t *)readArray)[0] = error;
+        }
+        return false;
+    }
+    return true;
+}
+
+void ModbusFreePrepared(modbusPrepared_t request)
+{
+    free(request);
+}
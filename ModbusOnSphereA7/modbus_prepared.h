@@ -0,0 +1,128 @@
+/**
+ * @file    modbus_prepared.h
+ * @brief   Prepared requests for polls that repeat the same requests every cycle. A ModbusPrepare function encodes
+ *          the request once for the handle's transport, complete with its framing and CRC, and works out the length
+ *          of a successful response. ModbusSendPrepared then sends the stored frame as it is, supplying only the
+ *          transaction ID on Modbus TCP, and checks the response against the stored length.
+ *
+ *          A prepared request is never changed after it is built, so it may be sent from several threads at once
+ *          and through any handle that uses the same transport.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+
+#pragma once
+
+#include "modbus.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct _modbusPrepared* modbusPrepared_t;
+
+/// <summary>
+/// Prepares a ReadCoils request.
+/// </summary>
+/// <param name="hndl">A handle using the transport the request will be sent over</param>
+/// <param name="slaveID">Slave Device ID</param>
+/// <param name="address">The address of the first coil to read</param>
+/// <param name="bitsToRead">The number of coils to read</param>
+/// <returns>The prepared request, or NULL if the request is not valid or memory could not be allocated</returns>
+modbusPrepared_t ModbusPrepareReadCoils( modbus_t hndl, uint8_t slaveID, uint16_t address, uint16_t bitsToRead );
+
+/// <summary>
+/// Prepares a ReadDiscreteInputs request.
+/// </summary>
+/// <param name="hndl">A handle using the transport the request will be sent over</param>
+/// <param name="slaveID">Slave Device ID</param>
+/// <param name="address">The address of the first input to read</param>
+/// <param name="bitsToRead">The number of inputs to read</param>
+/// <returns>The prepared request, or NULL if the request is not valid or memory could not be allocated</returns>
+modbusPrepared_t ModbusPrepareReadDiscreteInputs( modbus_t hndl, uint8_t slaveID, uint16_t address,
+                                                  uint16_t bitsToRead );
+
+/// <summary>
+/// Prepares a ReadMultipleHoldingRegisters request.
+/// </summary>
+/// <param name="hndl">A handle using the transport the request will be sent over</param>
+/// <param name="slaveID">Slave Device ID</param>
+/// <param name="address">The address of the first register to read</param>
+/// <param name="registersToRead">The number of registers to read</param>
+/// <returns>The prepared request, or NULL if the request is not valid or memory could not be allocated</returns>
+modbusPrepared_t ModbusPrepareReadMultipleHoldingRegisters( modbus_t hndl, uint8_t slaveID, uint16_t address,
+                                                            uint16_t registersToRead );
+
+/// <summary>
+/// Prepares a ReadInputRegisters request.
+/// </summary>
+/// <param name="hndl">A handle using the transport the request will be sent over</param>
+/// <param name="slaveID">Slave Device ID</param>
+/// <param name="address">The address of the first register to read</param>
+/// <param name="registersToRead">The number of registers to read</param>
+/// <returns>The prepared request, or NULL if the request is not valid or memory could not be allocated</returns>
+modbusPrepared_t ModbusPrepareReadInputRegisters( modbus_t hndl, uint8_t slaveID, uint16_t address,
+                                                  uint16_t registersToRead );
+
+/// <summary>
+/// Prepares a WriteSingleCoil request.
+/// </summary>
+/// <param name="hndl">A handle using the transport the request will be sent over</param>
+/// <param name="slaveID">Slave Device ID</param>
+/// <param name="address">The address of the coil</param>
+/// <param name="bit">The value to write</param>
+/// <returns>The prepared request, or NULL if memory could not be allocated</returns>
+modbusPrepared_t ModbusPrepareWriteSingleCoil( modbus_t hndl, uint8_t slaveID, uint16_t address, bool bit );
+
+/// <summary>
+/// Prepares a WriteSingleHoldingRegister request.
+/// </summary>
+/// <param name="hndl">A handle using the transport the request will be sent over</param>
+/// <param name="slaveID">Slave Device ID</param>
+/// <param name="address">The address of the register</param>
+/// <param name="mbRegister">The value to write</param>
+/// <returns>The prepared request, or NULL if memory could not be allocated</returns>
+modbusPrepared_t ModbusPrepareWriteSingleHoldingRegister( modbus_t hndl, uint8_t slaveID, uint16_t address,
+                                                          uint16_t mbRegister );
+
+/// <summary>
+/// Prepares a WriteMultipleCoils request. The values are copied into the request.
+/// </summary>
+/// <param name="hndl">A handle using the transport the request will be sent over</param>
+/// <param name="slaveID">Slave Device ID</param>
+/// <param name="address">The address of the first coil</param>
+/// <param name="numToWrite">The number of coils to write</param>
+/// <param name="bitArray">The values to write, packed with the first coil in the least significant bit</param>
+/// <returns>The prepared request, or NULL if the request is not valid or memory could not be allocated</returns>
+modbusPrepared_t ModbusPrepareWriteMultipleCoils( modbus_t hndl, uint8_t slaveID, uint16_t address,
+                                                  uint16_t numToWrite, const uint8_t* bitArray );
+
+/// <summary>
+/// Prepares a WriteMultipleHoldingRegisters request. The values are copied into the request.
+/// </summary>
+/// <param name="hndl">A handle using the transport the request will be sent over</param>
+/// <param name="slaveID">Slave Device ID</param>
+/// <param name="address">The address of the first register</param>
+/// <param name="numToWrite">The number of registers to write</param>
+/// <param name="registerArray">The values to write</param>
+/// <returns>The prepared request, or NULL if the request is not valid or memory could not be allocated</returns>
+modbusPrepared_t ModbusPrepareWriteMultipleHoldingRegisters( modbus_t hndl, uint8_t slaveID, uint16_t address,
+                                                             uint16_t numToWrite, const uint16_t* registerArray );
+
+/// <summary>
+/// Sends a prepared request and waits for the response. The results are returned as by the function the request
+/// was prepared for: register values for register reads, packed bits for coil and input reads, and the echoed
+/// address and value for writes. If the request fails the error code is placed in readArray[0].
+/// </summary>
+/// <param name="hndl">A handle using the transport the request was prepared for</param>
+/// <param name="request">The prepared request</param>
+/// <param name="readArray">A uint16_t array for register reads, otherwise a uint8_t array</param>
+/// <param name="timeout">Time in milliseconds after which function will return an error if no response a has been received from the device</param>
+/// <returns>true on success, or false on failure</returns>
+bool ModbusSendPrepared( modbus_t hndl, modbusPrepared_t request, void* readArray, size_t timeout );
+
+/// <summary>
+/// Frees a prepared request.
+/// </summary>
+/// <param name="request">The prepared request, or NULL</param>
+void ModbusFreePrepared( modbusPrepared_t request );
@@ -0,0 +1,369 @@
+/**
+ * @file    modbus_redundant.c
+ * @brief   Hedged reads from a device that can be reached over two paths.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+
+#include "modbus_redundant.h"
+#include "modbus_internal.h"
+#include "../fcode-registry.h"
+#include <applibs/log.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define REQUEST_LENGTH 6
+// Response times kept per path
+#define PATH_SAMPLES 32
+// Response times a path needs before its percentiles are used
+#define MIN_PATH_SAMPLES 8
+// The other path becomes the primary when its 95th percentile is below this percentage of the primary's
+#define PRIMARY_SWITCH_PERCENT 80
+
+typedef struct
+{
+    modbus_t hndl;
+    uint8_t slaveID;
+    uint32_t samplesUs[PATH_SAMPLES]; // Ring of recent response times
+    uint8_t sampleCount;
+    uint8_t nextSample;
+    modbusPathStats_t stats;
+
+    // The current read
+    uint8_t request[REQUEST_LENGTH];
+    uint8_t response[MAX_PDU_LENGTH];
+    uint64_t sentUs;
+    bool sent;     // The request has been sent and not yet finished
+    bool finished; // The path has answered, failed or been given up on
+
+    // A request cancelled on a handle that cannot tell a late response from the answer to its next request, left
+    // outstanding until the response arrives or drainUntilUs, if set, passes. The path sits out reads until then.
+    bool draining;
+    uint64_t drainUntilUs;
+} path_t;
+
+struct _modbusRedundant
+{
+    path_t paths[2];
+    uint8_t primary;
+    uint32_t minHedgeDelayUs;
+};
+
+static bool IsRegisterTable(modbusTable_t table)
+{
+    return table == MODBUS_TABLE_HOLDING_REGISTERS || table == MODBUS_TABLE_INPUT_REGISTERS;
+}
+
+static uint8_t ReadFunctionCode(modbusTable_t table)
+{
+    static const uint8_t functionCodes[] = {READ_COILS, READ_DISCRETE_INPUTS, READ_MULTIPLE_HOLDING_REGISTERS,
+                                            READ_INPUT_REGISTERS};
+    return functionCodes[table];
+}
+
+static void AddSample(path_t *path, uint64_t elapsedUs)
+{
+    path->samplesUs[path->nextSample] = (elapsedUs > UINT32_MAX) ? UINT32_MAX : (uint32_t)elapsedUs;
+    path->nextSample = (uint8_t)((path->nextSample + 1) % PATH_SAMPLES);
+    if (path->sampleCount < PATH_SAMPLES)
+    {
+        path->sampleCount++;
+    }
+}
+
+// Returns a percentile of a path's recent response times, or 0 if it has none.
+static uint32_t Percentile(const path_t *path, unsigned int percent)
+{
+    uint32_t sorted[PATH_SAMPLES];
+    uint8_t count = path->sampleCount;
+    if (!count)
+    {
+        return 0;
+    }
+    // Insertion sort; there are never more than PATH_SAMPLES.
+    for (uint8_t i = 0; i < count; i++)
+    {
+        uint32_t sample = path->samplesUs[i];
+        uint8_t j = i;
+        for (; j > 0 && sorted[j - 1] > sample; j--)
+        {
+            sorted[j] = sorted[j - 1];
+        }
+        sorted[j] = sample;
+    }
+    unsigned int rank = (count * percent + 99) / 100;
+    return sorted[rank ? rank - 1 : 0];
+}
+
+// How long to wait for the primary before sending the hedge: its 95th percentile, but never more than half the
+// timeout, so that a few recent failures do not stop the hedge going out in time to be answered.
+static uint64_t HedgeDelayUs(const struct _modbusRedundant *group, size_t timeout)
+{
+    const path_t *primary = &group->paths[group->primary];
+    uint64_t delayUs = (uint64_t)timeout * 1000 / 2;
+    if (primary->sampleCount >= MIN_PATH_SAMPLES && (!timeout || Percentile(primary, 95) < delayUs))
+    {
+        delayUs = Percentile(primary, 95);
+    }
+    return (delayUs < group->minHedgeDelayUs) ? group->minHedgeDelayUs : delayUs;
+}
+
+static void ChoosePrimary(struct _modbusRedundant *group)
+{
+    const path_t *primary = &group->paths[group->primary];
+    const path_t *other = &group->paths[!group->primary];
+    if (primary->sampleCount < MIN_PATH_SAMPLES || other->sampleCount < MIN_PATH_SAMPLES)
+    {
+        return;
+    }
+    if ((uint64_t)Percentile(other, 95) * 100 < (uint64_t)Percentile(primary, 95) * PRIMARY_SWITCH_PERCENT)
+    {
+        group->primary = !group->primary;
+    }
+}
+
+// Counts a failed request on a path. A failure counts as a response that took the whole timeout, so a path that
+// keeps failing loses its place as the primary.
+static void NoteFailure(path_t *path, size_t timeout)
+{
+    path->stats.failures++;
+    AddSample(path, timeout ? (uint64_t)timeout * 1000 : ModbusMonotonicUs() - path->sentUs);
+}
+
+// Only Modbus TCP and local handles match responses to requests by transaction ID, and can drop a request at once.
+static bool MatchesResponses(modbus_t hndl)
+{
+    return hndl->type == tcp || hndl->type == local;
+}
+
+// Ends a cancelled request left outstanding on a path once its response has arrived or its time is up, or at once
+// if force is set.
+static void SettlePath(path_t *path, bool force)
+{
+    if (path->draining && (force || ModbusRequestDone(path->hndl) ||
+                           (path->drainUntilUs && ModbusMonotonicUs() >= path->drainUntilUs)))
+    {
+        uint8_t error = 0;
+        ModbusFinishRequest(path->hndl, true, &error);
+        path->draining = false;
+    }
+}
+
+// Sends the read on a path, or finishes the path with the reason in error if it could not be sent. A path still
+// waiting for a cancelled request is skipped without counting as a failure.
+static void StartPath(path_t *path, uint8_t *error, size_t timeout)
+{
+    if (path->draining)
+    {
+        *error = HANDLE_IN_USE;
+        path->finished = true;
+        return;
+    }
+    path->stats.requests++;
+    path->sentUs = ModbusMonotonicUs();
+    path->sent = ModbusStartRequest(path->hndl, path->request, REQUEST_LENGTH, path->response, error);
+    path->finished = !path->sent;
+    if (!path->sent)
+    {
+        NoteFailure(path, timeout);
+    }
+}
+
+// Checks a response to a read and unpacks its values if it is valid. Returns 0 or the exception code. Exceptions
+// that say the path rather than the device could not handle the read fail the path, as an invalid response does;
+// other exceptions are answers.
+static uint8_t DecodeResponse(const path_t *path, uint16_t responseLength, void *values, bool *pathFailed)
+{
+    uint8_t error = FcodeDecodeResponse(path->request, REQUEST_LENGTH, path->response, responseLength, values, NULL);
+    if (error == INVALID_RESPONSE)
+    {
+        Log_Debug("Error: Invalid response to redundant read from slave %u\n", path->slaveID);
+    }
+    *pathFailed = error == INVALID_RESPONSE || error == SLAVE_DEVICE_BUSY || error == GATEWAY_PATH_UNAVAILABLE ||
+                  error == GATEWAY_TARGET_DEVICE_FAILED_TO_RESPOND;
+    return error;
+}
+
+modbusRedundant_t ModbusCreateRedundant(modbus_t first, uint8_t firstID, modbus_t second, uint8_t secondID,
+                                        size_t minHedgeDelay)
+{
+    if (!first || !second || first == second)
+    {
+        Log_Debug("Error: Redundant paths need two different handles\n");
+        return NULL;
+    }
+    struct _modbusRedundant *group = calloc(1, sizeof(struct _modbusRedundant));
+    if (!group)
+    {
+        Log_Debug("Error: Unable to allocate redundant paths\n");
+        return NULL;
+    }
+    group->paths[0].hndl = first;
+    group->paths[0].slaveID = firstID;
+    group->paths[1].hndl = second;
+    group->paths[1].slaveID = secondID;
+    group->minHedgeDelayUs = (minHedgeDelay > UINT32_MAX / 1000) ? UINT32_MAX : (uint32_t)(minHedgeDelay * 1000);
+    return group;
+}
+
+bool ModbusRedundantRead(modbusRedundant_t paths, modbusTable_t table, uint16_t address, uint16_t count,
+                         void *values, size_t timeout)
+{
+    bool isRegisterRead = IsRegisterTable(table);
+    uint8_t error = 0;
+    path_t *winner = NULL;
+
+    if (table > MODBUS_TABLE_INPUT_REGISTERS)
+    {
+        Log_Debug("Error: Invalid table %d for a redundant read\n", (int)table);
+        error = ILLEGAL_FUNCTION;
+        goto done;
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        path_t *path = &paths->paths[i];
+        if (count == 0 || count > ModbusMaxReadQuantity(path->hndl, path->slaveID, table))
+        {
+            Log_Debug("Error: Invalid count %u for a redundant read\n", count);
+            error = ILLEGAL_DATA_VALUE;
+            goto done;
+        }
+        SET_MODBUS_HEADER(path->request, path->slaveID, ReadFunctionCode(table), address, count);
+        SettlePath(path, false);
+        path->sent = false;
+        path->finished = false;
+    }
+
+    path_t *primary = &paths->paths[paths->primary];
+    path_t *hedge = &paths->paths[!paths->primary];
+    uint64_t startUs = ModbusMonotonicUs();
+    uint64_t hedgeUs = startUs + HedgeDelayUs(paths, timeout);
+    uint64_t deadlineUs = startUs + (uint64_t)timeout * 1000;
+    bool hedged = false;
+
+    StartPath(primary, &error, timeout);
+
+    while (!winner)
+    {
+        uint64_t nowUs = ModbusMonotonicUs();
+        // The hedge goes out once the primary is slow, or at once if the primary has failed.
+        if (!hedged && (primary->finished || nowUs >= hedgeUs))
+        {
+            hedged = true;
+            if (!hedge->draining)
+            {
+                hedge->stats.hedges++;
+            }
+            StartPath(hedge, &error, timeout);
+        }
+
+        for (int i = 0; i < 2 && !winner; i++)
+        {
+            path_t *path = &paths->paths[i];
+            if (!path->sent || !ModbusRequestDone(path->hndl))
+            {
+                continue;
+            }
+            uint8_t pathError = 0;
+            bool pathFailed = true;
+            uint16_t responseLength = ModbusFinishRequest(path->hndl, false, &pathError);
+            if (responseLength)
+            {
+                pathError = DecodeResponse(path, responseLength, values, &pathFailed);
+            }
+            path->sent = false;
+            path->finished = true;
+            if (pathFailed)
+            {
+                NoteFailure(path, timeout);
+                error = pathError;
+            }
+            else
+            {
+                AddSample(path, ModbusMonotonicUs() - path->sentUs);
+                winner = path;
+                error = pathError;
+            }
+        }
+
+        if (winner || (primary->finished && hedged && hedge->finished) ||
+            (timeout > 0 && ModbusMonotonicUs() >= deadlineUs))
+        {
+            break;
+        }
+        struct timespec t = {.tv_sec = 0, .tv_nsec = 100000};
+        nanosleep(&t, NULL);
+    }
+
+    // Give up on whatever is still outstanding: cancelled if the other path answered, otherwise timed out. A
+    // cancelled request on a handle without transaction IDs is left to be answered, so that its response is not
+    // taken as the answer to the path's next request.
+    for (int i = 0; i < 2; i++)
+    {
+        path_t *path = &paths->paths[i];
+        if (!path->sent)
+        {
+            continue;
+        }
+        path->sent = false;
+        if (winner)
+        {
+            // Slower than the winner; at least the time waited.
+            AddSample(path, ModbusMonotonicUs() - path->sentUs);
+            path->draining = true;
+            path->drainUntilUs = timeout ? path->sentUs + (uint64_t)timeout * 1000 : 0;
+            if (MatchesResponses(path->hndl))
+            {
+                SettlePath(path, true);
+            }
+        }
+        else
+        {
+            uint8_t pathError = 0;
+            ModbusFinishRequest(path->hndl, false, &pathError);
+            NoteFailure(path, timeout);
+            error = MODBUS_TIMEOUT;
+        }
+    }
+    if (winner)
+    {
+        winner->stats.wins++;
+    }
+    ChoosePrimary(paths);
+
+done:
+    if (!winner || error)
+    {
+        if (isRegisterRead)
+        {
+            ((uint16_t *)values)[0] = error ? error : MODBUS_TIMEOUT;
+        }
+        else
+        {
+            ((uint8_t *)values)[0] = error ? error : MODBUS_TIMEOUT;
+        }
+        return false;
+    }
+    return true;
+}
+
+bool ModbusGetPathStats(modbusRedundant_t paths, uint8_t path, modbusPathStats_t *stats)
+{
+    if (path > 1)
+    {
+        return false;
+    }
+    *stats = paths->paths[path].stats;
+    stats->p50Us = Percentile(&paths->paths[path], 50);
+    stats->p95Us = Percentile(&paths->paths[path], 95);
+    stats->primary = paths->primary == path;
+    return true;
+}
+
+void ModbusFreeRedundant(modbusRedundant_t paths)
+{
+    SettlePath(&paths->paths[0], true);
+    SettlePath(&paths->paths[1], true);
+    free(paths);
+}
@@ -0,0 +1,83 @@
+/**
+ * @file    modbus_redundant.h
+ * @brief   Hedged reads from a device that can be reached over two paths, such as directly over Modbus TCP and
+ *          through an RTU gateway, so that a stalled path does not cost a full timeout.
+ *
+ *          A read is sent on the primary path first. If it has not been answered once the primary's 95th percentile
+ *          response time has passed, or the primary fails, the same read is sent on the other path as a hedge. The
+ *          first valid response is returned and the other request is cancelled. RTU handles cannot tell a late
+ *          response from the answer to their next request, so a request cancelled on one is left to be answered or
+ *          to time out, and its path sits out reads until then. Each path keeps the response times of its recent
+ *          requests, and the path whose 95th percentile is clearly lower becomes the primary. Only reads are sent
+ *          this way, since sending a write twice could carry it out twice.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+
+#pragma once
+
+#include "modbus.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct _modbusRedundant* modbusRedundant_t;
+
+// How a path has performed, see ModbusGetPathStats
+typedef struct _modbusPathStats
+{
+    uint32_t requests; // Requests sent on the path, including hedges
+    uint32_t hedges;   // Requests sent on the path because the other path was slow or failed
+    uint32_t wins;     // Reads answered first by the path
+    uint32_t failures; // Requests that timed out, could not be sent or were answered by a gateway or busy exception
+    uint32_t p50Us;    // Median response time of recent requests, in microseconds; a failure counts as the timeout
+    uint32_t p95Us;    // 95th percentile response time of recent requests
+    bool primary;      // Whether the path is the primary
+} modbusPathStats_t;
+
+/// <summary>
+/// Groups two handles that reach the same device. The first path starts as the primary. Both handles must only be
+/// used from the thread that reads through the group, and must stay open until the group is freed.
+/// </summary>
+/// <param name="first">The handle for the first path</param>
+/// <param name="firstID">The device's unit ID on the first path</param>
+/// <param name="second">The handle for the second path</param>
+/// <param name="secondID">The device's unit ID on the second path, which differs from firstID if a gateway maps it</param>
+/// <param name="minHedgeDelay">Shortest time in milliseconds to wait for the primary before sending a hedge</param>
+/// <returns>The group, or NULL if the handles are the same or memory could not be allocated</returns>
+modbusRedundant_t ModbusCreateRedundant( modbus_t first, uint8_t firstID, modbus_t second, uint8_t secondID,
+                                         size_t minHedgeDelay );
+
+/// <summary>
+/// Reads from the device over the primary path, and over the other path as well if the primary is slower than its
+/// 95th percentile response time or fails. The hedge is never sent later than half the timeout, which is also when
+/// it is sent until the primary has answered enough requests to know its response times. An exception from the
+/// device is a valid response and is returned; SLAVE_DEVICE_BUSY and the gateway exceptions are treated as a
+/// failure of the path.
+/// </summary>
+/// <param name="paths">The group</param>
+/// <param name="table">The table to read</param>
+/// <param name="address">The address of the first register or bit to read</param>
+/// <param name="count">The number of registers or bits to read</param>
+/// <param name="values">Receives the values: a uint16_t array for registers, a packed uint8_t array for bits. On
+/// failure the first element receives a Modbus exception code or one of the library's error codes</param>
+/// <param name="timeout">Time in milliseconds after which the read fails if neither path has answered</param>
+/// <returns>true on success, false otherwise</returns>
+bool ModbusRedundantRead( modbusRedundant_t paths, modbusTable_t table, uint16_t address, uint16_t count,
+                          void* values, size_t timeout );
+
+/// <summary>
+/// Gets how one of the paths of a group has performed.
+/// </summary>
+/// <param name="paths">The group</param>
+/// <param name="path">0 for the first path, 1 for the second</param>
+/// <param name="stats">Receives the statistics</param>
+/// <returns>true on success, false if path is not 0 or 1</returns>
+bool ModbusGetPathStats( modbusRedundant_t paths, uint8_t path, modbusPathStats_t* stats );
+
+/// <summary>
+/// Frees a group. The handles are not closed.
+/// </summary>
+/// <param name="paths">The group</param>
+void ModbusFreeRedundant( modbusRedundant_t paths );
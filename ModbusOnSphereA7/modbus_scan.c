@@ -0,0 +1,73 @@
+/**
+ * @file    modbus_scan.c
+ * @brief   Reads address ranges larger than a single Modbus request allows.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+
+#include "modbus_scan.h"
+#include "modbus_transact.h"
+#include "modbus_internal.h"
+#include <applibs/log.h>
+
+static const uint8_t tableFunctionCodes[] = {READ_COILS, READ_DISCRETE_INPUTS, READ_MULTIPLE_HOLDING_REGISTERS,
+                                             READ_INPUT_REGISTERS};
+
+size_t ModbusScanChunkCount(modbus_t hndl, uint8_t slaveID, modbusTable_t table, uint32_t count)
+{
+    uint16_t chunkSize = ModbusMaxReadQuantity(hndl, slaveID, table);
+    return (count + chunkSize - 1) / chunkSize;
+}
+
+bool ModbusScanRegisters(modbus_t hndl, uint8_t slaveID, modbusTable_t table, uint16_t start, uint32_t count,
+                         void *out, modbusScanChunk_t *chunks, size_t maxChunks, size_t timeout)
+{
+    if ((uint32_t)table >= sizeof(tableFunctionCodes) || count == 0 || start + count > 0x10000)
+    {
+        Log_Debug("Error: Invalid range for %s\n", __FUNCTION__);
+        return false;
+    }
+    size_t chunkCount = ModbusScanChunkCount(hndl, slaveID, table, count);
+    if (chunks && maxChunks < chunkCount)
+    {
+        Log_Debug("Error: %s needs %zu chunks, only %zu provided\n", __FUNCTION__, chunkCount, maxChunks);
+        return false;
+    }
+
+    uint16_t chunkSize = ModbusMaxReadQuantity(hndl, slaveID, table);
+    bool isRegisterTable = (table == MODBUS_TABLE_HOLDING_REGISTERS || table == MODBUS_TABLE_INPUT_REGISTERS);
+    bool allSucceeded = true;
+    modbusTransaction_t group[MODBUS_MAX_IN_FLIGHT];
+
+    // Requests are handed over a group at a time so the transactions stay on the stack however large the range is.
+    for (size_t first = 0; first < chunkCount; first += MODBUS_MAX_IN_FLIGHT)
+    {
+        size_t groupSize = (chunkCount - first < MODBUS_MAX_IN_FLIGHT) ? chunkCount - first : MODBUS_MAX_IN_FLIGHT;
+        for (size_t i = 0; i < groupSize; i++)
+        {
+            uint32_t offset = (uint32_t)((first + i) * chunkSize);
+            // Every chunk but the last holds a multiple of eight bits, so each starts on a byte boundary.
+            void *chunkOut =
+                isRegisterTable ? (void *)((uint16_t *)out + offset) : (void *)((uint8_t *)out + offset / 8);
+            group[i] = (modbusTransaction_t){.slaveID = slaveID,
+                                             .functionCode = tableFunctionCodes[table],
+                                             .address = (uint16_t)(start + offset),
+                                             .count = (uint16_t)((count - offset < chunkSize) ? count - offset
+                                                                                               : chunkSize),
+                                             .out = chunkOut};
+        }
+
+        if (!ModbusTransact(hndl, group, groupSize, timeout))
+        {
+            allSucceeded = false;
+        }
+
+        for (size_t i = 0; chunks && i < groupSize; i++)
+        {
+            chunks[first + i] =
+                (modbusScanChunk_t){.address = group[i].address, .count = group[i].count, .error = group[i].error};
+        }
+    }
+    return allSucceeded;
+}
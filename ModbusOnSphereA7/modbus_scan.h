@@ -0,0 +1,53 @@
+/**
+ * @file    modbus_scan.h
+ * @brief   Reads address ranges larger than a single Modbus request allows. The range is split into the largest
+ *          requests the handle's transport can carry, and on Modbus TCP handles several of those requests are kept in
+ *          flight at once (see ModbusSetMaxInFlight). The results are written to one contiguous array, and the outcome
+ *          of every request is reported separately so a gap in the slave's address map does not lose the rest of the
+ *          range.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+
+#pragma once
+
+#include "modbus.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct _modbusScanChunk
+{
+    uint16_t address; // First address read by this request
+    uint16_t count;   // Number of registers or bits read by this request
+    uint8_t error;    // 0 on success, otherwise a Modbus exception code or one of the library's error codes
+} modbusScanChunk_t;
+
+/// <summary>
+/// Gets the number of requests ModbusScanRegisters will use to read a range.
+/// </summary>
+/// <param name="hndl">The handle that will be used</param>
+/// <param name="slaveID">The slave that will be read</param>
+/// <param name="table">The table that will be read</param>
+/// <param name="count">The number of registers or bits in the range</param>
+/// <returns>The number of requests, and so the number of entries the chunks array must hold</returns>
+size_t ModbusScanChunkCount( modbus_t hndl, uint8_t slaveID, modbusTable_t table, uint32_t count );
+
+/// <summary>
+/// Reads a range of registers or bits from a slave, splitting it into as many requests as needed.
+/// </summary>
+/// <param name="hndl">The handle to read through</param>
+/// <param name="slaveID">The slave to read from</param>
+/// <param name="table">The table to read</param>
+/// <param name="start">The first address to read</param>
+/// <param name="count">The number of registers or bits to read. start + count must not exceed 65536</param>
+/// <param name="out">Receives the values: a uint16_t array for register tables, or a packed uint8_t array with
+/// the first address in the least significant bit of the first byte for coils and discrete inputs. Values from
+/// failed requests are left unchanged</param>
+/// <param name="chunks">Optional. Receives the address, size and outcome of every request</param>
+/// <param name="maxChunks">The number of entries in chunks, which must be at least ModbusScanChunkCount</param>
+/// <param name="timeout">Timeout for each group of requests</param>
+/// <returns>true if every request succeeded, false otherwise</returns>
+bool ModbusScanRegisters( modbus_t hndl, uint8_t slaveID, modbusTable_t table, uint16_t start, uint32_t count,
+                          void* out, modbusScanChunk_t* chunks, size_t maxChunks, size_t timeout );
@@ -0,0 +1,387 @@
+/**
+ * @file    modbus_subscribe.c
+ * @brief   Value change notification on top of polling.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+
+#include "modbus_subscribe.h"
+#include "modbus_transact.h"
+#include "modbus_internal.h"
+#include <applibs/log.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A range read on every poll, covering one or more overlapping or adjacent subscriptions.
+typedef struct
+{
+    modbus_t hndl;
+    uint8_t slaveID;
+    modbusTable_t table;
+    uint16_t address;
+    uint32_t count;
+    uint16_t chunkSize;
+    size_t firstTransaction;
+    size_t transactionCount;
+    uint16_t *values;
+    uint8_t *bits;
+} pollGroup_t;
+
+struct _modbusSubscription
+{
+    modbus_t hndl;
+    uint8_t slaveID;
+    modbusTable_t table;
+    uint16_t address;
+    uint16_t count;
+    uint16_t deadband;
+    modbusSubscriptionCallback_t callback;
+    void *context;
+    pollGroup_t *group;
+    struct _modbusSubscription *next;
+    bool reported;
+    uint16_t lastValues[];
+};
+
+static const uint8_t tableFunctionCodes[] = {READ_COILS, READ_DISCRETE_INPUTS, READ_MULTIPLE_HOLDING_REGISTERS,
+                                             READ_INPUT_REGISTERS};
+
+static modbusSubscription_t subscriptions = NULL;
+
+// The poll plan is rebuilt from the subscriptions the next time it is needed after they change.
+static bool planValid = false;
+static pollGroup_t *groups = NULL;
+static size_t groupCount = 0;
+static modbusTransaction_t *transactions = NULL;
+static size_t transactionCount = 0;
+
+static bool IsBitTable(modbusTable_t table)
+{
+    return table == MODBUS_TABLE_COILS || table == MODBUS_TABLE_DISCRETE_INPUTS;
+}
+
+static void FreePlan(void)
+{
+    for (size_t i = 0; i < groupCount; i++)
+    {
+        free(groups[i].values);
+        free(groups[i].bits);
+    }
+    free(groups);
+    free(transactions);
+    groups = NULL;
+    groupCount = 0;
+    transactions = NULL;
+    transactionCount = 0;
+    planValid = false;
+
+    for (modbusSubscription_t subscription = subscriptions; subscription; subscription = subscription->next)
+    {
+        subscription->group = NULL;
+    }
+}
+
+static int CompareSubscriptions(const void *a, const void *b)
+{
+    const struct _modbusSubscription *x = *(const modbusSubscription_t *)a;
+    const struct _modbusSubscription *y = *(const modbusSubscription_t *)b;
+
+    if (x->hndl != y->hndl)
+    {
+        return ((uintptr_t)x->hndl < (uintptr_t)y->hndl) ? -1 : 1;
+    }
+    if (x->slaveID != y->slaveID)
+    {
+        return (x->slaveID < y->slaveID) ? -1 : 1;
+    }
+    if (x->table != y->table)
+    {
+        return (x->table < y->table) ? -1 : 1;
+    }
+    return (x->address < y->address) ? -1 : (x->address > y->address);
+}
+
+// Sorts the subscriptions and merges them into poll groups, each read by one or more requests. Groups and their
+// requests are kept in handle order so each handle's requests can be sent in one call.
+static bool BuildPlan(void)
+{
+    FreePlan();
+
+    size_t count = 0;
+    for (modbusSubscription_t subscription = subscriptions; subscription; subscription = subscription->next)
+    {
+        count++;
+    }
+    if (count == 0)
+    {
+        planValid = true;
+        return true;
+    }
+
+    modbusSubscription_t *sorted = malloc(count * sizeof(modbusSubscription_t));
+    groups = calloc(count, sizeof(pollGroup_t));
+    if (!sorted || !groups)
+    {
+        Log_Debug("Error: Unable to allocate subscription poll plan\n");
+        free(sorted);
+        FreePlan();
+        return false;
+    }
+    size_t i = 0;
+    for (modbusSubscription_t subscription = subscriptions; subscription; subscription = subscription->next)
+    {
+        sorted[i++] = subscription;
+    }
+    qsort(sorted, count, sizeof(modbusSubscription_t), CompareSubscriptions);
+
+    pollGroup_t *group = NULL;
+    for (i = 0; i < count; i++)
+    {
+        modbusSubscription_t subscription = sorted[i];
+        uint32_t end = (uint32_t)subscription->address + subscription->count;
+
+        if (group && group->hndl == subscription->hndl && group->slaveID == subscription->slaveID &&
+            group->table == subscription->table && subscription->address <= group->address + group->count)
+        {
+            if (end > group->address + group->count)
+            {
+                group->count = end - group->address;
+            }
+        }
+        else
+        {
+            group = &groups[groupCount++];
+            *group = (pollGroup_t){.hndl = subscription->hndl,
+                                   .slaveID = subscription->slaveID,
+                                   .table = subscription->table,
+                                   .address = subscription->address,
+                                   .count = subscription->count,
+                                   .chunkSize = ModbusMaxReadQuantity(subscription->hndl, subscription->slaveID,
+                                                                      subscription->table)};
+        }
+        subscription->group = group;
+    }
+    free(sorted);
+
+    for (i = 0; i < groupCount; i++)
+    {
+        groups[i].firstTransaction = transactionCount;
+        groups[i].transactionCount = (groups[i].count + groups[i].chunkSize - 1) / groups[i].chunkSize;
+        transactionCount += groups[i].transactionCount;
+    }
+    transactions = calloc(transactionCount, sizeof(modbusTransaction_t));
+    if (!transactions)
+    {
+        Log_Debug("Error: Unable to allocate subscription poll plan\n");
+        FreePlan();
+        return false;
+    }
+
+    for (i = 0; i < groupCount; i++)
+    {
+        group = &groups[i];
+        group->values = calloc(group->count, sizeof(uint16_t));
+        group->bits = IsBitTable(group->table) ? calloc((group->count + 7) / 8, 1) : NULL;
+        if (!group->values || (IsBitTable(group->table) && !group->bits))
+        {
+            Log_Debug("Error: Unable to allocate subscription poll plan\n");
+            FreePlan();
+            return false;
+        }
+
+        for (size_t chunk = 0; chunk < group->transactionCount; chunk++)
+        {
+            uint32_t offset = (uint32_t)(chunk * group->chunkSize);
+            // Every chunk but the last holds a multiple of eight bits, so each starts on a byte boundary.
+            void *chunkOut = IsBitTable(group->table) ? (void *)&group->bits[offset / 8]
+                                                      : (void *)&group->values[offset];
+            transactions[group->firstTransaction + chunk] = (modbusTransaction_t){
+                .slaveID = group->slaveID,
+                .functionCode = tableFunctionCodes[group->table],
+                .address = (uint16_t)(group->address + offset),
+                .count = (uint16_t)((group->count - offset < group->chunkSize) ? group->count - offset
+                                                                               : group->chunkSize),
+                .out = chunkOut};
+        }
+    }
+
+    planValid = true;
+    return true;
+}
+
+modbusSubscription_t ModbusSubscribe(modbus_t hndl, uint8_t slaveID, modbusTable_t table, uint16_t address,
+                                     uint16_t count, uint16_t deadband, modbusSubscriptionCallback_t callback,
+                                     void *context)
+{
+    if (!hndl || !callback || (uint32_t)table >= sizeof(tableFunctionCodes) || count == 0 ||
+        (uint32_t)address + count > 0x10000)
+    {
+        Log_Debug("Error: Invalid subscription\n");
+        return NULL;
+    }
+
+    modbusSubscription_t subscription = malloc(sizeof(struct _modbusSubscription) + count * sizeof(uint16_t));
+    if (!subscription)
+    {
+        Log_Debug("Error: Unable to allocate subscription\n");
+        return NULL;
+    }
+    *subscription = (struct _modbusSubscription){.hndl = hndl,
+                                                 .slaveID = slaveID,
+                                                 .table = table,
+                                                 .address = address,
+                                                 .count = count,
+                                                 .deadband = IsBitTable(table) ? 0 : deadband,
+                                                 .callback = callback,
+                                                 .context = context};
+
+    // Subscribers are called in the order they subscribed.
+    modbusSubscription_t *tail = &subscriptions;
+    while (*tail)
+    {
+        tail = &(*tail)->next;
+    }
+    *tail = subscription;
+    planValid = false;
+    return subscription;
+}
+
+void ModbusUnsubscribe(modbusSubscription_t subscription)
+{
+    if (!subscription)
+    {
+        return;
+    }
+    for (modbusSubscription_t *link = &subscriptions; *link; link = &(*link)->next)
+    {
+        if (*link == subscription)
+        {
+            *link = subscription->next;
+            break;
+        }
+    }
+    free(subscription);
+    FreePlan();
+}
+
+// Calls a subscriber if every request covering its values succeeded and a value has moved past its deadband.
+static void Notify(modbusSubscription_t subscription)
+{
+    const pollGroup_t *group = subscription->group;
+    uint32_t offset = (uint32_t)subscription->address - group->address;
+
+    for (uint32_t chunk = offset / group->chunkSize; chunk <= (offset + subscription->count - 1) / group->chunkSize;
+         chunk++)
+    {
+        if (transactions[group->firstTransaction + chunk].error)
+        {
+            return;
+        }
+    }
+
+    const uint16_t *values = &group->values[offset];
+    bool changed = !subscription->reported;
+    for (uint16_t i = 0; i < subscription->count && !changed; i++)
+    {
+        uint16_t last = subscription->lastValues[i];
+        uint16_t difference = (values[i] > last) ? (uint16_t)(values[i] - last) : (uint16_t)(last - values[i]);
+        changed = difference > subscription->deadband;
+    }
+    if (!changed)
+    {
+        return;
+    }
+
+    subscription->callback(subscription->context, subscription->reported ? subscription->lastValues : NULL, values,
+                           subscription->count);
+    memcpy(subscription->lastValues, values, subscription->count * sizeof(uint16_t));
+    subscription->reported = true;
+}
+
+// Whether a read limit set or learned for one of the handle's slaves since the plan was built changes its requests.
+static bool ReadLimitsChanged(modbus_t hndl)
+{
+    for (size_t i = 0; i < groupCount; i++)
+    {
+        if (groups[i].hndl == hndl &&
+            groups[i].chunkSize != ModbusMaxReadQuantity(hndl, groups[i].slaveID, groups[i].table))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Finds the handle's groups, which are adjacent in the plan. Returns false if it has none.
+static bool FindGroups(modbus_t hndl, size_t *first, size_t *last)
+{
+    size_t i = 0;
+    while (i < groupCount && groups[i].hndl != hndl)
+    {
+        i++;
+    }
+    if (i == groupCount)
+    {
+        return false;
+    }
+    *first = i;
+    while (i + 1 < groupCount && groups[i + 1].hndl == hndl)
+    {
+        i++;
+    }
+    *last = i;
+    return true;
+}
+
+bool ModbusPollSubscriptions(modbus_t hndl, size_t timeout)
+{
+    size_t first = 0;
+    size_t last = 0;
+
+    if ((!planValid || ReadLimitsChanged(hndl)) && !BuildPlan())
+    {
+        return false;
+    }
+    if (!FindGroups(hndl, &first, &last))
+    {
+        return true;
+    }
+
+    size_t firstTransaction = groups[first].firstTransaction;
+    size_t count = groups[last].firstTransaction + groups[last].transactionCount - firstTransaction;
+    bool allSucceeded = ModbusTransact(hndl, &transactions[firstTransaction], count, timeout);
+
+    for (size_t i = first; i <= last; i++)
+    {
+        if (groups[i].bits)
+        {
+            for (uint32_t bit = 0; bit < groups[i].count; bit++)
+            {
+                groups[i].values[bit] = (groups[i].bits[bit / 8] >> (bit % 8)) & 1;
+            }
+        }
+    }
+
+    for (modbusSubscription_t subscription = subscriptions; subscription; subscription = subscription->next)
+    {
+        if (subscription->hndl == hndl)
+        {
+            Notify(subscription);
+        }
+    }
+    return allSucceeded;
+}
+
+size_t ModbusGetSubscriptionRequestCount(modbus_t hndl)
+{
+    size_t first = 0;
+    size_t last = 0;
+
+    if (((!planValid || ReadLimitsChanged(hndl)) && !BuildPlan()) || !FindGroups(hndl, &first, &last))
+    {
+        return 0;
+    }
+    return groups[last].firstTransaction + groups[last].transactionCount - groups[first].firstTransaction;
+}
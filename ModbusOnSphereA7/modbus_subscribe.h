@@ -0,0 +1,73 @@
+/**
+ * @file    modbus_subscribe.h
+ * @brief   Value change notification on top of polling. Each part of the application subscribes to the values it
+ *          cares about and is called back only when they change. Overlapping and adjacent subscriptions to the same
+ *          slave and table are read together, so one poll of the bus serves every subscriber.
+ *
+ *          Subscriptions are polled when the application calls ModbusPollSubscriptions, typically from the timer
+ *          that used to drive its own reads. All of these functions, and the callbacks, run on the caller's thread:
+ *          they must all be called from the same thread, and a callback must not subscribe or unsubscribe.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+
+#pragma once
+
+#include "modbus.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct _modbusSubscription* modbusSubscription_t;
+
+/// <summary>
+/// Called when subscribed values change. Register values are passed as read; coils and discrete inputs are passed
+/// one per element as 0 or 1.
+/// </summary>
+/// <param name="context">The context passed to ModbusSubscribe</param>
+/// <param name="oldValues">The values last passed to this callback, or NULL the first time</param>
+/// <param name="newValues">The values just read</param>
+/// <param name="count">The number of values</param>
+typedef void (*modbusSubscriptionCallback_t)( void* context, const uint16_t* oldValues, const uint16_t* newValues,
+                                              uint16_t count );
+
+/// <summary>
+/// Subscribes to a range of values. The callback is called after the first successful poll, and after any later
+/// poll in which a value has moved by more than the deadband since it was last passed to the callback.
+/// </summary>
+/// <param name="hndl">The handle to poll through. Unsubscribe before closing it</param>
+/// <param name="slaveID">The slave to read from</param>
+/// <param name="table">The table to read</param>
+/// <param name="address">The first address of the range</param>
+/// <param name="count">The number of registers or bits in the range</param>
+/// <param name="deadband">How far a register may move without being reported. Ignored for coils and inputs</param>
+/// <param name="callback">Called when the values change</param>
+/// <param name="context">Passed to the callback</param>
+/// <returns>The subscription, or NULL if the range is not valid or memory could not be allocated</returns>
+modbusSubscription_t ModbusSubscribe( modbus_t hndl, uint8_t slaveID, modbusTable_t table, uint16_t address,
+                                      uint16_t count, uint16_t deadband, modbusSubscriptionCallback_t callback,
+                                      void* context );
+
+/// <summary>
+/// Removes a subscription.
+/// </summary>
+/// <param name="subscription">The subscription, or NULL</param>
+void ModbusUnsubscribe( modbusSubscription_t subscription );
+
+/// <summary>
+/// Reads every range subscribed to through a handle and calls the subscribers whose values have changed.
+/// Subscribers whose values could not be read are not called.
+/// </summary>
+/// <param name="hndl">The modbus handle</param>
+/// <param name="timeout">Timeout for each group of requests in flight together</param>
+/// <returns>true if every read succeeded, false otherwise</returns>
+bool ModbusPollSubscriptions( modbus_t hndl, size_t timeout );
+
+/// <summary>
+/// Gets the number of requests ModbusPollSubscriptions sends for a handle, after overlapping subscriptions have
+/// been combined.
+/// </summary>
+/// <param name="hndl">The modbus handle</param>
+/// <returns>The number of requests per poll</returns>
+size_t ModbusGetSubscriptionRequestCount( modbus_t hndl );
@@ -0,0 +1,392 @@
+/**
+ * @file    modbus_transact.c
+ * @brief   Sends a set of different requests in one call.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+
+#include "modbus_transact.h"
+#include "modbus_internal.h"
+#include "../fcode-registry.h"
+#include <applibs/log.h>
+#include <string.h>
+
+#define REQUEST_HEADER_LENGTH 6
+
+static bool IsRead(uint8_t functionCode)
+{
+    return functionCode == READ_COILS || functionCode == READ_DISCRETE_INPUTS ||
+           functionCode == READ_MULTIPLE_HOLDING_REGISTERS || functionCode == READ_INPUT_REGISTERS;
+}
+
+static bool IsRegisterRead(uint8_t functionCode)
+{
+    return functionCode == READ_MULTIPLE_HOLDING_REGISTERS || functionCode == READ_INPUT_REGISTERS;
+}
+
+static modbusTable_t ReadTable(uint8_t functionCode)
+{
+    switch (functionCode)
+    {
+    case READ_COILS:
+        return MODBUS_TABLE_COILS;
+    case READ_DISCRETE_INPUTS:
+        return MODBUS_TABLE_DISCRETE_INPUTS;
+    case READ_MULTIPLE_HOLDING_REGISTERS:
+        return MODBUS_TABLE_HOLDING_REGISTERS;
+    default:
+        return MODBUS_TABLE_INPUT_REGISTERS;
+    }
+}
+
+// Encodes a transaction as a request PDU. Returns its length, or 0 with the transaction's error set if it cannot
+// be sent.
+static uint16_t BuildRequest(modbus_t hndl, modbusTransaction_t *transaction, uint8_t *request)
+{
+    const uint8_t *bits = transaction->values;
+    const uint16_t *registers = transaction->values;
+    uint16_t dataByteCount = 0;
+
+    request[0] = transaction->slaveID;
+    request[1] = transaction->functionCode;
+    SET_MODBUS_U16(&request[2], transaction->address);
+
+    switch (transaction->functionCode)
+    {
+    case READ_COILS:
+    case READ_DISCRETE_INPUTS:
+    case READ_MULTIPLE_HOLDING_REGISTERS:
+    case READ_INPUT_REGISTERS:
+        if (transaction->count == 0 ||
+            transaction->count >
+                ModbusMaxReadQuantity(hndl, transaction->slaveID, ReadTable(transaction->functionCode)))
+        {
+            break;
+        }
+        SET_MODBUS_U16(&request[4], transaction->count);
+        return REQUEST_HEADER_LENGTH;
+    case WRITE_SINGLE_COIL:
+        SET_MODBUS_U16(&request[4], (bits[0] & 1) ? 0xFF00 : 0x0000);
+        return REQUEST_HEADER_LENGTH;
+    case WRITE_SINGLE_HOLDING_REGISTER:
+        SET_MODBUS_U16(&request[4], registers[0]);
+        return REQUEST_HEADER_LENGTH;
+    case MASK_WRITE_REGISTER:
+        SET_MODBUS_U16(&request[4], registers[0]);
+        SET_MODBUS_U16(&request[6], registers[1]);
+        return REQUEST_HEADER_LENGTH + 2;
+    case WRITE_MULTIPLE_COILS:
+        if (transaction->count == 0 || transaction->count > MAX_WRITE_BITS)
+        {
+            break;
+        }
+        dataByteCount = (uint16_t)((transaction->count + 7) / 8);
+        SET_MODBUS_U16(&request[4], transaction->count);
+        request[6] = (uint8_t)dataByteCount;
+        memcpy(&request[7], bits, dataByteCount);
+        return (uint16_t)(REQUEST_HEADER_LENGTH + 1 + dataByteCount);
+    case WRITE_MULTIPLE_HOLDING_REGISTERS:
+        if (transaction->count == 0 || transaction->count > MAX_WRITE_REGISTERS)
+        {
+            break;
+        }
+        dataByteCount = (uint16_t)(transaction->count * 2);
+        SET_MODBUS_U16(&request[4], transaction->count);
+        request[6] = (uint8_t)dataByteCount;
+        for (uint16_t i = 0; i < transaction->count; i++)
+        {
+            SET_MODBUS_U16(&request[7 + (i * 2)], registers[i]);
+        }
+        return (uint16_t)(REQUEST_HEADER_LENGTH + 1 + dataByteCount);
+    default:
+        Log_Debug("Error: Function code %u is not supported by %s\n", transaction->functionCode, __FUNCTION__);
+        transaction->error = ILLEGAL_FUNCTION;
+        return 0;
+    }
+
+    Log_Debug("Error: Invalid count %u for function code %u\n", transaction->count, transaction->functionCode);
+    transaction->error = ILLEGAL_DATA_VALUE;
+    return 0;
+}
+
+// Checks a response and copies any values read to the transaction's output. Returns 0 or the reason it was
+// rejected.
+static uint8_t DecodeResponse(modbusTransaction_t *transaction, const modbusPending_t *pending)
+{
+    if (pending->error)
+    {
+        return pending->error;
+    }
+    void *out = IsRead(transaction->functionCode) ? transaction->out : NULL;
+    uint8_t error = FcodeDecodeResponse(pending->request, pending->requestLength, pending->response,
+                                        pending->responseLength, out, NULL);
+    if (error == INVALID_RESPONSE)
+    {
+        Log_Debug("Error: Invalid response to function code %u\n", transaction->functionCode);
+    }
+    return error;
+}
+
+static bool Transact(modbus_t hndl, modbusTransaction_t *transactions, size_t count, size_t timeout,
+                     bool learnLimits);
+
+static bool IsLimitException(uint8_t error)
+{
+    return error == ILLEGAL_DATA_VALUE || error == ILLEGAL_DATA_ADDRESS;
+}
+
+// Whether a read is longer than the limit set or learned for its slave, and so has to be sent in pieces.
+static bool NeedsPieces(modbus_t hndl, const modbusTransaction_t *transaction)
+{
+    if (!hndl->slaves || !IsRead(transaction->functionCode))
+    {
+        return false;
+    }
+    const struct _modbusSlave *slave = ModbusFindSlave(hndl, transaction->slaveID, false);
+    uint16_t limit = slave ? slave->maxRead[ReadTable(transaction->functionCode)] : 0;
+    return limit && transaction->count > limit;
+}
+
+// Whether a refused read would be repeated in pieces once its slave's limit is learned.
+static bool MayReadInPieces(modbus_t hndl, const modbusTransaction_t *transaction)
+{
+    return !hndl->noReadLimitDiscovery && IsRead(transaction->functionCode) && transaction->count > 1;
+}
+
+// Reads a range with a single request. Used to probe a slave, so never learns a limit itself.
+static uint8_t ProbeRead(modbus_t hndl, const modbusTransaction_t *like, uint16_t address, uint16_t count,
+                         size_t timeout)
+{
+    uint16_t values[MAX_READ_REGISTERS];
+    modbusTransaction_t probe = {.slaveID = like->slaveID,
+                                 .functionCode = like->functionCode,
+                                 .address = address,
+                                 .count = count,
+                                 .out = values};
+    Transact(hndl, &probe, 1, timeout, false);
+    return probe.error;
+}
+
+_Static_assert(MAX_READ_REGISTERS * 2 >= (MAX_READ_BITS + 7) / 8, "Probe buffer is too small for a read of bits");
+
+// Binary searches for the largest read, no longer than refused - 1, that the slave accepts at the transaction's
+// address. Bits are searched in whole bytes, as requests for bits are split on byte boundaries. Returns 0 if no
+// read is accepted or the search is stopped by another error, which is stored in error.
+static uint16_t SearchReadLimit(modbus_t hndl, const modbusTransaction_t *like, uint16_t refused, size_t timeout,
+                                uint8_t *error)
+{
+    uint16_t step = IsRegisterRead(like->functionCode) ? 1 : 8;
+    uint16_t accepted = 0;
+    uint16_t refusedSteps = (uint16_t)((refused + step - 1) / step);
+
+    *error = 0;
+    while (refusedSteps - accepted > 1)
+    {
+        uint16_t steps = (uint16_t)(accepted + (refusedSteps - accepted) / 2);
+        uint8_t result = ProbeRead(hndl, like, like->address, (uint16_t)(steps * step), timeout);
+        if (result == 0)
+        {
+            accepted = steps;
+        }
+        else if (IsLimitException(result))
+        {
+            refusedSteps = steps;
+        }
+        else
+        {
+            *error = result;
+            return 0;
+        }
+    }
+    return (uint16_t)(accepted * step);
+}
+
+// A read refused with ILLEGAL_DATA_VALUE or ILLEGAL_DATA_ADDRESS may be longer than the slave allows. If the last
+// address of the range can be read on its own the whole range exists, so the largest read the slave accepts is
+// searched for and kept as its limit. Returns true if a limit was learned.
+static bool LearnReadLimit(modbus_t hndl, const modbusTransaction_t *transaction, size_t timeout)
+{
+    uint8_t error = 0;
+
+    if (hndl->noReadLimitDiscovery || transaction->count <= 1 ||
+        ProbeRead(hndl, transaction, (uint16_t)(transaction->address + transaction->count - 1), 1, timeout) != 0)
+    {
+        return false;
+    }
+    uint16_t limit = SearchReadLimit(hndl, transaction, transaction->count, timeout, &error);
+    if (limit == 0)
+    {
+        return false;
+    }
+    Log_Debug("Slave %u accepts reads of up to %u with function code %u\n", transaction->slaveID, limit,
+              transaction->functionCode);
+    return ModbusSetReadLimit(hndl, transaction->slaveID, ReadTable(transaction->functionCode), limit);
+}
+
+// Reads a range longer than its slave accepts as several requests into the same output.
+static bool ReadInPieces(modbus_t hndl, modbusTransaction_t *transaction, size_t timeout)
+{
+    uint16_t limit = ModbusMaxReadQuantity(hndl, transaction->slaveID, ReadTable(transaction->functionCode));
+    size_t count = (transaction->count + limit - 1u) / limit;
+    modbusTransaction_t pieces[MODBUS_MAX_IN_FLIGHT];
+
+    // Pieces are handed over a group at a time so they stay on the stack however long the read is. A group with
+    // an error ends the read.
+    transaction->error = 0;
+    for (size_t first = 0; first < count && !transaction->error; first += MODBUS_MAX_IN_FLIGHT)
+    {
+        size_t groupSize = (count - first < MODBUS_MAX_IN_FLIGHT) ? count - first : MODBUS_MAX_IN_FLIGHT;
+        for (size_t i = 0; i < groupSize; i++)
+        {
+            uint32_t offset = (uint32_t)((first + i) * limit);
+            // Limits for bits are whole bytes, so every piece starts on a byte boundary.
+            void *pieceOut = IsRegisterRead(transaction->functionCode)
+                                 ? (void *)((uint16_t *)transaction->out + offset)
+                                 : (void *)((uint8_t *)transaction->out + offset / 8);
+            pieces[i] = (modbusTransaction_t){
+                .slaveID = transaction->slaveID,
+                .functionCode = transaction->functionCode,
+                .address = (uint16_t)(transaction->address + offset),
+                .count = (uint16_t)((transaction->count - offset < limit) ? transaction->count - offset : limit),
+                .out = pieceOut};
+        }
+        Transact(hndl, pieces, groupSize, timeout, false);
+
+        for (size_t i = 0; i < groupSize && !transaction->error; i++)
+        {
+            transaction->error = pieces[i].error;
+        }
+    }
+    return transaction->error == 0;
+}
+
+bool ModbusTransact(modbus_t hndl, modbusTransaction_t *transactions, size_t count, size_t timeout)
+{
+    return Transact(hndl, transactions, count, timeout, true);
+}
+
+void ModbusSetReadLimitDiscovery(modbus_t hndl, bool enabled)
+{
+    hndl->noReadLimitDiscovery = !enabled;
+}
+
+uint16_t ModbusDiscoverReadLimit(modbus_t hndl, uint8_t slaveID, modbusTable_t table, uint16_t address,
+                                 uint8_t *error, size_t timeout)
+{
+    static const uint8_t tableFunctionCodes[] = {READ_COILS, READ_DISCRETE_INPUTS, READ_MULTIPLE_HOLDING_REGISTERS,
+                                                 READ_INPUT_REGISTERS};
+    if ((uint32_t)table >= sizeof(tableFunctionCodes))
+    {
+        *error = ILLEGAL_DATA_VALUE;
+        return 0;
+    }
+    modbusTransaction_t like = {.slaveID = slaveID, .functionCode = tableFunctionCodes[table], .address = address};
+
+    // Start from what the transport allows, not from a limit found before.
+    ModbusSetReadLimit(hndl, slaveID, table, 0);
+    uint16_t largest = ModbusMaxReadQuantity(hndl, slaveID, table);
+    if ((uint32_t)address + largest > 0x10000)
+    {
+        largest = (uint16_t)(0x10000 - address);
+    }
+
+    *error = ProbeRead(hndl, &like, address, largest, timeout);
+    if (*error == 0)
+    {
+        return largest;
+    }
+    if (!IsLimitException(*error))
+    {
+        return 0;
+    }
+    uint16_t limit = SearchReadLimit(hndl, &like, largest, timeout, error);
+    if (limit == 0)
+    {
+        if (*error == 0)
+        {
+            *error = ILLEGAL_DATA_ADDRESS;
+        }
+        return 0;
+    }
+    ModbusSetReadLimit(hndl, slaveID, table, limit);
+    return limit;
+}
+
+static bool Transact(modbus_t hndl, modbusTransaction_t *transactions, size_t count, size_t timeout,
+                     bool learnLimits)
+{
+    bool allSucceeded = true;
+    uint8_t requests[MODBUS_MAX_IN_FLIGHT][MAX_PDU_LENGTH];
+    uint8_t responses[MODBUS_MAX_IN_FLIGHT][MAX_PDU_LENGTH];
+    modbusPending_t pending[MODBUS_MAX_IN_FLIGHT];
+    modbusTransaction_t *sent[MODBUS_MAX_IN_FLIGHT];
+
+    // Requests are handed over a group at a time so the buffers stay small however many there are. To keep them in
+    // array order, a read in pieces is never part of a group, and a write never follows a read in its group that
+    // may have to be repeated in pieces.
+    size_t next = 0;
+    while (next < count)
+    {
+        size_t groupSize = 0;
+        bool mayRepeat = false;
+        while (next < count && groupSize < MODBUS_MAX_IN_FLIGHT)
+        {
+            modbusTransaction_t *transaction = &transactions[next];
+            if (learnLimits && NeedsPieces(hndl, transaction))
+            {
+                if (groupSize > 0)
+                {
+                    break;
+                }
+                next++;
+                transaction->error = 0;
+                allSucceeded = ReadInPieces(hndl, transaction, timeout) && allSucceeded;
+                continue;
+            }
+            if (mayRepeat && !IsRead(transaction->functionCode))
+            {
+                break;
+            }
+            next++;
+            transaction->error = 0;
+            uint16_t requestLength = BuildRequest(hndl, transaction, requests[groupSize]);
+            if (requestLength == 0)
+            {
+                allSucceeded = false;
+                continue;
+            }
+            pending[groupSize] = (modbusPending_t){
+                .request = requests[groupSize], .requestLength = requestLength, .response = responses[groupSize]};
+            sent[groupSize++] = transaction;
+            mayRepeat = mayRepeat || (learnLimits && MayReadInPieces(hndl, transaction));
+        }
+        if (groupSize == 0)
+        {
+            continue;
+        }
+
+        ModbusRunRequests(hndl, pending, groupSize, timeout);
+
+        for (size_t i = 0; i < groupSize; i++)
+        {
+            sent[i]->error = DecodeResponse(sent[i], &pending[i]);
+            if (learnLimits && IsRead(sent[i]->functionCode) && IsLimitException(sent[i]->error) &&
+                (NeedsPieces(hndl, sent[i]) || LearnReadLimit(hndl, sent[i], timeout)))
+            {
+                if (!ReadInPieces(hndl, sent[i], timeout))
+                {
+                    allSucceeded = false;
+                }
+                // The reads after it in the group went before it, so they are sent again.
+                next = (size_t)(sent[i] - transactions) + 1;
+                break;
+            }
+            if (sent[i]->error)
+            {
+                allSucceeded = false;
+            }
+        }
+    }
+    return allSucceeded;
+}
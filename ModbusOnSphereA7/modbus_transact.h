@@ -0,0 +1,75 @@
+/**
+ * @file    modbus_transact.h
+ * @brief   Sends a set of different requests in one call. A device's poll, such as reading its coils, inputs and
+ *          registers, is described once as an array of transactions and submitted together. On Modbus TCP handles
+ *          the requests are written back to back and their responses collected with a single wait (see
+ *          ModbusSetMaxInFlight); other handles send them one after another without returning to the caller.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+
+#pragma once
+
+#include "modbus.h"
+#include "../modbusCommon.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct _modbusTransaction
+{
+    uint8_t slaveID;      // The slave to send the request to
+    uint8_t functionCode; // READ_COILS, READ_DISCRETE_INPUTS, READ_MULTIPLE_HOLDING_REGISTERS, READ_INPUT_REGISTERS,
+                          // WRITE_SINGLE_COIL, WRITE_SINGLE_HOLDING_REGISTER, WRITE_MULTIPLE_COILS,
+                          // WRITE_MULTIPLE_HOLDING_REGISTERS or MASK_WRITE_REGISTER
+    uint16_t address;     // First address to read or write
+    uint16_t count;       // Number of registers or bits to read or write; ignored by the single writes
+    const void* values;   // Values to write: a uint16_t array for registers, a packed uint8_t array for coils,
+                          // the AND mask followed by the OR mask for MASK_WRITE_REGISTER
+    void* out;            // Receives the values read: a uint16_t array for registers, a packed uint8_t array for
+                          // bits. Not used by writes
+    uint8_t error;        // Set by ModbusTransact: 0 on success, otherwise a Modbus exception code or one of the
+                          // library's error codes
+} modbusTransaction_t;
+
+/// <summary>
+/// Sends a set of requests and waits for all of their responses. The requests are sent in array order. A request
+/// that cannot be sent as described, for example because count is too large, is not sent and has its error set to
+/// ILLEGAL_FUNCTION or ILLEGAL_DATA_VALUE.
+///
+/// A read longer than the limit set for its slave with ModbusSetReadLimit is sent on its own as several shorter
+/// requests. When a slave refuses a read of more than one value with ILLEGAL_DATA_VALUE or ILLEGAL_DATA_ADDRESS,
+/// and the last address of the range can be read on its own, the largest read the slave accepts is found by binary
+/// search, kept as its limit and the read is repeated in pieces before the requests after it, so later reads and the
+/// plans of ModbusScanRegisters and the subscriptions use the limit. See ModbusSetReadLimitDiscovery.
+/// </summary>
+/// <param name="hndl">The modbus handle</param>
+/// <param name="transactions">The requests to send; the error field of each is set on return</param>
+/// <param name="count">Number of requests</param>
+/// <param name="timeout">Timeout for each group of requests in flight together</param>
+/// <returns>true if every request succeeded, false otherwise</returns>
+bool ModbusTransact( modbus_t hndl, modbusTransaction_t* transactions, size_t count, size_t timeout );
+
+/// <summary>
+/// Turns the search for a slave's read limit after a refused read on or off. It is on for new handles.
+/// Turn it off for devices that use ILLEGAL_DATA_VALUE or ILLEGAL_DATA_ADDRESS for other reasons.
+/// </summary>
+/// <param name="hndl">The modbus handle</param>
+/// <param name="enabled">Whether to search for limits</param>
+void ModbusSetReadLimitDiscovery( modbus_t hndl, bool enabled );
+
+/// <summary>
+/// Finds the largest read a slave accepts from a table by binary search, and keeps it as the slave's limit, so
+/// the limit is known before the first poll. Any earlier limit is replaced. The range starting at the address must
+/// exist for at least as many values as the transport allows in one read, or the limit found is its length.
+/// </summary>
+/// <param name="hndl">The modbus handle</param>
+/// <param name="slaveID">The slave to probe</param>
+/// <param name="table">The table to probe</param>
+/// <param name="address">The first address of each probe</param>
+/// <param name="error">Receives a Modbus exception code or one of the library's error codes on failure</param>
+/// <param name="timeout">Timeout for each probe</param>
+/// <returns>The largest quantity accepted, or 0 on failure</returns>
+uint16_t ModbusDiscoverReadLimit( modbus_t hndl, uint8_t slaveID, modbusTable_t table, uint16_t address,
+                                  uint8_t* error, size_t timeout );
@@ -8,6 +8,7 @@
  */
 
 #include "modbus.h"
+#include "modbus_transact.h"
 #include "tcw241.h"
 #include "azure_iot.h"
 
@@ -38,24 +39,40 @@ static float TCW441AnalogInputTelemetryData[ANALOGUE_INPUT_COUNT];
 void TCW241_ReadModbusData(modbus_t hndl)
 {
     static uint16_t counterTCP = 0;
-    uint8_t data[4];
+    static const uint8_t relayOff = 0;
+    static const uint8_t relayOn = 1;
+    uint8_t relays = 0;
+    uint8_t inputs = 0;
+    uint16_t doubleData[ANALOGUE_INPUT_COUNT * 2];
 
     // turn off one coil, and turn on the next.
-    if (!WriteSingleCoil(hndl, 0, (uint16_t)(WRITE_RELAY_ADDRESS_1 + counterTCP), 0, data, DEFAULT_TIMEOUT)) {
-        Log_Debug("Unable to write coils: %02x, %s\n", data[0], ModbusErrorToString(data[0]));
-    }
-    
+    uint16_t offAddress = (uint16_t)(WRITE_RELAY_ADDRESS_1 + counterTCP);
     counterTCP = (counterTCP + 1) & 3;
-    if (!WriteSingleCoil(hndl, 0, (uint16_t)(WRITE_RELAY_ADDRESS_1 + counterTCP), 1, data, DEFAULT_TIMEOUT)) {
-        Log_Debug("Unable to write coils: %02x, %s\n", data[0], ModbusErrorToString(data[0]));
+    uint16_t onAddress = (uint16_t)(WRITE_RELAY_ADDRESS_1 + counterTCP);
+
+    // The whole poll is sent in one go, then each part is checked.
+    modbusTransaction_t poll[] = {
+        {.functionCode = WRITE_SINGLE_COIL, .address = offAddress, .values = &relayOff},
+        {.functionCode = WRITE_SINGLE_COIL, .address = onAddress, .values = &relayOn},
+        {.functionCode = READ_COILS, .address = READ_RELAY_ADDRESS_1, .count = RELAY_COUNT, .out = &relays},
+        {.functionCode = READ_DISCRETE_INPUTS, .address = READ_DIGITAL_INPUT_ADDRESS_1, .count = DIGITAL_INPUT_COUNT,
+         .out = &inputs},
+        {.functionCode = READ_MULTIPLE_HOLDING_REGISTERS, .address = ANALOGUE_INPUT_ADDRESS_1,
+         .count = ANALOGUE_INPUT_COUNT * 2, .out = doubleData}};
+    ModbusTransact(hndl, poll, sizeof(poll) / sizeof(poll[0]), DEFAULT_TIMEOUT);
+
+    for (int i = 0; i < 2; i++) {
+        if (poll[i].error) {
+            Log_Debug("Unable to write coils: %02x, %s\n", poll[i].error, ModbusErrorToString(poll[i].error));
+        }
     }
 
-    // Read Coil statuses
-    if (!ReadCoils(hndl, 0, READ_RELAY_ADDRESS_1, RELAY_COUNT, data, DEFAULT_TIMEOUT)) {
-        Log_Debug("Unable to read coils: %02x, %s\n", data[0], ModbusErrorToString(data[0]));
+    // Coil statuses
+    if (poll[2].error) {
+        Log_Debug("Unable to read coils: %02x, %s\n", poll[2].error, ModbusErrorToString(poll[2].error));
     }
     else {
-        uint8_t state = data[0];
+        uint8_t state = relays;
         for (int i = 0; i < RELAY_COUNT; i++) {
             TCW241RelayStatusTelemetryData[i] = state & 1;
             Log_Debug("Relay status %d: %s\n", i + 1, TCW241RelayStatusTelemetryData[i] ? "On" : "Off");
@@ -63,13 +80,12 @@ void TCW241_ReadModbusData(modbus_t hndl)
         }
     }
 
-    // Read the Digital Inputs
-    if (!ReadDiscreteInputs(hndl, 0, READ_DIGITAL_INPUT_ADDRESS_1, DIGITAL_INPUT_COUNT, data, DEFAULT_TIMEOUT)) {
-        Log_Debug("%s\n", ModbusErrorToString(data[0]));
-        Log_Debug("Unable to read ReadDiscreteInputs: %02x, %s\n", data[0], ModbusErrorToString(data[0]));
+    // Digital Inputs
+    if (poll[3].error) {
+        Log_Debug("Unable to read ReadDiscreteInputs: %02x, %s\n", poll[3].error, ModbusErrorToString(poll[3].error));
     }
     else {
-        uint8_t state = data[0];
+        uint8_t state = inputs;
         for (int i = 0; i < DIGITAL_INPUT_COUNT; i++) {
             TCW241DigitalInputTelemetryData[i] = state & 1;
             Log_Debug("Ditigal input %d: %s\n", i + 1, TCW241DigitalInputTelemetryData[i] ? "Open" : "Closed");
@@ -77,10 +93,10 @@ void TCW241_ReadModbusData(modbus_t hndl)
         }
     }
 
-    // Read the Analogue inputs
-    uint16_t doubleData[ANALOGUE_INPUT_COUNT * 2];
-    if (!ReadMultipleHoldingRegisters(hndl, 0, ANALOGUE_INPUT_ADDRESS_1, ANALOGUE_INPUT_COUNT * 2, doubleData, DEFAULT_TIMEOUT)) {
-        Log_Debug("Unable to read ReadMultipleHoldingRegisters: %04x, %s\n", doubleData[0], ModbusErrorToString(data[0]));
+    // Analogue inputs
+    if (poll[4].error) {
+        Log_Debug("Unable to read ReadMultipleHoldingRegisters: %02x, %s\n", poll[4].error,
+                  ModbusErrorToString(poll[4].error));
     }
     else {
         // This hardware reports values in two 16 bit words, making up a 32 bit float.
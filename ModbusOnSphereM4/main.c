@@ -9,6 +9,7 @@
 
 #include "../modbusCommon.h"
 #include "../crc-util.h"
+#include "../fcode-registry.h"
 #include "message-handler.h"
 #include "mt3620-baremetal.h"
 #include "mt3620-intercore.h"
@@ -39,7 +40,6 @@ static void HandleUartIsu0RxIrqDeferred(void);
 
 static void HandleUARTRequest(messageHandle *message);
 static void HandleModbusRequest(messageHandle *message);
-static size_t GetFcodeLength(uint8_t fCode, uint8_t dataLength);
 
 typedef struct CallbackNode
 {
@@ -162,6 +162,15 @@ static void HandleModbusRequest(messageHandle *req)
         }
         break;
     }
+    case MODBUS_FCODE_MESSAGE: {
+        const uint8_t *data = GetMessageDataPtr(req);
+        if (GetMessageLength(req) == 1 + sizeof(fcodeDescriptor))
+        {
+            fcodeDescriptor descriptor = {data[1], data[2], data[3], data[4]};
+            FcodeRegister(data[0], &descriptor);
+        }
+        break;
+    }
     default:
         break;
     }
@@ -203,9 +212,15 @@ static void HandleUartIsu0RxIrqDeferred(void)
             continue;
         }
 
-        size_t expectedLength = GetFcodeLength(basePtr[1], basePtr[2]);
+        size_t expectedLength = FcodeResponseLength(basePtr, currentLength);
+        if (expectedLength == 0 || expectedLength > MAX_PDU_LENGTH)
+        {
+            // An unknown function code, or longer than any response; drop it and wait for the next one
+            SetMessageLength(&UartIsu0RxBuffer, 0);
+            continue;
+        }
 
-        if (currentLength >= expectedLength)
+        if (currentLength >= expectedLength + CRC_FOOTER_LENGTH)
         {
             if (ValidateCRC(basePtr, expectedLength + CRC_FOOTER_LENGTH))
             {
@@ -220,6 +235,14 @@ static void HandleUartIsu0RxIrqDeferred(void)
             else
             {
                 Uart_EnqueueString(UartCM4Debug, "Error: CRC Failure\n");
+                // Tell the A7 so it can retry a read rather than wait for its timeout.
+                messageHandle resp;
+                SetMessagePrefix(&resp, msgPrefix);
+                SetMessageProtocol(&resp, (uint8_t)MODBUS);
+                SetMessageCommand(&resp, (uint8_t)MODBUS_CRC_ERROR_MESSAGE);
+                SetMessageData(&resp, basePtr, 0);
+
+                SendA7Message(inbound, outbound, sharedBufSize, &resp);
             }
             SetMessageLength(&UartIsu0RxBuffer, 0);
         }
@@ -287,7 +310,7 @@ static _Noreturn void RTCoreMain(void)
     bool checkComplete = false;
     for (;;)
     {
-        __asm__("wfi");
+        WaitForInterrupt();
         InvokeCallbacks();
         while (!checkComplete)
         {
@@ -296,38 +319,3 @@ static _Noreturn void RTCoreMain(void)
         checkComplete = false;
     }
 }
-
-
-
-static size_t GetFcodeLength(uint8_t fCode, uint8_t dataLength)
-{
-    if ((fCode > FCODE_ERROR_OFFSET) && (FCODE_ERROR_OFFSET + FCODE_RANGE))
-    {
-        // Error response length is always three bytes
-        return ERROR_CODE_LENGTH;
-    }
-    switch (fCode)
-    {
-    case READ_COILS:
-        return PDU_HEADER_LENGTH + dataLength;
-    case READ_DISCRETE_INPUTS:
-        return PDU_HEADER_LENGTH + dataLength;
-    case READ_MULTIPLE_HOLDING_REGISTERS:
-        return PDU_HEADER_LENGTH + dataLength;
-    case READ_INPUT_REGISTERS:
-        return PDU_HEADER_LENGTH + dataLength;
-    case WRITE_SINGLE_COIL:
-        return PDU_HEADER_LENGTH + 3;
-    case WRITE_SINGLE_HOLDING_REGISTER:
-        return PDU_HEADER_LENGTH + 3;
-    case READ_EXCEPTION_STATUS:
-        return PDU_HEADER_LENGTH;
-    case WRITE_MULTIPLE_COILS:
-        return PDU_HEADER_LENGTH + 3;
-    case WRITE_MULTIPLE_HOLDING_REGISTERS:
-        return PDU_HEADER_LENGTH + 3;
-
-    default:
-        return 0;
-    }
-}
\ No newline at end of file
@@ -18,7 +18,10 @@
 // read message and return it as a messageHandle
 bool ReadA7Message(BufferHeader *inbound, BufferHeader *outbound, uint32_t sharedBufSize, messageHandle *message)
 {
-    int r = DequeueData(outbound, inbound, sharedBufSize, message->data, (uint32_t *)&message->length);
+    // DequeueData takes the capacity of the buffer on input and returns the block size.
+    uint32_t length = sizeof(message->data);
+    int r = DequeueData(outbound, inbound, sharedBufSize, message->data, &length);
+    message->length = length;
     if (r == -1 || message->length < PREFIX_LENGTH + MIN_HEADER_LENGTH)
     {
         return false;
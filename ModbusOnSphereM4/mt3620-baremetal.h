@@ -7,6 +7,10 @@
 #include <stdint.h>
 #include <stddef.h>
 
+#ifdef MT3620_HOST_EMULATION
+#include "../HostEmulator/host-baremetal.h"
+#endif
+
 /// <summary>Base address of System Control Block, ARM DDI 0403E.b S3.2.2.</summary>
 static const uintptr_t SCB_BASE = 0xE000ED00;
 /// <summary>Base address of NVIC Set-Enable Registers, ARM DDI 0403E.b S3.4.3.</summary>
@@ -32,7 +36,11 @@ typedef void (*Callback)(void);
 /// <param name="value">8-bit value to write to the target address.</param>
 static inline void WriteReg8(uintptr_t baseAddr, size_t offset, uint8_t value)
 {
+#ifdef MT3620_HOST_EMULATION
+    HostEmu_WriteReg8(baseAddr + offset, value);
+#else
     *(volatile uint8_t *)(baseAddr + offset) = value;
+#endif
 }
 
 /// <summary>
@@ -45,7 +53,11 @@ static inline void WriteReg8(uintptr_t baseAddr, size_t offset, uint8_t value)
 /// <param name="value">32-bit value to write to the target address.</param>
 static inline void WriteReg32(uintptr_t baseAddr, size_t offset, uint32_t value)
 {
+#ifdef MT3620_HOST_EMULATION
+    HostEmu_WriteReg32(baseAddr + offset, value);
+#else
     *(volatile uint32_t *)(baseAddr + offset) = value;
+#endif
 }
 
 /// <summary>
@@ -58,7 +70,11 @@ static inline void WriteReg32(uintptr_t baseAddr, size_t offset, uint32_t value)
 /// <returns>An unsigned 32-bit value which is read from the target address.</returns>
 static inline uint32_t ReadReg32(uintptr_t baseAddr, size_t offset)
 {
+#ifdef MT3620_HOST_EMULATION
+    return HostEmu_ReadReg32(baseAddr + offset);
+#else
     return *(volatile uint32_t *)(baseAddr + offset);
+#endif
 }
 
 /// <summary>
@@ -105,12 +121,16 @@ static inline void SetReg32(uintptr_t baseAddr, size_t offset, uint32_t setBits)
 /// which must be passed to <see cref="RestoreIrqs" />.</returns>
 static inline uint32_t BlockIrqs(void)
 {
+#ifdef MT3620_HOST_EMULATION
+    return HostEmu_BlockIrqs();
+#else
     uint32_t prevBasePri;
     uint32_t newBasePri = 1; // block IRQs priority 1 and above
 
     __asm__("mrs %0, BASEPRI" : "=r"(prevBasePri) :);
     __asm__("msr BASEPRI, %0" : : "r"(newBasePri));
     return prevBasePri;
+#endif
 }
 
 /// <summary>
@@ -119,7 +139,23 @@ static inline uint32_t BlockIrqs(void)
 /// <param name="prevBasePri">Value returned from <see cref="BlockIrqs" />.</param>
 static inline void RestoreIrqs(uint32_t prevBasePri)
 {
+#ifdef MT3620_HOST_EMULATION
+    HostEmu_RestoreIrqs(prevBasePri);
+#else
     __asm__("msr BASEPRI, %0" : : "r"(prevBasePri));
+#endif
+}
+
+/// <summary>
+/// Suspends execution until an interrupt has been taken (WFI).
+/// </summary>
+static inline void WaitForInterrupt(void)
+{
+#ifdef MT3620_HOST_EMULATION
+    HostEmu_WaitForInterrupt();
+#else
+    __asm__("wfi");
+#endif
 }
 
 /// <summary>
@@ -0,0 +1,225 @@
+/**
+ * @file    fcode-registry.c
+ * @brief   The function codes the A7 and M4 know how to frame.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+
+#include "fcode-registry.h"
+#include "modbusCommon.h"
+
+// Two bytes of address followed by two bytes of value or quantity
+#define ECHO_ADDRESS_AND_VALUE 6
+
+static const fcodeDescriptor exceptionDescriptor = {FCODE_FIXED_LENGTH, ERROR_CODE_LENGTH, 1, FCODE_DATA_BYTES};
+
+// Indexed by function code. Entries that are not standard codes can be filled by FcodeRegister.
+static fcodeDescriptor fcodes[FCODE_RANGE + 1] = {
+    [READ_COILS] = {FCODE_BYTE_COUNT, PDU_HEADER_LENGTH, 2, FCODE_DATA_BITS},
+    [READ_DISCRETE_INPUTS] = {FCODE_BYTE_COUNT, PDU_HEADER_LENGTH, 2, FCODE_DATA_BITS},
+    [READ_MULTIPLE_HOLDING_REGISTERS] = {FCODE_BYTE_COUNT, PDU_HEADER_LENGTH, 2, FCODE_DATA_REGISTERS},
+    [READ_INPUT_REGISTERS] = {FCODE_BYTE_COUNT, PDU_HEADER_LENGTH, 2, FCODE_DATA_REGISTERS},
+    [WRITE_SINGLE_COIL] = {FCODE_FIXED_LENGTH, PDU_HEADER_LENGTH + 3, ECHO_ADDRESS_AND_VALUE, FCODE_DATA_BYTES},
+    [WRITE_SINGLE_HOLDING_REGISTER] = {FCODE_FIXED_LENGTH, PDU_HEADER_LENGTH + 3, ECHO_ADDRESS_AND_VALUE,
+                                       FCODE_DATA_BYTES},
+    [READ_EXCEPTION_STATUS] = {FCODE_FIXED_LENGTH, PDU_HEADER_LENGTH, 2, FCODE_DATA_BYTES},
+    [WRITE_MULTIPLE_COILS] = {FCODE_FIXED_LENGTH, PDU_HEADER_LENGTH + 3, ECHO_ADDRESS_AND_VALUE, FCODE_DATA_BYTES},
+    [WRITE_MULTIPLE_HOLDING_REGISTERS] = {FCODE_FIXED_LENGTH, PDU_HEADER_LENGTH + 3, ECHO_ADDRESS_AND_VALUE,
+                                          FCODE_DATA_BYTES},
+    [READ_FILE] = {FCODE_BYTE_COUNT, PDU_HEADER_LENGTH, 2, FCODE_DATA_BYTES},
+    [WRITE_FILE] = {FCODE_BYTE_COUNT, PDU_HEADER_LENGTH, 2, FCODE_DATA_BYTES},
+    [MASK_WRITE_REGISTER] = {FCODE_FIXED_LENGTH, PDU_HEADER_LENGTH + 5, PDU_HEADER_LENGTH + 5, FCODE_DATA_BYTES},
+    [READ_FIFO_QUEUE] = {FCODE_WORD_COUNT, PDU_HEADER_LENGTH + 1, 2, FCODE_DATA_FIFO},
+    [ENCAPSULATED_INTERFACE_TRANSPORT] = {FCODE_DEVICE_ID, DEVICE_ID_HEADER_LENGTH, 2, FCODE_DATA_BYTES},
+};
+
+static bool IsStandard(uint8_t fCode)
+{
+    switch (fCode)
+    {
+    case READ_COILS:
+    case READ_DISCRETE_INPUTS:
+    case READ_MULTIPLE_HOLDING_REGISTERS:
+    case READ_INPUT_REGISTERS:
+    case WRITE_SINGLE_COIL:
+    case WRITE_SINGLE_HOLDING_REGISTER:
+    case READ_EXCEPTION_STATUS:
+    case WRITE_MULTIPLE_COILS:
+    case WRITE_MULTIPLE_HOLDING_REGISTERS:
+    case READ_FILE:
+    case WRITE_FILE:
+    case MASK_WRITE_REGISTER:
+    case READ_FIFO_QUEUE:
+    case ENCAPSULATED_INTERFACE_TRANSPORT:
+        return true;
+    default:
+        return false;
+    }
+}
+
+const fcodeDescriptor *FcodeDescriptor(uint8_t fCode)
+{
+    if (fCode > FCODE_ERROR_OFFSET)
+    {
+        return &exceptionDescriptor;
+    }
+    // Function code 0 and the bare exception bit are never valid, and their entry is always FCODE_UNKNOWN.
+    return &fcodes[fCode & FCODE_RANGE];
+}
+
+size_t FcodeResponseLength(const uint8_t *pdu, size_t available)
+{
+    if (available < 2)
+    {
+        return 2;
+    }
+    const fcodeDescriptor *descriptor = FcodeDescriptor(pdu[1]);
+    size_t length = descriptor->length;
+    switch (descriptor->lengthRule)
+    {
+    case FCODE_FIXED_LENGTH:
+        return length;
+    case FCODE_BYTE_COUNT:
+        return (available < length) ? length : length + pdu[length - 1];
+    case FCODE_WORD_COUNT:
+        return (available < length) ? length : length + (size_t)(pdu[length - 2] << 8 | pdu[length - 1]);
+    case FCODE_DEVICE_ID:
+        return DeviceIdResponseLength(pdu, available);
+    default:
+        return 0;
+    }
+}
+
+bool FcodeRegister(uint8_t fCode, const fcodeDescriptor *descriptor)
+{
+    if (fCode == 0 || fCode > FCODE_RANGE || IsStandard(fCode) || descriptor->echoLength < 2 ||
+        descriptor->length > MAX_PDU_LENGTH || descriptor->dataRule != FCODE_DATA_BYTES)
+    {
+        return false;
+    }
+    switch (descriptor->lengthRule)
+    {
+    case FCODE_FIXED_LENGTH:
+        if (descriptor->length < 2 || descriptor->echoLength > descriptor->length)
+        {
+            return false;
+        }
+        break;
+    case FCODE_BYTE_COUNT:
+    case FCODE_WORD_COUNT:
+        // The count must follow the slave ID and function code, and echoed bytes come before it.
+        if (descriptor->length < ((descriptor->lengthRule == FCODE_BYTE_COUNT) ? 3 : 4) ||
+            descriptor->echoLength > descriptor->length - ((descriptor->lengthRule == FCODE_BYTE_COUNT) ? 1 : 2))
+        {
+            return false;
+        }
+        break;
+    default:
+        return false;
+    }
+
+    fcodeDescriptor *entry = &fcodes[fCode];
+    if (entry->lengthRule != FCODE_UNKNOWN)
+    {
+        return entry->lengthRule == descriptor->lengthRule && entry->length == descriptor->length &&
+               entry->echoLength == descriptor->echoLength && entry->dataRule == descriptor->dataRule;
+    }
+    *entry = *descriptor;
+    return true;
+}
+
+uint8_t FcodeCheckResponse(const uint8_t *request, size_t requestLength, const uint8_t *response,
+                           size_t responseLength)
+{
+    if (requestLength < 2 || responseLength < 2 || response[0] != request[0])
+    {
+        return INVALID_RESPONSE;
+    }
+    if (response[1] == (request[1] | FCODE_ERROR_OFFSET))
+    {
+        return (responseLength == ERROR_CODE_LENGTH) ? response[2] : INVALID_RESPONSE;
+    }
+    const fcodeDescriptor *descriptor = FcodeDescriptor(request[1]);
+    if (response[1] != request[1] || descriptor->lengthRule == FCODE_UNKNOWN ||
+        FcodeResponseLength(response, responseLength) != responseLength || responseLength < descriptor->echoLength ||
+        requestLength < descriptor->echoLength)
+    {
+        return INVALID_RESPONSE;
+    }
+    for (uint8_t i = 2; i < descriptor->echoLength; i++)
+    {
+        if (response[i] != request[i])
+        {
+            return INVALID_RESPONSE;
+        }
+    }
+    return 0;
+}
+
+uint8_t FcodeDecodeResponse(const uint8_t *request, size_t requestLength, const uint8_t *response,
+                            size_t responseLength, void *out, uint16_t *count)
+{
+    uint8_t error = FcodeCheckResponse(request, requestLength, response, responseLength);
+    if (error)
+    {
+        return error;
+    }
+    const fcodeDescriptor *descriptor = FcodeDescriptor(request[1]);
+    const uint8_t *data = &response[(descriptor->lengthRule == FCODE_FIXED_LENGTH) ? 2 : descriptor->length];
+    size_t dataLength = responseLength - (size_t)(data - response);
+    size_t quantity = (requestLength >= 6) ? (size_t)(request[4] << 8 | request[5]) : 0;
+    uint8_t *bytes = out;
+    uint16_t *registers = out;
+
+    switch (descriptor->dataRule)
+    {
+    case FCODE_DATA_BITS:
+        if (requestLength < 6 || dataLength != (quantity + 7) / 8)
+        {
+            return INVALID_RESPONSE;
+        }
+        break;
+    case FCODE_DATA_REGISTERS:
+        if (requestLength < 6 || dataLength != quantity * 2)
+        {
+            return INVALID_RESPONSE;
+        }
+        break;
+    case FCODE_DATA_FIFO:
+        quantity = (dataLength < 2) ? 0 : (size_t)(data[0] << 8 | data[1]);
+        if (dataLength < 2 || quantity > MAX_FIFO_COUNT || dataLength != 2 + quantity * 2)
+        {
+            return INVALID_RESPONSE;
+        }
+        data += 2;
+        break;
+    default:
+        quantity = dataLength;
+        break;
+    }
+
+    if (out)
+    {
+        if (descriptor->dataRule == FCODE_DATA_REGISTERS || descriptor->dataRule == FCODE_DATA_FIFO)
+        {
+            for (size_t i = 0; i < quantity; i++)
+            {
+                // Don't use memcpy to ensure correct endianness
+                registers[i] = (uint16_t)(data[i * 2] << 8 | data[(i * 2) + 1]);
+            }
+        }
+        else
+        {
+            for (size_t i = 0; i < dataLength; i++)
+            {
+                bytes[i] = data[i];
+            }
+        }
+    }
+    if (count)
+    {
+        *count = (uint16_t)quantity;
+    }
+    return 0;
+}
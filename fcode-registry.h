@@ -0,0 +1,100 @@
+/**
+ * @file    fcode-registry.h
+ * @brief   The function codes the A7 and M4 know how to frame, as one table indexed by function code. Both cores find
+ *          the length of a response from it, so they cannot disagree about where a response ends, and vendor function
+ *          codes can be added to it at run time.
+ *
+ * @author  Copyright (c) Bsquare EMEA 2020. https://www.bsquare.com/
+ *          Licensed under the MIT License.
+ */
+#ifndef FCODEREGISTRY_H
+#define FCODEREGISTRY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* How the length of a response is found. Lengths count from the slave ID and leave out the CRC. */
+typedef enum
+{
+    FCODE_UNKNOWN = 0,  // Not a function code that can be framed
+    FCODE_FIXED_LENGTH, // Every response is length bytes long
+    FCODE_BYTE_COUNT,   // A header of length bytes, the last of which counts the bytes that follow it
+    FCODE_WORD_COUNT,   // A header of length bytes, the last two of which count the bytes that follow them
+    FCODE_DEVICE_ID     // Read Device Identification, found by walking its objects
+} fcodeLengthRule;
+
+/* How the data of a response is checked and unpacked. The data follows the function code of a fixed length response
+   and the header of any other. */
+typedef enum
+{
+    FCODE_DATA_BYTES = 0, // Bytes, copied as they are
+    FCODE_DATA_BITS,      // Bits packed eight to a byte, as many as the quantity at bytes 4 and 5 of the request
+    FCODE_DATA_REGISTERS, // Big-endian registers, as many as the quantity at bytes 4 and 5 of the request
+    FCODE_DATA_FIFO       // A count of big-endian registers, at most MAX_FIFO_COUNT, followed by the registers
+} fcodeDataRule;
+
+typedef struct
+{
+    uint8_t lengthRule; // An fcodeLengthRule
+    uint8_t length;     // The response length or header length, see fcodeLengthRule
+    uint8_t echoLength; // Bytes at the start of a response that repeat the request, at least the slave ID and
+                        // function code
+    uint8_t dataRule;   // An fcodeDataRule
+} fcodeDescriptor;
+
+/// <summary>
+/// Looks up a function code. Exception responses share one descriptor.
+/// </summary>
+/// <param name="fCode">The function code, with or without the exception bit</param>
+/// <returns>The descriptor, whose lengthRule is FCODE_UNKNOWN if the code has not been registered</returns>
+const fcodeDescriptor *FcodeDescriptor( uint8_t fCode );
+
+/// <summary>
+/// Finds the length of a response from its function code.
+/// </summary>
+/// <param name="pdu">The response, starting at the slave ID</param>
+/// <param name="available">The number of bytes of the response received so far</param>
+/// <returns>The length of the response without its CRC, a length greater than available while more of it is
+/// needed to tell, or 0 if the function code is unknown. A length greater than MAX_PDU_LENGTH means the response
+/// is longer than any the library accepts</returns>
+size_t FcodeResponseLength( const uint8_t *pdu, size_t available );
+
+/// <summary>
+/// Adds a function code to the table, such as a vendor specific code. The standard codes cannot be replaced, and a
+/// code already registered can only be registered again with the same descriptor. Registered codes return their
+/// data as bytes.
+/// </summary>
+/// <param name="fCode">The function code, from 1 to 127</param>
+/// <param name="descriptor">How its responses are framed and checked</param>
+/// <returns>true on success, false if the code or descriptor is not valid or the code is already registered
+/// differently</returns>
+bool FcodeRegister( uint8_t fCode, const fcodeDescriptor *descriptor );
+
+/// <summary>
+/// Checks a complete response against its request: the function code, the length and the bytes the response repeats
+/// from the request.
+/// </summary>
+/// <param name="request">The request, starting at the slave ID</param>
+/// <param name="requestLength">The length of the request</param>
+/// <param name="response">The response, starting at the slave ID</param>
+/// <param name="responseLength">The length of the response without its CRC</param>
+/// <returns>0 if the response is valid, the exception code of an exception response, or INVALID_RESPONSE</returns>
+uint8_t FcodeCheckResponse( const uint8_t *request, size_t requestLength, const uint8_t *response,
+                            size_t responseLength );
+
+/// <summary>
+/// Checks a complete response against its request as FcodeCheckResponse does, then checks its data against the
+/// request and unpacks it by the function code's fcodeDataRule. Nothing is written unless the response is valid.
+/// </summary>
+/// <param name="request">The request, starting at the slave ID</param>
+/// <param name="requestLength">The length of the request</param>
+/// <param name="response">The response, starting at the slave ID</param>
+/// <param name="responseLength">The length of the response without its CRC</param>
+/// <param name="out">Receives the bytes, packed bits or registers of the data, or NULL to only check it</param>
+/// <param name="count">Receives the number of bytes, bits or registers in the data, or NULL</param>
+/// <returns>0 if the response is valid, the exception code of an exception response, or INVALID_RESPONSE</returns>
+uint8_t FcodeDecodeResponse( const uint8_t *request, size_t requestLength, const uint8_t *response,
+                             size_t responseLength, void *out, uint16_t *count );
+
+#endif /* FCODEREGISTRY_H */
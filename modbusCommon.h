@@ -9,6 +9,9 @@
 #ifndef MODBUSCOMMON_H
 #define MODBUSCOMMON_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 typedef enum
 {
     UART_CFG_MESSAGE = 1,
@@ -17,7 +20,9 @@ typedef enum
 
 typedef enum
 {
-    MODBUS_DATA_MESSAGE = 1
+    MODBUS_DATA_MESSAGE = 1,
+    MODBUS_CRC_ERROR_MESSAGE, // From the M4: a response arrived but failed its CRC check
+    MODBUS_FCODE_MESSAGE      // To the M4: register a function code; the data is the code and its fcodeDescriptor
 } modbusMsgTypes;
 
 typedef enum
@@ -38,6 +43,12 @@ typedef enum
 #define WRITE_MULTIPLE_HOLDING_REGISTERS 16
 #define READ_FILE 20
 #define WRITE_FILE 21
+#define MASK_WRITE_REGISTER 22
+#define READ_FIFO_QUEUE 24
+#define ENCAPSULATED_INTERFACE_TRANSPORT 43
+
+/* MEI type of Read Device Identification, carried by ENCAPSULATED_INTERFACE_TRANSPORT */
+#define MEI_READ_DEVICE_ID 14
 
 /* Exception codes */
 #define ILLEGAL_FUNCTION 1
@@ -57,6 +68,7 @@ typedef enum
 #define HANDLE_IN_USE 22
 #define INVALID_RESPONSE 23
 #define DEVICE_DISCONNECTED 24
+#define SLAVE_UNAVAILABLE 25
 
 /* Supported baud rates */
 #define BAUD_SET_300 384
@@ -93,9 +105,12 @@ typedef enum
 #define CRC_FOOTER_LENGTH 2
 #define PDU_HEADER_LENGTH 3
 #define ERROR_CODE_LENGTH 3
-#define FCODE_RANGE 32
+#define FCODE_RANGE 127
 #define FCODE_ERROR_OFFSET 128
 #define MAX_PDU_LENGTH 254
+#define MAX_FIFO_COUNT 31
+#define DEVICE_ID_HEADER_LENGTH 8
+#define DEVICE_ID_OBJECT_COUNT_OFFSET 7
 
 /* Offsets into message header */
 #define PROTOCOL_OFFSET 0
@@ -106,4 +121,29 @@ typedef enum
 #define UART_CFG_MESSAGE_RESP_LENGTH 1
 #define UART_CFG_MESSAGE_RESP_SUCCESS_OFFSET 0
 
+/* Read Device Identification responses have no byte count, so the length is found by walking the objects that
+ * follow the header. pdu starts at the slave ID and available bytes of it have been received. Returns the length of
+ * the response without its CRC, or a length greater than available while more of it is needed. */
+static inline size_t DeviceIdResponseLength(const uint8_t *pdu, size_t available)
+{
+    size_t length = DEVICE_ID_HEADER_LENGTH;
+    if (available < length)
+    {
+        return length;
+    }
+    for (uint8_t object = 0; object < pdu[DEVICE_ID_OBJECT_COUNT_OFFSET]; object++)
+    {
+        if (length + 2 > MAX_PDU_LENGTH)
+        {
+            return MAX_PDU_LENGTH + 1;
+        }
+        if (available < length + 2)
+        {
+            return length + 2;
+        }
+        length += 2u + pdu[length + 1];
+    }
+    return (length > MAX_PDU_LENGTH) ? MAX_PDU_LENGTH + 1 : length;
+}
+
 #endif /* MODBUSCOMMON_H */